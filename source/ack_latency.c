@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the 
+ * Free Software Foundation. For the terms of this license, 
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ack_latency.h"
+#include "aq_serial.h"
+#include "config.h"
+#include "utils.h"
+
+/*
+ * Only the main (serial) thread records, the net thread reads.  Counters are single
+ * aligned 32 bit words, so a reader can see a report that's one sample out between
+ * fields, but never a torn count.  (total_us can tear on 32 bit, it only feeds the average)
+ */
+typedef struct ack_latency_hist {
+  uint32_t bucket[ACK_LATENCY_BUCKETS];
+  uint32_t count;
+  uint32_t deadline_miss;
+  uint32_t max_us;
+  uint64_t total_us;
+} ack_latency_hist;
+
+// Indexed by emulation_type, SIM_NONE and JANDY_DEVICE are never recorded.
+static ack_latency_hist _ack_latency[SIMULATOR + 1];
+
+static const char *ack_latency_name(emulation_type source)
+{
+  switch (source) {
+    case ALLBUTTON:  return "AllButton";
+    case RSSADAPTER: return "RSSerialAdapter";
+    case ONETOUCH:   return "OneTouch";
+    case IAQTOUCH:   return "iAqualinkTouch";
+    case AQUAPDA:    return "PDA";
+    case IAQUALNK:   return "iAqualink";
+    case SIMULATOR:  return "Simulator";
+    default:         return NULL;
+  }
+}
+
+void record_ack_latency(emulation_type source, const struct timespec *elapsed)
+{
+  ack_latency_hist *hist;
+  uint32_t us;
+  int b;
+
+  if (source < ALLBUTTON || source > SIMULATOR || source == JANDY_DEVICE)
+    return;
+
+  hist = &_ack_latency[source];
+  us = (uint32_t)(elapsed->tv_sec * 1000000 + elapsed->tv_nsec / 1000);
+
+  b = us / ACK_LATENCY_BUCKET_US;
+  if (b >= ACK_LATENCY_BUCKETS)
+    b = ACK_LATENCY_BUCKETS - 1;
+
+  hist->bucket[b]++;
+  hist->count++;
+  hist->total_us += us;
+  if (us > hist->max_us)
+    hist->max_us = us;
+  if (us > ACK_LATENCY_DEADLINE_US) {
+    hist->deadline_miss++;
+    LOG(RSTM_LOG, LOG_DEBUG, "%s reply took %.3f ms, over %d ms deadline\n", ack_latency_name(source), (float)us / 1000, ACK_LATENCY_DEADLINE_US / 1000);
+  }
+}
+
+void reset_ack_latency()
+{
+  memset(_ack_latency, 0, sizeof(_ack_latency));
+}
+
+// Upper edge of the bucket holding the pct percentile, in us.
+static uint32_t ack_latency_percentile(const ack_latency_hist *hist, uint32_t count, int pct)
+{
+  uint32_t target = (count * pct + 99) / 100;
+  uint32_t seen = 0;
+  int b;
+
+  for (b = 0; b < ACK_LATENCY_BUCKETS; b++) {
+    seen += hist->bucket[b];
+    if (seen >= target)
+      break;
+  }
+  if (b >= ACK_LATENCY_BUCKETS - 1)
+    return hist->max_us; // Overflow bucket has no upper edge
+
+  return (b + 1) * ACK_LATENCY_BUCKET_US;
+}
+
+int build_ack_latency_JSON(char* buffer, int size)
+{
+  int length = 0;
+  bool first = true;
+  tx_schedule_stats tx;
+  serial_recovery_stats rec;
+
+  memset(&buffer[0], 0, size);
+
+  length += snprintf(buffer+length, size-length, "{\"type\": \"ack_latency\",\"deadline_ms\": %.1f,\"devices\": {",
+                     (float)ACK_LATENCY_DEADLINE_US / 1000);
+
+  for (int i = ALLBUTTON; i <= SIMULATOR && length < size; i++) {
+    const ack_latency_hist *hist = &_ack_latency[i];
+    const char *name = ack_latency_name(i);
+    uint32_t count = hist->count;
+
+    if (name == NULL || count == 0)
+      continue;
+
+    length += snprintf(buffer+length, size-length,
+                       "%s\"%s\": {\"count\": %u,\"avg_ms\": %.3f,\"p50_ms\": %.3f,\"p99_ms\": %.3f,\"max_ms\": %.3f,\"deadline_miss\": %u}",
+                       first?"":",",
+                       name,
+                       count,
+                       (float)(hist->total_us / count) / 1000,
+                       (float)ack_latency_percentile(hist, count, 50) / 1000,
+                       (float)ack_latency_percentile(hist, count, 99) / 1000,
+                       (float)hist->max_us / 1000,
+                       hist->deadline_miss);
+    first = false;
+  }
+
+  get_tx_schedule_stats(&tx);
+  get_serial_recovery_stats(&rec);
+
+  if (length < size)
+    length += snprintf(buffer+length, size-length,
+                       "},\"repeated_frames_skipped\": %lu,\"tx_schedule\": {\"frame_delay_ms\": %d,\"scheduled\": %lu,\"late\": %lu,\"avg_overshoot_us\": %lu,\"max_overshoot_us\": %lu}"
+                       ",\"serial_recovery\": {\"outages\": %lu,\"recoveries\": %lu,\"reopen_attempts\": %lu,\"last_ms\": %lu,\"avg_ms\": %lu,\"max_ms\": %lu}}",
+                       get_repeated_frame_count(),
+                       get_frame_delay(),
+                       tx.scheduled,
+                       tx.late,
+                       tx.scheduled > 0 ? tx.total_overshoot_us / tx.scheduled : 0,
+                       tx.max_overshoot_us,
+                       rec.outages,
+                       rec.recoveries,
+                       rec.reopen_attempts,
+                       rec.last_recover_ms,
+                       rec.recoveries > 0 ? rec.total_recover_ms / rec.recoveries : 0,
+                       rec.max_recover_ms);
+
+  return length < size ? length : size - 1;
+}
@@ -0,0 +1,21 @@
+#ifndef ACK_LATENCY_H_
+#define ACK_LATENCY_H_
+
+#include <stdbool.h>
+#include <time.h>
+
+#include "aq_programmer.h"
+
+/*
+ * Histogram of time from the end of a packet addressed to one of our emulated
+ * devices, to tcdrain() completing on our reply. Always on, one per emulation type.
+ */
+#define ACK_LATENCY_BUCKET_US   100   // Resolution of each bucket
+#define ACK_LATENCY_BUCKETS     500   // 0 to 50ms, anything longer goes in last bucket
+#define ACK_LATENCY_DEADLINE_US 20000 // Replies later than this count as a deadline miss
+
+void record_ack_latency(emulation_type source, const struct timespec *elapsed);
+void reset_ack_latency();
+int build_ack_latency_JSON(char* buffer, int size);
+
+#endif // ACK_LATENCY_H_
@@ -707,7 +707,6 @@ bool process_allbutton_packet(unsigned char *packet, int length, struct aqualink
 {
   bool rtn = false;
   //static unsigned char last_packet[AQ_MAXPKTLEN];
-  static unsigned char last_checksum;
   static char message[AQ_MSGLONGLEN + 1];
   static int processing_long_msg = 0;
 
@@ -730,16 +729,7 @@ bool process_allbutton_packet(unsigned char *packet, int length, struct aqualink
   aqdata->last_packet_type = packet[PKT_CMD];
 
 
-  if ( packet[PKT_CMD] == CMD_STATUS && packet[length-3] == last_checksum && ! in_programming_mode(aqdata) )
-  {
-    LOG(ALLB_LOG,LOG_DEBUG_SERIAL, "RS Received duplicate, ignoring.\n", length);
-    return false;
-  }
-  else
-  {
-    last_checksum = packet[length-3];
-    rtn = true;
-  }
+  rtn = true;
 
   if (processing_long_msg > 0 && packet[PKT_CMD] != CMD_MSG_LONG)
   {
@@ -760,6 +750,14 @@ bool process_allbutton_packet(unsigned char *packet, int length, struct aqualink
     //LOG(ALLB_LOG,LOG_DEBUG, "RS Received STATUS length %d.\n", length);
     //debuglogPacket(ALLB_LOG, packet, length, true, true);
     
+    // Nothing to decode if it's the same as last time, but still here so a cut short long message above gets processed.
+    if ( is_repeated_frame(packet, length) && ! in_programming_mode(aqdata) )
+    {
+      LOG(ALLB_LOG,LOG_DEBUG_SERIAL, "RS Received duplicate, ignoring.\n", length);
+      rtn = false;
+      break;
+    }
+
     //memcpy(aqdata->raw_status, packet + 4, AQ_PSTLEN);
     //processLEDstate(aqdata);
     processLEDstate(aqdata, packet, ALLB_LOG);
@@ -13,6 +13,8 @@
 #include "aq_serial.h"
 #include "color_lights.h"
 #include "devices_jandy.h"
+#include "flight_recorder.h"
+#include "aq_snapshot.h"
 
 
 
@@ -349,7 +351,9 @@ STOP BOOST POOL
     }
     if (i < wait_messages) {
       // Takes ages to see bost is off from menu, to set it here.
+      aqdata_write_begin();
       setSWGboost(aqdata, false);
+      aqdata_write_end();
     }
     /*
     // Extra message overcome.
@@ -421,7 +425,9 @@ void *set_allbutton_SWG( void *ptr )
   }
 
   // Let everyone know we set SWG, if it failed we will update on next message, unless it's 0.
+  aqdata_write_begin();
   setSWGpercent(aqdata, val); // Don't use changeSWGpercent as we are in programming mode.
+  aqdata_write_end();
 
 /*
   if (select_sub_menu_item(aqdata, "SET POOL SP") != true) {
@@ -1367,6 +1373,7 @@ void _waitfor_queue2empty(bool longwait)
 
   if (_pgm_command_state != PGM_COMMAND_IDLE) {
     LOG(ALLB_LOG, LOG_WARNING, "Send command queue did not empty: %s\n", strerror(ret));
+    auto_flight_recorder_dump("programming command timeout");
   } else {
     LOG(ALLB_LOG, LOG_DEBUG, "Queue now empty!\n");
   }
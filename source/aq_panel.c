@@ -29,6 +29,7 @@
 #include "rs_msg_utils.h"
 #include "iaqualink.h"
 #include "color_lights.h"
+#include "aq_snapshot.h"
 
 
 #define USE_LAST_VALUE 101
@@ -150,6 +151,7 @@ void checkPanelConfig(struct aqualinkdata *aqdata) {
       LOG(PANL_LOG, LOG_WARNING, "Removing option '%s', please correct configuration\n",CFG_N_extended_device_id);
       _aqconfig_.extended_device_id = 0x00;
       removePanelIAQTouchInterface();
+      rebuild_dest_handlers();
     }
   }
 
@@ -160,6 +162,7 @@ void checkPanelConfig(struct aqualinkdata *aqdata) {
       LOG(PANL_LOG, LOG_WARNING, "Removing option '%s', please correct configuration\n",CFG_N_extended_device_id);
       _aqconfig_.extended_device_id = 0x00;
       removePanelOneTouchInterface();
+      rebuild_dest_handlers();
     }
   }
 
@@ -170,6 +173,7 @@ void checkPanelConfig(struct aqualinkdata *aqdata) {
       LOG(PANL_LOG, LOG_WARNING, "Removing option '%s', please correct configuration\n",CFG_N_rssa_device_id);
       _aqconfig_.rssa_device_id = 0x00;
       removePanelRSserialAdapterInterface();
+      rebuild_dest_handlers();
     }
   }
 
@@ -354,7 +358,7 @@ uint8_t setPanelInformationFromPanelMsg(struct aqualinkdata *aqdata, const char
       }
     }
 
-    aqdata->is_dirty = true;
+    SET_DIRTY(aqdata->is_dirty);
     return rtn;
 }
 
@@ -1428,6 +1432,8 @@ bool programDeviceValue(struct aqualinkdata *aqdata, action_type type, int value
   else
     aqdata->unactioned.requested = 0;
 
+  wakeup_main_loop();
+
   return true;
 }
 
@@ -1610,6 +1616,7 @@ void programDeviceLightBrightness(struct aqualinkdata *aqdata, int value, int de
     aqdata->unactioned.value = value;
     aqdata->unactioned.type = LIGHT_BRIGHTNESS;
     aqdata->unactioned.id = deviceIndex;
+    wakeup_main_loop();
     return;
   }
 
@@ -1680,6 +1687,7 @@ void programDeviceLightBrightness(struct aqualinkdata *aqdata, int value, int de
         aqdata->unactioned.value = value;
         aqdata->unactioned.type = LIGHT_BRIGHTNESS;
         aqdata->unactioned.id = deviceIndex;
+        wakeup_main_loop();
       }
       
     }
@@ -1922,9 +1930,16 @@ bool panel_device_request(struct aqualinkdata *aqdata, action_type type, int dev
 // Programmable light has been updated, so update the status in AqualinkD
 void updateLightProgram(struct aqualinkdata *aqdata, int value, clight_detail *light)
 {
+  bool changed = (value > 0 && light->lastValue != value);
+
+  // Called from the programming threads as well as the serial thread
+  aqdata_write_begin();
   light->currentValue = value;
-  if (value > 0 && light->lastValue != value) {
+  if (changed)
     light->lastValue = value;
+  aqdata_write_end();
+
+  if (changed) {
     if (_aqconfig_.save_light_programming_value && light->lightType == LC_PROGRAMABLE ) {
       LOG(PANL_LOG,LOG_INFO, "Writing light programming value to config for %s\n",light->button->label);
       writeCfg(aqdata);
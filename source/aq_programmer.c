@@ -46,6 +46,8 @@
 
 #include <time.h>
 #include "timespec_subtract.h"
+#include "flight_recorder.h"
+#include "aq_snapshot.h"
 
 void _aq_programmer(program_type r_type, char *args, struct aqualinkdata *aqdata, bool allowOveride);
 
@@ -826,6 +828,7 @@ void waitForSingleThreadOrTerminate(struct programmingThreadCtrl *threadCtrl, pr
                   &threadCtrl->thread_id, ptypeName(type), strerror(ret),
                   threadCtrl->aqdata->active_thread.thread_id,
                   ptypeName(threadCtrl->aqdata->active_thread.ptype));
+      auto_flight_recorder_dump("programming thread timeout");
       pthread_mutex_unlock(&threadCtrl->aqdata->active_thread.lifecycle_mutex);
       free(threadCtrl);
       pthread_exit(0);
@@ -833,9 +836,11 @@ void waitForSingleThreadOrTerminate(struct programmingThreadCtrl *threadCtrl, pr
   }
  
   // Clear out any messages to the UI.
+  aqdata_write_begin();
   threadCtrl->aqdata->last_display_message[0] = '\0';
   threadCtrl->aqdata->active_thread.thread_id = &threadCtrl->thread_id;
   threadCtrl->aqdata->active_thread.ptype = type;
+  aqdata_write_end();
 
   if (_aqconfig_.log_msec_ts) {
     clock_gettime(CLOCK_REALTIME, &threadCtrl->aqdata->start_active_time);
@@ -871,8 +876,10 @@ void cleanAndTerminateThread(struct programmingThreadCtrl *threadCtrl)
   } else {
     LOG(PROG_LOG, LOG_DEBUG, "Thread %d,%p (%s) finished\n",threadCtrl->aqdata->active_thread.ptype, threadCtrl->thread_id,ptypeName(threadCtrl->aqdata->active_thread.ptype));
   }
+  aqdata_write_begin();
   threadCtrl->aqdata->active_thread.thread_id = 0;
   threadCtrl->aqdata->active_thread.ptype = AQP_NULL;
+  aqdata_write_end();
   pthread_cond_broadcast(&threadCtrl->aqdata->active_thread.lifecycle_cond);
   pthread_mutex_unlock(&threadCtrl->aqdata->active_thread.lifecycle_mutex);
   threadCtrl->thread_id = 0;
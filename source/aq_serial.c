@@ -23,6 +23,8 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 // Below is needed to set low latency.
 #include <linux/serial.h>
 
@@ -35,18 +37,219 @@
 #include "utils.h"
 #include "config.h"
 #include "packetLogger.h"
+#include "flight_recorder.h"
 #include "timespec_subtract.h"
 #include "aqualink.h"
 #include <sys/select.h>
+#include <sys/uio.h>
 
 
 #define SERIAL_READ_TIMEOUT_SEC 2;
 
 static int _RS485_fds = -1;
 
-static struct timespec _last_serial_read_time;
 
-void send_packet(int fd, unsigned char *packet, int length);
+/*
+ * Receive framer.
+ * Bytes are pulled off the port in as large a chunk as the driver has available into ring[],
+ * then the DLE/STX/ETX & Pentair preamble state machine in rs_framer_byte() consumes them one at a time.
+ * Framer state is kept between calls, so bytes that belong to the next frame stay buffered and
+ * don't cost another select() / read().
+ * The same state machine frames bytes already in memory for the offline capture decoder, see
+ * rs_framer_init_mem().
+ */
+#define RS_RX_RING_MASK (RS_RX_RING_SIZE - 1)
+
+static rs_framer _rs_rx = {.fd = -1, .PentairDataCnt = -1};
+
+// CLOCK_MONOTONIC end of last good packet read, and of last tcdrain() on a write. Used for ACK latency.
+static struct timespec _last_packet_end;
+static struct timespec _last_send_end;
+
+static void rs_framer_reset_frame(rs_framer *fr)
+{
+  fr->index = 0;
+  fr->lastByteDLE = false;
+  fr->jandyPacketStarted = false;
+  fr->pentairPacketStarted = false;
+  fr->PentairPreCnt = 0;
+  fr->PentairDataCnt = -1;
+}
+
+static void rs_framer_reset(rs_framer *fr, int fd)
+{
+  fr->fd = fd;
+  fr->head = 0;
+  fr->tail = 0;
+  fr->mem = NULL;
+  fr->mem_end = NULL;
+  rs_framer_reset_frame(fr);
+}
+
+// Read as many bytes as will fit (contiguously) in the ring
+static int rs_framer_fill(rs_framer *fr, int fd)
+{
+  unsigned int start = fr->head & RS_RX_RING_MASK;
+  unsigned int space = RS_RX_RING_SIZE - (fr->head - fr->tail);
+  int bytesRead;
+
+  if (space > RS_RX_RING_SIZE - start)
+    space = RS_RX_RING_SIZE - start;
+
+  bytesRead = read(fd, &fr->ring[start], space);
+  if (bytesRead > 0) {
+    fr->head += bytesRead;
+    clock_gettime(CLOCK_MONOTONIC, &fr->fill_time);
+    if (_aqconfig_.log_raw_bytes)
+      logPacketBytes(&fr->ring[start], bytesRead);
+  }
+
+  return bytesRead;
+}
+
+/*
+ * Feed one byte through the framer.  Returns 1 when fr->frame holds a complete frame of
+ * fr->index bytes, 0 if more are needed, or AQSERR_2LARGE (caller resets the frame).
+ */
+static int rs_framer_byte(rs_framer *fr, unsigned char byte)
+{
+  int rtn = 0;
+
+  if (fr->lastByteDLE == true && byte == NUL)
+  {
+    // Check for DLE | NULL (that's escape DLE so delete the NULL)
+    //printf("IGNORE THIS PACKET\n");
+    fr->lastByteDLE = false;
+  }
+  else if (fr->lastByteDLE == true)
+  {
+    if (fr->index == 0)
+      fr->index++;
+
+    fr->frame[fr->index] = byte;
+    fr->index++;
+    if (byte == STX && fr->jandyPacketStarted == false)
+    {
+      fr->jandyPacketStarted = true;
+      fr->pentairPacketStarted = false;
+    }
+    else if (byte == ETX && fr->jandyPacketStarted == true)
+    {
+      rtn = 1;
+    }
+  }
+  else if (fr->jandyPacketStarted || fr->pentairPacketStarted)
+  {
+    fr->frame[fr->index] = byte;
+    fr->index++;
+    if (fr->pentairPacketStarted == true && fr->index == 9)
+    {
+      //printf("Read 0x%02hhx %d pentair\n", byte, byte);
+      fr->PentairDataCnt = byte;
+    }
+    if (fr->PentairDataCnt >= 0 && fr->index - 11 >= fr->PentairDataCnt && fr->pentairPacketStarted == true)
+    {
+      rtn = 1;
+      fr->PentairPreCnt = -1;
+    }
+  }
+  else if (byte == DLE && fr->jandyPacketStarted == false)
+  {
+    fr->frame[fr->index] = byte;
+  }
+
+  // // reset index incase we have EOP before start
+  if (fr->jandyPacketStarted == false && fr->pentairPacketStarted == false)
+  {
+    fr->index = 0;
+  }
+
+  if (byte == DLE && fr->pentairPacketStarted == false)
+  {
+    fr->lastByteDLE = true;
+    fr->PentairPreCnt = -1;
+  }
+  else
+  {
+    fr->lastByteDLE = false;
+    if (byte == PP1 && fr->PentairPreCnt == 0)
+      fr->PentairPreCnt = 1;
+    else if (byte == PP2 && fr->PentairPreCnt == 1)
+      fr->PentairPreCnt = 2;
+    else if (byte == PP3 && fr->PentairPreCnt == 2)
+      fr->PentairPreCnt = 3;
+    else if (byte == PP4 && fr->PentairPreCnt == 3)
+    {
+      fr->pentairPacketStarted = true;
+      fr->jandyPacketStarted = false;
+      fr->PentairDataCnt = -1;
+      fr->frame[0] = PP1;
+      fr->frame[1] = PP2;
+      fr->frame[2] = PP3;
+      fr->frame[3] = byte;
+      fr->index = 4;
+    }
+    else if (byte != PP1) // Don't reset counter if multiple PP1's
+      fr->PentairPreCnt = 0;
+  }
+
+  // Stop if we exceed maximum packet length.
+  if (fr->index >= AQ_MAXPKTLEN)
+    return AQSERR_2LARGE;
+
+  return rtn;
+}
+
+// Frame bytes from memory rather than the port, the framer doesn't copy or keep them past the last frame.
+void rs_framer_init_mem(rs_framer *fr, const unsigned char *bytes, size_t length)
+{
+  rs_framer_reset(fr, -1);
+  fr->mem = bytes;
+  fr->mem_end = bytes + length;
+}
+
+/*
+ * Next frame from memory, same checks as read_packet() but no logging.  *packet points into the
+ * framer and is good until the next call.  Returns frame length, AQSERR_* or 0 when out of bytes
+ * (a partial frame at the end is dropped).
+ */
+int rs_framer_next_mem(rs_framer *fr, unsigned char **packet)
+{
+  bool jandyPacketStarted;
+  bool pentairPacketStarted;
+  int framed = 0;
+  int index;
+
+  while (framed == 0) {
+    if (fr->mem >= fr->mem_end)
+      return 0;
+
+    framed = rs_framer_byte(fr, *fr->mem++);
+    if (framed == AQSERR_2LARGE) {
+      rs_framer_reset_frame(fr);
+      return AQSERR_2LARGE;
+    }
+  }
+
+  index = fr->index;
+  jandyPacketStarted = fr->jandyPacketStarted;
+  pentairPacketStarted = fr->pentairPacketStarted;
+  *packet = fr->frame;
+  rs_framer_reset_frame(fr);
+
+  if (jandyPacketStarted && check_jandy_checksum(fr->frame, index) != true)
+    return AQSERR_CHKSUM;
+  else if (pentairPacketStarted && check_pentair_checksum(fr->frame, index) != true)
+    return AQSERR_CHKSUM;
+
+  if (index < AQ_MINPKTLEN && (jandyPacketStarted || pentairPacketStarted))
+    return AQSERR_2SMALL;
+
+  return index;
+}
+
+static void send_frame(int fd, const struct iovec *iov, int iovcnt);
+static void build_ack_templates();
 //unsigned char getProtocolType(unsigned char* packet);
 
 emulation_type getJandyDeviceType(unsigned char ID) {
@@ -119,7 +322,7 @@ const char *getJandyDeviceName(emulation_type etype) {
 
 const char* get_pentair_packet_type(const unsigned char* packet , int length)
 {
-  static char buf[15];
+  static __thread char buf[15]; // Per thread, offline decode classifies packets in parallel
 
   if (length <= 0 )
     return "";
@@ -157,7 +360,7 @@ const char* get_pentair_packet_type(const unsigned char* packet , int length)
 }
 const char* get_jandy_packet_type(const unsigned char* packet , int length)
 {
-  static char buf[15];
+  static __thread char buf[15];
 
   if (length <= 0 )
     return "";
@@ -408,8 +611,76 @@ protocolType getProtocolType(const unsigned char* packet) {
   return P_UNKNOWN; 
 }
 
+/*
+ * Cache of the last frame seen for each (destination, command), so decoders can skip
+ * the identical status frames the panel repeats over and over.
+ * Direct mapped, a collision just means we decode a frame we didn't need to.
+ * Per thread, the serial thread and the decoder thread both check frames, each only
+ * compares against what it has seen itself.
+ */
+#define FRAME_SIG_SLOTS 512
+
+typedef struct frame_sig {
+  unsigned char dest;
+  unsigned char cmd;
+  uint16_t length;
+  uint32_t hash;
+} frame_sig;
+
+static __thread frame_sig _frame_sig[FRAME_SIG_SLOTS];
+static atomic_ulong _repeated_frames = 0;
+
+// FNV-1a
+static uint32_t frame_hash(const unsigned char *packet, int length)
+{
+  uint32_t hash = 2166136261u;
+  int i;
+
+  for (i=0; i < length; i++) {
+    hash ^= packet[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/*
+ * Return true if packet is byte for byte the same as the last one with the same
+ * destination and command.  Only use for frames that carry state and nothing else,
+ * ie not probes, polls or messages where the repeat itself means something.
+ */
+bool is_repeated_frame(const unsigned char *packet, int length)
+{
+  unsigned int slot = ((packet[PKT_DEST] << 1) ^ (packet[PKT_CMD] * 31)) & (FRAME_SIG_SLOTS - 1);
+  frame_sig *sig = &_frame_sig[slot];
+  uint32_t hash = frame_hash(packet, length);
+
+  if (sig->dest == packet[PKT_DEST] && sig->cmd == packet[PKT_CMD] && sig->length == length && sig->hash == hash) {
+    atomic_fetch_add_explicit(&_repeated_frames, 1, memory_order_relaxed);
+    return true;
+  }
+
+  sig->dest = packet[PKT_DEST];
+  sig->cmd = packet[PKT_CMD];
+  sig->length = length;
+  sig->hash = hash;
+
+  return false;
+}
+
+unsigned long get_repeated_frame_count()
+{
+  return atomic_load_explicit(&_repeated_frames, memory_order_relaxed);
+}
+
 
 int set_port_low_latency(int fd, const char* tty)
+{
+  return _set_port_low_latency(fd, tty, true);
+}
+
+// enable false is only for rs485mon's serial benchmark, to compare with and without.
+int _set_port_low_latency(int fd, const char* tty, bool enable)
 {
 
   struct serial_struct serial;
@@ -420,8 +691,13 @@ int set_port_low_latency(int fd, const char* tty)
     return -1;
   }
 
-  LOG(RSSD_LOG,LOG_NOTICE, "Port %s low latency mode is %s\n", tty, (serial.flags & ASYNC_LOW_LATENCY) ? "set" : "NOT set, resetting to low latency!");
-  serial.flags |= ASYNC_LOW_LATENCY;
+  if (enable) {
+    LOG(RSSD_LOG,LOG_NOTICE, "Port %s low latency mode is %s\n", tty, (serial.flags & ASYNC_LOW_LATENCY) ? "set" : "NOT set, resetting to low latency!");
+    serial.flags |= ASYNC_LOW_LATENCY;
+  } else {
+    LOG(RSSD_LOG,LOG_NOTICE, "Port %s low latency mode is %s\n", tty, (serial.flags & ASYNC_LOW_LATENCY) ? "set, clearing" : "NOT set");
+    serial.flags &= ~ASYNC_LOW_LATENCY;
+  }
 
   if (ioctl (fd, TIOCSSERIAL, &serial) < 0) {
 		LOG(RSSD_LOG,LOG_ERR, "Unable to set port %s to low latency mode (%d): %s\n", tty, errno, strerror( errno ));
@@ -524,10 +800,12 @@ void print_file_flags(int fd) {
 
 int init_serial_port(const char* port)
 {
-  struct termios tty;
+  build_ack_templates();
 
   // Have to open with O_NONBLOCK so we don't wait for the Data Carrier Detect (DCD) signal to go high
   _RS485_fds = open(port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC); 
+  // fd numbers get reused on reconnect, so don't carry over anything buffered from the old port
+  rs_framer_reset(&_rs_rx, _RS485_fds);
 
   if (_RS485_fds < 0)  {
     LOG(RSSD_LOG,LOG_ERR, "Unable to open port: %s: %s\n", port, strerror(errno));
@@ -544,8 +822,26 @@ int init_serial_port(const char* port)
 
   if (_aqconfig_.ftdi_low_latency)
     set_port_low_latency(_RS485_fds, port);
-  
-  if (tcgetattr(_RS485_fds, &tty) != 0) {
+
+  // VMIN = 0, VTIME > 0 for a read timeout, in this case 1 second (10 * 0.1s).
+  // (The port stays O_NONBLOCK, so read() never actually waits, we select() first.)
+  if (set_serial_port_attr(_RS485_fds, port, 0, 10) != 0)
+    return -1;
+
+  // Clear out buffer
+  if (tcflush(_RS485_fds, TCIFLUSH) == -1) {
+    LOG(RSSD_LOG,LOG_ERR,"Error %i from tcflush: %s\n", errno, strerror(errno));
+  }
+
+  return _RS485_fds;
+}
+
+// 9600 8N1 raw, with the given VMIN / VTIME
+int set_serial_port_attr(int fd, const char* port, unsigned char vmin, unsigned char vtime)
+{
+  struct termios tty;
+
+  if (tcgetattr(fd, &tty) != 0) {
     LOG(RSSD_LOG,LOG_ERR, "Unable to get port attributes: %s: %s\n", port,strerror(errno));
     return -1;
   }
@@ -577,26 +873,19 @@ int init_serial_port(const char* port)
   tty.c_cflag |= (CREAD | CLOCAL);
 
   // Set timeout for read operations
-  // VMIN = 0, VTIME > 0 for a read timeout
-  // In this case, 1 second (10 * 0.1s) timeout.
-  tty.c_cc[VMIN] = 0;
-  tty.c_cc[VTIME] = 10;
+  tty.c_cc[VMIN] = vmin;
+  tty.c_cc[VTIME] = vtime;
 
   // Below resets the open with O_NONBLOCK
   //fcntl(fd, F_SETFL, 0);
   
   // Write the modified settings
-  if (tcsetattr(_RS485_fds, TCSANOW, &tty) != 0) {
+  if (tcsetattr(fd, TCSANOW, &tty) != 0) {
     LOG(RSSD_LOG,LOG_ERR,"Error %i from tcsetattr: %s\n", errno, strerror(errno));
     return -1;
   }
 
-  // Clear out buffer
-  if (tcflush(_RS485_fds, TCIFLUSH) == -1) {
-    LOG(RSSD_LOG,LOG_ERR,"Error %i from tcflush: %s\n", errno, strerror(errno));
-  }
-
-  return _RS485_fds;
+  return 0;
 }
 
 /* close tty port */
@@ -609,6 +898,8 @@ void _close_serial_port(int fd)
 
   unlock_port(fd);
   close(fd);
+  if (fd == _rs_rx.fd)
+    rs_framer_reset(&_rs_rx, -1);
   LOG(RSSD_LOG,LOG_DEBUG_SERIAL, "Closed serial port\n");
 }
 
@@ -657,92 +948,148 @@ void print_hex(char *pk, int length)
 
 
 
-void send_pentair_command(int fd, unsigned char *packet_buffer, int size)
+/*
+ * Frame builder, everything we put on the wire is assembled here.
+ *
+ * Jandy   : [NUL] DLE STX <dest cmd data... checksum> DLE ETX [NUL]
+ *           Any DLE between STX and the end DLE is escaped with a following NUL.
+ * Pentair : NUL PP1 PP2 PP3 PP4 <body> <checksum hi lo> NUL
+ *
+ * Leading or trailing NUL depends on SEND_CMD_WITH_TRAILING_NUL, see the ACK notes below for why.
+ * Frames are built on the caller's stack (or are read only templates), so nothing here is shared
+ * between senders.
+ */
+#ifndef SEND_CMD_WITH_TRAILING_NUL
+static const unsigned char _jandy_head[] = { NUL, DLE, STX };
+#define JANDY_TAIL_PAD 0
+#else
+static const unsigned char _jandy_head[] = { DLE, STX };
+#define JANDY_TAIL_PAD 1
+#endif
+
+// Worst case, every body byte and the checksum escaped.
+#define JANDY_FRAME_MAX(size) (sizeof(_jandy_head) + ((size) + 1) * 2 + 2 + JANDY_TAIL_PAD)
+
+static unsigned char jandy_checksum(const unsigned char *body, int size)
 {
-  unsigned char packet[AQ_MAXPKTLEN];
-  int i=0;
+  int i;
+  int sum = DLE + STX;
 
-  packet[0] = NUL;
-  packet[1] = PP1;
-  packet[2] = PP2;
-  packet[3] = PP3;
-  packet[4] = PP4;
+  for (i = 0; i < size; i++)
+    sum += body[i];
 
-  //packet[i++] = 0x00; // from
-  //packet[i++] = // to
-  for (i=5; i-5 < size; i++) {
-    //printf("added 0x%02hhx at position %d\n",packet_buffer[i-4],i);
-    if (i==6) {
-      // Replace source
-      //packet[i] = 0x00;
-      // Don't replace source
-      packet[i] = packet_buffer[i-5];
-    } else if (i==9) {
-      // Replace length
-      //packet[i] = 0xFF;
-      packet[i] = (unsigned char)size-5;
-    } else {
-      packet[i] = packet_buffer[i-5];
-    }
+  return (unsigned char)(sum & 0xff);
+}
+
+// Copy src to dst escaping any DLE, dst must have room for 2x length.  Return bytes written.
+static int jandy_escape(unsigned char *dst, const unsigned char *src, int length)
+{
+  int i;
+  int n = 0;
 
-    //packet[i] = packet_buffer[i-4];    
+  for (i = 0; i < length; i++) {
+    dst[n++] = src[i];
+    if (src[i] == DLE)
+      dst[n++] = NUL;
   }
 
-  packet[++i] = NUL;  // Checksum
-  packet[++i] = NUL;  // Checksum
-  generate_pentair_checksum(&packet[1], i);
-  //packet[++i] = NUL;
+  return n;
+}
+
+// Write DLE ETX (and pad) after checksum, return bytes written.
+static int jandy_tail(unsigned char *dst, unsigned char checksum)
+{
+  int n = jandy_escape(dst, &checksum, 1);
 
+  dst[n++] = DLE;
+  dst[n++] = ETX;
+#ifdef SEND_CMD_WITH_TRAILING_NUL
+  dst[n++] = NUL;
+#endif
 
-  //logPacket(packet, i);
-  send_packet(fd,packet,++i);
+  return n;
 }
 
-#ifndef SEND_CMD_WITH_TRAILING_NUL
+// Build complete frame for body (dest, cmd, data) into frame, which must be JANDY_FRAME_MAX(size). Return length.
+static int build_jandy_frame(unsigned char *frame, const unsigned char *body, int size)
+{
+  int length = sizeof(_jandy_head);
 
-void send_jandy_command(int fd, unsigned char *packet_buffer, int size)
+  memcpy(frame, _jandy_head, length);
+  length += jandy_escape(&frame[length], body, size);
+  length += jandy_tail(&frame[length], jandy_checksum(body, size));
+
+  return length;
+}
+
+void send_pentair_command(int fd, unsigned char *packet_buffer, int size)
 {
-  unsigned char packet[AQ_MAXPKTLEN];
-  int i=0;
-  
-  packet[0] = NUL;
-  packet[1] = DLE;
-  packet[2] = STX;
+  unsigned char packet[AQ_MAXPKTLEN + 8];
+  struct iovec iov;
+  int sum = 0;
+  int i;
 
-  for (i=3; i-3 < size; i++) {
-    //printf("added 0x%02hhx at position %d\n",packet_buffer[i-2],i);
-    packet[i] = packet_buffer[i-3];
+  if (size < 0 || size > AQ_MAXPKTLEN) {
+    LOG(RSSD_LOG, LOG_ERR, "Pentair command too large to send (%d bytes)\n", size);
+    return;
   }
 
-  packet[++i] = DLE;
-  packet[++i] = ETX;
+  packet[0] = NUL;
+  packet[1] = PP1;
+  packet[2] = PP2;
+  packet[3] = PP3;
+  packet[4] = PP4;
 
-  packet[i-2] = generate_checksum(packet, i+1);
+  memcpy(&packet[5], packet_buffer, size);
+  // Replace length, but don't replace source
+  if (size > 4)
+    packet[9] = (unsigned char)size-5;
 
-  send_packet(fd,packet,++i);
+  // Checksum is from PP4 to end of data
+  for (i = 4; i < size + 5; i++)
+    sum += packet[i];
+
+  packet[i++] = (unsigned char) ((sum >> 8) & 0xFF); // High Byte
+  packet[i++] = (unsigned char) (sum & 0xFF);        // Low Byte
+  packet[i++] = NUL;
+
+  iov.iov_base = packet;
+  iov.iov_len = i;
+  send_frame(fd, &iov, 1);
 }
-#else
+
+/*
+ * Body is sent straight from the caller's buffer unless it needs escaping, header & tail are
+ * tacked on with writev() so there's no copy in the common case.
+ */
 void send_jandy_command(int fd, unsigned char *packet_buffer, int size)
 {
-  unsigned char packet[AQ_MAXPKTLEN];
-  int i=0;
-  
-  packet[0] = DLE;
-  packet[1] = STX;
+  unsigned char checksum = jandy_checksum(packet_buffer, size);
+  unsigned char tail[2 + 2 + JANDY_TAIL_PAD];
+  struct iovec iov[3];
 
-  for (i=2; i-2 < size; i++) {
-    packet[i] = packet_buffer[i-2];
+  if (size < 0 || size > AQ_MAXPKTLEN) {
+    LOG(RSSD_LOG, LOG_ERR, "Jandy command too large to send (%d bytes)\n", size);
+    return;
   }
 
-  packet[++i] = DLE;
-  packet[++i] = ETX;
-  packet[++i] = NUL;
+  if (memchr(packet_buffer, DLE, size) != NULL) {
+    unsigned char frame[JANDY_FRAME_MAX(AQ_MAXPKTLEN)];
 
-  packet[i-3] = generate_checksum(packet, i);
+    iov[0].iov_base = frame;
+    iov[0].iov_len = build_jandy_frame(frame, packet_buffer, size);
+    send_frame(fd, iov, 1);
+    return;
+  }
 
-  send_packet(fd,packet,++i);
+  iov[0].iov_base = (void *)_jandy_head;
+  iov[0].iov_len = sizeof(_jandy_head);
+  iov[1].iov_base = packet_buffer;
+  iov[1].iov_len = size;
+  iov[2].iov_base = tail;
+  iov[2].iov_len = jandy_tail(tail, checksum);
+  send_frame(fd, iov, 3);
 }
-#endif
 /*
  unsigned char tp[] = {PCOL_PENTAIR, 0x07, 0x0F, 0x10, 0x08, 0x0D, 0x55, 0x55, 0x5B, 0x2A, 0x2B, 0x00, 0x00, 0x00, 0x00, 0x64, 0x00, 0x00, 0x00};
  send_command(0, tp, 19);
@@ -776,6 +1123,12 @@ void send_command(int fd, unsigned char *packet_buffer, int size)
  unsigned char cleanOutSerial(int fd, bool fullClean)
  {
    unsigned char byte = 0x00;
+   // Anything get_packet() has already buffered comes before what's still in the driver
+   while (_rs_rx.fd == fd && _rs_rx.tail != _rs_rx.head) {
+     byte = _rs_rx.ring[_rs_rx.tail++ & RS_RX_RING_MASK];
+     if (byte != 0x00 && !fullClean)
+       return byte;
+   }
    while ( (read(fd, &byte, 1) == 1) && (byte == 0x00 || fullClean) ) {
      //printf("*** Peek Read 0x%02hhx ***\n",byte);
    }
@@ -784,162 +1137,408 @@ void send_command(int fd, unsigned char *packet_buffer, int size)
 
 
 /*
-NEWPACKETADDRESSSPACE 
-is test to copy packet to unused address space before send, just incase tc_drain doesn't work correctly 
-and we change buffer after function call.  (shouldn;t even happen / be needed buyt good for testing)
-*/
-#ifdef NEWPACKETADDRESSSPACE
-void send_packet(int fd, unsigned char *packet_buffer, int length)
-{
-  static unsigned char packet[AQ_MAXPKTLEN];
-  memcpy(packet, packet_buffer, length);
-#else
-void send_packet(int fd, unsigned char *packet, int length)
+ * rs485_frame_delay_auto.  Walk frame_delay down 1ms at a time while nothing we transmit is
+ * followed by a bad read, and back up (and hold there for a while) as soon as something is.
+ * Never go above the panel's own (smoothed) gap between frames, or we'd be replying slower
+ * than it polls.
+ */
+#define FRAME_DELAY_AUTO_MIN         0
+#define FRAME_DELAY_AUTO_MAX         20   // ~40 and the panel thinks we are dead
+#define FRAME_DELAY_AUTO_START       10   // If rs485_frame_delay isn't set
+#define FRAME_DELAY_AUTO_STEP_UP     2
+#define FRAME_DELAY_AUTO_WINDOW      500  // Transmits per evaluation
+#define FRAME_DELAY_AUTO_MAX_ERRORS  3    // Don't wait for the window to finish if we see this many
+#define FRAME_DELAY_AUTO_HOLD        20   // Windows to stay clear of a value that caused errors
+
+static struct {
+  bool awaiting_reply;
+  int transmits;
+  int errors;
+  int hold_windows;
+  int failed_ms;
+  float panel_gap_ms;
+  int history_count;
+  frame_delay_adjustment history[FRAME_DELAY_HISTORY];
+} _fd_tune = {.failed_ms = -1};
+
+// Odd while the serial thread is writing history, the net thread copies it out when it's even and unchanged.
+static atomic_uint _fd_history_seq = 0;
+
+// Tuned value lives here, _aqconfig_.frame_delay stays what the user configured (and what gets saved).
+// Only the serial thread changes it, the net thread reads it for status.
+static atomic_int _tuned_frame_delay = 0;
+
+static void adjust_frame_delay(int to_ms, int errors)
 {
+  unsigned int seq = atomic_load_explicit(&_fd_history_seq, memory_order_relaxed);
+  frame_delay_adjustment *adj = &_fd_tune.history[_fd_tune.history_count % FRAME_DELAY_HISTORY];
+
+  atomic_store_explicit(&_fd_history_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  adj->time = time(NULL);
+  adj->from_ms = atomic_load_explicit(&_tuned_frame_delay, memory_order_relaxed);
+  adj->to_ms = to_ms;
+  adj->errors = errors;
+  _fd_tune.history_count++;
+
+  atomic_store_explicit(&_fd_history_seq, seq + 2, memory_order_release);
+
+  LOG(RSSD_LOG, errors>0?LOG_NOTICE:LOG_INFO, "Auto frame delay changed from %dms to %dms (%d errors in last %d transmits)\n",
+      adj->from_ms, to_ms, errors, _fd_tune.transmits);
+
+  atomic_store_explicit(&_tuned_frame_delay, to_ms, memory_order_relaxed);
+#ifndef RS485MON
+  status_fields_changed(STATUS_F_MESSAGE); // frame_delay is in the status message group
 #endif
+}
+
+static int frame_delay_ceiling()
+{
+  int ceiling = FRAME_DELAY_AUTO_MAX;
+
+  if (_fd_tune.panel_gap_ms >= 1 && _fd_tune.panel_gap_ms < ceiling)
+    ceiling = (int)_fd_tune.panel_gap_ms;
+
+  return ceiling;
+}
+
+static void tune_frame_delay()
+{
+  int delay = atomic_load_explicit(&_tuned_frame_delay, memory_order_relaxed);
+
+  _fd_tune.transmits++;
+  _fd_tune.awaiting_reply = true;
+
+  if (_fd_tune.errors >= FRAME_DELAY_AUTO_MAX_ERRORS || (_fd_tune.transmits >= FRAME_DELAY_AUTO_WINDOW && _fd_tune.errors > 0)) {
+    _fd_tune.failed_ms = delay;
+    _fd_tune.hold_windows = FRAME_DELAY_AUTO_HOLD;
+    if (delay < frame_delay_ceiling())
+      adjust_frame_delay(AQ_MIN(delay + FRAME_DELAY_AUTO_STEP_UP, frame_delay_ceiling()), _fd_tune.errors);
+  } else if (_fd_tune.transmits >= FRAME_DELAY_AUTO_WINDOW) {
+    if (_fd_tune.hold_windows > 0) {
+      _fd_tune.hold_windows--;
+    } else if (delay > frame_delay_ceiling()) {
+      adjust_frame_delay(frame_delay_ceiling(), 0);
+    } else if (delay > FRAME_DELAY_AUTO_MIN && delay - 1 != _fd_tune.failed_ms) {
+      adjust_frame_delay(delay - 1, 0);
+    } else if (delay - 1 == _fd_tune.failed_ms) {
+      // Held long enough, allow another go at the value that failed next time round.
+      _fd_tune.failed_ms = -1;
+    }
+  } else {
+    return;
+  }
+
+  _fd_tune.transmits = 0;
+  _fd_tune.errors = 0;
+}
+
+// 9600 8N1, 10 bits a byte
+#define RS_BYTE_WIRE_MS (10.0 * 1000 / 9600)
+
+/*
+ * Smoothed gap between frames on the bus, ignoring frames that came in the same read and long idle periods.
+ * elapsed is end of last frame to the read that finished this one, so take off this frame's time on the wire.
+ * Skip the gap we just transmitted in, that's our own frame_delay and would only feed back on itself.
+ */
+static void record_frame_gap(const struct timespec *elapsed, int frame_bytes)
+{
+  float gap_ms = (timespec2float(elapsed) * 1000) - (frame_bytes * RS_BYTE_WIRE_MS);
+
+  if (_fd_tune.awaiting_reply || gap_ms <= 0 || gap_ms > 500)
+    return;
+
+  if (_fd_tune.panel_gap_ms <= 0)
+    _fd_tune.panel_gap_ms = gap_ms;
+  else
+    _fd_tune.panel_gap_ms = (_fd_tune.panel_gap_ms * 0.95) + (gap_ms * 0.05);
+}
+
+void init_frame_delay_auto()
+{
+  if (!_aqconfig_.frame_delay_auto)
+    return;
+
+  atomic_store_explicit(&_tuned_frame_delay, _aqconfig_.frame_delay > 0 ? _aqconfig_.frame_delay : FRAME_DELAY_AUTO_START, memory_order_relaxed);
+
+  LOG(RSSD_LOG, LOG_NOTICE, "Auto tuning frame delay, starting at %dms\n", get_frame_delay());
+}
+
+// Frame delay in use, the tuned one if rs485_frame_delay_auto is set.
+int get_frame_delay()
+{
+  if (_aqconfig_.frame_delay_auto)
+    return atomic_load_explicit(&_tuned_frame_delay, memory_order_relaxed);
 
-  struct timespec elapsed_time;
+  return _aqconfig_.frame_delay;
+}
+
+// Newest first, return number of entries filled.  Called from the net thread, so retry if
+// the serial thread changed the history while we were copying it.
+int get_frame_delay_history(frame_delay_adjustment *history, int max)
+{
+  unsigned int seq;
+  int i;
+  int count;
+
+  do {
+    while ((seq = atomic_load_explicit(&_fd_history_seq, memory_order_acquire)) & 1)
+      ;
+    count = AQ_MIN(AQ_MIN(_fd_tune.history_count, FRAME_DELAY_HISTORY), max);
+    for (i=0; i < count; i++)
+      history[i] = _fd_tune.history[(_fd_tune.history_count - 1 - i) % FRAME_DELAY_HISTORY];
+    atomic_thread_fence(memory_order_acquire);
+  } while (atomic_load_explicit(&_fd_history_seq, memory_order_relaxed) != seq);
+
+  return count;
+}
+
+float get_panel_frame_gap()
+{
+  return _fd_tune.panel_gap_ms;
+}
+
+static tx_schedule_stats _tx_schedule = {0};
+
+/*
+ * Hold off a transmit until frame_delay ms after the end of the last packet we read.
+ * Sleeps to an absolute CLOCK_MONOTONIC deadline, so it's immune to NTP / panel time sync
+ * stepping the wall clock, and an interrupted sleep can't stretch the gap.
+ */
+static void wait_for_frame_gap(int frame_delay)
+{
+  struct timespec deadline = _last_packet_end;
   struct timespec now;
+  struct timespec overshoot;
+  unsigned long overshoot_us;
 
-  if (_aqconfig_.frame_delay > 0) {
-    struct timespec min_frame_wait_time;
-    struct timespec frame_wait_time;
-    struct timespec remainder_time;
-    //struct timespec diff;
+  deadline.tv_nsec += frame_delay * 1000000L;
+  while (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
 
-    min_frame_wait_time.tv_sec = 0;
-    min_frame_wait_time.tv_nsec = _aqconfig_.frame_delay * 1000000;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (timespec_subtract(&overshoot, &deadline, &now)) {
+    // Already past the gap, nothing to wait for.
+    _tx_schedule.late++;
+    return;
+  }
 
-    do {
-      clock_gettime(CLOCK_REALTIME, &now);
-      timespec_subtract(&elapsed_time, &now, &_last_serial_read_time);
-      if (timespec_subtract(&frame_wait_time, &min_frame_wait_time, &elapsed_time)) {
-        break;
-      }
-    } while (nanosleep(&frame_wait_time, &remainder_time) != 0);
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    // Interrupted, go back to sleep until the same deadline.
   }
 
-  clock_gettime(CLOCK_REALTIME, &now);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timespec_subtract(&overshoot, &now, &deadline);
+  overshoot_us = overshoot.tv_sec * 1000000UL + overshoot.tv_nsec / 1000;
 
-  if (true) {
-    //int nwrite = write(fd, packet, length);
-    //LOG(RSSD_LOG,LOG_DEBUG, "Serial write %d bytes of %d\n",nwrite,length);
-    int nwrite = write(fd, packet, length);
-    //if (nwrite < 0)
-    if (nwrite != length)
-        LOG(RSSD_LOG, LOG_ERR, "write to serial port failed\n");
-  } else {
-    int nwrite, i;
-    for (i = 0; i < length; i += nwrite) {
-      nwrite = write(fd, packet + i, length - i);
-      if (nwrite < 0)
-        LOG(RSSD_LOG, LOG_ERR, "write to serial port failed\n");
-      //else
-      //  LOG(RSSD_LOG,LOG_DEBUG, "Serial write %d bytes of %d\n",nwrite,length-1);
-    }
-  } // _blockine_mode
+  _tx_schedule.scheduled++;
+  _tx_schedule.total_overshoot_us += overshoot_us;
+  if (overshoot_us > _tx_schedule.max_overshoot_us)
+    _tx_schedule.max_overshoot_us = overshoot_us;
+}
 
-  /*
-  #ifdef AQ_DEBUG
-    // Need to take this out for release
-    if ( getLogLevel(RSSD_LOG) >= LOG_DEBUG) {
-      debuglogPacket(&packet[1], length-2);
-    }
-  #endif
-  */
+void get_tx_schedule_stats(tx_schedule_stats *stats)
+{
+  *stats = _tx_schedule;
+}
+
+void reset_tx_schedule_stats()
+{
+  memset(&_tx_schedule, 0, sizeof(_tx_schedule));
+}
+
+/*
+ * Serial outage accounting, from the port going bad to the first good packet after it's reopened.
+ * Only called from the main loop, read by the net thread for the API.
+ */
+static serial_recovery_stats _recovery = {0};
+static struct timespec _outage_start;
+static bool _in_outage = false;
+
+// Returns true if this starts a new outage, false if we were already in one.
+bool record_serial_lost()
+{
+  if (_in_outage)
+    return false;
+
+  clock_gettime(CLOCK_MONOTONIC, &_outage_start);
+  _in_outage = true;
+  _recovery.outages++;
+  return true;
+}
+
+void record_serial_reopen()
+{
+  _recovery.reopen_attempts++;
+}
+
+// Returns ms the outage lasted, or -1 if we weren't in one.
+long record_serial_recovered()
+{
+  struct timespec now;
+  struct timespec elapsed;
+  unsigned long ms;
+
+  if (!_in_outage)
+    return -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  timespec_subtract(&elapsed, &now, &_outage_start);
+  ms = elapsed.tv_sec * 1000UL + elapsed.tv_nsec / 1000000;
+
+  _in_outage = false;
+  _recovery.recoveries++;
+  _recovery.last_recover_ms = ms;
+  _recovery.total_recover_ms += ms;
+  if (ms > _recovery.max_recover_ms)
+    _recovery.max_recover_ms = ms;
+
+  return ms;
+}
+
+void get_serial_recovery_stats(serial_recovery_stats *stats)
+{
+  *stats = _recovery;
+}
+
+void reset_serial_recovery_stats()
+{
+  memset(&_recovery, 0, sizeof(_recovery));
+  // Keep counting an outage that's still going.
+  if (_in_outage)
+    _recovery.outages = 1;
+}
+
+static void send_frame(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct timespec now;
+  ssize_t length = 0;
+  ssize_t nwrite;
+  int frame_delay;
+  int i;
+
+  for (i = 0; i < iovcnt; i++)
+    length += iov[i].iov_len;
+
+  if (_aqconfig_.frame_delay_auto) {
+    tune_frame_delay();
+  }
+
+  frame_delay = get_frame_delay();
+  if (frame_delay > 0) {
+    wait_for_frame_gap(frame_delay);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  nwrite = writev(fd, iov, iovcnt);
+  if (nwrite != length)
+    LOG(RSSD_LOG, LOG_ERR, "write to serial port failed\n");
 
   // MAYBE Change this back to debug serial
   //LOG(RSSD_LOG,LOG_DEBUG_SERIAL, "Serial write %d bytes\n",length-2);
-  //LOG(RSSD_LOG,LOG_DEBUG, "Serial write %d bytes, type 0x%02hhx cmd 0x%02hhx\n",length-2,packet[5],packet[6]);
-  if (_aqconfig_.log_protocol_packets || getLogLevel(RSSD_LOG) >= LOG_DEBUG_SERIAL)
-    logPacketWrite(&packet[1], length-1);
-/*
-  if (getLogLevel(PDA_LOG) == LOG_DEBUG) {
-    char buff[1024];
-    beautifyPacket(buff, &packet[1], length, false);
-    LOG(PDA_LOG,LOG_DEBUG, "%s", buff);
+  // Always, the flight recorder keeps every packet. Only logging needs the frame in one piece.
+  {
+    unsigned char packet[JANDY_FRAME_MAX(AQ_MAXPKTLEN)];
+    int plen = 0;
+
+    for (i = 0; i < iovcnt && plen + iov[i].iov_len <= sizeof(packet); i++) {
+      memcpy(&packet[plen], iov[i].iov_base, iov[i].iov_len);
+      plen += iov[i].iov_len;
+    }
+    // Packet is padded with leading NUL, so discard for logging
+    if (packet[0] == NUL)
+      logPacketWrite(&packet[1], plen-1);
+    else
+      logPacketWrite(packet, plen);
   }
-*/
-/*
-  if ( getLogLevel(RSSD_LOG) >= LOG_DEBUG_SERIAL || ) {
-    // Packet is padded with 0x00, so discard for logging
-    LOG(RSSD_LOG,LOG_DEBUG_SERIAL, "Serial write %d bytes\n",length-2);
-    logPacket(&packet[1], length-2);
-  }*/ /*else if (getLogLevel(RSSD_LOG) >= LOG_DEBUG) {
-    static char buf[1000];
-    beautifyPacket(buf,&packet[1],length-2);
-    LOG(RSSD_LOG,LOG_DEBUG, "Serial write %s\n",buf);
-  }*/
 
   tcdrain(fd); // Make sure buffer has been sent.
-  //if (_aqconfig_.frame_delay > 0) {
+  clock_gettime(CLOCK_MONOTONIC, &_last_send_end);
 #ifndef RS485MON
-  if (_aqconfig_.frame_delay > 0) {
-    timespec_subtract(&elapsed_time, &now, &_last_serial_read_time);
+  if (frame_delay > 0) {
+    struct timespec elapsed_time;
+    timespec_subtract(&elapsed_time, &now, &_last_packet_end);
     LOG(RSTM_LOG, LOG_DEBUG, "Time from recv to send is %.3f sec\n",
                             roundf3(timespec2float(&elapsed_time)));
   }
 #endif
-  //}
+}
 
+/*
+ * ACK frames are the bulk of what we send, so they are prebuilt for every command for the
+ * ack types we use, and sent straight from the template.
+ * Anything else is built on the stack each time.
+ *
+ * To overcome Pentair VSP bug in Jandy control panel, we need to NOT send trailing NUL on
+ * a normal ACK, but sent the trailing NUL on in ack with command.
+ * Always send trailing NUL causes VSP to loose connection
+ * Never sending trailing NUL causes come commands to be missed.
+ * (At present neither, see SEND_CMD_WITH_TRAILING_NUL)
+ */
+#define ACK_BODY_LEN 4 // dest, CMD_ACK, ack_type, command
+#define ACK_FRAME_MAX JANDY_FRAME_MAX(ACK_BODY_LEN)
+
+typedef struct ack_template {
+  unsigned char length;
+  unsigned char frame[ACK_FRAME_MAX];
+} ack_template;
+
+// ACK_NORMAL, ACK_SCREEN_BUSY*, ACK_PDA, ACK_ONETOUCH, ACK_IAQ_TOUCH and the iAqualink ready ack
+static const unsigned char _ack_template_types[] = { 0x00, 0x01, 0x03, 0x3f, 0x40, 0x80, 0x81, 0x83 };
+#define ACK_TEMPLATE_TYPES (sizeof(_ack_template_types) / sizeof(_ack_template_types[0]))
+
+static ack_template _ack_templates[ACK_TEMPLATE_TYPES][256];
+static signed char _ack_template_row[256];
+static bool _ack_templates_built = false;
+
+static int build_ack_frame(unsigned char *frame, unsigned char ack_type, unsigned char command)
+{
+  unsigned char body[ACK_BODY_LEN] = { DEV_MASTER, CMD_ACK, ack_type, command };
+
+  return build_jandy_frame(frame, body, ACK_BODY_LEN);
 }
 
-#ifndef SEND_CMD_WITH_TRAILING_NUL
-void _send_ack(int fd, unsigned char ack_type, unsigned char command)
+// Called before the port is opened, so before anything can send.
+static void build_ack_templates()
 {
-  //const int length = 11;
-  int length = 10;
-  // Default null ack with checksum generated, don't mess with it, just over right                    
-  unsigned char ackPacket[] = { NUL, DLE, STX, DEV_MASTER, CMD_ACK, NUL, NUL, 0x13, DLE, ETX, NUL }; 
-  //unsigned char ackPacket[] = { NUL, DLE, STX, DEV_MASTER, CMD_ACK, NUL, NUL, 0x13, DLE, ETX }; 
-
-  // To overcome Pentair VSP bug in Jandy control panel, we need to NOT send trailing NUL on
-  // a normal ACK, but sent the trailing NUL on in ack with command.
-  // Always send trailing NUL causes VSP to loose connection
-  // Never sending trailing NUL causes come commands to be missed.
-
-  // Update the packet and checksum if command argument is not NUL.
-  if(command != NUL || ack_type != NUL) {
-    //ackPacket[5] = 0x00 normal, 0x03 some pause, 0x01 some pause ending  (0x01 = Screen Busy (also return from logn message))
-    ackPacket[5] = ack_type;
-    ackPacket[6] = command;
-    ackPacket[7] = generate_checksum(ackPacket, length);
-    if (command == DLE) {  // We shuld probably also check the ack type as well, just for future proofing.
-      // 0x10(DLE) that's not part of the headder or footer needs to be escaped AFTER with NUL, so shif everyting uo one
-      ackPacket[8] = ackPacket[7]; // move the caculated checksum
-      ackPacket[7] = NUL; // escape the DLE
-      ackPacket[9] = DLE; // add new end sequence 
-      ackPacket[10] = ETX; // add new end sequence
-      length = 11;
+  unsigned int row;
+  int cmd;
+
+  if (_ack_templates_built)
+    return;
+
+  memset(_ack_template_row, -1, sizeof(_ack_template_row));
+
+  for (row = 0; row < ACK_TEMPLATE_TYPES; row++) {
+    _ack_template_row[_ack_template_types[row]] = row;
+    for (cmd = 0; cmd < 256; cmd++) {
+      _ack_templates[row][cmd].length = build_ack_frame(_ack_templates[row][cmd].frame, _ack_template_types[row], cmd);
     }
   }
-  send_packet(fd, ackPacket, length);
+
+  _ack_templates_built = true;
 }
-#else
+
 void _send_ack(int fd, unsigned char ack_type, unsigned char command)
 {
-  //const int length = 11;
-  int length = 9;
-  // Default null ack with checksum generated, don't mess with it, just over right                    
-  unsigned char ackPacket[] = { DLE, STX, DEV_MASTER, CMD_ACK, NUL, NUL, 0x13, DLE, ETX, NUL }; 
-
-  if(command != NUL || ack_type != NUL) {
-    //ackPacket[5] = 0x00 normal, 0x03 some pause, 0x01 some pause ending  (0x01 = Screen Busy (also return from logn message))
-    ackPacket[4] = ack_type;
-    ackPacket[5] = command;
-    ackPacket[6] = generate_checksum(ackPacket, length);
-    if (command == DLE) {  // We shuld probably also check the ack type as well, just for future proofing.
-      // 0x10(DLE) that's not part of the headder or footer needs to be escaped AFTER with NUL, so shif everyting uo one
-      ackPacket[7] = ackPacket[7]; // move the caculated checksum
-      ackPacket[6] = NUL; // escape the DLE
-      ackPacket[8] = DLE; // add new end sequence 
-      ackPacket[9] = ETX; // add new end sequence
-      length = 10;
-    }
+  unsigned char frame[ACK_FRAME_MAX];
+  struct iovec iov;
+
+  if (_ack_templates_built && _ack_template_row[ack_type] >= 0) {
+    const ack_template *ack = &_ack_templates[(int)_ack_template_row[ack_type]][command];
+    iov.iov_base = (void *)ack->frame;
+    iov.iov_len = ack->length;
+  } else {
+    iov.iov_base = frame;
+    iov.iov_len = build_ack_frame(frame, ack_type, command);
   }
-  send_packet(fd, ackPacket, length);
+
+  send_frame(fd, &iov, 1);
 }
-#endif // SEND_CMD_WITH_TRAILING_NUL
 
 void send_ack(int fd, unsigned char command)
 {
@@ -1082,28 +1681,27 @@ LXi status | HEX: 0x10|0x02|0x00|0x0d|0x00|0x00|0x00|0x1f|0x10|0x03|
 */
 
 
-int get_packet(int fd, unsigned char* packet)
+static int read_packet(int fd, unsigned char* packet)
 {
+  rs_framer *fr = &_rs_rx;
   unsigned char byte = 0x00;
   int bytesRead;
   int index = 0;
   bool endOfPacket = false;
-  //bool packetStarted = FALSE;
-  bool lastByteDLE = false;
+  int framed;
   int retry = 0;
   bool jandyPacketStarted = false;
   bool pentairPacketStarted = false;
-  //bool lastByteDLE = false;
-  int PentairPreCnt = 0;
-  int PentairDataCnt = -1;
   struct timespec packet_elapsed;
-  struct timespec packet_end_time;
 
   int wait_val;
   struct timeval read_tv;
   read_tv.tv_sec = SERIAL_READ_TIMEOUT_SEC;  // 1-second timeout
   read_tv.tv_usec = 0;
 
+  if (fr->fd != fd)
+    rs_framer_reset(fr, fd);
+
   memset(packet, 0, AQ_MAXPKTLEN);
 
   // Read packet in byte order below
@@ -1111,130 +1709,74 @@ int get_packet(int fd, unsigned char* packet)
   // sometimes we get ETX DLE and no start, so for now just ignoring that.  Seem to be more applicable when busy RS485 traffic
 
   while (!endOfPacket) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
-    // Wait for up to read_tv.tv_sec second for data to become available
-    wait_val = select(fd + 1, &readfds, NULL, NULL, &read_tv);
-    if (wait_val == -1) {
-      return AQSERR_READ;
-    } else if (wait_val == 0) {
-      //return AQSERR_TIMEOUT;
-      return 0; // Should probably change to above
-    }
-
-    bytesRead = read(fd, &byte, 1);
-
-    if (bytesRead <= 0 && errno == EAGAIN ) { // We also get ENOTTY on some non FTDI adapters
-      if (jandyPacketStarted == false && pentairPacketStarted == false && lastByteDLE == false) {
-        return 0;
-      } else if (++retry > 10 ) {
-        LOG(RSSD_LOG,LOG_WARNING, "Serial read timeout\n");
-        if (index > 0) { logPacketError(packet, index); }
-        return AQSERR_READ;
-      } else {
-        continue;
-      }
-    } else if(bytesRead <= 0) {
-      if (! isAqualinkDStopping() ) {
+    // Only go to the port once everything buffered has been consumed
+    if (fr->tail == fr->head) {
+      fd_set readfds;
+      FD_ZERO(&readfds);
+      FD_SET(fd, &readfds);
+      // Wait for up to read_tv.tv_sec second for data to become available
+      wait_val = select(fd + 1, &readfds, NULL, NULL, &read_tv);
+      if (wait_val == -1) {
+        rs_framer_reset_frame(fr);
         return AQSERR_READ;
-      } else {
-        return 0;
+      } else if (wait_val == 0) {
+        // Bus has been quiet for the full timeout, anything partial is stale
+        rs_framer_reset_frame(fr);
+        //return AQSERR_TIMEOUT;
+        return 0; // Should probably change to above
       }
-    } else if (bytesRead == 1) {
-      retry = 0;
-      if (_aqconfig_.log_raw_bytes)
-        logPacketByte(&byte);
 
-      if (lastByteDLE == true && byte == NUL)
-      {
-        // Check for DLE | NULL (that's escape DLE so delete the NULL)
-        //printf("IGNORE THIS PACKET\n");
-        lastByteDLE = false;
-      }
-      else if (lastByteDLE == true)
-      {
-        if (index == 0)
-          index++;
-
-        packet[index] = byte;
-        index++;
-        if (byte == STX && jandyPacketStarted == false)
-        {
-          jandyPacketStarted = true;
-          pentairPacketStarted = false;
-        }
-        else if (byte == ETX && jandyPacketStarted == true)
-        {
-          endOfPacket = true;
-        }
-      }
-      else if (jandyPacketStarted || pentairPacketStarted)
-      {
-        packet[index] = byte;
-        index++;
-        if (pentairPacketStarted == true && index == 9)
-        {
-          //printf("Read 0x%02hhx %d pentair\n", byte, byte);
-          PentairDataCnt = byte;
+      bytesRead = rs_framer_fill(fr, fd);
+
+      if (bytesRead <= 0 && errno == EAGAIN ) { // We also get ENOTTY on some non FTDI adapters
+        if (fr->jandyPacketStarted == false && fr->pentairPacketStarted == false && fr->lastByteDLE == false) {
+          return 0;
+        } else if (++retry > 10 ) {
+          LOG(RSSD_LOG,LOG_WARNING, "Serial read timeout\n");
+          if (fr->index > 0) { logPacketError(fr->frame, fr->index); }
+          rs_framer_reset_frame(fr);
+          return AQSERR_READ;
+        } else {
+          continue;
         }
-        if (PentairDataCnt >= 0 && index - 11 >= PentairDataCnt && pentairPacketStarted == true)
-        {
-          endOfPacket = true;
-          PentairPreCnt = -1;
+      } else if(bytesRead <= 0) {
+        rs_framer_reset_frame(fr);
+        if (! isAqualinkDStopping() ) {
+          return AQSERR_READ;
+        } else {
+          return 0;
         }
       }
-      else if (byte == DLE && jandyPacketStarted == false)
-      {
-        packet[index] = byte;
-      }
-
-      // // reset index incase we have EOP before start
-      if (jandyPacketStarted == false && pentairPacketStarted == false)
-      {
-        index = 0;
-      }
-
-      if (byte == DLE && pentairPacketStarted == false)
-      {
-        lastByteDLE = true;
-        PentairPreCnt = -1;
-      }
-      else
-      {
-        lastByteDLE = false;
-        if (byte == PP1 && PentairPreCnt == 0)
-          PentairPreCnt = 1;
-        else if (byte == PP2 && PentairPreCnt == 1)
-          PentairPreCnt = 2;
-        else if (byte == PP3 && PentairPreCnt == 2)
-          PentairPreCnt = 3;
-        else if (byte == PP4 && PentairPreCnt == 3)
-        {
-          pentairPacketStarted = true;
-          jandyPacketStarted = false;
-          PentairDataCnt = -1;
-          packet[0] = PP1;
-          packet[1] = PP2;
-          packet[2] = PP3;
-          packet[3] = byte;
-          index = 4;
-        }
-        else if (byte != PP1) // Don't reset counter if multiple PP1's
-          PentairPreCnt = 0;
-      }
+      retry = 0;
     }
 
-    // Break out of the loop if we exceed maximum packet
-    // length.
-    if (index >= AQ_MAXPKTLEN) {
+    byte = fr->ring[fr->tail++ & RS_RX_RING_MASK];
+
+    framed = rs_framer_byte(fr, byte);
+    if (framed == AQSERR_2LARGE) {
       LOG(RSSD_LOG,LOG_WARNING, "Serial packet too large for buffer, stopped reading\n");
-      logPacketError(packet, index);
+      logPacketError(fr->frame, fr->index);
       //log_packet(LOG_WARNING, "Bad receive packet ", packet, index);
+      rs_framer_reset_frame(fr);
       return AQSERR_2LARGE;
-      break;
     }
+    endOfPacket = (framed > 0);
+  }
+
+  // Hand the completed frame to the caller, anything left in the ring is the start of the next one.
+  // Frame ended in the last chunk read, so that's as close as we can get to when it came off the wire.
+  index = fr->index;
+  if (_aqconfig_.frame_delay_auto || getLogLevel(RSTM_LOG) >= LOG_DEBUG) {
+    timespec_subtract(&packet_elapsed, &fr->fill_time, &_last_packet_end);
+    if (_aqconfig_.frame_delay_auto)
+      record_frame_gap(&packet_elapsed, index);
+    LOG(RSTM_LOG, LOG_DEBUG, "Time between packets (%.3f sec)\n", roundf3(timespec2float(&packet_elapsed)) );
   }
+  _last_packet_end = fr->fill_time;
+  jandyPacketStarted = fr->jandyPacketStarted;
+  pentairPacketStarted = fr->pentairPacketStarted;
+  memcpy(packet, fr->frame, index);
+  rs_framer_reset_frame(fr);
 
   // Report any unusual size packets.
   if (index >= AQ_MAXPKTLEN_WARNING) {
@@ -1285,35 +1827,52 @@ int get_packet(int fd, unsigned char* packet)
   }
 
 
-  if (_aqconfig_.frame_delay > 0 || getLogLevel(RSTM_LOG) >= LOG_DEBUG) {
-    clock_gettime(CLOCK_REALTIME, &packet_end_time);
-    if (getLogLevel(RSTM_LOG) >= LOG_DEBUG) {
-      timespec_subtract(&packet_elapsed, &packet_end_time, &_last_serial_read_time);
-      /*
-      LOG(RSTM_LOG, LOG_NOTICE, "Start sec=%ld nsec=%ld\n",_last_serial_read_time.tv_sec,_last_serial_read_time.tv_nsec);
-      LOG(RSTM_LOG, LOG_NOTICE, "End sec=%ld nsec=%ld\n",packet_end_time.tv_sec,packet_end_time.tv_nsec);
-      LOG(RSTM_LOG, LOG_NOTICE, "Elapsed sec=%ld nsec=%ld Time between packets (%.3f sec)\n",packet_elapsed.tv_sec,packet_elapsed.tv_nsec, roundf3(timespec2float(&packet_elapsed)) );
-      */
-      LOG(RSTM_LOG, LOG_DEBUG, "Time between packets (%.3f sec)\n", roundf3(timespec2float(&packet_elapsed)) );
-
-    }
-    //if (_aqconfig_.frame_delay > 0) {
-    memcpy(&_last_serial_read_time, &packet_end_time, sizeof(struct timespec));
-    //}
-  }
-
-  //clock_gettime(CLOCK_REALTIME, &_last_serial_read_time);
   //}
   //LOG(RSSD_LOG,LOG_DEBUG_SERIAL, "Serial read %d bytes\n",index);
-  if (_aqconfig_.log_protocol_packets || getLogLevel(RSSD_LOG) >= LOG_DEBUG_SERIAL) {
-    logPacketRead(packet, index);
-  } else {
-    LOG(RSSD_LOG,LOG_DEBUG_SERIAL, "Serial read %d bytes\n",index);
-  }
+  // Always, the flight recorder keeps every packet (nothing's formatted unless we're logging).
+  logPacketRead(packet, index);
   // Return the packet length.
   return index;
 }
 
+int get_packet(int fd, unsigned char* packet)
+{
+  int rtn = read_packet(fd, packet);
+
+  if (rtn == AQSERR_CHKSUM)
+    flight_recorder_checksum_error();
+
+  if (_aqconfig_.frame_delay_auto && _fd_tune.awaiting_reply && rtn != 0) {
+    // First thing on the bus after we transmitted, was it readable?
+    _fd_tune.awaiting_reply = false;
+    if (rtn == AQSERR_CHKSUM || rtn == AQSERR_2LARGE || rtn == AQSERR_2SMALL || rtn == AQSERR_TIMEOUT)
+      _fd_tune.errors++;
+  }
+
+  return rtn;
+}
+
+/*
+ * Time from the end of the last packet read, to tcdrain() completing on the last write.
+ * Return false if nothing's been written since that packet.
+ */
+bool get_ack_turnaround(struct timespec *elapsed)
+{
+  return timespec_subtract(elapsed, &_last_send_end, &_last_packet_end) == 0;
+}
+
+// CLOCK_MONOTONIC of the read() that finished the last frame get_packet() returned, good or bad.
+void get_last_read_time(struct timespec *ts)
+{
+  *ts = _rs_rx.fill_time;
+}
+
+// True if get_packet() already has unread bytes from fd, ie don't wait on fd before calling it again.
+bool serial_rx_buffered(int fd)
+{
+  return (_rs_rx.fd == fd && _rs_rx.tail != _rs_rx.head);
+}
+
 const char* cmd_to_string(const unsigned char cmd)
 {
   switch (cmd) {
@@ -4,6 +4,7 @@
 
 #include <termios.h>
 #include <stdbool.h>
+#include <time.h>
 
 #include "aq_programmer.h" // Need this for function getJandyDeviceType due to enum defined their.
 emulation_type getJandyDeviceType(unsigned char ID);
@@ -580,7 +581,8 @@ typedef enum {
   DRS_CHEM_FEED,
   DRS_HEATPUMP,
   DRS_JLIGHT,
-  DRS_CHEM_ANLZ
+  DRS_CHEM_ANLZ,
+  DRS_IAQLNK // Status only, never interested in the ack
 } rsDeviceType;
 
 /*
@@ -613,6 +615,9 @@ typedef enum {
 
 int init_serial_port(const char* tty);
 int init_blocking_serial_port(const char* tty);
+int set_serial_port_attr(int fd, const char* port, unsigned char vmin, unsigned char vtime);
+int set_port_low_latency(int fd, const char* tty);
+int _set_port_low_latency(int fd, const char* tty, bool enable);
 //int init_readahead_serial_port(const char* tty);
 
 void close_serial_port(int file_descriptor);
@@ -625,12 +630,82 @@ void close_serial_port(int file_descriptor);
 //#endif
 int generate_checksum(unsigned char* packet, int length);
 protocolType getProtocolType(const unsigned char* packet);
+bool is_repeated_frame(const unsigned char *packet, int length);
+unsigned long get_repeated_frame_count();
 bool check_jandy_checksum(unsigned char* packet, int length);
 bool check_pentair_checksum(unsigned char* packet, int length);
 void send_ack(int file_descriptor, unsigned char command);
 void send_extended_ack(int fd, unsigned char ack_type, unsigned char command);
 //void send_cmd(int file_descriptor, unsigned char cmd, unsigned char args);
+// Receive framer, normally fed from the port by get_packet().  See aq_serial.c
+#define RS_RX_RING_SIZE 1024 // Must be power of 2
+
+typedef struct rs_framer {
+  int fd;
+  unsigned char ring[RS_RX_RING_SIZE];
+  unsigned int head; // Free running, next write position
+  unsigned int tail; // Free running, next read position
+  struct timespec fill_time; // CLOCK_MONOTONIC of last read() into ring
+  const unsigned char *mem;     // Or bytes already in memory, rs_framer_init_mem()
+  const unsigned char *mem_end;
+  unsigned char frame[AQ_MAXPKTLEN];
+  int index;
+  bool lastByteDLE;
+  bool jandyPacketStarted;
+  bool pentairPacketStarted;
+  int PentairPreCnt;
+  int PentairDataCnt;
+} rs_framer;
+
+void rs_framer_init_mem(rs_framer *fr, const unsigned char *bytes, size_t length);
+int rs_framer_next_mem(rs_framer *fr, unsigned char **packet);
+
 int get_packet(int file_descriptor, unsigned char* packet);
+bool serial_rx_buffered(int file_descriptor);
+bool get_ack_turnaround(struct timespec *elapsed);
+void get_last_read_time(struct timespec *ts);
+
+// frame_delay transmit scheduling, how long past the target gap we actually sent.
+typedef struct tx_schedule_stats {
+  unsigned long scheduled;          // Transmits we held back to honor frame_delay
+  unsigned long late;               // Transmits that were already past the frame_delay gap
+  unsigned long total_overshoot_us;
+  unsigned long max_overshoot_us;
+} tx_schedule_stats;
+
+void get_tx_schedule_stats(tx_schedule_stats *stats);
+void reset_tx_schedule_stats();
+
+// Serial port outages, time from losing the port to the first good packet after reopening it.
+typedef struct serial_recovery_stats {
+  unsigned long outages;
+  unsigned long recoveries;
+  unsigned long reopen_attempts;
+  unsigned long last_recover_ms;
+  unsigned long max_recover_ms;
+  unsigned long total_recover_ms;
+} serial_recovery_stats;
+
+bool record_serial_lost();
+void record_serial_reopen();
+long record_serial_recovered();
+void get_serial_recovery_stats(serial_recovery_stats *stats);
+void reset_serial_recovery_stats();
+
+// rs485_frame_delay_auto adjustments
+#define FRAME_DELAY_HISTORY 16
+
+typedef struct frame_delay_adjustment {
+  time_t time;
+  int from_ms;
+  int to_ms;
+  int errors; // Bad reads after our transmits that caused the change, 0 when stepping down
+} frame_delay_adjustment;
+
+void init_frame_delay_auto();
+int get_frame_delay();
+int get_frame_delay_history(frame_delay_adjustment *history, int max);
+float get_panel_frame_gap();
 //int get_packet_lograw(int fd, unsigned char* packet);
 int is_valid_port(int fd);
 
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "aqualink.h"
+#include "utils.h"
+#include "aq_snapshot.h"
+
+#define SNAPSHOT_SPIN 8 // Tries before we start yielding to the writer
+
+/*
+ * _writers is how many write sections are open, _generation goes up as each one closes
+ * (before _writers comes down).  A copy is good if no one was writing when it started and
+ * nothing was open or had closed by the time it finished.
+ */
+static atomic_uint _writers = 0;
+static atomic_uint _generation = 0;
+
+// Only the serial & decoder threads take this, for the length of one packet.
+static pthread_mutex_t _decode_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Last copy taken, so pointers into it can be turned back into the real thing
+static const struct aqualinkdata *_snap_src = NULL;
+static struct aqualinkdata *_snap_dst = NULL;
+
+void aqdata_write_begin()
+{
+  atomic_fetch_add(&_writers, 1);
+}
+
+void aqdata_write_end()
+{
+  atomic_fetch_add(&_generation, 1);
+  atomic_fetch_sub(&_writers, 1);
+}
+
+void aqdata_decode_begin()
+{
+  pthread_mutex_lock(&_decode_mutex);
+  aqdata_write_begin();
+}
+
+void aqdata_decode_end()
+{
+  aqdata_write_end();
+  pthread_mutex_unlock(&_decode_mutex);
+}
+
+static void relocate(void **ptr, const struct aqualinkdata *src, struct aqualinkdata *dst)
+{
+  const char *p = (const char *)*ptr;
+
+  if (p >= (const char *)src && p < (const char *)(src + 1))
+    *ptr = (char *)dst + (p - (const char *)src);
+}
+
+/*
+ * Copy src into dst, waiting out any writes in progress.  Pointers that pointed into src
+ * (button leds, pump / light buttons etc) are moved to point into dst, so the copy is self
+ * contained apart from virtual button leds which live elsewhere.
+ */
+void aqdata_snapshot(const struct aqualinkdata *src, struct aqualinkdata *dst)
+{
+  unsigned int generation;
+  int tries = 0;
+
+  for (;;) {
+    generation = atomic_load(&_generation);
+    if (atomic_load(&_writers) == 0) {
+      memcpy(dst, src, sizeof(struct aqualinkdata));
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load(&_writers) == 0 && atomic_load(&_generation) == generation)
+        break;
+    }
+    if (++tries > SNAPSHOT_SPIN)
+      sched_yield();
+  }
+
+  if (tries > SNAPSHOT_SPIN)
+    LOG(NET_LOG,LOG_DEBUG, "State snapshot took %d tries\n", tries);
+
+  for (int i=0; i < TOTAL_BUTTONS; i++) {
+    relocate((void **)&dst->aqbuttons[i].led, src, dst);
+    relocate(&dst->aqbuttons[i].special_mask_ptr, src, dst);
+  }
+  relocate((void **)&dst->chiller_button, src, dst);
+  for (int i=0; i < MAX_PUMPS; i++)
+    relocate((void **)&dst->pumps[i].button, src, dst);
+  for (int i=0; i < MAX_LIGHTS; i++)
+    relocate((void **)&dst->lights[i].button, src, dst);
+
+  _snap_src = src;
+  _snap_dst = dst;
+}
+
+// A pointer into the last snapshot, as a pointer into what it was copied from.
+void *aqdata_live_ptr(void *ptr)
+{
+  const char *p = (const char *)ptr;
+
+  if (_snap_dst != NULL && p >= (const char *)_snap_dst && p < (const char *)(_snap_dst + 1))
+    return (char *)_snap_src + (p - (const char *)_snap_dst);
+
+  return ptr;
+}
@@ -0,0 +1,26 @@
+#ifndef AQ_SNAPSHOT_H_
+#define AQ_SNAPSHOT_H_
+
+#include "aqualink.h"
+
+/*
+ * Consistent copies of aqualinkdata for the net thread, a seqlock that lets more than one
+ * writer in at once.  Threads that change several related values (a pump or light record,
+ * a whole panel packet) wrap them in aqdata_write_begin() / aqdata_write_end(), readers
+ * retry the copy if a write overlapped it.  Writers never wait on readers.
+ */
+
+void aqdata_write_begin();
+void aqdata_write_end();
+
+/*
+ * Write section for decoding panel packets.  The serial thread and the decoder thread both
+ * decode state (SWG, LEDs etc), these also keep them from writing at the same time.
+ */
+void aqdata_decode_begin();
+void aqdata_decode_end();
+
+void aqdata_snapshot(const struct aqualinkdata *src, struct aqualinkdata *dst);
+void *aqdata_live_ptr(void *ptr);
+
+#endif // AQ_SNAPSHOT_H_
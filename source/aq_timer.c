@@ -9,6 +9,7 @@
 #include "aqualink.h"
 #include "utils.h"
 #include "aq_timer.h"
+#include "aq_snapshot.h"
 
 
 struct timerthread {
@@ -34,6 +35,9 @@ struct timerthread *find_timerthread(aqkey *button)
 {
   struct timerthread *t_ptr;
 
+  // Could be from a net thread snapshot
+  button = aqdata_live_ptr(button);
+
   if (_timerthread_ll != NULL) {
     for (t_ptr = _timerthread_ll; t_ptr != NULL; t_ptr = t_ptr->next) {
       if (t_ptr->button == button) {
@@ -150,7 +154,10 @@ void *timer_worker( void *ptr )
   LOG(TIMR_LOG, LOG_NOTICE, "Start timer for '%s'\n",tmthread->button->name);
 
   // Add mask so we know timer is active
+  aqdata_write_begin();
   tmthread->button->special_mask |= TIMER_ACTIVE;
+  SET_DIRTY_FIELDS(tmthread->aqdata->is_dirty, STATUS_F_TIMERS);
+  aqdata_write_end();
 
 /*
 #ifndef PRESTATE_ONOFF
@@ -222,7 +229,7 @@ void *timer_worker( void *ptr )
         break; // Timer finished
     }
 
-    SET_DIRTY(tmthread->aqdata->is_dirty);
+    SET_DIRTY_FIELDS(tmthread->aqdata->is_dirty, STATUS_F_TIMERS);
     // 3. Print time left
     if (remaining_sec >= 60) {
       LOG(TIMR_LOG, LOG_INFO, "Time left for '%s': %ldm %lds\n", tmthread->button->name, remaining_sec / 60, remaining_sec % 60);
@@ -282,7 +289,10 @@ void *timer_worker( void *ptr )
   }
 
   // remove mask so we know timer is dead
+  aqdata_write_begin();
   tmthread->button->special_mask &= ~ TIMER_ACTIVE;
+  SET_DIRTY_FIELDS(tmthread->aqdata->is_dirty, STATUS_F_TIMERS);
+  aqdata_write_end();
 
   if (tmthread->next != NULL && tmthread->prev != NULL){
     // Middle of linked list
@@ -19,6 +19,7 @@
 
 #define SIGRESTART SIGUSR1
 #define SIGRUPGRADE SIGUSR2
+#define SIGFLIGHTREC SIGRTMIN // SIGUSR1/2 are taken, kill -RTMIN to dump the flight recorder
 
 #define CLIGHT_PANEL_FIX // Overcome bug in some jandy panels where color light status of on is not in LED status
 
@@ -40,6 +41,8 @@
 void intHandler(int dummy);
 
 bool isAqualinkDStopping();
+void wakeup_main_loop();
+void rebuild_dest_handlers();
 
 #ifdef AQ_PDA
 bool checkAqualinkTime(); // Only need to externalise this for PDA
@@ -353,6 +356,34 @@ typedef struct clightd
 } while(0)
 
 
+/*
+ * Which parts of the status JSON have changed since the net thread last sent it, so
+ * websockets that asked for it only get those keys (status_delta).  SET_IF_CHANGED
+ * works the group out from the address of what changed, see status_field_changed()
+ * in json_messages.c, SET_DIRTY doesn't know so marks everything.  Both also wake the
+ * net thread, so set is_dirty through them rather than directly.
+ */
+#define STATUS_F_MESSAGE    (1 << 0)  // status, panel_message, version, battery etc
+#define STATUS_F_DATETIME   (1 << 1)
+#define STATUS_F_SETPOINTS  (1 << 2)
+#define STATUS_F_TEMPS      (1 << 3)  // air / pool / spa temp and temp_units
+#define STATUS_F_SWG        (1 << 4)
+#define STATUS_F_CHEM       (1 << 5)
+#define STATUS_F_LEDS       (1 << 6)
+#define STATUS_F_PUMPS      (1 << 7)
+#define STATUS_F_TIMERS     (1 << 8)  // timers and timer_durations
+#define STATUS_F_LIGHTS     (1 << 9)
+#define STATUS_F_ALTMODES   (1 << 10)
+#define STATUS_F_SENSORS    (1 << 11)
+#define STATUS_F_ALL        0xFFFFFFFF
+
+struct aqualinkdata;
+void set_status_field_data(struct aqualinkdata *aqdata);
+void status_field_changed(const void *field);
+void status_fields_changed(uint32_t fields);
+uint32_t take_status_field_changes();
+uint32_t status_version();
+
 /**
  * SET_IF_CHANGED: Updates a variable and sets a flag if the value has changed.
  *
@@ -362,6 +393,7 @@ typedef struct clightd
  *
  * This macro uses GCC extensions for type safety and to prevent
  * double-evaluation of the `val` argument.
+ * It also records which part of the status JSON src belongs to.
  */
 //#define DEBUG_SET_IF_CHANGED
 #ifndef DEBUG_SET_IF_CHANGED
@@ -372,6 +404,7 @@ typedef struct clightd
         if ((src) != __new_val) {                                \
             (src) = __new_val;                                   \
             (flag) = true;                                       \
+            status_field_changed(&(src));                        \
         }                                                        \
     })
 
@@ -382,10 +415,12 @@ typedef struct clightd
             strncpy((src), __new_val, sizeof(src));            \
             (src)[sizeof(src) - 1] = '\0';                     \
             (flag) = true;                                     \
+            status_field_changed((src));                       \
         }                                                      \
     })
 
-#define SET_DIRTY(flag)    ((flag) = true)
+#define SET_DIRTY(flag)    ((flag) = true, status_fields_changed(STATUS_F_ALL))
+#define SET_DIRTY_FIELDS(flag, fields) ((flag) = true, status_fields_changed(fields))
 #define CLEAR_DIRTY(flag)  ((flag) = false)
 
 #else
@@ -397,6 +432,7 @@ typedef struct clightd
         if (__old_val != __new_val) { \
             (src) = __new_val; \
             (flag) = true; \
+            status_field_changed(&(src)); \
             printf("[%s:%d] Changed %s: %d -> %d\n", __FILE__, __LINE__, #src, (int)__old_val, (int)__new_val); \
         } \
     })
@@ -409,17 +445,28 @@ typedef struct clightd
             strncpy((src), __new_val, sizeof(src));                    \
             (src)[sizeof(src) - 1] = '\0';                             \
             (flag) = true;                                             \
+            status_field_changed((src));                               \
         }                                                              \
     })
 
 #define SET_DIRTY(flag)  \
     do {                  \
+        status_fields_changed(STATUS_F_ALL); \
         if (!(flag)) {    \
             (flag) = true;\
             printf("[%s:%d] Set dirty flag\n", __FILE__, __LINE__); \
         }                 \
     } while(0)
 
+#define SET_DIRTY_FIELDS(flag, fields)  \
+    do {                  \
+        status_fields_changed(fields); \
+        if (!(flag)) {    \
+            (flag) = true;\
+            printf("[%s:%d] Set dirty flag (fields 0x%x)\n", __FILE__, __LINE__, (unsigned)(fields)); \
+        }                 \
+    } while(0)
+
 #define CLEAR_DIRTY(flag)  \
     do {                  \
         if ((flag)) {    \
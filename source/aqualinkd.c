@@ -23,8 +23,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <libgen.h>
+#include <limits.h>
 #include <termios.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
 
 #include <time.h> // Need GNU_SOURCE & XOPEN defined for strptime
 
@@ -43,6 +49,8 @@
 #include "devices_pentair.h"
 #include "pda_aq_programmer.h"
 #include "packetLogger.h"
+#include "packet_capture.h"
+#include "flight_recorder.h"
 #include "devices_jandy.h"
 #include "allbutton.h"
 #include "allbutton_aq_programmer.h"
@@ -60,6 +68,9 @@
 #include "json_messages.h"
 #include "aq_systemutils.h"
 #include "auto_configure.h"
+#include "ack_latency.h"
+#include "rs_decoder.h"
+#include "aq_snapshot.h"
 
 #ifdef AQ_MANAGER
 #include "rs485mon.h"
@@ -78,6 +89,7 @@ static volatile bool _keepRunning = true;
 #ifdef SELF_RESTART
 static volatile bool _restart = false;
 #endif
+static volatile sig_atomic_t _flightrec_requested = false;
 //char** _argv;
 //static struct aqconfig _aqconfig_;
 static struct aqualinkdata _aqualink_data;
@@ -88,6 +100,7 @@ char *_cfgFile;
 int _cmdln_loglevel = -1;
 bool _cmdln_debugRS485 = false;
 bool _cmdln_lograwRS485 = false;
+bool _cmdln_captureRS485 = false;
 bool _cmdln_nostartupcheck = false;
 bool _cmdln_log_msec_ts = false;
 
@@ -96,8 +109,41 @@ bool _cmdln_log_msec_ts = false;
   int _rs_packet_timer;
 #endif
 
-#define AddAQDstatusMask(mask) (_aqualink_data.status_mask |= mask)
-#define RemoveAQDstatusMask(mask) (_aqualink_data.status_mask &= ~mask)
+/*
+ * Main loop event sources, everything the main loop waits on goes into one epoll set.
+ * Serial port, eventfd other threads use to post work (wakeup_main_loop()), timers
+ * for delayed (unactioned) requests and serial reconnect, and inotify on the serial
+ * port's device node so we reopen as soon as a USB adapter comes back.
+ */
+#define MAIN_LOOP_MAX_EVENTS       5
+#define SERIAL_IDLE_TIMEOUT_MS     2000  // No packet for this long is a blank read (same as get_packet() timeout)
+#define SERIAL_RECONNECT_MIN_MS    100   // First retry after a failed reopen, doubles each time
+#define SERIAL_RECONNECT_MAX_MS    10000
+
+typedef enum {
+  EV_SERIAL = 1,
+  EV_WAKEUP,
+  EV_DELAYED_ACTION,
+  EV_RECONNECT,
+  EV_PORT_NODE
+} main_loop_event;
+
+static int _epoll_fd = -1;
+static int _wakeup_fd = -1;
+static int _delayed_action_tfd = -1;
+static int _reconnect_tfd = -1;
+static int _port_node_ifd = -1;
+static time_t _delayed_action_due = 0;
+
+static struct {
+  bool pending;    // Port is closed, waiting on the reconnect timer or the device node
+  int backoff_ms;  // Next retry delay
+  int attempts;    // Reopen attempts this outage
+} _reconnect = {false, SERIAL_RECONNECT_MIN_MS, 0};
+
+// Net services are up while these change, so each is its own write section for the status snapshot (they nest).
+#define AddAQDstatusMask(mask) do { aqdata_write_begin(); _aqualink_data.status_mask |= mask; aqdata_write_end(); } while (0)
+#define RemoveAQDstatusMask(mask) do { aqdata_write_begin(); _aqualink_data.status_mask &= ~mask; aqdata_write_end(); } while (0)
 
 // Keep running on all errors (we can) if we are in a container or demonized
 #if defined(AQ_CONTAINER)
@@ -115,6 +161,13 @@ bool isAqualinkDStopping() {
   return !_keepRunning;
 }
 
+// Dump is done off the main loop, all we can safely do here is flag it.
+void flightrecHandler(int sig_num)
+{
+  _flightrec_requested = true;
+  wakeup_main_loop();
+}
+
 void intHandler(int sig_num)
 {
   if (sig_num == SIGRUPGRADE) {
@@ -127,6 +180,7 @@ void intHandler(int sig_num)
   LOG(AQUA_LOG,LOG_WARNING, "Stopping!\n");
 
   _keepRunning = false;
+  wakeup_main_loop();
 
   if (sig_num == SIGRESTART) {
     LOG(AQUA_LOG,LOG_WARNING, "Restarting AqualinkD!\n");
@@ -461,6 +515,7 @@ void printHelp()
   printf("\t-m         (Millisecond timestamps and thread timing)\n");
   printf("\t-rsd       (RS485 debug)\n");
   printf("\t-rsrd      (RS485 raw debug)\n");
+  printf("\t-rscap     (RS485 binary capture to %s, replaces -rsd / -rsrd text logs)\n", RS485CAPFILE);
 }
 
 int main(int argc, char *argv[])
@@ -548,6 +603,10 @@ int main(int argc, char *argv[])
     {
       _cmdln_lograwRS485 = true;
     }
+    else if (strcmp(argv[i], "-rscap") == 0)
+    {
+      _cmdln_captureRS485 = true;
+    }
     else if (strcmp(argv[i], "-nc") == 0)
     {
       _cmdln_nostartupcheck = true;
@@ -619,6 +678,9 @@ int startup(char *self, char *cfgFile)
   if (_cmdln_lograwRS485)
     _aqconfig_.log_raw_bytes = true;
 
+  if (_cmdln_captureRS485)
+    _aqconfig_.log_packet_capture = true;
+
   if (_cmdln_log_msec_ts)
     _aqconfig_.log_msec_ts = true;
 
@@ -716,6 +778,7 @@ void caculate_ack_packet(int rs_fd, unsigned char *packet_buffer, emulation_type
 {
   unsigned char *cmd;
   int size;
+  struct timespec turnaround;
 
   switch (source) {
     case ALLBUTTON:
@@ -790,6 +853,100 @@ void caculate_ack_packet(int rs_fd, unsigned char *packet_buffer, emulation_type
       //DEBUG_TIMER_STOP(_rs_packet_timer,AQUA_LOG,"Unknown Emulation type Processed packet in");
     break;
   }
+
+  if (get_ack_turnaround(&turnaround))
+    record_ack_latency(source, &turnaround);
+}
+
+/*
+ * Destination ID dispatch table.  Every Jandy packet is routed by PKT_DEST with a single
+ * index, rather than comparing against each configured ID and ID range.
+ * ack is the emulation we reply as, SIM_NONE means it's a readonly device (or not ours at all).
+ */
+typedef struct dest_handler {
+  bool (*process)(unsigned char *packet, int length, struct aqualinkdata *aqdata);
+  emulation_type ack;
+} dest_handler;
+
+static dest_handler _dest_handler[256];
+static dest_handler _pentair_handler;
+static volatile bool _dest_handler_stale = true;
+
+static bool process_pda_dest_packet(unsigned char *packet, int length, struct aqualinkdata *aqdata)
+{
+  return process_pda_packet(packet, length);
+}
+
+static bool queue_readonly_packet(unsigned char *packet, int length, struct aqualinkdata *aqdata)
+{
+  return queue_packet_decode(DECODE_READONLY, packet, length);
+}
+
+static void set_emulated_dest_handler(unsigned char id)
+{
+  if (id == 0x00)
+    return;
+
+  _dest_handler[id].ack = getJandyDeviceType(id);
+
+  switch (_dest_handler[id].ack) {
+    case ALLBUTTON:
+      _dest_handler[id].process = process_allbutton_packet;
+    break;
+    case RSSADAPTER:
+      _dest_handler[id].process = process_rssadapter_packet;
+    break;
+    case IAQTOUCH:
+      _dest_handler[id].process = process_iaqtouch_packet;
+    break;
+    case ONETOUCH:
+      _dest_handler[id].process = process_onetouch_packet;
+    break;
+    case AQUAPDA:
+      _dest_handler[id].process = process_pda_dest_packet;
+    break;
+    case IAQUALNK:
+      _dest_handler[id].process = process_iaqualink_packet;
+    break;
+    default:
+      _dest_handler[id].process = NULL;
+      _dest_handler[id].ack = SIM_NONE;
+    break;
+  }
+}
+
+// Only ever called from main_loop, other threads use rebuild_dest_handlers()
+// ID's set while searching / auto configuring are picked up by the first call before the main loop,
+// anything that changes an ID after that has to call rebuild_dest_handlers().
+static void build_dest_handlers()
+{
+  int i;
+  dest_handler readonly = {NULL, SIM_NONE};
+
+  if (_aqconfig_.read_RS485_devmask > 0)
+    readonly.process = queue_readonly_packet;
+
+  for (i=0; i < 256; i++)
+    _dest_handler[i] = readonly;
+
+  // Pentair have to & from in message, so send everything to the readonly decoder
+  _pentair_handler = readonly;
+
+  set_emulated_dest_handler(_aqconfig_.device_id);
+  set_emulated_dest_handler(_aqconfig_.rssa_device_id);
+  set_emulated_dest_handler(_aqconfig_.extended_device_id);
+  set_emulated_dest_handler(_aqconfig_.extended_device_id2);
+
+  build_jandy_readonly_table();
+
+  _dest_handler_stale = false;
+}
+
+// Device ID's have changed (ie panel doesn't support protocol), rebuild dispatch table on the main loop.
+void rebuild_dest_handlers()
+{
+  _dest_handler_stale = true;
+  wakeup_main_loop();
 }
 
 
@@ -817,6 +974,245 @@ unsigned char find_unused_address(unsigned char* packet) {
   return 0x00;
 }
 
+// Any thread (or signal handler) can call this to get the main loop to re-check pending work now.
+void wakeup_main_loop()
+{
+  uint64_t one = 1;
+
+  if (_wakeup_fd >= 0 && write(_wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+    // Counter is saturated, so the main loop is already due to wake up.
+  }
+}
+
+static bool add_main_loop_event(int fd, main_loop_event type)
+{
+  struct epoll_event ev = {0};
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = type;
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    LOGSystemError(errno, AQUA_LOG, "epoll_ctl");
+    return false;
+  }
+  return true;
+}
+
+static bool init_main_loop_events()
+{
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  // unactioned.requested is a time(), so use the same clock.
+  _delayed_action_tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+  _reconnect_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  _delayed_action_due = 0;
+
+  if (_epoll_fd < 0 || _wakeup_fd < 0 || _delayed_action_tfd < 0 || _reconnect_tfd < 0) {
+    LOGSystemError(errno, AQUA_LOG, "main loop events");
+    return false;
+  }
+
+  // Not fatal, without it we just fall back to the reconnect timer.
+  _port_node_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_port_node_ifd < 0 || !add_main_loop_event(_port_node_ifd, EV_PORT_NODE))
+    LOG(AQUA_LOG,LOG_WARNING, "Can't watch for serial port device changes, reconnect will only use timer\n");
+
+  return add_main_loop_event(_wakeup_fd, EV_WAKEUP) &&
+         add_main_loop_event(_delayed_action_tfd, EV_DELAYED_ACTION) &&
+         add_main_loop_event(_reconnect_tfd, EV_RECONNECT);
+}
+
+static void close_main_loop_events()
+{
+  int *fds[] = {&_wakeup_fd, &_delayed_action_tfd, &_reconnect_tfd, &_port_node_ifd, &_epoll_fd};
+
+  for (int i=0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
+    }
+  }
+}
+
+static void watch_serial_port(int rs_fd)
+{
+  if (rs_fd >= 0)
+    add_main_loop_event(rs_fd, EV_SERIAL);
+}
+
+static void unwatch_serial_port(int rs_fd)
+{
+  if (rs_fd >= 0)
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, rs_fd, NULL);
+}
+
+static void arm_main_loop_timer(int tfd, time_t sec, int flags)
+{
+  struct itimerspec its = {0};
+
+  its.it_value.tv_sec = sec;
+  if (timerfd_settime(tfd, flags, &its, NULL) != 0)
+    LOGSystemError(errno, AQUA_LOG, "timerfd_settime");
+}
+
+static void arm_main_loop_timer_ms(int tfd, int ms)
+{
+  struct itimerspec its = {0};
+
+  its.it_value.tv_sec = ms / 1000;
+  its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+  if (timerfd_settime(tfd, 0, &its, NULL) != 0)
+    LOGSystemError(errno, AQUA_LOG, "timerfd_settime");
+}
+
+// Clear an eventfd / timerfd that's fired
+static void clear_main_loop_event(int fd)
+{
+  uint64_t count;
+
+  if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+    // Nothing pending, ie already cleared
+  }
+}
+
+// milliseconds left of period_ms since start, never less than 0
+static int ms_remaining(const struct timespec *start, int period_ms)
+{
+  struct timespec now;
+  struct timespec elapsed;
+  long elapsed_ms;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (timespec_subtract(&elapsed, &now, start))
+    return period_ms;
+
+  elapsed_ms = elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000;
+  return elapsed_ms >= period_ms ? 0 : (int)(period_ms - elapsed_ms);
+}
+
+/*
+ * Watch every directory leading to the serial port, not just the one it's in.  A by-id path like
+ * /dev/serial/by-id/usb-FTDI... disappears along with its directories when the adapter is unplugged,
+ * so each time one gets recreated we pick up a watch on the next level down.
+ * Directories that don't exist (yet) just fail, and inotify re-uses the watch for ones we already have.
+ */
+static void watch_port_node(const char *port)
+{
+  char path[PATH_MAX];
+  char *slash;
+
+  if (_port_node_ifd < 0)
+    return;
+
+  snprintf(path, sizeof(path), "%s", port);
+  while ((slash = strrchr(path, '/')) != NULL && slash != path) {
+    *slash = '\0';
+    inotify_add_watch(_port_node_ifd, path, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+  }
+}
+
+// Drain inotify, don't care what the events were just that something changed.
+static void clear_port_node_events()
+{
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+  while (read(_port_node_ifd, buf, sizeof(buf)) > 0) {
+    // Keep reading until EAGAIN
+  }
+}
+
+static void schedule_serial_reconnect()
+{
+  LOG(AQUA_LOG,LOG_DEBUG, "Serial port '%s' retry in %dms\n", _aqconfig_.serial_port, _reconnect.backoff_ms);
+  arm_main_loop_timer_ms(_reconnect_tfd, _reconnect.backoff_ms);
+  _reconnect.backoff_ms = _reconnect.backoff_ms * 2 > SERIAL_RECONNECT_MAX_MS ? SERIAL_RECONNECT_MAX_MS : _reconnect.backoff_ms * 2;
+  _reconnect.pending = true;
+}
+
+// Try to open the serial port, on failure come back from the reconnect timer or the device node reappearing.
+static int reopen_serial_port()
+{
+  int rs_fd = -1;
+
+  _reconnect.attempts++;
+  record_serial_reopen();
+
+  // If the device node's gone (USB adapter unplugged / re-enumerating) don't log another open error, inotify will tell us when it's back.
+  if (access(_aqconfig_.serial_port, F_OK) == 0)
+    rs_fd = init_serial_port(_aqconfig_.serial_port);
+  else
+    LOG(AQUA_LOG,LOG_DEBUG, "Serial port '%s' not present\n", _aqconfig_.serial_port);
+
+  if (!is_valid_port(rs_fd)) {
+    schedule_serial_reconnect();
+    return -1;
+  }
+
+  LOG(AQUA_LOG,LOG_NOTICE, "Reopened serial port '%s', attempt %d\n", _aqconfig_.serial_port, _reconnect.attempts);
+  arm_main_loop_timer(_reconnect_tfd, 0, 0); // Disarm, we may have been woken by inotify
+  _reconnect.pending = false;
+  watch_serial_port(rs_fd);
+  return rs_fd;
+}
+
+/*
+ * Serial port is bad or the panel's gone quiet, close it and start reconnecting.
+ * Only the first loss of an outage is reported and retried immediately, after that the port
+ * opened but the panel never came back, so wait out the backoff rather than hammering it.
+ */
+static int serial_port_lost(int rs_fd)
+{
+  bool bad_port = !is_valid_port(rs_fd);
+
+  if (!bad_port) {
+    unwatch_serial_port(rs_fd);
+    close_serial_port(rs_fd);
+  }
+
+  if (!record_serial_lost()) {
+    schedule_serial_reconnect();
+    return -1;
+  }
+
+  if (bad_port)
+    LOG(AQUA_LOG,LOG_ERR, "Bad serial port '%s', are you sure that's right?\n",_aqconfig_.serial_port);
+  else
+    LOG(AQUA_LOG,LOG_ERR, "Aqualink daemon looks like serial error, resetting.\n");
+
+  aqdata_write_begin();
+  sprintf(_aqualink_data.last_display_message, CONNECTION_ERROR);
+  AddAQDstatusMask(ERROR_SERIAL);
+  SET_DIRTY(_aqualink_data.is_dirty);
+  aqdata_write_end();
+  broadcast_aqualinkstate_error(getAqualinkDStatusMessage(&_aqualink_data));
+
+  _reconnect.attempts = 0;
+  _reconnect.backoff_ms = SERIAL_RECONNECT_MIN_MS;
+  watch_port_node(_aqconfig_.serial_port);
+
+  return reopen_serial_port();
+}
+
+// Action any unactioned commands that are due, or set the timer to wake us when they will be.
+static void check_delayed_request()
+{
+  time_t now;
+
+  if (_aqualink_data.unactioned.type == NO_ACTION)
+    return;
+
+  time(&now);
+  if (difftime(now, _aqualink_data.unactioned.requested) > 2)
+  {
+    LOG(AQUA_LOG,LOG_DEBUG, "Actioning delayed request\n");
+    action_delayed_request();
+  }
+  else if (_delayed_action_due != _aqualink_data.unactioned.requested + 3)
+  {
+    _delayed_action_due = _aqualink_data.unactioned.requested + 3;
+    arm_main_loop_timer(_delayed_action_tfd, _delayed_action_due, TFD_TIMER_ABSTIME);
+  }
+}
+
 void main_loop()
 {
   int exit_code = EXIT_SUCCESS;
@@ -831,6 +1227,11 @@ void main_loop()
   bool print_once = false;
   int blank_read_reconnect = MAX_ZERO_READ_BEFORE_RECONNECT; // Will get reset if non blocking
   bool auto_config_complete = true;
+  struct epoll_event events[MAIN_LOOP_MAX_EVENTS];
+  struct timespec last_serial_read;
+  bool serial_ready;
+  int nfds;
+  dest_handler *handler;
 
 
   //_aqualink_data.panelstatus = STARTING;
@@ -926,6 +1327,13 @@ void main_loop()
   signal(SIGQUIT, intHandler);
   signal(SIGRESTART, intHandler);
   signal(SIGRUPGRADE, intHandler);
+  signal(SIGFLIGHTREC, flightrecHandler);
+
+  if (!init_main_loop_events())
+  {
+    LOG(AQUA_LOG,LOG_ERR, "Can not setup main loop events.\n");
+    exit(EXIT_FAILURE);
+  }
 
   if (!start_net_services(&_aqualink_data))
   {
@@ -1006,6 +1414,7 @@ void main_loop()
         LOG(AQUA_LOG,LOG_ERR, "I'm done, exiting, please check '%s'\n",_aqconfig_.serial_port);
         stopPacketLogger();
         close_serial_port(rs_fd);
+        close_main_loop_events();
         stop_net_services();
         stop_sensors_thread();
         exit_code=EXIT_FAILURE;
@@ -1101,6 +1510,7 @@ void main_loop()
               LOG(AQUA_LOG,LOG_ERR, "No probe on device_id '0x%02hhx', giving up! (please check config)\n",_aqconfig_.device_id);
               stopPacketLogger();
               close_serial_port(rs_fd);
+              close_main_loop_events();
               stop_net_services();
               stop_sensors_thread();
               return;
@@ -1195,39 +1605,22 @@ void main_loop()
 
   //int loopnum=0;
   blank_read = 0;
+  build_dest_handlers();
+  init_frame_delay_auto();
+  start_decoder_thread(&_aqualink_data);
+  watch_serial_port(rs_fd);
+  watch_port_node(_aqconfig_.serial_port);
+  clock_gettime(CLOCK_MONOTONIC, &last_serial_read);
   // OK, Now go into infinate loop
   while (_keepRunning == true)
   {
     //printf("%d ",blank_read);
-    while ((rs_fd < 0 || blank_read >= blank_read_reconnect) && _keepRunning == true)
+    if ((rs_fd < 0 || blank_read >= blank_read_reconnect) && _reconnect.pending == false)
     {
-      //printf("rs_fd  =% d\n",rs_fd);
-      if (!is_valid_port(rs_fd))
-      {
-        sleep(1);
-        LOG(AQUA_LOG,LOG_ERR, "Bad serial port '%s', are you sure that's right?\n",_aqconfig_.serial_port);   
-        sprintf(_aqualink_data.last_display_message, CONNECTION_ERROR);
-        //LOG(AQUA_LOG,LOG_ERR, "Serial port error, Aqualink daemon waiting to connect to master device...\n");    
-        SET_DIRTY(_aqualink_data.is_dirty);
-        AddAQDstatusMask(ERROR_SERIAL);
-        //broadcast_aqualinkstate_error(CONNECTION_ERROR);
-        broadcast_aqualinkstate_error(getAqualinkDStatusMessage(&_aqualink_data));
-        sleep(10);
-        // broadcast_aqualinkstate_error(mgr.active_connections, "No connection to RS control panel");
-      }
-      else
-      {
-        sprintf(_aqualink_data.last_display_message, CONNECTION_ERROR);
-        LOG(AQUA_LOG,LOG_ERR, "Aqualink daemon looks like serial error, resetting.\n");
-        SET_DIRTY(_aqualink_data.is_dirty);
-        AddAQDstatusMask(ERROR_SERIAL);
-        //broadcast_aqualinkstate_error(CONNECTION_ERROR);
-        broadcast_aqualinkstate_error(getAqualinkDStatusMessage(&_aqualink_data));
-        close_serial_port(rs_fd);
-        //rs_fd = init_serial_port(_aqconfig_.serial_port);
-      }
-      rs_fd = init_serial_port(_aqconfig_.serial_port);
+      rs_fd = serial_port_lost(rs_fd);
       blank_read = 0;
+      clock_gettime(CLOCK_MONOTONIC, &last_serial_read);
+      continue;
     }
 
 #ifdef AQ_MANAGER
@@ -1246,7 +1639,71 @@ void main_loop()
     }
 #endif
 
+    serial_ready = false;
+    // get_packet() may already have the next packet buffered, so no need to wait on the port for it.
+    if (_reconnect.pending == false && serial_rx_buffered(rs_fd)) {
+      serial_ready = true;
+    } else {
+      nfds = epoll_wait(_epoll_fd, events, MAIN_LOOP_MAX_EVENTS,
+                        _reconnect.pending?-1:ms_remaining(&last_serial_read, SERIAL_IDLE_TIMEOUT_MS));
+      if (nfds < 0) {
+        if (errno != EINTR) {
+          LOGSystemError(errno, AQUA_LOG, "epoll_wait");
+          delay(100);
+        }
+        continue;
+      }
+
+      for (i=0; i < nfds; i++) {
+        switch (events[i].data.u32) {
+          case EV_SERIAL:
+            serial_ready = true;
+          break;
+          case EV_WAKEUP:
+            clear_main_loop_event(_wakeup_fd);
+            if (_flightrec_requested) {
+              _flightrec_requested = false;
+              trigger_flight_recorder_dump("signal");
+            }
+          break;
+          case EV_DELAYED_ACTION:
+            clear_main_loop_event(_delayed_action_tfd);
+            _delayed_action_due = 0;
+          break;
+          case EV_RECONNECT:
+            clear_main_loop_event(_reconnect_tfd);
+            if (_reconnect.pending) {
+              rs_fd = reopen_serial_port();
+              blank_read = 0;
+              clock_gettime(CLOCK_MONOTONIC, &last_serial_read);
+            }
+          break;
+          case EV_PORT_NODE:
+            clear_port_node_events();
+            watch_port_node(_aqconfig_.serial_port);
+            if (_reconnect.pending && access(_aqconfig_.serial_port, F_OK) == 0) {
+              rs_fd = reopen_serial_port();
+              blank_read = 0;
+              clock_gettime(CLOCK_MONOTONIC, &last_serial_read);
+            }
+          break;
+        }
+      }
+
+      if (nfds == 0 && _reconnect.pending == false) {
+        // Nothing on the port for SERIAL_IDLE_TIMEOUT_MS, same as a blank get_packet() used to be.
+        LOG(AQUA_LOG,LOG_WARNING, "Nothing read on serial port\n");
+        blank_read++;
+        clock_gettime(CLOCK_MONOTONIC, &last_serial_read);
+      }
+    }
+
+    if (serial_ready == false) {
+      check_delayed_request();
+      continue;
+    }
 
+    clock_gettime(CLOCK_MONOTONIC, &last_serial_read);
     packet_length = get_packet(rs_fd, packet_buffer);
 
     if (packet_length <= 0 && _keepRunning)
@@ -1274,6 +1731,11 @@ void main_loop()
     }
     else if (packet_length > 0)
     {
+      long recover_ms;
+
+      if ((recover_ms = record_serial_recovered()) >= 0)
+        LOG(AQUA_LOG,LOG_NOTICE, "Serial port recovered, %ldms without panel traffic\n", recover_ms);
+
       RemoveAQDstatusMask(ERROR_SERIAL);
       RemoveAQDstatusMask(CONNECTING);
       AddAQDstatusMask(CONNECTED);
@@ -1310,77 +1772,51 @@ void main_loop()
         }
       }
 
+      if (_dest_handler_stale)
+        build_dest_handlers();
+
+      handler = (getProtocolType(packet_buffer) == JANDY)?&_dest_handler[packet_buffer[PKT_DEST]]:&_pentair_handler;
+
       // Process and packets of devices we are acting as
-      if (packet_length > 0 && getProtocolType(packet_buffer) == JANDY && packet_buffer[PKT_DEST] != 0x00 &&
-          (packet_buffer[PKT_DEST] == _aqconfig_.device_id ||
-           packet_buffer[PKT_DEST] == _aqconfig_.rssa_device_id ||
-           packet_buffer[PKT_DEST] == _aqconfig_.extended_device_id ||
-           packet_buffer[PKT_DEST] == _aqconfig_.extended_device_id2
-           ))
+      if (handler->ack != SIM_NONE)
       {
         AddAQDstatusMask(CONNECTED);
-        switch(getJandyDeviceType(packet_buffer[PKT_DEST])){
-          case ALLBUTTON:
-            process_allbutton_packet(packet_buffer, packet_length, &_aqualink_data);
-            caculate_ack_packet(rs_fd, packet_buffer, ALLBUTTON);
-          break;
-          case RSSADAPTER:
-            process_rssadapter_packet(packet_buffer, packet_length, &_aqualink_data);
-            caculate_ack_packet(rs_fd, packet_buffer, RSSADAPTER);    
-          break;
-          case IAQTOUCH:
-            process_iaqtouch_packet(packet_buffer, packet_length, &_aqualink_data);
-            caculate_ack_packet(rs_fd, packet_buffer, IAQTOUCH);
-          break;
-          case ONETOUCH:
-            process_onetouch_packet(packet_buffer, packet_length, &_aqualink_data);
-            caculate_ack_packet(rs_fd, packet_buffer, ONETOUCH);
-          break;
-          case AQUAPDA:
-            process_pda_packet(packet_buffer, packet_length);
-            caculate_ack_packet(rs_fd, packet_buffer, AQUAPDA);
-          break;
-          case IAQUALNK:
-            process_iaqualink_packet(packet_buffer, packet_length, &_aqualink_data);
-            caculate_ack_packet(rs_fd, packet_buffer, IAQUALNK);
-          break;
-          default:
-          break;
+        // iAqualink status blobs are big and slow to decode, but our reply to them never changes, so ACK first then decode.
+        // They stay on this thread, they carry the same LEDs as AllButton status & page messages so have to be applied in bus order.
+        if (handler->ack == IAQTOUCH &&
+            (packet_buffer[PKT_CMD] == CMD_IAQ_MAIN_STATUS ||
+             packet_buffer[PKT_CMD] == CMD_IAQ_1TOUCH_STATUS ||
+             packet_buffer[PKT_CMD] == CMD_IAQ_AUX_STATUS)) {
+          caculate_ack_packet(rs_fd, packet_buffer, IAQTOUCH);
+          aqdata_decode_begin();
+          process_iAqualinkStatusPacket(packet_buffer, packet_length, &_aqualink_data);
+          aqdata_decode_end();
+          set_iaqtouch_lastmsg(packet_buffer[PKT_CMD]);
+          kick_aq_program_thread(&_aqualink_data, IAQTOUCH);
+        } else {
+          aqdata_decode_begin();
+          handler->process(packet_buffer, packet_length, &_aqualink_data);
+          aqdata_decode_end();
+          caculate_ack_packet(rs_fd, packet_buffer, handler->ack);
         }
 #ifdef AQ_TM_DEBUG
         char message[128];
-        sprintf(message,"%s Emulation Processed packet in",getJandyDeviceName(getJandyDeviceType(packet_buffer[PKT_DEST])));
+        sprintf(message,"%s Emulation Processed packet in",getJandyDeviceName(handler->ack));
         DEBUG_TIMER_STOP(_rs_packet_timer,AQUA_LOG,message);
 #endif
       }
       // Process any packets to readonly devices.
-      else if (packet_length > 0 && _aqconfig_.read_RS485_devmask > 0)
+      // Nothing to reply to, so decode on the decoder thread and get back to reading.
+      else if (handler->process != NULL)
       {
-        if (getProtocolType(packet_buffer) == JANDY)
-        {
-          processJandyPacket(packet_buffer, packet_length, &_aqualink_data);
-        }
-        // Process Pentair Device Packed (pentair have to & from in message, so no need to)
-        else if (getProtocolType(packet_buffer) == PENTAIR && READ_RSDEV_vsfPUMP) {
-          processPentairPacket(packet_buffer, packet_length, &_aqualink_data);
-          // In the future probably add code to catch device offline (ie missing reply message)
-        }
-        DEBUG_TIMER_STOP(_rs_packet_timer,AQUA_LOG,"Processed (readonly) packet in");
+        handler->process(packet_buffer, packet_length, &_aqualink_data);
+        DEBUG_TIMER_STOP(_rs_packet_timer,AQUA_LOG,"Queued (readonly) packet in");
       } else {
         DEBUG_TIMER_CLEAR(_rs_packet_timer); // Clear timer, no need to print anything
       }
     }
     // Any unactioned commands
-    if (_aqualink_data.unactioned.type != NO_ACTION)
-    {
-      time_t now;
-      time(&now);
-      if (difftime(now, _aqualink_data.unactioned.requested) > 2)
-      {
-        LOG(AQUA_LOG,LOG_DEBUG, "Actioning delayed request\n");
-        action_delayed_request();
-      }
-    }
+    check_delayed_request();
 
     
     //tcdrain(rs_fd); // Make sure buffer has been sent.
@@ -1388,6 +1824,7 @@ void main_loop()
   }
   
   //if (_aqconfig_.debug_RSProtocol_packets) stopPacketLogger();
+  stop_decoder_thread();
   stopPacketLogger();
 
 #ifdef SELF_RESTART
@@ -1401,6 +1838,7 @@ void main_loop()
 
   // Reset and close the port.
   close_serial_port(rs_fd);
+  close_main_loop_events();
   // Clear webbrowser
   //mg_mgr_free(&mgr);
 
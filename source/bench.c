@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+/*
+ * Microbenchmarks for aqualinkd's hot functions, built and run with "make bench".
+ *
+ * Links every aqualinkd object except aqualinkd.c (stubs for the few things other
+ * modules call from it are below), against a RS-8 Combo panel with made up state, or
+ * the panel from -c <config>.  Each benchmark is run for at least -t ms and reports
+ * ns/op and allocs/op, -j gives the same as JSON so runs from two builds can be diffed.
+ * Allocations are counted by wrapping malloc & co at link time, so they are calls
+ * made from aqualinkd code, not from inside libc.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "aqualink.h"
+#include "config.h"
+#include "aq_serial.h"
+#include "aq_panel.h"
+#include "utils.h"
+#include "packetLogger.h"
+#include "json_messages.h"
+#include "net_services.h"
+#include "rs_msg_utils.h"
+
+#define VERSION "aqualinkd-bench V1.0"
+
+#define DEFAULT_BENCH_MS   500
+#define MAX_BENCH_ITERS    1000000000L
+#define PIPE_BATCH         256 // Frames written to the pipe at a time, must fit in the pipe
+
+typedef struct bench_ctx {
+  long n;               // Iterations to run
+  bool running;
+  struct timespec start;
+  long long elapsed_ns;
+  long alloc_start;
+  long allocs;
+} bench_ctx;
+
+typedef struct bench {
+  const char *name;
+  void (*fn)(bench_ctx *b);
+} bench;
+
+static struct aqualinkdata _aqualink_data;
+static long _allocs = 0;
+
+// Results go here so the compiler can't throw the calls away.
+static volatile long _sink;
+
+/*
+ * Allocation counting, linked with -Wl,--wrap=malloc etc.
+ */
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+void *__wrap_malloc(size_t size) { _allocs++; return __real_malloc(size); }
+void *__wrap_calloc(size_t nmemb, size_t size) { _allocs++; return __real_calloc(nmemb, size); }
+void *__wrap_realloc(void *ptr, size_t size) { _allocs++; return __real_realloc(ptr, size); }
+char *__wrap_strdup(const char *s) { _allocs++; return __real_strdup(s); }
+char *__wrap_strndup(const char *s, size_t n) { _allocs++; return __real_strndup(s, n); }
+
+/*
+ * aqualinkd.c isn't linked (it has main), these are the bits of it other modules use.
+ */
+bool isAqualinkDStopping() { return false; }
+void intHandler(int sig_num) {}
+void wakeup_main_loop() {}
+void rebuild_dest_handlers() {}
+bool checkAqualinkTime() { return true; }
+bool isVirtualButtonEnabled() { return _aqualink_data.virtual_button_start>0?true:false; }
+
+/*
+ * Timer, benchmarks can stop it around setup that shouldn't be counted.
+ */
+static void bench_start_timer(bench_ctx *b)
+{
+  if (!b->running) {
+    b->running = true;
+    b->alloc_start = _allocs;
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+  }
+}
+
+static void bench_stop_timer(bench_ctx *b)
+{
+  struct timespec now;
+
+  if (b->running) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    b->elapsed_ns += (now.tv_sec - b->start.tv_sec) * 1000000000LL + (now.tv_nsec - b->start.tv_nsec);
+    b->allocs += _allocs - b->alloc_start;
+    b->running = false;
+  }
+}
+
+/*
+ * Jandy frame, DLE's in the body escaped the same as on the wire.
+ */
+static int build_frame(unsigned char *buf, unsigned char dest, unsigned char cmd, const unsigned char *data, int data_len)
+{
+  unsigned char raw[AQ_MAXPKTLEN];
+  int i, len = 0, out = 0;
+
+  raw[len++] = DLE;
+  raw[len++] = STX;
+  raw[len++] = dest;
+  raw[len++] = cmd;
+  for (i=0; i < data_len; i++)
+    raw[len++] = data[i];
+  raw[len++] = 0x00; // checksum
+  raw[len++] = DLE;
+  raw[len++] = ETX;
+  raw[len-3] = generate_checksum(raw, len);
+
+  for (i=0; i < len; i++) {
+    buf[out++] = raw[i];
+    if (raw[i] == DLE && i > 1 && i < len-2)
+      buf[out++] = NUL;
+  }
+
+  return out;
+}
+
+// What's on the bus most of the time, probe & status to us, and the odd long message.
+static unsigned char _wire[PIPE_BATCH * AQ_MAXPKTLEN];
+static int _wire_len = 0;
+
+static void build_wire()
+{
+  const unsigned char status[] = {0x00, 0x10, 0x00, 0x00, 0x00};
+  const unsigned char msg[] = "\x01" "POOL TEMP 81`F  ";
+  int i;
+
+  _wire_len = 0;
+  for (i=0; i < PIPE_BATCH; i++) {
+    switch (i % 4) {
+      case 0:
+        _wire_len += build_frame(&_wire[_wire_len], 0x08, CMD_PROBE, NULL, 0);
+      break;
+      case 1:
+      case 2:
+        _wire_len += build_frame(&_wire[_wire_len], 0x08, CMD_STATUS, status, sizeof(status));
+      break;
+      case 3:
+        _wire_len += build_frame(&_wire[_wire_len], 0x08, CMD_MSG_LONG, msg, sizeof(msg)-1);
+      break;
+    }
+  }
+}
+
+/*
+ * Benchmarks
+ */
+static void bench_get_packet(bench_ctx *b)
+{
+  unsigned char packet[AQ_MAXPKTLEN+1];
+  int fds[2];
+  long i;
+  int rtn;
+
+  if (pipe(fds) != 0) {
+    fprintf(stderr, "ERROR, can't create pipe\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i=0; i < b->n; i++) {
+    if (i % PIPE_BATCH == 0) {
+      bench_stop_timer(b);
+      if (write(fds[1], _wire, _wire_len) != _wire_len) {
+        fprintf(stderr, "ERROR, short write to pipe\n");
+        exit(EXIT_FAILURE);
+      }
+      bench_start_timer(b);
+    }
+    if ((rtn = get_packet(fds[0], packet)) <= 0) {
+      fprintf(stderr, "ERROR, get_packet returned %d\n", rtn);
+      exit(EXIT_FAILURE);
+    }
+    _sink += rtn;
+  }
+
+  bench_stop_timer(b);
+  // Drain the rest of the batch so the framer's ring is left empty
+  for (; i % PIPE_BATCH != 0; i++)
+    get_packet(fds[0], packet);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void bench_check_jandy_checksum(bench_ctx *b)
+{
+  unsigned char packet[] = {DLE, STX, 0x08, CMD_STATUS, 0x00, 0x10, 0x00, 0x00, 0x00, 0x2c, DLE, ETX};
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += check_jandy_checksum(packet, sizeof(packet));
+}
+
+static void bench_generate_checksum(bench_ctx *b)
+{
+  unsigned char packet[AQ_MAXPKTLEN];
+  int len = build_frame(packet, 0x08, CMD_MSG_LONG, (unsigned char *)"\x01" "POOL TEMP 81`F  ", 17);
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += generate_checksum(packet, len);
+}
+
+static void bench_beautifyPacket(bench_ctx *b)
+{
+  char buff[LARGELOGBUFFER];
+  unsigned char packet[AQ_MAXPKTLEN];
+  int len = build_frame(packet, 0x08, CMD_MSG_LONG, (unsigned char *)"\x01" "POOL TEMP 81`F  ", 17);
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += beautifyPacket(buff, LARGELOGBUFFER, packet, len, true);
+}
+
+static void bench_build_aqualink_status_JSON(bench_ctx *b)
+{
+  char buff[JSON_STATUS_SIZE];
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += build_aqualink_status_JSON(&_aqualink_data, buff, JSON_STATUS_SIZE);
+}
+
+static void bench_build_device_JSON(bench_ctx *b)
+{
+  char buff[JSON_BUFFER_SIZE];
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += build_device_JSON(&_aqualink_data, buff, JSON_BUFFER_SIZE, false);
+}
+
+static void _bench_action_URI(bench_ctx *b, const char *uri, float value)
+{
+  int len = strlen(uri);
+  char *msg = NULL;
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += action_URI(NET_API, uri, len, value, false, &msg);
+}
+
+// Returns before looking at any device
+static void bench_action_URI_status(bench_ctx *b) { _bench_action_URI(b, "status", TEMP_UNKNOWN); }
+// Walks every button and misses
+static void bench_action_URI_nodevice(bench_ctx *b) { _bench_action_URI(b, "No_Such_Device/set", 1); }
+// Falls through most of the URI checks, but doesn't queue anything for the panel
+static void bench_action_URI_chem(bench_ctx *b) { _bench_action_URI(b, "CHEM/ORP/set", 650); }
+
+static void bench_LOG_disabled(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    LOG(NET_LOG, LOG_DEBUG, "%s: URI Request '%.*s': value %.2f\n", "API", 6, "status", (float)i);
+}
+
+static const char *_panel_msgs[] = {"POOL TEMP 81`F", "AIR TEMP  72`F", "AQUAPURE 40%", "SALT 3200 PPM", "FILTER PUMP OFF"};
+#define NUM_PANEL_MSGS (int)(sizeof(_panel_msgs)/sizeof(_panel_msgs[0]))
+
+static void bench_rsm_strmatch(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += rsm_strmatch(_panel_msgs[i % NUM_PANEL_MSGS], "AIR TEMP");
+}
+
+static void bench_rsm_strmatch_ignore(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += rsm_strmatch_ignore(_panel_msgs[i % NUM_PANEL_MSGS], "SALT", 1);
+}
+
+static void bench_rsm_strnstr(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += (long)rsm_strnstr(_panel_msgs[i % NUM_PANEL_MSGS], "PPM", AQ_MSGLEN);
+}
+
+static void bench_rsm_strncasestr(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += (long)rsm_strncasestr(_panel_msgs[i % NUM_PANEL_MSGS], "temp", AQ_MSGLEN);
+}
+
+static void bench_rsm_charafterstr(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += (long)rsm_charafterstr(_panel_msgs[i % NUM_PANEL_MSGS], "TEMP", AQ_MSGLEN);
+}
+
+static void bench_rsm_lastindexof(bench_ctx *b)
+{
+  long i;
+
+  for (i=0; i < b->n; i++)
+    _sink += (long)rsm_lastindexof(_panel_msgs[i % NUM_PANEL_MSGS], " ", AQ_MSGLEN);
+}
+
+static const bench _benchmarks[] = {
+  {"get_packet", bench_get_packet},
+  {"check_jandy_checksum", bench_check_jandy_checksum},
+  {"generate_checksum", bench_generate_checksum},
+  {"beautifyPacket", bench_beautifyPacket},
+  {"build_aqualink_status_JSON", bench_build_aqualink_status_JSON},
+  {"build_device_JSON", bench_build_device_JSON},
+  {"action_URI/status", bench_action_URI_status},
+  {"action_URI/nodevice", bench_action_URI_nodevice},
+  {"action_URI/chem", bench_action_URI_chem},
+  {"LOG/disabled", bench_LOG_disabled},
+  {"rsm_strmatch", bench_rsm_strmatch},
+  {"rsm_strmatch_ignore", bench_rsm_strmatch_ignore},
+  {"rsm_strnstr", bench_rsm_strnstr},
+  {"rsm_strncasestr", bench_rsm_strncasestr},
+  {"rsm_charafterstr", bench_rsm_charafterstr},
+  {"rsm_lastindexof", bench_rsm_lastindexof},
+};
+#define NUM_BENCHMARKS (int)(sizeof(_benchmarks)/sizeof(_benchmarks[0]))
+
+/*
+ * Run with increasing iterations until one run takes at least target_ns.
+ */
+static void run_benchmark(const bench *bm, long long target_ns, bench_ctx *result)
+{
+  bench_ctx b;
+  long n = 1;
+
+  for (;;) {
+    memset(&b, 0, sizeof(b));
+    b.n = n;
+    bench_start_timer(&b);
+    bm->fn(&b);
+    bench_stop_timer(&b);
+
+    if (b.elapsed_ns >= target_ns || n >= MAX_BENCH_ITERS)
+      break;
+
+    // Aim a little over the target, but don't grow more than 100x at a time
+    long long per_op = b.elapsed_ns / n;
+    long next = (per_op <= 0) ? n * 100 : (long)(target_ns * 1.2 / per_op);
+    if (next > n * 100)
+      next = n * 100;
+    if (next <= n)
+      next = n + 1;
+    n = (next > MAX_BENCH_ITERS) ? MAX_BENCH_ITERS : next;
+  }
+
+  *result = b;
+}
+
+/*
+ * Panel to benchmark against, when there's no config file.
+ */
+static void setup_default_panel()
+{
+  int i;
+
+  setPanelByName(&_aqualink_data, "RS-8 Combo");
+
+  _aqualink_data.temp_units = FAHRENHEIT;
+  _aqualink_data.air_temp = 72;
+  _aqualink_data.pool_temp = 81;
+  _aqualink_data.spa_temp = 81;
+  _aqualink_data.frz_protect_set_point = 38;
+  _aqualink_data.pool_htr_set_point = 82;
+  _aqualink_data.spa_htr_set_point = 101;
+  _aqualink_data.chiller_set_point = TEMP_UNKNOWN;
+  _aqualink_data.swg_percent = 40;
+  _aqualink_data.swg_ppm = 3200;
+  _aqualink_data.swg_delayed_percent = TEMP_UNKNOWN;
+  _aqualink_data.battery = OK;
+  _aqualink_data.ph = 7.4;
+  _aqualink_data.orp = 650;
+  _aqualink_data.frz_protect_state = ENABLE;
+  _aqualink_data.swg_led_state = ON;
+  _aqualink_data.service_mode_state = OFF;
+  strcpy(_aqualink_data.date, "10/18/26 SUN");
+  strcpy(_aqualink_data.time, "9:41 AM");
+
+  for (i=0; i < TOTAL_LEDS; i++)
+    _aqualink_data.aqualinkleds[i].state = OFF;
+  _aqualink_data.aqualinkleds[PUMP_INDEX].state = ON;
+}
+
+void printUsage(char *self)
+{
+  printf("%s\n", VERSION);
+  printf("Usage: %s [-j] [-t <ms>] [-b <name>] [-c <config>]\n", self);
+  printf("\t-j           JSON output\n");
+  printf("\t-t <ms>      Minimum time per benchmark (default %d)\n", DEFAULT_BENCH_MS);
+  printf("\t-b <name>    Only run benchmarks with <name> in their name\n");
+  printf("\t-c <config>  Benchmark against the panel in an aqualinkd config file\n");
+}
+
+int main(int argc, char *argv[])
+{
+  bench_ctx result;
+  char *filter = NULL;
+  char *cfgFile = NULL;
+  bool json = false;
+  long long target_ns = DEFAULT_BENCH_MS * 1000000LL;
+  int i, printed = 0;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      target_ns = atoll(argv[++i]) * 1000000LL;
+    } else if (strcmp(argv[i], "-b") == 0 && i+1 < argc) {
+      filter = argv[++i];
+    } else if (strcmp(argv[i], "-c") == 0 && i+1 < argc) {
+      cfgFile = argv[++i];
+    } else {
+      printUsage(argv[0]);
+      return (strcmp(argv[i], "-h") == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  init_config();
+  // Quiet, only errors (to stderr), so LOG/disabled is what it says and stdout is only results.
+#ifdef AQ_MANAGER
+  setLoggingPrms(LOG_ERR, false, NULL);
+#else
+  setLoggingPrms(LOG_ERR, false, NULL, NULL);
+#endif
+
+  if (cfgFile != NULL) {
+    read_config(&_aqualink_data, cfgFile);
+    setSystemLogLevel(LOG_ERR);
+  } else {
+    setup_default_panel();
+  }
+  // Don't want the packet logger writing files, just the in-memory bits of logPacketRead().
+  _aqconfig_.log_protocol_packets = false;
+  _aqconfig_.log_raw_bytes = false;
+  _aqconfig_.log_packet_capture = false;
+  bench_net_services_data(&_aqualink_data);
+  build_wire();
+
+  if (json)
+    printf("{\"version\": \"%s\", \"rev\": \"%s\", \"benchmarks\": [", VERSION, GIT_HASH);
+  else
+    printf("%-28s %12s %12s %10s\n", "Benchmark", "iterations", "ns/op", "allocs/op");
+
+  for (i=0; i < NUM_BENCHMARKS; i++) {
+    if (filter != NULL && strstr(_benchmarks[i].name, filter) == NULL)
+      continue;
+
+    run_benchmark(&_benchmarks[i], target_ns, &result);
+
+    double ns_op = (double)result.elapsed_ns / result.n;
+    double allocs_op = (double)result.allocs / result.n;
+    if (json)
+      printf("%s\n  {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f}",
+             printed++?",":"", _benchmarks[i].name, result.n, ns_op, allocs_op);
+    else
+      printf("%-28s %12ld %12.2f %10.2f\n", _benchmarks[i].name, result.n, ns_op, allocs_op);
+    fflush(stdout);
+  }
+
+  if (json)
+    printf("\n]}\n");
+
+  return EXIT_SUCCESS;
+}
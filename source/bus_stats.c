@@ -0,0 +1,261 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "aq_serial.h"
+#include "bus_stats.h"
+
+#define BUS_BYTE_NS 1041667 // 10 bits at 9600 baud
+#define NO_ID -1
+
+static const int _gap_edges_ms[BUS_GAP_BUCKETS - 1] = {1, 2, 5, 10, 20, 50, 100};
+
+/*
+ * Only used from the serial read loop, so no locking.
+ * last_end_ns and the poll we're waiting on a reply for carry across windows.
+ */
+static struct {
+  int window_sec;
+  int64_t window_start_ns;
+  int64_t last_end_ns;
+  int poll_id;
+  int64_t poll_end_ns;
+  uint64_t frames;
+  uint64_t bytes;
+  int64_t busy_ns;
+  uint32_t gap_hist[BUS_GAP_BUCKETS];
+  uint32_t chksum_errors;
+  uint32_t toosmall_errors;
+  uint32_t toolarge_errors;
+  bus_id_stats jandy[256];
+  bus_id_stats pentair[256];
+} _bus;
+
+static int64_t ts_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int gap_bucket(int64_t gap_ns)
+{
+  for (int i = 0; i < BUS_GAP_BUCKETS - 1; i++) {
+    if (gap_ns < _gap_edges_ms[i] * 1000000LL)
+      return i;
+  }
+  return BUS_GAP_BUCKETS - 1;
+}
+
+// Packets are unescaped, every DLE between DLE STX and the checksum went out as DLE NUL.
+static int wire_bytes(const unsigned char *packet, int length)
+{
+  int bytes = length;
+
+  if (getProtocolType(packet) == JANDY) {
+    for (int i = 2; i < length - 3; i++) {
+      if (packet[i] == DLE)
+        bytes++;
+    }
+  }
+  return bytes;
+}
+
+static void count_error(bus_id_stats *id, int error)
+{
+  if (error == AQSERR_CHKSUM)
+    id->chksum_errors++;
+  else if (error == AQSERR_2SMALL)
+    id->toosmall_errors++;
+  else if (error == AQSERR_2LARGE)
+    id->toolarge_errors++;
+}
+
+static void reset_window(int64_t now_ns)
+{
+  _bus.window_start_ns = now_ns;
+  _bus.frames = 0;
+  _bus.bytes = 0;
+  _bus.busy_ns = 0;
+  _bus.chksum_errors = 0;
+  _bus.toosmall_errors = 0;
+  _bus.toolarge_errors = 0;
+  memset(_bus.gap_hist, 0, sizeof(_bus.gap_hist));
+  memset(_bus.jandy, 0, sizeof(_bus.jandy));
+  memset(_bus.pentair, 0, sizeof(_bus.pentair));
+}
+
+void bus_stats_init(int window_sec)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  _bus.window_sec = window_sec;
+  _bus.last_end_ns = 0;
+  _bus.poll_id = NO_ID;
+  reset_window(ts_ns(&now));
+}
+
+void bus_stats_packet(const unsigned char *packet, int length, const struct timespec *end)
+{
+  int64_t end_ns = ts_ns(end);
+  int wire = wire_bytes(packet, length);
+  int64_t busy_ns = (int64_t)wire * BUS_BYTE_NS;
+  int64_t start_ns = end_ns - busy_ns;
+  int64_t gap_ns = -1;
+  bus_id_stats *id;
+
+  // Frames that came in the same read() all get its time, so the gap can look negative
+  if (_bus.last_end_ns != 0)
+    gap_ns = (start_ns > _bus.last_end_ns) ? start_ns - _bus.last_end_ns : 0;
+
+  if (getProtocolType(packet) == PENTAIR) {
+    id = &_bus.pentair[packet[PEN_PKT_FROM]];
+  } else if (packet[PKT_DEST] != DEV_MASTER) {
+    id = &_bus.jandy[packet[PKT_DEST]];
+    id->polls++;
+    if (_bus.poll_id != NO_ID)
+      _bus.jandy[_bus.poll_id].no_reply++;
+    _bus.poll_id = packet[PKT_DEST];
+    _bus.poll_end_ns = end_ns;
+  } else if (_bus.poll_id != NO_ID) {
+    int64_t reply_ns = (start_ns > _bus.poll_end_ns) ? start_ns - _bus.poll_end_ns : 0;
+
+    id = &_bus.jandy[_bus.poll_id];
+    id->replies++;
+    id->reply_ns += reply_ns;
+    if (reply_ns > id->reply_max_ns)
+      id->reply_max_ns = reply_ns;
+    id->reply_hist[gap_bucket(reply_ns)]++;
+    _bus.poll_id = NO_ID;
+  } else {
+    // To the master with no poll before it
+    id = &_bus.jandy[DEV_MASTER];
+  }
+
+  id->frames++;
+  id->bytes += wire;
+  id->busy_ns += busy_ns;
+
+  _bus.frames++;
+  _bus.bytes += wire;
+  _bus.busy_ns += busy_ns;
+  if (gap_ns >= 0) {
+    id->gap_hist[gap_bucket(gap_ns)]++;
+    _bus.gap_hist[gap_bucket(gap_ns)]++;
+  }
+  _bus.last_end_ns = end_ns;
+}
+
+void bus_stats_error(int error, const struct timespec *end)
+{
+  // A bad frame while a reply is due is most likely that reply
+  if (_bus.poll_id != NO_ID) {
+    count_error(&_bus.jandy[_bus.poll_id], error);
+    _bus.poll_id = NO_ID;
+  }
+
+  if (error == AQSERR_CHKSUM)
+    _bus.chksum_errors++;
+  else if (error == AQSERR_2SMALL)
+    _bus.toosmall_errors++;
+  else if (error == AQSERR_2LARGE)
+    _bus.toolarge_errors++;
+
+  _bus.last_end_ns = ts_ns(end);
+}
+
+bool bus_stats_due(const struct timespec *now)
+{
+  return (ts_ns(now) - _bus.window_start_ns >= _bus.window_sec * 1000000000LL);
+}
+
+static void print_hist(FILE *out, const char *name, const uint32_t *hist)
+{
+  fprintf(out, "\"%s\":[", name);
+  for (int i = 0; i < BUS_GAP_BUCKETS; i++)
+    fprintf(out, "%s%u", i > 0 ? "," : "", hist[i]);
+  fprintf(out, "]");
+}
+
+static void print_id(FILE *out, const char *protocol, int i, const bus_id_stats *id, double window, bool first)
+{
+  uint32_t errors = id->chksum_errors + id->toosmall_errors + id->toolarge_errors;
+
+  fprintf(out, "%s{\"id\":\"0x%02x\",\"protocol\":\"%s\",\"frames\":%u,\"frames_per_sec\":%.2f,\"bytes\":%llu,\"bytes_per_sec\":%.1f,\"bus_share\":%.4f,",
+          first ? "" : ",", i, protocol, id->frames, id->frames / window, (unsigned long long)id->bytes, id->bytes / window,
+          id->busy_ns / 1e9 / window);
+  if (id->polls > 0 || id->replies > 0) {
+    fprintf(out, "\"polls\":%u,\"replies\":%u,\"no_reply\":%u,\"reply_ms\":{\"avg\":%.2f,\"max\":%.2f,",
+            id->polls, id->replies, id->no_reply, id->replies > 0 ? id->reply_ns / 1e6 / id->replies : 0.0, id->reply_max_ns / 1e6);
+    print_hist(out, "hist", id->reply_hist);
+    fprintf(out, "},");
+  }
+  print_hist(out, "gap_hist", id->gap_hist);
+  fprintf(out, ",\"errors\":{\"checksum\":%u,\"too_small\":%u,\"too_large\":%u,\"rate\":%.4f}}",
+          id->chksum_errors, id->toosmall_errors, id->toolarge_errors,
+          (errors + id->frames) > 0 ? (double)errors / (errors + id->frames) : 0.0);
+}
+
+/*
+ * One line of JSON per window, then start the next one.  Histograms are counts
+ * for gap_edges_ms buckets, the last being everything over the last edge.
+ */
+void bus_stats_report(FILE *out)
+{
+  struct timespec now;
+  int64_t now_ns;
+  double window;
+  uint32_t errors = _bus.chksum_errors + _bus.toosmall_errors + _bus.toolarge_errors;
+  bool first = true;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  now_ns = ts_ns(&now);
+  window = (now_ns - _bus.window_start_ns) / 1e9;
+  if (window <= 0)
+    window = 1e-9;
+
+  fprintf(out, "{\"window_sec\":%.3f,\"frames\":%llu,\"frames_per_sec\":%.2f,\"bytes\":%llu,\"bytes_per_sec\":%.1f,\"bus_busy\":%.4f,",
+          window, (unsigned long long)_bus.frames, _bus.frames / window, (unsigned long long)_bus.bytes, _bus.bytes / window,
+          _bus.busy_ns / 1e9 / window);
+  fprintf(out, "\"gap_edges_ms\":[");
+  for (int i = 0; i < BUS_GAP_BUCKETS - 1; i++)
+    fprintf(out, "%s%d", i > 0 ? "," : "", _gap_edges_ms[i]);
+  fprintf(out, "],");
+  print_hist(out, "gap_hist", _bus.gap_hist);
+  fprintf(out, ",\"errors\":{\"checksum\":%u,\"too_small\":%u,\"too_large\":%u,\"per_sec\":%.3f,\"rate\":%.4f},\"ids\":[",
+          _bus.chksum_errors, _bus.toosmall_errors, _bus.toolarge_errors, errors / window,
+          (errors + _bus.frames) > 0 ? (double)errors / (errors + _bus.frames) : 0.0);
+
+  for (int i = 0; i < 256; i++) {
+    if (_bus.jandy[i].frames > 0 || _bus.jandy[i].polls > 0 || _bus.jandy[i].chksum_errors + _bus.jandy[i].toosmall_errors + _bus.jandy[i].toolarge_errors > 0) {
+      print_id(out, "jandy", i, &_bus.jandy[i], window, first);
+      first = false;
+    }
+  }
+  for (int i = 0; i < 256; i++) {
+    if (_bus.pentair[i].frames > 0) {
+      print_id(out, "pentair", i, &_bus.pentair[i], window, first);
+      first = false;
+    }
+  }
+  fprintf(out, "]}\n");
+  fflush(out);
+
+  reset_window(now_ns);
+}
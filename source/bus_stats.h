@@ -0,0 +1,40 @@
+#ifndef BUS_STATS_H_
+#define BUS_STATS_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * RS485 bus utilisation, accumulated per device ID over a window and reported as JSON.
+ * Jandy replies to the master are counted against the ID that was just polled, as are any
+ * errors while that reply was due.  Times are from when the read() that finished the frame
+ * returned, so are only as good as the adapter's latency.
+ */
+
+#define BUS_GAP_BUCKETS 8 // <1, <2, <5, <10, <20, <50, <100, >=100 ms
+
+typedef struct bus_id_stats {
+  uint32_t frames;
+  uint64_t bytes;     // On the wire, ie including DLE escapes
+  int64_t busy_ns;    // Time on the wire at 9600 baud
+  uint32_t polls;
+  uint32_t replies;
+  uint32_t no_reply;
+  int64_t reply_ns;   // Total end of poll to start of reply
+  int64_t reply_max_ns;
+  uint32_t reply_hist[BUS_GAP_BUCKETS];
+  uint32_t gap_hist[BUS_GAP_BUCKETS]; // Gap before each frame
+  uint32_t chksum_errors;
+  uint32_t toosmall_errors;
+  uint32_t toolarge_errors;
+} bus_id_stats;
+
+void bus_stats_init(int window_sec);
+void bus_stats_packet(const unsigned char *packet, int length, const struct timespec *end);
+void bus_stats_error(int error, const struct timespec *end);
+bool bus_stats_due(const struct timespec *now);
+void bus_stats_report(FILE *out);
+
+#endif // BUS_STATS_H_
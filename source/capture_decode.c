@@ -0,0 +1,516 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "aq_serial.h"
+#include "utils.h"
+#include "packet_capture.h"
+#include "timespec_subtract.h"
+#include "capture_decode.h"
+
+#define NO_ID -1
+
+// Don't bother with another thread for less than this
+#define MIN_CHUNK_BYTES   (64 * 1024)
+#define MIN_CHUNK_RECORDS 4096
+
+typedef enum chunk_head {
+  HEAD_NONE,  // No Jandy frames in chunk
+  HEAD_POLL,  // First Jandy frame was to a device
+  HEAD_REPLY  // First Jandy frame was to the master, so a reply to a poll in the previous chunk
+} chunk_head;
+
+typedef struct capture_index {
+  size_t offset; // Data offset in file
+  uint16_t length;
+  uint8_t flags;
+} capture_index;
+
+typedef struct decode_chunk {
+  pthread_t thread_id;
+  bool threaded;
+  // Either a range of bytes to frame, or a range of already framed capture records
+  const unsigned char *bytes;
+  size_t length;
+  const unsigned char *map;
+  const capture_index *records;
+  size_t nrecords;
+  // Jandy replies are credited to the ID polled before them, which can be in the previous chunk
+  int last_id;
+  int pending; // Polled ID we haven't seen a reply for yet
+  chunk_head head;
+  int head_bytes;
+  int head_unknown; // Command of the first frame if it was unknown and a reply
+  decode_stats stats;
+} decode_chunk;
+
+static void count_error(decode_stats *stats, int error)
+{
+  if (error == AQSERR_CHKSUM)
+    stats->chksum_errors++;
+  else if (error == AQSERR_2LARGE)
+    stats->toolarge_errors++;
+  else if (error == AQSERR_2SMALL)
+    stats->toosmall_errors++;
+}
+
+static void count_unknown(decode_unknown_cmd *cmd, unsigned char id)
+{
+  if (cmd->count++ == 0)
+    cmd->first_id = id;
+}
+
+// Mirrors the ID tracking in _rs485mon(), lastID only moves on good Jandy frames.
+static void classify_frame(decode_chunk *chunk, unsigned char *packet, int length)
+{
+  decode_stats *stats = &chunk->stats;
+  bool unknown = (strncmp(get_packet_type(packet, length), "Unknown", 7) == 0);
+  unsigned char dest;
+
+  stats->frames++;
+  stats->frame_bytes += length;
+
+  if (getProtocolType(packet) == PENTAIR) {
+    stats->pentair[packet[PEN_PKT_FROM]].from++;
+    stats->pentair[packet[PEN_PKT_FROM]].bytes += length;
+    stats->pentair[packet[PEN_PKT_DEST]].to++;
+    if (unknown)
+      count_unknown(&stats->pentair_unknown[packet[PEN_PKT_CMD]], packet[PEN_PKT_DEST]);
+    return;
+  }
+
+  dest = packet[PKT_DEST];
+
+  if (dest != DEV_MASTER) {
+    if (chunk->last_id == NO_ID)
+      chunk->head = HEAD_POLL;
+    else if (chunk->pending != NO_ID)
+      stats->jandy[chunk->pending].no_reply++;
+
+    stats->jandy[dest].polls++;
+    stats->jandy[dest].bytes += length;
+    if (packet[PKT_CMD] == CMD_PROBE)
+      stats->jandy[dest].probes++;
+    if (unknown)
+      count_unknown(&stats->jandy_unknown[packet[PKT_CMD]], dest);
+    chunk->pending = dest;
+  } else if (chunk->last_id == NO_ID) {
+    // Don't know who this is from until the chunks are merged
+    chunk->head = HEAD_REPLY;
+    chunk->head_bytes = length;
+    if (unknown) {
+      count_unknown(&stats->jandy_unknown[packet[PKT_CMD]], DEV_MASTER);
+      chunk->head_unknown = packet[PKT_CMD];
+    }
+    chunk->pending = NO_ID;
+  } else {
+    if (chunk->last_id != DEV_MASTER)
+      stats->jandy[chunk->last_id].replies++;
+    stats->jandy[chunk->last_id].bytes += length;
+    if (unknown)
+      count_unknown(&stats->jandy_unknown[packet[PKT_CMD]], chunk->last_id);
+    chunk->pending = NO_ID;
+  }
+
+  chunk->last_id = dest;
+}
+
+static void decode_bytes(decode_chunk *chunk)
+{
+  rs_framer fr;
+  unsigned char *packet;
+  int length;
+
+  rs_framer_init_mem(&fr, chunk->bytes, chunk->length);
+
+  while ((length = rs_framer_next_mem(&fr, &packet)) != 0) {
+    if (length < 0)
+      count_error(&chunk->stats, length);
+    else
+      classify_frame(chunk, packet, length);
+  }
+}
+
+/*
+ * Bad packets are captured as they were logged, so work out the error again.
+ * A good but oversized packet is logged as an error before it's read, skip that copy.
+ */
+static int capture_error_type(unsigned char *packet, int length)
+{
+  if (length >= AQ_MAXPKTLEN)
+    return AQSERR_2LARGE;
+  if (length < AQ_MINPKTLEN)
+    return AQSERR_2SMALL;
+  if (getProtocolType(packet) == PENTAIR) {
+    if (length > PEN_PKT_CMD + 3 && length > packet[8] + 10 && check_pentair_checksum(packet, length))
+      return 0;
+  } else if (check_jandy_checksum(packet, length)) {
+    return 0;
+  }
+  return AQSERR_CHKSUM;
+}
+
+static void decode_records(decode_chunk *chunk)
+{
+  unsigned char packet[AQ_MAXPKTLEN];
+  int length;
+  int error;
+
+  for (size_t i = 0; i < chunk->nrecords; i++) {
+    const capture_index *rec = &chunk->records[i];
+
+    length = rec->length < AQ_MAXPKTLEN ? rec->length : AQ_MAXPKTLEN;
+    memcpy(packet, chunk->map + rec->offset, length);
+
+    if (rec->flags & CAPTURE_ERROR) {
+      if ((error = capture_error_type(packet, rec->length)) != 0)
+        count_error(&chunk->stats, error);
+    } else if (length < AQ_MINPKTLEN || (getProtocolType(packet) == PENTAIR && length <= PEN_PKT_CMD)) {
+      count_error(&chunk->stats, AQSERR_2SMALL);
+    } else {
+      classify_frame(chunk, packet, length);
+    }
+  }
+}
+
+static void *decode_worker(void *ptr)
+{
+  decode_chunk *chunk = (decode_chunk *)ptr;
+
+  if (chunk->records != NULL)
+    decode_records(chunk);
+  else
+    decode_bytes(chunk);
+
+  return NULL;
+}
+
+/*
+ * Chunks start straight after a DLE ETX, where the framer is always idle, so framing each
+ * one from scratch gives the same frames as reading the file end to end.
+ */
+static size_t next_frame_boundary(const unsigned char *bytes, size_t length, size_t from)
+{
+  for (size_t i = (from > 0 ? from : 1); i < length; i++) {
+    if (bytes[i] == ETX && bytes[i - 1] == DLE)
+      return i + 1;
+  }
+  return length;
+}
+
+static void merge_unknown(decode_unknown_cmd *to, const decode_unknown_cmd *from, int head_cmd, int cmd, int last_id)
+{
+  if (from->count == 0)
+    return;
+  if (to->count == 0)
+    to->first_id = (cmd == head_cmd && last_id != NO_ID) ? last_id : from->first_id;
+  to->count += from->count;
+}
+
+// Chunks have to be merged in file order, last_id & pending carry across them.
+static void merge_chunk(decode_stats *stats, const decode_chunk *chunk, int *last_id, int *pending)
+{
+  const decode_stats *cs = &chunk->stats;
+
+  stats->frames += cs->frames;
+  stats->frame_bytes += cs->frame_bytes;
+  stats->chksum_errors += cs->chksum_errors;
+  stats->toolarge_errors += cs->toolarge_errors;
+  stats->toosmall_errors += cs->toosmall_errors;
+
+  for (int i = 0; i < 256; i++) {
+    stats->jandy[i].polls += cs->jandy[i].polls;
+    stats->jandy[i].probes += cs->jandy[i].probes;
+    stats->jandy[i].replies += cs->jandy[i].replies;
+    stats->jandy[i].no_reply += cs->jandy[i].no_reply;
+    stats->jandy[i].bytes += cs->jandy[i].bytes;
+    stats->pentair[i].from += cs->pentair[i].from;
+    stats->pentair[i].to += cs->pentair[i].to;
+    stats->pentair[i].bytes += cs->pentair[i].bytes;
+    merge_unknown(&stats->jandy_unknown[i], &cs->jandy_unknown[i], chunk->head_unknown, i, *last_id);
+    merge_unknown(&stats->pentair_unknown[i], &cs->pentair_unknown[i], -1, i, NO_ID);
+  }
+
+  if (chunk->head == HEAD_REPLY) {
+    if (*last_id != NO_ID && *last_id != DEV_MASTER)
+      stats->jandy[*last_id].replies++;
+    stats->jandy[*last_id != NO_ID ? *last_id : DEV_MASTER].bytes += chunk->head_bytes;
+  } else if (chunk->head == HEAD_POLL && *pending != NO_ID) {
+    stats->jandy[*pending].no_reply++;
+  }
+
+  if (chunk->head != HEAD_NONE) {
+    *last_id = chunk->last_id;
+    *pending = chunk->pending;
+  }
+}
+
+static int hex_nibble(unsigned char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// "0x10|0x02|..." to bytes, anything that isn't 0xNN is skipped.
+static unsigned char *parse_bytelog(const unsigned char *text, size_t length, size_t *out_length)
+{
+  unsigned char *bytes = malloc(length / 4 + 1);
+  size_t n = 0;
+  int hi, lo;
+
+  if (bytes == NULL)
+    return NULL;
+
+  for (size_t i = 0; i + 3 < length; ) {
+    if (text[i] == '0' && (text[i + 1] == 'x' || text[i + 1] == 'X') &&
+        (hi = hex_nibble(text[i + 2])) >= 0 && (lo = hex_nibble(text[i + 3])) >= 0) {
+      bytes[n++] = (hi << 4) | lo;
+      i += 4;
+    } else {
+      i++;
+    }
+  }
+
+  *out_length = n;
+  return bytes;
+}
+
+/*
+ * Index every record, returns number of framed packet records.  If there aren't any
+ * (raw bytes only capture) the raw reads are joined up in *raw instead.
+ */
+static size_t index_capture(const unsigned char *map, size_t size, capture_index **index, unsigned char **raw, size_t *raw_length)
+{
+  const capture_file_header *header = (const capture_file_header *)map;
+  capture_record record;
+  size_t offset = sizeof(capture_file_header);
+  size_t max = (size - offset) / header->record_size + 1;
+  size_t framed = 0;
+  size_t raw_bytes = 0;
+
+  *index = malloc(max * sizeof(capture_index));
+  *raw = NULL;
+  *raw_length = 0;
+  if (*index == NULL)
+    return 0;
+
+  while (offset + header->record_size <= size) {
+    memcpy(&record, map + offset, sizeof(record));
+    if (offset + header->record_size + record.length > size)
+      break; // Truncated, capture was still being written
+    if (record.flags & CAPTURE_RAW) {
+      raw_bytes += record.length;
+    } else {
+      (*index)[framed].offset = offset + header->record_size;
+      (*index)[framed].length = record.length;
+      (*index)[framed].flags = record.flags;
+      framed++;
+    }
+    offset += header->record_size + record.length;
+  }
+
+  if (framed > 0 || raw_bytes == 0)
+    return framed;
+
+  if ((*raw = malloc(raw_bytes)) == NULL)
+    return 0;
+
+  for (offset = sizeof(capture_file_header); offset + header->record_size <= size; ) {
+    memcpy(&record, map + offset, sizeof(record));
+    if (offset + header->record_size + record.length > size)
+      break;
+    if (record.flags & CAPTURE_RAW) {
+      memcpy(*raw + *raw_length, map + offset + header->record_size, record.length);
+      *raw_length += record.length;
+    }
+    offset += header->record_size + record.length;
+  }
+
+  return 0;
+}
+
+static bool is_capture(const unsigned char *map, size_t size)
+{
+  const capture_file_header *header = (const capture_file_header *)map;
+
+  return (size >= sizeof(capture_file_header) &&
+          header->magic == CAPTURE_MAGIC &&
+          header->version == CAPTURE_VERSION &&
+          header->record_size >= sizeof(capture_record));
+}
+
+int decode_default_threads()
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (cpus < 1)
+    return 1;
+  return cpus > DECODE_MAX_THREADS ? DECODE_MAX_THREADS : cpus;
+}
+
+const char *decode_source_text(decode_source source)
+{
+  switch (source) {
+    case DECODE_SRC_CAPTURE:
+      return "capture";
+    case DECODE_SRC_CAPTURE_RAW:
+      return "capture (raw bytes)";
+    case DECODE_SRC_BYTELOG:
+      return "raw byte log";
+    case DECODE_SRC_BINARY:
+    default:
+      return "binary";
+  }
+}
+
+bool decode_capture_file(const char *filename, int threads, decode_stats *stats)
+{
+  struct stat st;
+  struct timespec start, end, elapsed;
+  unsigned char *map;
+  unsigned char *buffer = NULL;
+  const unsigned char *bytes = NULL;
+  size_t length = 0;
+  capture_index *index = NULL;
+  size_t nrecords = 0;
+  decode_chunk *chunks;
+  size_t units, from;
+  int last_id = NO_ID;
+  int pending = NO_ID;
+  int fd;
+
+  memset(stats, 0, sizeof(decode_stats));
+
+  if ((fd = open(filename, O_RDONLY)) < 0) {
+    LOG(SLOG_LOG, LOG_ERR, "Unable to open file: %s\n", filename);
+    displayLastSystemError(filename);
+    return false;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    LOG(SLOG_LOG, LOG_ERR, "Nothing to decode in %s\n", filename);
+    close(fd);
+    return false;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG(SLOG_LOG, LOG_ERR, "Unable to map file: %s\n", filename);
+    displayLastSystemError(filename);
+    return false;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  stats->file_bytes = st.st_size;
+
+  if (is_capture(map, st.st_size)) {
+    nrecords = index_capture(map, st.st_size, &index, &buffer, &length);
+    stats->source = (nrecords > 0 || buffer == NULL) ? DECODE_SRC_CAPTURE : DECODE_SRC_CAPTURE_RAW;
+    bytes = buffer;
+  } else if (st.st_size >= 4 && map[0] == '0' && map[1] == 'x') {
+    stats->source = DECODE_SRC_BYTELOG;
+    bytes = buffer = parse_bytelog(map, st.st_size, &length);
+  } else {
+    stats->source = DECODE_SRC_BINARY;
+    bytes = map;
+    length = st.st_size;
+  }
+
+  units = (nrecords > 0) ? (nrecords + MIN_CHUNK_RECORDS - 1) / MIN_CHUNK_RECORDS : (length + MIN_CHUNK_BYTES - 1) / MIN_CHUNK_BYTES;
+  if (threads < 1)
+    threads = decode_default_threads();
+  if (threads > DECODE_MAX_THREADS)
+    threads = DECODE_MAX_THREADS;
+  if ((size_t)threads > units)
+    threads = units > 0 ? units : 1;
+  stats->threads = threads;
+
+  if ((chunks = calloc(threads, sizeof(decode_chunk))) == NULL) {
+    LOG(SLOG_LOG, LOG_ERR, "Out of memory decoding %s\n", filename);
+    free(index);
+    free(buffer);
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  from = 0;
+  for (int i = 0; i < threads; i++) {
+    decode_chunk *chunk = &chunks[i];
+    size_t to;
+
+    chunk->last_id = NO_ID;
+    chunk->pending = NO_ID;
+    chunk->head_unknown = -1;
+
+    if (nrecords > 0) {
+      to = nrecords * (i + 1) / threads;
+      chunk->map = map;
+      chunk->records = &index[from];
+      chunk->nrecords = to - from;
+    } else {
+      to = (i == threads - 1) ? length : next_frame_boundary(bytes, length, length * (i + 1) / threads);
+      if (to < from)
+        to = from;
+      chunk->bytes = bytes + from;
+      chunk->length = to - from;
+    }
+    from = to;
+
+    if (i > 0) {
+      if (pthread_create(&chunk->thread_id, NULL, decode_worker, (void *)chunk) == 0) {
+        chunk->threaded = true;
+      } else {
+        LOG(SLOG_LOG, LOG_WARNING, "Unable to create decode thread, decoding inline\n");
+        decode_worker(chunk);
+      }
+    }
+  }
+
+  // First chunk on this thread, while the others run
+  decode_worker(&chunks[0]);
+
+  for (int i = 0; i < threads; i++) {
+    if (chunks[i].threaded)
+      pthread_join(chunks[i].thread_id, NULL);
+    merge_chunk(stats, &chunks[i], &last_id, &pending);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  timespec_subtract(&elapsed, &end, &start);
+  stats->elapsed = timespec2float(&elapsed);
+
+  free(chunks);
+  free(index);
+  free(buffer);
+  munmap(map, st.st_size);
+
+  return true;
+}
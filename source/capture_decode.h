@@ -0,0 +1,62 @@
+#ifndef CAPTURE_DECODE_H_
+#define CAPTURE_DECODE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Offline decode of a capture file, binary capture (see packet_capture.h), a raw byte log
+ * ("0x10|0x02|..." from -lrawb) or a straight dump of serial bytes.
+ * The file is split at frame boundaries and each piece is framed and classified on its
+ * own thread, results are merged in file order so they match what a live run would see.
+ */
+
+#define DECODE_MAX_THREADS 64
+
+typedef enum decode_source {
+  DECODE_SRC_CAPTURE,     // Binary capture, framed packets
+  DECODE_SRC_CAPTURE_RAW, // Binary capture with only raw reads, so we frame them
+  DECODE_SRC_BYTELOG,     // Text raw byte log
+  DECODE_SRC_BINARY       // Serial bytes as read from the port
+} decode_source;
+
+typedef struct decode_jandy_id {
+  uint32_t polls;    // Frames from the master to this ID
+  uint32_t probes;   // Polls that were CMD_PROBE
+  uint32_t replies;  // Frames to the master straight after a poll to this ID
+  uint32_t no_reply; // Polls followed by another poll
+  uint64_t bytes;    // Both directions
+} decode_jandy_id;
+
+typedef struct decode_pentair_id {
+  uint32_t from;
+  uint32_t to;
+  uint64_t bytes;
+} decode_pentair_id;
+
+typedef struct decode_unknown_cmd {
+  uint32_t count;
+  unsigned char first_id; // Destination the first time it was seen
+} decode_unknown_cmd;
+
+typedef struct decode_stats {
+  decode_source source;
+  int threads;
+  uint64_t file_bytes;
+  uint64_t frames;
+  uint64_t frame_bytes;
+  uint64_t chksum_errors;
+  uint64_t toolarge_errors;
+  uint64_t toosmall_errors;
+  decode_jandy_id jandy[256];
+  decode_pentair_id pentair[256];
+  decode_unknown_cmd jandy_unknown[256];   // Index is command
+  decode_unknown_cmd pentair_unknown[256];
+  double elapsed; // Seconds spent decoding (not loading)
+} decode_stats;
+
+int decode_default_threads();
+bool decode_capture_file(const char *filename, int threads, decode_stats *stats);
+const char *decode_source_text(decode_source source);
+
+#endif // CAPTURE_DECODE_H_
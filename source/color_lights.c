@@ -540,18 +540,28 @@ int build_color_lights_json(struct aqualinkdata *aqdata, char* buffer, int size)
   return length;
 }
 
+// Returns size if it didn't all fit, buffer then has as many whole names as did
 int build_color_light_jsonarray(int index, char* buffer, int size)
 {
-  memset(&buffer[0], 0, size);
   int i;
   int length=0;
+  int result;
+
+  if (size <= 0)
+    return size;
+
+  buffer[0] = '\0';
 
   for (i=0; i < LIGHT_COLOR_OPTIONS; i++) { // Start a 1 since index 0 is blank
     if (_color_light_options[index][i] != NULL) {
-      length += sprintf(buffer+length, "\"%s\",", _color_light_options[index][i] );
+      result = snprintf(buffer+length, size-length, "%s\"%s\"", length==0?"":",", _color_light_options[index][i] );
+      if (result >= size-length) {
+        buffer[length] = '\0';
+        return size;
+      }
+      length += result;
     }
   }
-  buffer[--length] = '\0';
 
   return length;
 }
@@ -89,6 +89,7 @@ struct tmpPanelInfo _defaultPanel;
    
    ftdi_low_latency
    rs485_frame_delay
+   rs485_frame_delay_auto
 
    display_warnings_in_web
    sync_panel_time
@@ -597,6 +598,13 @@ void init_parameters (struct aqconfig * parms)
   _cfgParams[_numCfgParams].name = CFG_N_ftdi_low_latency;
   _cfgParams[_numCfgParams].default_value = (void *)&_dcfg_true;
 
+  // Must be before rs485_frame_delay, config names are matched on prefix
+  _numCfgParams++;
+  _cfgParams[_numCfgParams].value_ptr = &_aqconfig_.frame_delay_auto;
+  _cfgParams[_numCfgParams].value_type = CFG_BOOL;
+  _cfgParams[_numCfgParams].name = CFG_N_rs485_frame_delay_auto;
+  _cfgParams[_numCfgParams].default_value = (void *)&_dcfg_false;
+
   _numCfgParams++;
   _cfgParams[_numCfgParams].value_ptr = &_aqconfig_.frame_delay;
   _cfgParams[_numCfgParams].value_type = CFG_INT;
@@ -701,6 +709,10 @@ void init_parameters (struct aqconfig * parms)
   // Few other defaults we don;t set in general config
   parms->log_protocol_packets = false; // Read & Write as packets write to file
   parms->log_raw_bytes = false; // bytes read and write to file
+  parms->log_packet_capture = false; // binary capture of packets (and bytes if above) to file
+  parms->log_packet_max_kb = 2048; // rotate the above at this size
+  parms->log_packet_max_min = 60; // or the capture at this age
+  parms->log_packet_keep = 10; // number of rotated files to keep
 
   // CHANGED DEFAULT IN V3.  (WAnt to DELETE this)
   parms->device_pre_state = true;
@@ -991,6 +1003,18 @@ if (strlen(cleanwhitespace(value)) <= 0) {
   } else if (strncasecmp (param, "debug_RSProtocol_packets", 24) == 0) {
     _aqconfig_.log_protocol_packets = text2bool(value);
     rtn=true;
+  } else if (strncasecmp (param, "debug_RSProtocol_capture", 24) == 0) {
+    _aqconfig_.log_packet_capture = text2bool(value);
+    rtn=true;
+  } else if (strncasecmp (param, "debug_RSProtocol_max_kb", 23) == 0) {
+    _aqconfig_.log_packet_max_kb = strtoul(value, NULL, 10);
+    rtn=true;
+  } else if (strncasecmp (param, "debug_RSProtocol_max_minutes", 28) == 0) {
+    _aqconfig_.log_packet_max_min = strtoul(value, NULL, 10);
+    rtn=true;
+  } else if (strncasecmp (param, "debug_RSProtocol_keep", 21) == 0) {
+    _aqconfig_.log_packet_keep = strtoul(value, NULL, 10);
+    rtn=true;
     
   // Build panel without string
   } else if (strncasecmp(param, "panel_type_size", 15) == 0) {
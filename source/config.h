@@ -118,6 +118,10 @@ struct aqconfig
   bool display_warnings_web;
   bool log_protocol_packets; // Read & Write as packets
   bool log_raw_bytes; // Read as bytes
+  bool log_packet_capture; // Binary capture instead of the two above
+  int log_packet_max_kb;   // Rotate capture / text logs at this size, 0 never
+  int log_packet_max_min;  // Rotate capture at this age, 0 never
+  int log_packet_keep;     // Rotated files to keep (capture segments and text logs), 0 keeps them all
   unsigned char RSSD_LOG_filter[MAX_RSSD_LOG_FILTERS];
   //bool log_raw_RS_bytes;
 
@@ -130,6 +134,7 @@ struct aqconfig
   char *sched_chk_booston_device;
   bool ftdi_low_latency;
   int frame_delay;
+  bool frame_delay_auto;
   bool device_pre_state;
   bool save_debug_log_masks;
   bool save_light_programming_value;
@@ -344,6 +349,7 @@ int _numCfgParams;
 
 #define CFG_N_ftdi_low_latency                  "ftdi_low_latency"
 #define CFG_N_rs485_frame_delay                 "rs485_frame_delay"
+#define CFG_N_rs485_frame_delay_auto            "rs485_frame_delay_auto"
 
 #define CFG_N_save_debug_log_masks              "save_debug_log_masks"
 #define CFG_N_save_light_programming_value      "save_light_programming_value"
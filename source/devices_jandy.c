@@ -79,6 +79,42 @@ void printJandyDebugPacket (const char *msg, const unsigned char *packet, int pa
   }
 }
 
+// Readonly device type for each destination ID, see build_jandy_readonly_table()
+static rsDeviceType _readonly_dest[256] = {DRS_NONE};
+
+/*
+ * Build lookup of the devices we've been asked to read (read_RS485_devmask) by ID, so
+ * processJandyPacket doesn't have to check every ID range on every packet.
+ */
+void build_jandy_readonly_table()
+{
+  int i;
+
+  for (i=0; i < 256; i++) {
+    if (READ_RSDEV_SWG && is_swg_id(i))
+      _readonly_dest[i] = DRS_SWG;
+    else if (READ_RSDEV_ePUMP && is_jandy_pump_id(i))
+      _readonly_dest[i] = DRS_EPUMP;
+    else if (READ_RSDEV_JXI && is_jxi_heater_id(i))
+      _readonly_dest[i] = DRS_JXI;
+    else if (READ_RSDEV_LX && is_lx_heater_id(i))
+      _readonly_dest[i] = DRS_LX;
+    else if (READ_RSDEV_CHEM_FEDR && is_chem_feeder_id(i))
+      _readonly_dest[i] = DRS_CHEM_FEED;
+    else if (READ_RSDEV_CHEM_ANLZ && is_chem_anlzer_id(i))
+      _readonly_dest[i] = DRS_CHEM_ANLZ;
+    else if (READ_RSDEV_iAQLNK && is_aqualink_touch_id(i) // should we add is_iaqualink_id() as well????
+             && i != _aqconfig_.extended_device_id) // We would have already read extended_device_id frame
+      _readonly_dest[i] = DRS_IAQLNK;
+    else if (READ_RSDEV_HPUMP && is_heat_pump_id(i))
+      _readonly_dest[i] = DRS_HEATPUMP;
+    else if (READ_RSDEV_JLIGHT && is_jandy_light_id(i))
+      _readonly_dest[i] = DRS_JLIGHT;
+    else
+      _readonly_dest[i] = DRS_NONE;
+  }
+}
+
 bool processJandyPacket(unsigned char *packet_buffer, int packet_length, struct aqualinkdata *aqdata)
 {
   static rsDeviceType interestedInNextAck = DRS_NONE;
@@ -145,71 +181,57 @@ bool processJandyPacket(unsigned char *packet_buffer, int packet_length, struct
     interestedInNextAck = DRS_NONE;
     previous_packet_to = NUL;
   }
-  else if (READ_RSDEV_SWG && is_swg_id(packet_buffer[PKT_DEST]))
-  {
-    interestedInNextAck = DRS_SWG;
-    printJandyDebugPacket("SWG", packet_buffer, packet_length);
-    rtn = processPacketToSWG(packet_buffer, packet_length, aqdata/*, _aqconfig_.swg_zero_ignore*/);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_ePUMP && is_jandy_pump_id(packet_buffer[PKT_DEST]))
-  {
-    interestedInNextAck = DRS_EPUMP;
-    printJandyDebugPacket("EPump", packet_buffer, packet_length);
-    rtn = processPacketToJandyPump(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_JXI && is_jxi_heater_id(packet_buffer[PKT_DEST]))
-  {
-    interestedInNextAck = DRS_JXI;
-    printJandyDebugPacket("JXi", packet_buffer, packet_length);
-    rtn = processPacketToJandyJXiHeater(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_LX && is_lx_heater_id(packet_buffer[PKT_DEST]))
-  {
-    interestedInNextAck = DRS_LX;
-    printJandyDebugPacket("LX", packet_buffer, packet_length);
-    rtn = processPacketToJandyLXHeater(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_CHEM_FEDR && is_chem_feeder_id(packet_buffer[PKT_DEST] ))
-  {
-    interestedInNextAck = DRS_CHEM_FEED;
-    printJandyDebugPacket("ChemL", packet_buffer, packet_length);
-    rtn = processPacketToJandyChemFeeder(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_CHEM_ANLZ && is_chem_anlzer_id(packet_buffer[PKT_DEST]))
-  {
-    interestedInNextAck = DRS_CHEM_ANLZ;
-    printJandyDebugPacket("CemSnr", packet_buffer, packet_length);
-    rtn = processPacketToJandyChemAnalyzer(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_iAQLNK && is_aqualink_touch_id(packet_buffer[PKT_DEST]) // should we add is_iaqualink_id() as well????
-          && packet_buffer[PKT_DEST] != _aqconfig_.extended_device_id) // We would have already read extended_device_id frame
-  {
-    process_iAqualinkStatusPacket(packet_buffer, packet_length, aqdata);
-  }
-  else if (READ_RSDEV_HPUMP && is_heat_pump_id(packet_buffer[PKT_DEST] ))
-  {
-    interestedInNextAck = DRS_HEATPUMP;
-    printJandyDebugPacket("HPump", packet_buffer, packet_length);
-    rtn = processPacketToHeatPump(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
-  else if (READ_RSDEV_JLIGHT && is_jandy_light_id(packet_buffer[PKT_DEST]))
-  {
-    interestedInNextAck = DRS_JLIGHT;
-    printJandyDebugPacket("JLight", packet_buffer, packet_length);
-    rtn = processPacketToJandyLight(packet_buffer, packet_length, aqdata);
-    previous_packet_to = packet_buffer[PKT_DEST];
-  }
   else
   {
-    interestedInNextAck = DRS_NONE;
-    previous_packet_to = NUL;
+    rsDeviceType dest_type = _readonly_dest[packet_buffer[PKT_DEST]];
+
+    switch (dest_type) {
+      case DRS_SWG:
+        printJandyDebugPacket("SWG", packet_buffer, packet_length);
+        rtn = processPacketToSWG(packet_buffer, packet_length, aqdata/*, _aqconfig_.swg_zero_ignore*/);
+      break;
+      case DRS_EPUMP:
+        printJandyDebugPacket("EPump", packet_buffer, packet_length);
+        rtn = processPacketToJandyPump(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_JXI:
+        printJandyDebugPacket("JXi", packet_buffer, packet_length);
+        rtn = processPacketToJandyJXiHeater(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_LX:
+        printJandyDebugPacket("LX", packet_buffer, packet_length);
+        rtn = processPacketToJandyLXHeater(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_CHEM_FEED:
+        printJandyDebugPacket("ChemL", packet_buffer, packet_length);
+        rtn = processPacketToJandyChemFeeder(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_CHEM_ANLZ:
+        printJandyDebugPacket("CemSnr", packet_buffer, packet_length);
+        rtn = processPacketToJandyChemAnalyzer(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_HEATPUMP:
+        printJandyDebugPacket("HPump", packet_buffer, packet_length);
+        rtn = processPacketToHeatPump(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_JLIGHT:
+        printJandyDebugPacket("JLight", packet_buffer, packet_length);
+        rtn = processPacketToJandyLight(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_IAQLNK:
+        process_iAqualinkStatusPacket(packet_buffer, packet_length, aqdata);
+      break;
+      case DRS_NONE:
+      break;
+    }
+
+    if (dest_type == DRS_NONE || dest_type == DRS_IAQLNK) {
+      interestedInNextAck = DRS_NONE;
+      previous_packet_to = NUL;
+    } else {
+      interestedInNextAck = dest_type;
+      previous_packet_to = packet_buffer[PKT_DEST];
+    }
   }
 /*
   if (packet_buffer[PKT_CMD] != CMD_PROBE && getLogLevel(DJAN_LOG) >= LOG_DEBUG) {
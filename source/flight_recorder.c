@@ -0,0 +1,228 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the 
+ * Free Software Foundation. For the terms of this license, 
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "utils.h"
+#include "aq_serial.h"
+#include "packetLogger.h"
+#include "flight_recorder.h"
+
+#define FLIGHTREC_MASK (FLIGHTREC_FRAMES - 1)
+
+/*
+ * Written only by the serial thread.  Each slot's seq is the frame number + 1 once it's
+ * complete, and 0 while it's being overwritten, so a dump (any thread) can tell a torn copy.
+ */
+typedef struct flight_frame {
+  atomic_uint seq;
+  int64_t timestamp_ns; // CLOCK_MONOTONIC
+  uint16_t length;      // Real length, data may be truncated to FLIGHTREC_FRAME_BYTES
+  uint8_t direction;
+  uint8_t error;
+  unsigned char data[FLIGHTREC_FRAME_BYTES];
+} flight_frame;
+
+static flight_frame _ring[FLIGHTREC_FRAMES];
+static atomic_uint _next = 0;
+static atomic_bool _dumping = false;
+
+// Checksum burst detection, serial thread only.
+static struct timespec _chksum_window;
+static int _chksum_count = 0;
+static atomic_long _last_auto_dump = 0; // Any thread
+
+void flight_record(flight_direction direction, bool error, const unsigned char *data, int length)
+{
+  unsigned int n = atomic_load_explicit(&_next, memory_order_relaxed);
+  flight_frame *frame = &_ring[n & FLIGHTREC_MASK];
+  struct timespec now;
+
+  if (length < 0)
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  atomic_store_explicit(&frame->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  frame->timestamp_ns = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+  frame->length = length;
+  frame->direction = direction;
+  frame->error = error;
+  memcpy(frame->data, data, length < FLIGHTREC_FRAME_BYTES ? length : FLIGHTREC_FRAME_BYTES);
+
+  atomic_store_explicit(&frame->seq, n + 1, memory_order_release);
+  atomic_store_explicit(&_next, n + 1, memory_order_release);
+}
+
+// Copy out the recorder oldest first, skipping any slot the serial thread was writing as we copied it.
+static int flight_recorder_snapshot(flight_frame *out)
+{
+  unsigned int next = atomic_load_explicit(&_next, memory_order_acquire);
+  unsigned int first = next > FLIGHTREC_FRAMES ? next - FLIGHTREC_FRAMES : 0;
+  int count = 0;
+
+  for (unsigned int n = first; n != next; n++) {
+    flight_frame *frame = &_ring[n & FLIGHTREC_MASK];
+    flight_frame *copy = &out[count];
+
+    if (atomic_load_explicit(&frame->seq, memory_order_acquire) != n + 1)
+      continue;
+
+    copy->timestamp_ns = frame->timestamp_ns;
+    copy->length = frame->length;
+    copy->direction = frame->direction;
+    copy->error = frame->error;
+    memcpy(copy->data, frame->data, sizeof(copy->data));
+
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&frame->seq, memory_order_relaxed) == n + 1)
+      count++;
+  }
+
+  return count;
+}
+
+/*
+ * Write the recorder to a new file, this is the only place packets get formatted.
+ * Returns number of packets written, or -1.  Only one dump at a time.
+ */
+int dump_flight_recorder(const char *reason, char *filename, int size)
+{
+  static flight_frame frames[FLIGHTREC_FRAMES];
+  char buff[LARGELOGBUFFER];
+  char timestr[32];
+  time_t now = time(NULL);
+  struct tm tmbuf;
+  int64_t last;
+  int count;
+  FILE *fp;
+  bool expected = false;
+
+  if (!atomic_compare_exchange_strong(&_dumping, &expected, true)) {
+    LOG(RSSD_LOG,LOG_NOTICE, "Flight recorder dump already running, ignoring '%s'\n", reason);
+    return -1;
+  }
+
+  count = flight_recorder_snapshot(frames);
+
+  strftime(timestr, sizeof(timestr), "%Y%m%d_%H%M%S", localtime_r(&now, &tmbuf));
+  snprintf(filename, size, "%s_%s.log", FLIGHTRECFILE, timestr);
+
+  if ((fp = fopen(filename, "w")) == NULL) {
+    LOG(RSSD_LOG,LOG_ERR, "Unable to open flight recorder file %s\n", filename);
+    atomic_store(&_dumping, false);
+    return -1;
+  }
+
+  fprintf(fp, "# AqualinkD flight recorder, %s, %s", reason, ctime_r(&now, timestr));
+  fprintf(fp, "# %d packets oldest first, seconds are relative to the last packet\n", count);
+
+  last = count > 0 ? frames[count - 1].timestamp_ns : 0;
+  for (int i = 0; i < count; i++) {
+    flight_frame *frame = &frames[i];
+    int length = frame->length < FLIGHTREC_FRAME_BYTES ? frame->length : FLIGHTREC_FRAME_BYTES;
+
+    if (frame->error)
+      beautifyBadPacket(buff, LARGELOGBUFFER, frame->data, length, frame->direction == FLIGHT_READ);
+    else
+      beautifyPacket(buff, LARGELOGBUFFER, frame->data, length, frame->direction == FLIGHT_READ);
+
+    fprintf(fp, "%11.6f %s%s", (frame->timestamp_ns - last) / 1e9,
+            frame->length > FLIGHTREC_FRAME_BYTES ? "(truncated) " : "", buff);
+  }
+
+  fclose(fp);
+  atomic_store(&_dumping, false);
+
+  LOG(RSSD_LOG,LOG_WARNING, "Flight recorder (%s) dumped %d packets to %s\n", reason, count, filename);
+  return count;
+}
+
+// Dump now (we're on the net thread) and say where it went.
+int build_flight_recorder_dump_JSON(char *buffer, int size)
+{
+  char filename[128];
+  int count = dump_flight_recorder("requested", filename, sizeof(filename));
+  int length;
+
+  if (count < 0)
+    length = snprintf(buffer, size, "{\"type\": \"flightrecorder\",\"error\": \"dump failed or already running\"}");
+  else
+    length = snprintf(buffer, size, "{\"type\": \"flightrecorder\",\"file\": \"%s\",\"packets\": %d}", filename, count);
+
+  return length < size ? length : size - 1;
+}
+
+static void *flight_recorder_dump_thread(void *ptr)
+{
+  char filename[128];
+
+  dump_flight_recorder((const char *)ptr, filename, sizeof(filename));
+  return NULL;
+}
+
+// Dump from a thread of it's own, for when we're on the serial thread or in a signal / timeout path.
+void trigger_flight_recorder_dump(const char *reason)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  if (atomic_load(&_dumping))
+    return;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create(&thread, &attr, flight_recorder_dump_thread, (void *)reason) != 0)
+    LOG(RSSD_LOG,LOG_ERR, "Unable to start flight recorder dump thread\n");
+  pthread_attr_destroy(&attr);
+}
+
+/*
+ * Automatic dumps (checksum bursts, programming timeouts) are limited to one every
+ * FLIGHTREC_AUTO_INTERVAL_SEC so a bad bus doesn't fill /tmp.
+ */
+void auto_flight_recorder_dump(const char *reason)
+{
+  time_t now = time(NULL);
+
+  if (now - _last_auto_dump < FLIGHTREC_AUTO_INTERVAL_SEC)
+    return;
+
+  _last_auto_dump = now;
+  trigger_flight_recorder_dump(reason);
+}
+
+void flight_recorder_checksum_error()
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (_chksum_count == 0 || now.tv_sec - _chksum_window.tv_sec >= FLIGHTREC_CHKSUM_WINDOW_SEC) {
+    _chksum_window = now;
+    _chksum_count = 0;
+  }
+
+  if (++_chksum_count == FLIGHTREC_CHKSUM_BURST)
+    auto_flight_recorder_dump("checksum error burst");
+}
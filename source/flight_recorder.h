@@ -0,0 +1,32 @@
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+
+#include <stdbool.h>
+
+/*
+ * Always on record of the last FLIGHTREC_FRAMES packets read & written, raw bytes and a
+ * timestamp only.  Nothing is formatted until it's dumped, on a checksum error burst,
+ * programming thread timeout, SIGFLIGHTREC, or request from aqmanager (/api/flightrecorder).
+ */
+
+#define FLIGHTRECFILE "/tmp/aqualinkd_flightrec"
+
+#define FLIGHTREC_FRAMES              2048 // Must be power of 2
+#define FLIGHTREC_FRAME_BYTES         128  // Longer packets are truncated
+#define FLIGHTREC_CHKSUM_BURST        5    // Checksum errors within FLIGHTREC_CHKSUM_WINDOW_SEC to dump
+#define FLIGHTREC_CHKSUM_WINDOW_SEC   10
+#define FLIGHTREC_AUTO_INTERVAL_SEC   300
+
+typedef enum flight_direction {
+  FLIGHT_READ,
+  FLIGHT_WRITE
+} flight_direction;
+
+void flight_record(flight_direction direction, bool error, const unsigned char *data, int length);
+void flight_recorder_checksum_error();
+void auto_flight_recorder_dump(const char *reason);
+void trigger_flight_recorder_dump(const char *reason);
+int dump_flight_recorder(const char *reason, char *filename, int size);
+int build_flight_recorder_dump_JSON(char *buffer, int size);
+
+#endif // FLIGHT_RECORDER_H_
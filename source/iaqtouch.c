@@ -1058,6 +1058,7 @@ bool process_iaqtouch_packet(unsigned char *packet, int length, struct aqualinkd
         } else {
           _aqconfig_.extended_device_id2 = _aqconfig_.extended_device_id + 112; // 0x70 in dec
         }
+        rebuild_dest_handlers();
         LOG(IAQT_LOG,LOG_NOTICE, "Enabling iAqualink Protocol on 0x%02hhx\n",_aqconfig_.extended_device_id2);
       }
       // Don't like this here.  Come back and rethink getting panel string.
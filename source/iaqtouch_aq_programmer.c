@@ -33,6 +33,8 @@
 #include "devices_jandy.h"
 #include "packetLogger.h"
 #include "color_lights.h"
+#include "flight_recorder.h"
+#include "aq_snapshot.h"
 
 // System Page is obfiously fixed and not dynamic loaded, so set buttons to stop confustion.
 
@@ -112,6 +114,7 @@ void waitfor_iaqt_queue2empty()
 
   if (_iaqt_pgm_command != NUL) {
     LOG(IAQT_LOG,LOG_WARNING, "Send command Queue did not empty, timeout\n");
+    auto_flight_recorder_dump("programming command timeout");
   }
 }
 
@@ -168,6 +171,7 @@ bool waitfor_iaqt_ctrl_queue2empty()
 
   if (_iaqt_control_cmd_len > 0 ) {
     LOG(IAQT_LOG,LOG_WARNING, "Send control command Queue did not empty, timeout\n");
+    auto_flight_recorder_dump("programming command timeout");
     return false;
   }
   return true;
@@ -812,8 +816,10 @@ void *set_aqualink_iaqtouch_light_colormode( void *ptr )
     waitfor_iaqt_nextPage(aqdata);
     if (use_current_mode) {
       // Their is no message for this, so give one.
+      aqdata_write_begin();
       sprintf(aqdata->last_display_message, "Light will turn %s in 5 seconds", turn_off?"off":"on");
       aqdata->is_display_message_programming = true;
+      aqdata_write_end();
       SET_DIRTY(aqdata->is_dirty);
     }
     // Wait for next page maybe?
@@ -1078,8 +1084,10 @@ void *get_aqualink_iaqtouch_freezeprotect( void *ptr )
   if (frz >= 0) {
     //aqdata->frz_protect_set_point = frz;
     //aqdata->frz_protect_state = ON;
+    aqdata_write_begin();
     SET_IF_CHANGED( aqdata->frz_protect_set_point, frz, aqdata->is_dirty);
     SET_IF_CHANGED( aqdata->frz_protect_state, ON, aqdata->is_dirty);
+    aqdata_write_end();
     LOG(IAQT_LOG,LOG_NOTICE, "IAQ Touch Freeze Protection setpoint %d\n",frz);
   }
 
@@ -1372,8 +1380,11 @@ void *set_aqualink_iaqtouch_swg_percent( void *ptr )
  
   val = setpoint_check(SWG_SETPOINT, val, aqdata);
 
-  if (set_aqualink_iaqtouch_aquapure(aqdata, false, val))
+  if (set_aqualink_iaqtouch_aquapure(aqdata, false, val)) {
+    aqdata_write_begin();
     setSWGpercent(aqdata, val);
+    aqdata_write_end();
+  }
 
   goto_iaqt_page(IAQ_PAGE_HOME, aqdata);
   cleanAndTerminateThread(threadCtrl);
@@ -418,6 +418,10 @@ const char* getColorLightMode(unsigned char BIT2, unsigned char BIT3, unsigned c
 */
 bool process_iAqualinkStatusPacket(unsigned char *packet, int length, struct aqualinkdata *aqdata)
 {
+  // Panel sends these every few seconds, nothing to do unless something changed.
+  if (is_repeated_frame(packet, length))
+    return false;
+
   if (packet[PKT_CMD] == CMD_IAQ_MAIN_STATUS)
   {
     logPacket(IAQL_LOG, LOG_INFO, packet, length, true);
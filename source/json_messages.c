@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
 
 #include "aqualink.h"
 #include "config.h"
@@ -36,6 +38,9 @@
 #include "color_lights.h"
 #include "iaqualink.h"
 #include "aq_panel.h"
+#include "aq_serial.h"
+#include "net_services.h"
+#include "json_writer.h"
 
 //#define test_message "{\"type\": \"status\",\"version\": \"8157 REV MMM\",\"date\": \"09/01/16 THU\",\"time\": \"1:16 PM\",\"temp_units\": \"F\",\"air_temp\": \"96\",\"pool_temp\": \"86\",\"spa_temp\": \" \",\"battery\": \"ok\",\"pool_htr_set_pnt\": \"85\",\"spa_htr_set_pnt\": \"99\",\"freeze_protection\": \"off\",\"frz_protect_set_pnt\": \"0\",\"leds\": {\"pump\": \"on\",\"spa\": \"off\",\"aux1\": \"off\",\"aux2\": \"off\",\"aux3\": \"off\",\"aux4\": \"off\",\"aux5\": \"off\",\"aux6\": \"off\",\"aux7\": \"off\",\"pool_heater\": \"off\",\"spa_heater\": \"off\",\"solar_heater\": \"off\"}}"
 //#define test_labels "{\"type\": \"aux_labels\",\"aux1_label\": \"Cleaner\",\"aux2_label\": \"Waterfall\",\"aux3_label\": \"Spa Blower\",\"aux4_label\": \"Pool Light\",\"aux5_label\": \"Spa Light\",\"aux6_label\": \"Unassigned\",\"aux7_label\": \"Unassigned\"}"
@@ -65,6 +70,13 @@ int json_chars(char *dest, const char *src, int dest_len, int src_len)
 {
   int i;
   int end = dest_len < src_len ? dest_len:src_len;
+
+  if (end <= 0) {
+    if (dest_len > 0)
+      dest[0] = '\0';
+    return 0;
+  }
+
   for(i=0; i < end; i++) {
     /*
     if ( (src[i] < 32 || src[i] > 126) || 
@@ -185,29 +197,36 @@ const char* getAqualinkDStatusMessage(struct aqualinkdata *aqdata) {
 
 int build_mqtt_status_JSON(char* buffer, int size, int idx, int nvalue, float tvalue/*char *svalue*/)
 {
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  json_writer jw;
 
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_int(&jw, "idx", idx);
+  jw_int(&jw, "nvalue", nvalue);
   if (tvalue == TEMP_UNKNOWN) {
-    length = sprintf(buffer, "{\"idx\":%d,\"nvalue\":%d,\"svalue\":\"\"}", idx, nvalue);
+    jw_string(&jw, "svalue", "");
   } else {
-    length = sprintf(buffer, "{\"idx\":%d,\"nvalue\":%d,\"stype\":\"SetPoint\",\"svalue\":\"%.2f\"}", idx, nvalue, tvalue);
+    jw_string(&jw, "stype", "SetPoint");
+    jw_string_float(&jw, "svalue", tvalue, 2);
   }
+  jw_object_end(&jw);
 
-  buffer[length] = '\0';
-  return strlen(buffer);
+  return jw_finish(&jw, "mqtt status");
 }
 
 int build_mqtt_status_message_JSON(char* buffer, int size, int idx, int nvalue, char *svalue)
 {
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  json_writer jw;
   //json.htm?type=command&param=udevice&idx=IDX&nvalue=LEVEL&svalue=TEXT
 
-  length = sprintf(buffer, "{\"idx\":%d,\"nvalue\":%d,\"svalue\":\"%s\"}", idx, nvalue, svalue);
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_int(&jw, "idx", idx);
+  jw_int(&jw, "nvalue", nvalue);
+  jw_string(&jw, "svalue", svalue);
+  jw_object_end(&jw);
 
-  buffer[length] = '\0';
-  return strlen(buffer);
+  return jw_finish(&jw, "mqtt status message");
 }
 
 int build_aqualink_error_status_JSON(char* buffer, int size, const char *msg)
@@ -261,690 +280,743 @@ int LED2int(aqledstate state)
   }
 }
 
-#define AUX_BUFFER_SIZE 500
+static const char *pumpType2JSON(pump_type type)
+{
+  return (type==VFPUMP?"vfPump":(type==VSPUMP?"vsPump":"ePump"));
+}
 
-char *get_aux_information(aqkey *button, struct aqualinkdata *aqdata, char *buffer, bool homekit)
+// The extra members for a switch, depending on what's behind it
+void get_aux_information(json_writer *jw, aqkey *button, struct aqualinkdata *aqdata, bool homekit)
 {
   int i;
-  int length = 0;
-  buffer[0] = '\0';
 
   //if ((button->special_mask & VS_PUMP) == VS_PUMP)
   if (isVS_PUMP(button->special_mask))
   {
-//printf("Button %s is VSP\n", button->name);
     for (i=0; i < aqdata->num_pumps; i++) {
-      if (button == aqdata->pumps[i].button) {       
-          length += sprintf(buffer, ",\"type_ext\":\"switch_vsp\",\"Pump_RPM\":\"%d\",\"Pump_GPM\":\"%d\",\"Pump_Watts\":\"%d\",\"Pump_Type\":\"%s\",\"Pump_Status\":\"%d\",\"Pump_Speed\":\"%d\"", 
-                  aqdata->pumps[i].rpm,
-                  aqdata->pumps[i].gpm,
-                  aqdata->pumps[i].watts,
-                  (aqdata->pumps[i].pumpType==VFPUMP?"vfPump":(aqdata->pumps[i].pumpType==VSPUMP?"vsPump":"ePump")),
-                  getPumpStatus(i, aqdata),
-                  getPumpSpeedAsPercent(&aqdata->pumps[i]));
-
-          return buffer;
+      if (button == aqdata->pumps[i].button) {
+        jw_string(jw, "type_ext", "switch_vsp");
+        jw_string_int(jw, "Pump_RPM", aqdata->pumps[i].rpm);
+        jw_string_int(jw, "Pump_GPM", aqdata->pumps[i].gpm);
+        jw_string_int(jw, "Pump_Watts", aqdata->pumps[i].watts);
+        jw_string(jw, "Pump_Type", pumpType2JSON(aqdata->pumps[i].pumpType));
+        jw_string_int(jw, "Pump_Status", getPumpStatus(i, aqdata));
+        jw_string_int(jw, "Pump_Speed", getPumpSpeedAsPercent(&aqdata->pumps[i]));
+        return;
       }
     }
   } 
   //else if ((button->special_mask & PROGRAM_LIGHT) == PROGRAM_LIGHT)
   else if (isPLIGHT(button->special_mask))
   {
-//printf("Button %s is ProgramableLight\n", button->name);
     for (i=0; i < aqdata->num_lights; i++) {
       if (button == aqdata->lights[i].button) {
+        jw_string(jw, "type_ext", aqdata->lights[i].lightType == LC_DIMMER2?"light_dimmer":"switch_program");
+        jw_string_int(jw, "Light_Type", aqdata->lights[i].lightType);
+        jw_string_int(jw, "Light_Program", aqdata->lights[i].currentValue);
+
         if (aqdata->lights[i].lightType == LC_DIMMER2 ) {
-          length += sprintf(buffer, ",\"type_ext\": \"light_dimmer\", \"Light_Type\":\"%d\", \"Light_Program\":\"%d\", \"Program_Name\":\"%d%%\" ",
-                                  aqdata->lights[i].lightType,
-                                  aqdata->lights[i].currentValue,
-                                  aqdata->lights[i].currentValue);
+          char percent[16];
+          snprintf(percent, sizeof(percent), "%d%%", aqdata->lights[i].currentValue);
+          jw_string(jw, "Program_Name", percent);
         } else {
-          length += sprintf(buffer, ",\"type_ext\": \"switch_program\", \"Light_Type\":\"%d\", \"Light_Program\":\"%d\", \"Program_Name\":\"%s\" ",
-                                  aqdata->lights[i].lightType,
-                                  aqdata->lights[i].currentValue,
-                                  get_currentlight_mode_name(aqdata->lights[i], ALLBUTTON));
-                                  //light_mode_name(aqdata->lights[i].lightType, aqdata->lights[i].currentValue, ALLBUTTON));
-
-          length += sprintf(buffer+length, ",\"light_programs\": [");
-          length += build_color_light_jsonarray(aqdata->lights[i].lightType, &buffer[length], AUX_BUFFER_SIZE-length);
-          length += sprintf(buffer+length, "]");
+          char *tail;
+          int space;
+
+          jw_string(jw, "Program_Name", get_currentlight_mode_name(aqdata->lights[i], ALLBUTTON));
+          //light_mode_name(aqdata->lights[i].lightType, aqdata->lights[i].currentValue, ALLBUTTON));
+          jw_array_begin(jw, "light_programs");
+          tail = jw_tail(jw, &space);
+          jw_commit(jw, build_color_light_jsonarray(aqdata->lights[i].lightType, tail, space));
+          jw_array_end(jw);
         }
 
-        return buffer;
+        return;
       }
     }
   }
   if (isVBUTTON_ALTLABEL(button->special_mask))
   {
-    length += sprintf(buffer, ",\"alt_label\":\"%s\", \"in_alt_mode\": \"%s\" ",((altlabel_detail *)button->special_mask_ptr)->altlabel, ((altlabel_detail *)button->special_mask_ptr)->in_alt_mode?JSON_ON:JSON_OFF );
-    //return buffer;
+    jw_string(jw, "alt_label", ((altlabel_detail *)button->special_mask_ptr)->altlabel);
+    jw_string(jw, "in_alt_mode", ((altlabel_detail *)button->special_mask_ptr)->in_alt_mode?JSON_ON:JSON_OFF);
   }
 
-//printf("Button %s is Switch\n", button->name);
-  length += sprintf(buffer+length, ",\"type_ext\": \"switch_timer\", \"timer_active\":\"%s\"", (((button->special_mask & TIMER_ACTIVE) == TIMER_ACTIVE)?JSON_ON:JSON_OFF) );
+  jw_string(jw, "type_ext", "switch_timer");
+  jw_string(jw, "timer_active", ((button->special_mask & TIMER_ACTIVE) == TIMER_ACTIVE)?JSON_ON:JSON_OFF);
   if ((button->special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
-    //length += sprintf(buffer+length,",\"timer_duration\":\"%d\"", get_timer_left(button));
-    length += sprintf(buffer+length,",\"timer_duration\":\"%u\"", get_timer_left_sec(button));
+    jw_string_int(jw, "timer_duration", get_timer_left_sec(button));
   }
-  return buffer;
+}
+
+// Heaters, freeze protect, chiller & SWG.  timer_active is left out if NULL
+static void setpoint_device_JSON(json_writer *jw, const char *type, const char *id, const char *name, const char *state, const char *status,
+                                 int decimals, float spvalue, float value, int int_status, const char *timer_active)
+{
+  jw_object_begin(jw, NULL);
+  jw_string(jw, "type", type);
+  jw_string(jw, "id", id);
+  jw_string(jw, "name", name);
+  jw_string(jw, "state", state);
+  jw_string(jw, "status", status);
+  jw_string_float(jw, "spvalue", spvalue, decimals);
+  jw_string_float(jw, "value", value, decimals);
+  jw_string_int(jw, "int_status", int_status);
+  if (timer_active != NULL)
+    jw_string(jw, "timer_active", timer_active);
+  jw_object_end(jw);
+}
+
+// Temperatures, chemistry, sensors etc.  uom is left out if NULL
+static void value_device_JSON(json_writer *jw, const char *type, const char *id, const char *name, int decimals, float value, const char *uom)
+{
+  jw_object_begin(jw, NULL);
+  jw_string(jw, "type", type);
+  jw_string(jw, "id", id);
+  jw_string(jw, "name", name);
+  jw_string(jw, "state", "on");
+  jw_string_float(jw, "value", value, decimals);
+  if (uom != NULL)
+    jw_string(jw, "uom", uom);
+  jw_object_end(jw);
+}
+
+static void switch_device_JSON(json_writer *jw, const char *id, const char *name, aqledstate state)
+{
+  jw_string(jw, "type", "switch");
+  jw_string(jw, "id", id);
+  jw_string(jw, "name", name);
+  jw_string(jw, "state", state==ON?JSON_ON:JSON_OFF);
+  jw_string(jw, "status", LED2text(state));
+  jw_string_int(jw, "int_status", LED2int(state));
 }
 
 //int build_device_JSON(struct aqualinkdata *aqdata, int programable_switch1, int programable_switch2, char* buffer, int size, bool homekit)
 int build_device_JSON(struct aqualinkdata *aqdata, char* buffer, int size, bool homekit)
 {
-  char aux_info[AUX_BUFFER_SIZE];
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  json_writer jw;
+  char id[64];
+  int length;
   int i;
 
   // IF temp units are F assume homekit is using F
   bool homekit_f = (homekit && ( aqdata->temp_units==FAHRENHEIT || aqdata->temp_units == UNKNOWN) );
 
-  length += sprintf(buffer+length, "{\"type\": \"devices\"");
-  length += sprintf(buffer+length, ",\"aqualinkd_version\":\"%s\"",AQUALINKD_VERSION);//"09/01/16 THU",
-  length += sprintf(buffer+length, ",\"date\":\"%s\"",aqdata->date );//"09/01/16 THU",
-  length += sprintf(buffer+length, ",\"time\":\"%s\"",aqdata->time );//"1:16 PM",
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_string(&jw, "type", "devices");
+  jw_string(&jw, "aqualinkd_version", AQUALINKD_VERSION);
+  jw_string(&jw, "date", aqdata->date );//"09/01/16 THU",
+  jw_string(&jw, "time", aqdata->time );//"1:16 PM",
   if ( aqdata->temp_units == FAHRENHEIT )
-    length += sprintf(buffer+length, ",\"temp_units\":\"%s\"",JSON_FAHRENHEIT );
+    jw_string(&jw, "temp_units", JSON_FAHRENHEIT );
   else if ( aqdata->temp_units == CELSIUS )
-    length += sprintf(buffer+length, ",\"temp_units\":\"%s\"", JSON_CELSIUS);
+    jw_string(&jw, "temp_units", JSON_CELSIUS);
   else
-    length += sprintf(buffer+length, ",\"temp_units\":\"%s\"",JSON_UNKNOWN );
+    jw_string(&jw, "temp_units", JSON_UNKNOWN );
 
-  length += sprintf(buffer+length,  ", \"devices\": [");
+  jw_array_begin(&jw, "devices");
   
   for (i=0; i < aqdata->total_buttons; i++) 
   {
     if ( strcmp(BTN_POOL_HTR,aqdata->aqbuttons[i].name) == 0 && (ENABLE_HEATERS || aqdata->pool_htr_set_point != TEMP_UNKNOWN)) {
-      length += sprintf(buffer+length, "{\"type\": \"setpoint_thermo\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"spvalue\": \"%.*f\", \"value\": \"%.*f\", \"int_status\": \"%d\", \"timer_active\":\"%s\" },",
-                                     aqdata->aqbuttons[i].name, 
-                                     aqdata->aqbuttons[i].label,
-                                     aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
-                                     LED2text(aqdata->aqbuttons[i].led->state),
-                                     ((homekit)?2:0),
-                                     ((homekit_f)?degFtoC(aqdata->pool_htr_set_point):aqdata->pool_htr_set_point),
-                                     ((homekit)?2:0),
-                                     ((homekit_f)?degFtoC(aqdata->pool_temp):aqdata->pool_temp),
-                                     LED2int(aqdata->aqbuttons[i].led->state),
-                                     ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE?JSON_ON:JSON_OFF) );
+      setpoint_device_JSON(&jw, "setpoint_thermo",
+                           aqdata->aqbuttons[i].name,
+                           aqdata->aqbuttons[i].label,
+                           aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
+                           LED2text(aqdata->aqbuttons[i].led->state),
+                           ((homekit)?2:0),
+                           ((homekit_f)?degFtoC(aqdata->pool_htr_set_point):aqdata->pool_htr_set_point),
+                           ((homekit_f)?degFtoC(aqdata->pool_temp):aqdata->pool_temp),
+                           LED2int(aqdata->aqbuttons[i].led->state),
+                           ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE?JSON_ON:JSON_OFF) );
 
     } else if ( strcmp(BTN_SPA_HTR,aqdata->aqbuttons[i].name)==0 && (ENABLE_HEATERS || aqdata->spa_htr_set_point != TEMP_UNKNOWN)) {
-      length += sprintf(buffer+length, "{\"type\": \"setpoint_thermo\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"spvalue\": \"%.*f\", \"value\": \"%.*f\", \"int_status\": \"%d\", \"timer_active\":\"%s\" },",
-                                     aqdata->aqbuttons[i].name, 
-                                     aqdata->aqbuttons[i].label,
-                                     aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
-                                     LED2text(aqdata->aqbuttons[i].led->state),
-                                     ((homekit)?2:0),
-                                     ((homekit_f)?degFtoC(aqdata->spa_htr_set_point):aqdata->spa_htr_set_point),
-                                     ((homekit)?2:0),
-                                     ((homekit_f)?degFtoC(aqdata->spa_temp):aqdata->spa_temp),
-                                     LED2int(aqdata->aqbuttons[i].led->state),
-                                     ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE?JSON_ON:JSON_OFF));
+      setpoint_device_JSON(&jw, "setpoint_thermo",
+                           aqdata->aqbuttons[i].name,
+                           aqdata->aqbuttons[i].label,
+                           aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
+                           LED2text(aqdata->aqbuttons[i].led->state),
+                           ((homekit)?2:0),
+                           ((homekit_f)?degFtoC(aqdata->spa_htr_set_point):aqdata->spa_htr_set_point),
+                           ((homekit_f)?degFtoC(aqdata->spa_temp):aqdata->spa_temp),
+                           LED2int(aqdata->aqbuttons[i].led->state),
+                           ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE?JSON_ON:JSON_OFF));
 
     } else {
       if (!homekit && ENABLE_CHILLER && isVBUTTON_CHILLER(aqdata->aqbuttons[i].special_mask) ) {
         // We will add this VButton as a thermostat
         continue;
       }
-      get_aux_information(&aqdata->aqbuttons[i], aqdata, aux_info, homekit);
-      //length += sprintf(buffer+length, "{\"type\": \"switch\", \"type_ext\": \"switch_vsp\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"int_status\": \"%d\" %s},", 
-      length += sprintf(buffer+length, "{\"type\": \"switch\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"int_status\": \"%d\" %s},", 
-                                     aqdata->aqbuttons[i].name, 
-                                     aqdata->aqbuttons[i].label,
-                                     aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
-                                     LED2text(aqdata->aqbuttons[i].led->state),
-                                     LED2int(aqdata->aqbuttons[i].led->state),
-                                     aux_info);
+      jw_object_begin(&jw, NULL);
+      switch_device_JSON(&jw, aqdata->aqbuttons[i].name, aqdata->aqbuttons[i].label, aqdata->aqbuttons[i].led->state);
+      get_aux_information(&jw, &aqdata->aqbuttons[i], aqdata, homekit);
+      jw_object_end(&jw);
     }
-    /*    
-    } else if ( (programable_switch1 > 0 && programable_switch1 == i) || 
-                (programable_switch2 > 0 && programable_switch2 == i)) {
-        length += sprintf(buffer+length, "{\"type\": \"switch\", \"type_ext\": \"switch_program\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"int_status\": \"%d\"},", 
-                                     aqdata->aqbuttons[i].name, 
-                                     aqdata->aqbuttons[i].label,
-                                     aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
-                                     LED2text(aqdata->aqbuttons[i].led->state),
-                                     LED2int(aqdata->aqbuttons[i].led->state));
-    } else {
-      if ( get_aux_information(&aqdata->aqbuttons[i], aqdata, aux_info)[0] == '\0' ) {
-        length += sprintf(buffer+length, "{\"type\": \"switch\", \"type_ext\": \"switch\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"int_status\": \"%d\"},", 
-                                     aqdata->aqbuttons[i].name, 
-                                     aqdata->aqbuttons[i].label,
-                                     aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
-                                     LED2text(aqdata->aqbuttons[i].led->state),
-                                     LED2int(aqdata->aqbuttons[i].led->state));
-      } else {
-        length += sprintf(buffer+length, "{\"type\": \"switch\", \"type_ext\": \"switch_vsp\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"int_status\": \"%d\" %s},", 
-                                     aqdata->aqbuttons[i].name, 
-                                     aqdata->aqbuttons[i].label,
-                                     aqdata->aqbuttons[i].led->state==ON?JSON_ON:JSON_OFF,
-                                     LED2text(aqdata->aqbuttons[i].led->state),
-                                     LED2int(aqdata->aqbuttons[i].led->state),
-                                     aux_info);
-                                     //get_aux_information(&aqdata->aqbuttons[i], aqdata, aux_info));
-      }
-    }*/
   }
 
   if ( ENABLE_FREEZEPROTECT || (aqdata->frz_protect_set_point != TEMP_UNKNOWN && aqdata->air_temp != TEMP_UNKNOWN) ) {
-    length += sprintf(buffer+length, "{\"type\": \"setpoint_freeze\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"spvalue\": \"%.*f\", \"value\": \"%.*f\", \"int_status\": \"%d\" },",
-                                     FREEZE_PROTECT,
-                                    "Freeze Protection",
-                                    aqdata->frz_protect_state==ON?JSON_ON:JSON_OFF,
-                                    aqdata->frz_protect_state==ON?LED2text(ON):LED2text(ENABLE),
-                                    ((homekit)?2:0),
-                                    ((homekit_f)?degFtoC(aqdata->frz_protect_set_point):aqdata->frz_protect_set_point),
-                                    ((homekit)?2:0),
-                                    ((homekit_f)?degFtoC(aqdata->air_temp):aqdata->air_temp),
-                                    aqdata->frz_protect_state==ON?1:0);
+    setpoint_device_JSON(&jw, "setpoint_freeze",
+                         FREEZE_PROTECT,
+                         "Freeze Protection",
+                         aqdata->frz_protect_state==ON?JSON_ON:JSON_OFF,
+                         aqdata->frz_protect_state==ON?LED2text(ON):LED2text(ENABLE),
+                         ((homekit)?2:0),
+                         ((homekit_f)?degFtoC(aqdata->frz_protect_set_point):aqdata->frz_protect_set_point),
+                         ((homekit_f)?degFtoC(aqdata->air_temp):aqdata->air_temp),
+                         aqdata->frz_protect_state==ON?1:0,
+                         NULL);
   }
 
   if ( (ENABLE_CHILLER || (aqdata->chiller_set_point != TEMP_UNKNOWN && getWaterTemp(aqdata) != TEMP_UNKNOWN)) && (aqdata->chiller_button != NULL) ) {
-    length += sprintf(buffer+length, "{\"type\": \"setpoint_chiller\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"spvalue\": \"%.*f\", \"value\": \"%.*f\", \"int_status\": \"%d\" },",
-      CHILLER,
-     "Heat Pump Chiller",
-     aqdata->chiller_button->led->state==ON?JSON_ON:JSON_OFF,
-     //((vbutton_detail *)aqdata->chiller_button->special_mask_ptr)->in_alt_mode?JSON_ON:JSON_OFF,
-     aqdata->chiller_button->led->state==ON?LED2text(ON):LED2text(ENABLE),
-     //((vbutton_detail *)aqdata->chiller_button->special_mask_ptr)->in_alt_mode?(aqdata->chiller_button->led->state==ON?LED2text(ON):LED2text(ENABLE)):JSON_OFF,
-     ((homekit)?2:0),
-     ((homekit_f)?degFtoC(aqdata->chiller_set_point):aqdata->chiller_set_point),
-     ((homekit)?2:0),
-     ((homekit_f)?degFtoC(getWaterTemp(aqdata)):getWaterTemp(aqdata)),
-     aqdata->chiller_button->led->state==ON?1:0);
+    setpoint_device_JSON(&jw, "setpoint_chiller",
+                         CHILLER,
+                         "Heat Pump Chiller",
+                         aqdata->chiller_button->led->state==ON?JSON_ON:JSON_OFF,
+                         aqdata->chiller_button->led->state==ON?LED2text(ON):LED2text(ENABLE),
+                         ((homekit)?2:0),
+                         ((homekit_f)?degFtoC(aqdata->chiller_set_point):aqdata->chiller_set_point),
+                         ((homekit_f)?degFtoC(getWaterTemp(aqdata)):getWaterTemp(aqdata)),
+                         aqdata->chiller_button->led->state==ON?1:0,
+                         NULL);
   }
 
   if (aqdata->swg_led_state != LED_S_UNKNOWN) {
     if ( aqdata->swg_percent != TEMP_UNKNOWN ) {
-      length += sprintf(buffer+length, "{\"type\": \"setpoint_swg\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"spvalue\": \"%.*f\", \"value\": \"%.*f\", \"int_status\": \"%d\" },",
-                                     SWG_TOPIC,
-                                    "Salt Water Generator",
-                                    //aqdata->ar_swg_status == SWG_STATUS_OFF?JSON_OFF:JSON_ON,
-                                    aqdata->swg_led_state == OFF?JSON_OFF:JSON_ON,
-                                    //LED2text(get_swg_led_state(aqdata)),
-                                    LED2text(aqdata->swg_led_state),
-                                    ((homekit)?2:0),
-                                    ((homekit_f)?degFtoC(aqdata->swg_percent):aqdata->swg_percent),
-                                    ((homekit)?2:0),
-                                    ((homekit_f)?degFtoC(aqdata->swg_percent):aqdata->swg_percent),
-                                    LED2int(aqdata->swg_led_state) );
-                                    //aqdata->ar_swg_status == SWG_STATUS_OFF?LED2int(OFF):LED2int(ON));
-
-    //length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%d\" },",
-      length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                   ((homekit_f)?SWG_PERCENT_F_TOPIC:SWG_PERCENT_TOPIC),
-                                   "Salt Water Generator Percent",
-                                   "on",
-                                   ((homekit_f)?2:0),
-                                   ((homekit_f)?degFtoC(aqdata->swg_percent):aqdata->swg_percent));
-      //if (!homekit) { // For the moment keep boost off homekit   
-
-        length += sprintf(buffer+length, "{\"type\": \"switch\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"status\": \"%s\", \"int_status\": \"%d\"},", 
-                                     SWG_BOOST_TOPIC, 
-                                     "SWG Boost",
-                                     aqdata->boost?JSON_ON:JSON_OFF,
-                                     aqdata->boost?JSON_ON:JSON_OFF,
-                                     aqdata->boost?LED2int(ON):LED2int(OFF));
-      //}
+      setpoint_device_JSON(&jw, "setpoint_swg",
+                           SWG_TOPIC,
+                           "Salt Water Generator",
+                           aqdata->swg_led_state == OFF?JSON_OFF:JSON_ON,
+                           LED2text(aqdata->swg_led_state),
+                           ((homekit)?2:0),
+                           ((homekit_f)?degFtoC(aqdata->swg_percent):aqdata->swg_percent),
+                           ((homekit_f)?degFtoC(aqdata->swg_percent):aqdata->swg_percent),
+                           LED2int(aqdata->swg_led_state),
+                           NULL);
+
+      value_device_JSON(&jw, "value",
+                        ((homekit_f)?SWG_PERCENT_F_TOPIC:SWG_PERCENT_TOPIC),
+                        "Salt Water Generator Percent",
+                        ((homekit_f)?2:0),
+                        ((homekit_f)?degFtoC(aqdata->swg_percent):aqdata->swg_percent),
+                        NULL);
+
+      jw_object_begin(&jw, NULL);
+      switch_device_JSON(&jw, SWG_BOOST_TOPIC, "SWG Boost", aqdata->boost?ON:OFF);
+      jw_object_end(&jw);
     }
 
     if ( aqdata->swg_ppm != TEMP_UNKNOWN ) {
-
-      length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                     ((homekit_f)?SWG_PPM_F_TOPIC:SWG_PPM_TOPIC),
-                                     "Salt Level PPM",
-                                     "on",
-                                     ((homekit)?2:0),
-                                     ((homekit_f)?roundf(degFtoC(aqdata->swg_ppm)):aqdata->swg_ppm)); 
-                                   
-     /*         
-   length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%d\" },",
-                                   SWG_PPM_TOPIC,
-                                   "Salt Level PPM",
-                                   "on",
-                                   aqdata->swg_ppm);
-   */
-                                   
+      value_device_JSON(&jw, "value",
+                        ((homekit_f)?SWG_PPM_F_TOPIC:SWG_PPM_TOPIC),
+                        "Salt Level PPM",
+                        ((homekit)?2:0),
+                        ((homekit_f)?roundf(degFtoC(aqdata->swg_ppm)):aqdata->swg_ppm),
+                        NULL);
     }
   }
 
   if ( aqdata->ph != TEMP_UNKNOWN ) {
-    length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                   ((homekit_f)?CHRM_PH_F_TOPIC:CHEM_PH_TOPIC),
-                                   "Water Chemistry pH",
-                                   "on",
-                                   ((homekit)?2:1),
-                                   ((homekit_f)?(degFtoC(aqdata->ph)):aqdata->ph)); 
+    value_device_JSON(&jw, "value",
+                      ((homekit_f)?CHRM_PH_F_TOPIC:CHEM_PH_TOPIC),
+                      "Water Chemistry pH",
+                      ((homekit)?2:1),
+                      ((homekit_f)?(degFtoC(aqdata->ph)):aqdata->ph),
+                      NULL);
   }
   if ( aqdata->orp != TEMP_UNKNOWN ) {
-    length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                   ((homekit_f)?CHRM_ORP_F_TOPIC:CHEM_ORP_TOPIC),
-                                   "Water Chemistry ORP",
-                                   "on",
-                                   ((homekit)?2:0),
-                                   ((homekit_f)?(degFtoC(aqdata->orp)):aqdata->orp)); 
+    value_device_JSON(&jw, "value",
+                      ((homekit_f)?CHRM_ORP_F_TOPIC:CHEM_ORP_TOPIC),
+                      "Water Chemistry ORP",
+                      ((homekit)?2:0),
+                      ((homekit_f)?(degFtoC(aqdata->orp)):aqdata->orp),
+                      NULL);
   }
 
-  length += sprintf(buffer+length, "{\"type\": \"temperature\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                   AIR_TEMP_TOPIC,
-                                   /*AIR_TEMPERATURE,*/
-                                   "Pool Air Temperature",
-                                   "on",
-                                   ((homekit)?2:0),
-                                   ((homekit_f)?degFtoC(aqdata->air_temp):aqdata->air_temp));
-  length += sprintf(buffer+length, "{\"type\": \"temperature\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                   POOL_TEMP_TOPIC,
-                                   /*POOL_TEMPERATURE,*/
-                                   "Pool Water Temperature",
-                                   "on",
-                                   ((homekit)?2:0),
-                                   ((homekit_f)?degFtoC(aqdata->pool_temp):aqdata->pool_temp));
-  length += sprintf(buffer+length, "{\"type\": \"temperature\", \"id\": \"%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-                                   SPA_TEMP_TOPIC,
-                                   /*SPA_TEMPERATURE,*/
-                                   "Spa Water Temperature",
-                                   "on",
-                                   ((homekit)?2:0),
-                                   ((homekit_f)?degFtoC(aqdata->spa_temp):aqdata->spa_temp));
+  value_device_JSON(&jw, "temperature", AIR_TEMP_TOPIC, "Pool Air Temperature",
+                    ((homekit)?2:0), ((homekit_f)?degFtoC(aqdata->air_temp):aqdata->air_temp), NULL);
+  value_device_JSON(&jw, "temperature", POOL_TEMP_TOPIC, "Pool Water Temperature",
+                    ((homekit)?2:0), ((homekit_f)?degFtoC(aqdata->pool_temp):aqdata->pool_temp), NULL);
+  value_device_JSON(&jw, "temperature", SPA_TEMP_TOPIC, "Spa Water Temperature",
+                    ((homekit)?2:0), ((homekit_f)?degFtoC(aqdata->spa_temp):aqdata->spa_temp), NULL);
 
   for (i=0; i < aqdata->num_sensors; i++) 
   {
     if (aqdata->sensors[i].value != TEMP_UNKNOWN) {
-       //length += sprintf(buffer+length, "\"%s\": \"%.2f\",", aqdata->sensors[i].label, aqdata->sensors[i].value );
-       /*
-      length += sprintf(buffer+length, "{\"type\": \"temperature\", \"id\": \"%s/%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-        SENSOR_TOPIC,aqdata->sensors[i].label,
-        aqdata->sensors[i].label,
-        "on",
-        ((homekit)?2:0),
-        ((homekit_f)?aqdata->sensors[i].value:aqdata->sensors[i].value));*/
-
       temperatureUOM t_uom = getTemperatureUOM(aqdata->sensors[i].uom);
 
+      snprintf(id, sizeof(id), "%s%s", FULL_SENSOR_TOPIC, aqdata->sensors[i].ID);
+
       if (aqdata->sensors[i].uom == NULL) {
-        length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s%s\", \"name\": \"%s\", \"state\": \"on\", \"value\": \"%.*f\", \"uom\": \"\" },",
-        FULL_SENSOR_TOPIC,
-        aqdata->sensors[i].ID,
-        aqdata->sensors[i].label,
-        2,
-        aqdata->sensors[i].value);
+        value_device_JSON(&jw, "value", id, aqdata->sensors[i].label, 2, aqdata->sensors[i].value, "");
       } else if (t_uom == UNKNOWN) {
-        length += sprintf(buffer+length, "{\"type\": \"value\", \"id\": \"%s%s\", \"name\": \"%s\", \"state\": \"on\", \"value\": \"%.*f\", \"uom\": \"%s\" },",
-        FULL_SENSOR_TOPIC,
-        aqdata->sensors[i].ID,
-        aqdata->sensors[i].label,
-        2,
-        aqdata->sensors[i].value,
-        aqdata->sensors[i].uom);
+        value_device_JSON(&jw, "value", id, aqdata->sensors[i].label, 2, aqdata->sensors[i].value, aqdata->sensors[i].uom);
       } else if ( !homekit && (aqdata->temp_units == FAHRENHEIT && t_uom == CELSIUS) ) {
-        length += sprintf(buffer+length, "{\"type\": \"temperature\", \"id\": \"%s%s\", \"name\": \"%s\", \"state\": \"on\", \"value\": \"%.*f\" },",
-        FULL_SENSOR_TOPIC,
-        aqdata->sensors[i].ID,
-        aqdata->sensors[i].label,
-        2,
-        degCtoF(aqdata->sensors[i].value));
+        value_device_JSON(&jw, "temperature", id, aqdata->sensors[i].label, 2, degCtoF(aqdata->sensors[i].value), NULL);
       } else {
-        length += sprintf(buffer+length, "{\"type\": \"temperature\", \"id\": \"%s%s\", \"name\": \"%s\", \"state\": \"%s\", \"value\": \"%.*f\" },",
-        FULL_SENSOR_TOPIC,
-        aqdata->sensors[i].ID,
-        aqdata->sensors[i].label,
-        "on",
-        ((homekit)?2:0),
-        ((homekit_f)?aqdata->sensors[i].value:aqdata->sensors[i].value));
+        value_device_JSON(&jw, "temperature", id, aqdata->sensors[i].label, ((homekit)?2:0), aqdata->sensors[i].value, NULL);
       }
     }
   }
-/*
-  length += sprintf(buffer+length,  "], \"aux_device_detail\": [");
-  for (i=0; i < MAX_PUMPS; i++) {
-  }
-*/
-  if (buffer[length-1] == ',')
-    length--;
 
-  length += sprintf(buffer+length, "]}");
+  jw_array_end(&jw);
+  jw_object_end(&jw);
 
-  // Really crap test
-  if (length >= size) {
-    LOG(NET_LOG,LOG_ERR, "JSON: %s went over buffer size %d of %d\n", homekit?"homebridge":"web", length, size);
-    buffer[size - 1] = '\0';
-  }
+  length = jw_finish(&jw, homekit?"homebridge":"web");
 
   LOG(NET_LOG,LOG_DEBUG, "JSON: %s used %d of %d\n", homekit?"homebridge":"web", length, size);
 
-  buffer[length] = '\0';
-
-//printf("%s\n",buffer);
-
-  return strlen(buffer);
-  
-  //return length;
+  return length;
 }
 
-int logmaskjsonobject(logmask_t flag, char* buffer)
+void logmaskjsonobject(json_writer *jw, logmask_t flag)
 {
-  int length = sprintf(buffer, "{\"name\":\"%s\",\"id\":\"%d\",\"set\":\"%s\"},", logmask2name(flag), flag,(isDebugLogMaskSet(flag)?JSON_ON:JSON_OFF));
+  jw_object_begin(jw, NULL);
+  jw_string(jw, "name", logmask2name(flag));
+  jw_string_int(jw, "id", flag);
+  jw_string(jw, "set", isDebugLogMaskSet(flag)?JSON_ON:JSON_OFF);
 
   if (flag == RSSD_LOG) {
-    //length = sprintf(buffer, "{\"name\":\"%s\",\"id\":\"%d\",\"set\":\"%s\",\"filter\":\"0x%02hhx\"},", logmask2name(flag), flag,(isDebugLogMaskSet(flag)?JSON_ON:JSON_OFF), _aqconfig_.RSSD_LOG_filter[0]);
-    length = sprintf(buffer, "{\"name\":\"%s\",\"id\":\"%d\",\"set\":\"%s\",\"filters\":[", logmask2name(flag), flag,(isDebugLogMaskSet(flag)?JSON_ON:JSON_OFF));
+    jw_array_begin(jw, "filters");
     for (int i=0; i < MAX_RSSD_LOG_FILTERS; i++) {
-      length += sprintf(buffer+length, "\"0x%02hhx\",", _aqconfig_.RSSD_LOG_filter[i]);
+      jw_string_hex(jw, NULL, _aqconfig_.RSSD_LOG_filter[i]);
     }
-    //"]},"
-    length += sprintf(buffer+length-1, "]},");
-    length--;
+    jw_array_end(jw);
   }
-  return length;
+  jw_object_end(jw);
 }
-int logleveljsonobject(int level, char* buffer)
+
+void logleveljsonobject(json_writer *jw, int level)
 {
-  int length = sprintf(buffer, "{\"name\":\"%s\",\"id\":\"%d\",\"set\":\"%s\"},", loglevel2name(level), level,(getSystemLogLevel()==level?JSON_ON:JSON_OFF));
-  return length;
+  jw_object_begin(jw, NULL);
+  jw_string(jw, "name", loglevel2name(level));
+  jw_string_int(jw, "id", level);
+  jw_string(jw, "set", getSystemLogLevel()==level?JSON_ON:JSON_OFF);
+  jw_object_end(jw);
 }
 
 int build_aqualink_aqmanager_JSON(struct aqualinkdata *aqdata, char* buffer, int size)
 {
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  json_writer jw;
+  char revision[AQ_MSGLEN*2+1];
 
-  length += sprintf(buffer+length, "{\"type\": \"aqmanager\"");
-  length += sprintf(buffer+length, ",\"deamonized\": \"%s\"", (_aqconfig_.deamonize?JSON_ON:JSON_OFF) );
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_string(&jw, "type", "aqmanager");
+  jw_string(&jw, "deamonized", (_aqconfig_.deamonize?JSON_ON:JSON_OFF) );
 
   if ( isMASK_SET(aqdata->status_mask,AUTOCONFIGURE_ID ) ||
        isMASK_SET(aqdata->status_mask,AUTOCONFIGURE_PANEL ) /*||
        isMASK_SET(aqdata->status_mask,CONNECTING )*/  ) 
   {
-    length += sprintf(buffer+length, ",\"config_editor\": \"no\"");
+    jw_string(&jw, "config_editor", "no");
   } else {
-    length += sprintf(buffer+length, ",\"config_editor\": \"yes\"");
+    jw_string(&jw, "config_editor", "yes");
   }
 
-  length += sprintf(buffer+length, ",\"aqualinkd_version\":\"%s\"",AQUALINKD_VERSION);
-
-  length += sprintf(buffer+length, ",\"panel_type_full\":\"%s\"",getPanelString());
-  length += sprintf(buffer+length, ",\"panel_type\":\"%s\"",getShortPanelString());
-  length += sprintf(buffer+length, ",\"panel_revision\":\"%s %s\"",aqdata->panel_cpu, aqdata->panel_rev );//8157 REV MMM",
-  length += sprintf(buffer+length, ",\"panel_reported_string\":\"%s\"",aqdata->panel_string);
-  
-
-  
-  /*
-  length += sprintf(buffer+length, ",\"panel_type\":\"%s\"",getPanelString());
-  length += sprintf(buffer+length, ",\"version\":\"%s\"",aqdata->version );//8157 REV MMM",
-  length += sprintf(buffer+length, ",\"aqualinkd_version\":\"%s\"", AQUALINKD_VERSION ); //1.0b,
-  */
-  //length += sprintf(buffer+length, ",\"logging2file\": \"%s\"",islogFileReady()?JSON_ON:JSON_OFF);
-  //length += sprintf(buffer+length, ",\"logfileready\": \"%s\"",islogFileReady()?JSON_ON:JSON_OFF);
-  //length += sprintf(buffer+length, ",\"logfilename\": \"%s\"",_aqconfig_.log_file);
-  length += sprintf(buffer+length, ",\"debugmasks\":[");
-  length += logmaskjsonobject(AQUA_LOG, buffer+length);
-  length += logmaskjsonobject(NET_LOG, buffer+length);
-  length += logmaskjsonobject(ALLB_LOG, buffer+length);
-  length += logmaskjsonobject(ONET_LOG, buffer+length);
-  length += logmaskjsonobject(IAQT_LOG, buffer+length);
-  length += logmaskjsonobject(PDA_LOG, buffer+length);
-  length += logmaskjsonobject(RSSA_LOG, buffer+length);
-  length += logmaskjsonobject(DJAN_LOG, buffer+length);
-  length += logmaskjsonobject(DPEN_LOG, buffer+length);
-  length += logmaskjsonobject(PROG_LOG, buffer+length);
-  length += logmaskjsonobject(SCHD_LOG, buffer+length);
-  length += logmaskjsonobject(RSTM_LOG, buffer+length);
-  length += logmaskjsonobject(SIM_LOG, buffer+length);
-
-  length += logmaskjsonobject(RSSD_LOG, buffer+length); // Make sure the last one.
+  jw_string(&jw, "aqualinkd_version", AQUALINKD_VERSION);
+
+  jw_string(&jw, "panel_type_full", getPanelString());
+  jw_string(&jw, "panel_type", getShortPanelString());
+  snprintf(revision, sizeof(revision), "%s %s", aqdata->panel_cpu, aqdata->panel_rev);
+  jw_string(&jw, "panel_revision", revision);//8157 REV MMM",
+  jw_string(&jw, "panel_reported_string", aqdata->panel_string);
+
+  jw_array_begin(&jw, "debugmasks");
+  logmaskjsonobject(&jw, AQUA_LOG);
+  logmaskjsonobject(&jw, NET_LOG);
+  logmaskjsonobject(&jw, ALLB_LOG);
+  logmaskjsonobject(&jw, ONET_LOG);
+  logmaskjsonobject(&jw, IAQT_LOG);
+  logmaskjsonobject(&jw, PDA_LOG);
+  logmaskjsonobject(&jw, RSSA_LOG);
+  logmaskjsonobject(&jw, DJAN_LOG);
+  logmaskjsonobject(&jw, DPEN_LOG);
+  logmaskjsonobject(&jw, PROG_LOG);
+  logmaskjsonobject(&jw, SCHD_LOG);
+  logmaskjsonobject(&jw, RSTM_LOG);
+  logmaskjsonobject(&jw, SIM_LOG);
+  logmaskjsonobject(&jw, RSSD_LOG);
   // DBGT_LOG is a compile time only, so don;t include
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "]");
-
-  length += sprintf(buffer+length, ",\"loglevels\":[");
-  length += logleveljsonobject(LOG_DEBUG_SERIAL, buffer+length);
-  length += logleveljsonobject(LOG_DEBUG, buffer+length);
-  length += logleveljsonobject(LOG_INFO, buffer+length);
-  length += logleveljsonobject(LOG_NOTICE, buffer+length);
-  length += logleveljsonobject(LOG_WARNING, buffer+length);
-  length += logleveljsonobject(LOG_ERR, buffer+length);
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "]");
-
-  length += sprintf(buffer+length, "}");
+  jw_array_end(&jw);
+
+  jw_array_begin(&jw, "loglevels");
+  logleveljsonobject(&jw, LOG_DEBUG_SERIAL);
+  logleveljsonobject(&jw, LOG_DEBUG);
+  logleveljsonobject(&jw, LOG_INFO);
+  logleveljsonobject(&jw, LOG_NOTICE);
+  logleveljsonobject(&jw, LOG_WARNING);
+  logleveljsonobject(&jw, LOG_ERR);
+  jw_array_end(&jw);
+
+  jw_object_end(&jw);
   
-  return length;
+  return jw_finish(&jw, "aqmanager");
 }
 
-int build_aqualink_status_JSON(struct aqualinkdata *aqdata, char* buffer, int size)
+// rs485_frame_delay in use, plus how auto tuning got there.
+static void frame_delay_JSON(json_writer *jw)
 {
-  //strncpy(buffer, test_message, strlen(test_message)+1);
-  //return strlen(test_message);
-  //char buffer2[600];
-  
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  frame_delay_adjustment history[FRAME_DELAY_HISTORY];
+  int count;
   int i;
 
-  length += sprintf(buffer+length, "{\"type\": \"status\"");
-  length += sprintf(buffer+length, ",\"status\":\"%s\"",getStatus(aqdata) );
-  length += sprintf(buffer+length, ",\"panel_message\":\"%s\"",aqdata->last_message );
-  length += sprintf(buffer+length, ",\"panel_type_full\":\"%s\"",getPanelString());
-  length += sprintf(buffer+length, ",\"panel_type\":\"%s\"",getShortPanelString());
-  //length += sprintf(buffer+length, ",\"message\":\"%s\"",aqdata->message );
-  //length += sprintf(buffer+length, ",\"version\":\"%s\"",aqdata->version );//8157 REV MMM",
-  length += sprintf(buffer+length, ",\"version\":\"%s %s\"",aqdata->panel_cpu, aqdata->panel_rev );//8157 REV MMM",
-  length += sprintf(buffer+length, ",\"aqualinkd_version\":\"%s (rev %s)\"", AQUALINKD_VERSION, GIT_HASH); //1.0b,
-  length += sprintf(buffer+length, ",\"date\":\"%s\"",aqdata->date );//"09/01/16 THU",
-  length += sprintf(buffer+length, ",\"time\":\"%s\"",aqdata->time );//"1:16 PM",
-  //length += sprintf(buffer+length, ",\"air_temp\":\"%d\"",aqdata->air_temp );//"96",
-  //length += sprintf(buffer+length, ",\"pool_temp\":\"%d\"",aqdata->pool_temp );//"86",
-  //length += sprintf(buffer+length, ",\"spa_temp\":\"%d\"",aqdata->spa_temp );//" ",
+  jw_object_begin(jw, "frame_delay");
+  jw_int(jw, "ms", get_frame_delay());
+  jw_bool(jw, "auto", _aqconfig_.frame_delay_auto);
+
+  if (_aqconfig_.frame_delay_auto) {
+    count = get_frame_delay_history(history, FRAME_DELAY_HISTORY);
+
+    jw_float(jw, "panel_gap_ms", get_panel_frame_gap(), 1);
+    jw_array_begin(jw, "history");
+    for (i=0; i < count; i++) {
+      jw_object_begin(jw, NULL);
+      jw_int(jw, "time", (long)history[i].time);
+      jw_int(jw, "from_ms", history[i].from_ms);
+      jw_int(jw, "to_ms", history[i].to_ms);
+      jw_int(jw, "errors", history[i].errors);
+      jw_object_end(jw);
+    }
+    jw_array_end(jw);
+  }
+
+  jw_object_end(jw);
+}
+
+/*
+ * Status JSON field groups changed since the net thread last took them.  Any thread can
+ * set them, starts as everything so the first broadcast is complete.
+ */
+static struct aqualinkdata *_status_aqdata = NULL;
+static atomic_uint _status_fields = STATUS_F_ALL;
+static atomic_uint _status_version = 0;
+
+#define IN_MEMBER(offset, member) ((offset) >= offsetof(struct aqualinkdata, member) && \
+                                   (offset) < offsetof(struct aqualinkdata, member) + sizeof(((struct aqualinkdata *)0)->member))
+
+void set_status_field_data(struct aqualinkdata *aqdata)
+{
+  _status_aqdata = aqdata;
+}
+
+// Which bit of the status JSON a changed value ends up in, everything if we don't know.
+// LEDs also give the light mode names (get_currentlight_mode_name() goes off the button's LED).
+static uint32_t status_field_group(const void *field)
+{
+  const struct aqualinkdata *aqdata = _status_aqdata;
+  size_t offset;
+
+  if (aqdata == NULL)
+    return STATUS_F_ALL;
+
+  if ((const char *)field < (const char *)aqdata || (const char *)field >= (const char *)(aqdata + 1)) {
+    // Virtual buttons have their LEDs outside aqualinkdata
+    for (int i=0; i < aqdata->total_buttons; i++) {
+      if (aqdata->aqbuttons[i].led != NULL && field == &aqdata->aqbuttons[i].led->state)
+        return STATUS_F_LEDS | STATUS_F_LIGHTS;
+    }
+    return STATUS_F_ALL;
+  }
+
+  offset = (const char *)field - (const char *)aqdata;
+
+  if (IN_MEMBER(offset, status_mask) || IN_MEMBER(offset, last_message) || IN_MEMBER(offset, last_display_message) ||
+      IN_MEMBER(offset, is_display_message_programming) || IN_MEMBER(offset, service_mode_state) ||
+      IN_MEMBER(offset, panel_rev) || IN_MEMBER(offset, panel_cpu) || IN_MEMBER(offset, battery) ||
+      IN_MEMBER(offset, active_thread))
+    return STATUS_F_MESSAGE;
+  if (IN_MEMBER(offset, date) || IN_MEMBER(offset, time))
+    return STATUS_F_DATETIME;
+  if (IN_MEMBER(offset, pool_htr_set_point) || IN_MEMBER(offset, spa_htr_set_point) ||
+      IN_MEMBER(offset, frz_protect_set_point) || IN_MEMBER(offset, chiller_set_point))
+    return STATUS_F_SETPOINTS;
+  if (IN_MEMBER(offset, air_temp) || IN_MEMBER(offset, pool_temp) || IN_MEMBER(offset, spa_temp))
+    return STATUS_F_TEMPS;
+  if (IN_MEMBER(offset, temp_units))
+    return STATUS_F_TEMPS | STATUS_F_SENSORS;
+  // SWG state and boost are also in leds
+  if (IN_MEMBER(offset, swg_percent) || IN_MEMBER(offset, swg_ppm) || IN_MEMBER(offset, swg_led_state) ||
+      IN_MEMBER(offset, boost) || IN_MEMBER(offset, boost_msg) || IN_MEMBER(offset, ar_swg_device_status))
+    return STATUS_F_SWG | STATUS_F_LEDS;
+  if (IN_MEMBER(offset, ph) || IN_MEMBER(offset, orp))
+    return STATUS_F_CHEM;
+  if (IN_MEMBER(offset, aqualinkleds))
+    return STATUS_F_LEDS | STATUS_F_LIGHTS;
+  if (IN_MEMBER(offset, frz_protect_state))
+    return STATUS_F_LEDS;
+  if (IN_MEMBER(offset, aqbuttons))
+    return STATUS_F_LEDS | STATUS_F_TIMERS | STATUS_F_ALTMODES | STATUS_F_LIGHTS;
+  if (IN_MEMBER(offset, pumps))
+    return STATUS_F_PUMPS;
+  if (IN_MEMBER(offset, lights))
+    return STATUS_F_LIGHTS;
+  if (IN_MEMBER(offset, sensors) || IN_MEMBER(offset, num_sensors))
+    return STATUS_F_SENSORS;
+
+  // Not in the table, send the lot rather than miss it
+  return STATUS_F_ALL;
+}
+
+// From SET_IF_CHANGED, field is whatever just changed
+void status_field_changed(const void *field)
+{
+  atomic_fetch_or(&_status_fields, status_field_group(field));
+  atomic_fetch_add(&_status_version, 1);
+  wakeup_net_services();
+}
+
+void status_fields_changed(uint32_t fields)
+{
+  atomic_fetch_or(&_status_fields, fields);
+  atomic_fetch_add(&_status_version, 1);
+  wakeup_net_services();
+}
+
+// Goes up on every change, unlike the fields it's never cleared
+uint32_t status_version()
+{
+  return atomic_load(&_status_version);
+}
+
+// Net thread, what's changed since it last asked
+uint32_t take_status_field_changes()
+{
+  return atomic_exchange(&_status_fields, 0);
+}
+
+/*
+ * Status JSON, either all of it (type status) or only the keys in fields (type status_delta).
+ */
+static int _build_aqualink_status_JSON(struct aqualinkdata *aqdata, char* buffer, int size, uint32_t fields, const char *type)
+{
+  json_writer jw;
+  char value[AQ_MSGLEN*2+1];
+  char key[32];
+  int i;
+
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_string(&jw, "type", type);
+  if (fields & STATUS_F_MESSAGE) {
+    jw_string(&jw, "status", getStatus(aqdata) );
+    jw_string(&jw, "panel_message", aqdata->last_message );
+    jw_string(&jw, "panel_type_full", getPanelString());
+    jw_string(&jw, "panel_type", getShortPanelString());
+    snprintf(value, sizeof(value), "%s %s", aqdata->panel_cpu, aqdata->panel_rev);
+    jw_string(&jw, "version", value);//8157 REV MMM",
+    jw_string(&jw, "aqualinkd_version", AQUALINKD_VERSION " (rev " GIT_HASH ")"); //1.0b,
+    frame_delay_JSON(&jw);
+
+    if (aqdata->battery == OK)
+      jw_string(&jw, "battery", JSON_OK );//"ok",
+    else
+      jw_string(&jw, "battery", JSON_LOW );//"ok",
+  }
+
+  if (fields & STATUS_F_DATETIME) {
+    jw_string(&jw, "date", aqdata->date );//"09/01/16 THU",
+    jw_string(&jw, "time", aqdata->time );//"1:16 PM",
+  }
   
-  length += sprintf(buffer+length, ",\"pool_htr_set_pnt\":\"%d\"",aqdata->pool_htr_set_point );//"85",
-  length += sprintf(buffer+length, ",\"spa_htr_set_pnt\":\"%d\"",aqdata->spa_htr_set_point );//"99",
-  //length += sprintf(buffer+length, ",\"freeze_protection":\"%s\"",aqdata->frz_protect_set_point );//"off",
-  length += sprintf(buffer+length, ",\"frz_protect_set_pnt\":\"%d\"",aqdata->frz_protect_set_point );//"0",
-  if ( (ENABLE_CHILLER || aqdata->chiller_set_point != TEMP_UNKNOWN) && aqdata->chiller_button != NULL) {
-    length += sprintf(buffer+length, ",\"chiller_set_pnt\":\"%d\"",aqdata->chiller_set_point );//"0",
-    if (isVBUTTON_CHILLER(aqdata->chiller_button->special_mask))
-      length += sprintf(buffer+length, ",\"chiller_mode\":\"%s\"",((altlabel_detail *)aqdata->chiller_button->special_mask_ptr)->in_alt_mode?"cool":"heat");
+  if (fields & STATUS_F_SETPOINTS) {
+    jw_string_int(&jw, "pool_htr_set_pnt", aqdata->pool_htr_set_point );//"85",
+    jw_string_int(&jw, "spa_htr_set_pnt", aqdata->spa_htr_set_point );//"99",
+    jw_string_int(&jw, "frz_protect_set_pnt", aqdata->frz_protect_set_point );//"0",
+    if ( (ENABLE_CHILLER || aqdata->chiller_set_point != TEMP_UNKNOWN) && aqdata->chiller_button != NULL) {
+      jw_string_int(&jw, "chiller_set_pnt", aqdata->chiller_set_point );//"0",
+      if (isVBUTTON_CHILLER(aqdata->chiller_button->special_mask))
+        jw_string(&jw, "chiller_mode", ((altlabel_detail *)aqdata->chiller_button->special_mask_ptr)->in_alt_mode?"cool":"heat");
+    }
   }
   
-  if ( aqdata->air_temp == TEMP_UNKNOWN )
-    length += sprintf(buffer+length, ",\"air_temp\":\" \"");
-  else
-    length += sprintf(buffer+length, ",\"air_temp\":\"%d\"",aqdata->air_temp );
+  if (fields & STATUS_F_TEMPS) {
+    if ( aqdata->air_temp == TEMP_UNKNOWN )
+      jw_string(&jw, "air_temp", " ");
+    else
+      jw_string_int(&jw, "air_temp", aqdata->air_temp );
   
-  if ( aqdata->pool_temp == TEMP_UNKNOWN )
-    length += sprintf(buffer+length, ",\"pool_temp\":\" \"");
-  else
-    length += sprintf(buffer+length, ",\"pool_temp\":\"%d\"",aqdata->pool_temp );
+    if ( aqdata->pool_temp == TEMP_UNKNOWN )
+      jw_string(&jw, "pool_temp", " ");
+    else
+      jw_string_int(&jw, "pool_temp", aqdata->pool_temp );
     
-  if ( aqdata->spa_temp == TEMP_UNKNOWN )
-    length += sprintf(buffer+length, ",\"spa_temp\":\" \"");
-  else
-    length += sprintf(buffer+length, ",\"spa_temp\":\"%d\"",aqdata->spa_temp );
+    if ( aqdata->spa_temp == TEMP_UNKNOWN )
+      jw_string(&jw, "spa_temp", " ");
+    else
+      jw_string_int(&jw, "spa_temp", aqdata->spa_temp );
 
-  if (aqdata->swg_led_state != LED_S_UNKNOWN) {
-    if ( aqdata->swg_percent != TEMP_UNKNOWN )
-      length += sprintf(buffer+length, ",\"swg_percent\":\"%d\"",aqdata->swg_percent );
-  
-    if ( aqdata->swg_ppm != TEMP_UNKNOWN )
-      length += sprintf(buffer+length, ",\"swg_ppm\":\"%d\"",aqdata->swg_ppm );
+    if ( aqdata->temp_units == FAHRENHEIT )
+      jw_string(&jw, "temp_units", JSON_FAHRENHEIT );
+    else if ( aqdata->temp_units == CELSIUS )
+      jw_string(&jw, "temp_units", JSON_CELSIUS);
+    else
+      jw_string(&jw, "temp_units", JSON_UNKNOWN );
   }
 
-  if ( aqdata->temp_units == FAHRENHEIT )
-    length += sprintf(buffer+length, ",\"temp_units\":\"%s\"",JSON_FAHRENHEIT );
-  else if ( aqdata->temp_units == CELSIUS )
-    length += sprintf(buffer+length, ",\"temp_units\":\"%s\"", JSON_CELSIUS);
-  else
-    length += sprintf(buffer+length, ",\"temp_units\":\"%s\"",JSON_UNKNOWN );
+  if (fields & STATUS_F_SWG) {
+    if (aqdata->swg_led_state != LED_S_UNKNOWN) {
+      if ( aqdata->swg_percent != TEMP_UNKNOWN )
+        jw_string_int(&jw, "swg_percent", aqdata->swg_percent );
   
-  if (aqdata->battery == OK)
-    length += sprintf(buffer+length, ",\"battery\":\"%s\"",JSON_OK );//"ok",
-  else
-    length += sprintf(buffer+length, ",\"battery\":\"%s\"",JSON_LOW );//"ok",
+      if ( aqdata->swg_ppm != TEMP_UNKNOWN )
+        jw_string_int(&jw, "swg_ppm", aqdata->swg_ppm );
+    }
 
-  if ( aqdata->swg_percent == 101 )
-    length += sprintf(buffer+length, ",\"swg_boost_msg\":\"%s\"",aqdata->boost_msg );
+    if ( aqdata->swg_percent == 101 )
+      jw_string(&jw, "swg_boost_msg", aqdata->boost_msg );
+
+    //if ( READ_RSDEV_SWG )
+      jw_string_int(&jw, "swg_fullstatus", aqdata->ar_swg_device_status);
+  }
   
-  if ( aqdata->ph != TEMP_UNKNOWN )
-    length += sprintf(buffer+length, ",\"chem_ph\":\"%.1f\"",aqdata->ph );
+  if (fields & STATUS_F_CHEM) {
+    if ( aqdata->ph != TEMP_UNKNOWN )
+      jw_string_float(&jw, "chem_ph", aqdata->ph, 1 );
     
-  if ( aqdata->orp != TEMP_UNKNOWN )
-    length += sprintf(buffer+length, ",\"chem_orp\":\"%d\"",aqdata->orp );
-
-  //if ( READ_RSDEV_SWG )
-    length += sprintf(buffer+length, ",\"swg_fullstatus\": \"%d\"", aqdata->ar_swg_device_status);
+    if ( aqdata->orp != TEMP_UNKNOWN )
+      jw_string_int(&jw, "chem_orp", aqdata->orp );
+  }
 
-  length += sprintf(buffer+length, ",\"leds\":{" );
-  for (i=0; i < aqdata->total_buttons; i++) 
-  {
-    char *state = LED2text(aqdata->aqbuttons[i].led->state);
-    length += sprintf(buffer+length, "\"%s\": \"%s\"", aqdata->aqbuttons[i].name, state);
+  if (fields & STATUS_F_LEDS) {
+    jw_object_begin(&jw, "leds");
+    for (i=0; i < aqdata->total_buttons; i++) 
+    {
+      jw_string(&jw, aqdata->aqbuttons[i].name, LED2text(aqdata->aqbuttons[i].led->state));
+    }
 
-    if (i+1 < aqdata->total_buttons)
-      length += sprintf(buffer+length, "," );
+    if ( aqdata->swg_percent != TEMP_UNKNOWN && aqdata->swg_led_state != LED_S_UNKNOWN ) {
+      jw_string(&jw, SWG_TOPIC, LED2text(aqdata->swg_led_state));
+      jw_string(&jw, SWG_BOOST_TOPIC, aqdata->boost?JSON_ON:JSON_OFF);
+    }
+    //NSF Need to come back and read what the display states when Freeze protection is on
+    if ( aqdata->frz_protect_set_point != TEMP_UNKNOWN || ENABLE_FREEZEPROTECT ) {
+      jw_string(&jw, FREEZE_PROTECT, LED2text(aqdata->frz_protect_state) );
+    }
+    // Add Chiller if exists
+    if (aqdata->chiller_button != NULL) {
+      jw_string(&jw, CHILLER, LED2text(aqdata->chiller_button->led->state) );
+    }
+    jw_object_end(&jw);
   }
 
-  if ( aqdata->swg_percent != TEMP_UNKNOWN && aqdata->swg_led_state != LED_S_UNKNOWN ) {
-    //length += sprintf(buffer+length, ", \"%s\": \"%s\"", SWG_TOPIC, LED2text(get_swg_led_state(aqdata)));
-    length += sprintf(buffer+length, ", \"%s\": \"%s\"", SWG_TOPIC, LED2text(aqdata->swg_led_state));
-    //length += sprintf(buffer+length, ", \"%s\": \"%s\"", SWG_TOPIC, aqdata->ar_swg_status == SWG_STATUS_OFF?JSON_OFF:JSON_ON);
-    length += sprintf(buffer+length, ", \"%s\": \"%s\"", SWG_BOOST_TOPIC, aqdata->boost?JSON_ON:JSON_OFF);
-  }
-  //NSF Need to come back and read what the display states when Freeze protection is on
-  if ( aqdata->frz_protect_set_point != TEMP_UNKNOWN || ENABLE_FREEZEPROTECT ) {
-    //length += sprintf(buffer+length, ", \"%s\": \"%s\"", FREEZE_PROTECT, aqdata->frz_protect_state==ON?JSON_ON:JSON_ENABLED);
-    length += sprintf(buffer+length, ", \"%s\": \"%s\"", FREEZE_PROTECT, LED2text(aqdata->frz_protect_state) );
-  }
-  // Add Chiller if exists
-  if (aqdata->chiller_button != NULL) {
-    length += sprintf(buffer+length, ", \"%s\": \"%s\"", CHILLER, LED2text(aqdata->chiller_button->led->state) );
-  }
-  //length += sprintf(buffer+length, "}, \"extra\":{" );
-  length += sprintf(buffer+length, "},");
-
-  // NSF Check below needs to be for VSP Pump (any state), not just known state
-  for (i=0; i < aqdata->num_pumps; i++) {
-    /*  NSF There is a problem here that needs to be fixed.
-printf("Loop %d Message '%s'\n",i,buffer);
-printf("Pump Label %s\n",aqdata->pumps[i].button->label);
-printf("Pump Name %s\n",aqdata->pumps[i].button->name);
-printf("Pump RPM %d\n",aqdata->pumps[i].rpm);
-printf("Pump GPM %d\n",aqdata->pumps[i].gpm);
-printf("Pump GPM %d\n",aqdata->pumps[i].watts);
-printf("Pump Type %d\n",aqdata->pumps[i].pumpType);
-    */
-    //if (aqdata->pumps[i].pumpType != PT_UNKNOWN && (aqdata->pumps[i].rpm != TEMP_UNKNOWN || aqdata->pumps[i].gpm != TEMP_UNKNOWN || aqdata->pumps[i].watts != TEMP_UNKNOWN)) {
-    if (aqdata->pumps[i].pumpType != PT_UNKNOWN) {
-      length += sprintf(buffer+length, "\"Pump_%d\":{\"name\":\"%s\",\"id\":\"%s\",\"RPM\":\"%d\",\"GPM\":\"%d\",\"Watts\":\"%d\",\"Pump_Type\":\"%s\",\"Status\":\"%d\"},",
-                        i+1,aqdata->pumps[i].button->label,aqdata->pumps[i].button->name,aqdata->pumps[i].rpm,aqdata->pumps[i].gpm,aqdata->pumps[i].watts,
-                        (aqdata->pumps[i].pumpType==VFPUMP?"vfPump":(aqdata->pumps[i].pumpType==VSPUMP?"vsPump":"ePump")),
-                        getPumpStatus(i, aqdata));
+  if (fields & STATUS_F_PUMPS) {
+    // NSF Check below needs to be for VSP Pump (any state), not just known state
+    for (i=0; i < aqdata->num_pumps; i++) {
+      //if (aqdata->pumps[i].pumpType != PT_UNKNOWN && (aqdata->pumps[i].rpm != TEMP_UNKNOWN || aqdata->pumps[i].gpm != TEMP_UNKNOWN || aqdata->pumps[i].watts != TEMP_UNKNOWN)) {
+      if (aqdata->pumps[i].pumpType != PT_UNKNOWN) {
+        snprintf(key, sizeof(key), "Pump_%d", i+1);
+        jw_object_begin(&jw, key);
+        jw_string(&jw, "name", aqdata->pumps[i].button->label);
+        jw_string(&jw, "id", aqdata->pumps[i].button->name);
+        jw_string_int(&jw, "RPM", aqdata->pumps[i].rpm);
+        jw_string_int(&jw, "GPM", aqdata->pumps[i].gpm);
+        jw_string_int(&jw, "Watts", aqdata->pumps[i].watts);
+        jw_string(&jw, "Pump_Type", pumpType2JSON(aqdata->pumps[i].pumpType));
+        jw_string_int(&jw, "Status", getPumpStatus(i, aqdata));
+        jw_object_end(&jw);
+      }
     }
   }
-  if (buffer[length-1] == ',')
-    length--;
 
-  length += sprintf(buffer+length, ",\"timers\":{" );
-  for (i=0; i < aqdata->total_buttons; i++) 
-  {
-    if ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
-      length += sprintf(buffer+length, "\"%s\": \"on\",", aqdata->aqbuttons[i].name);
-      //length += sprintf(buffer+length, "\"%s_duration\": \"%d\",", aqdata->aqbuttons[i].name, get_timer_left(&aqdata->aqbuttons[i]) );
+  if (fields & STATUS_F_TIMERS) {
+    jw_object_begin(&jw, "timers");
+    for (i=0; i < aqdata->total_buttons; i++) 
+    {
+      if ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
+        jw_string(&jw, aqdata->aqbuttons[i].name, "on");
+      }
     }
-  }
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "}");
+    jw_object_end(&jw);
 
-  length += sprintf(buffer+length, ",\"timer_durations\":{" );
-  for (i=0; i < aqdata->total_buttons; i++) 
-  {
-    if ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
-      //length += sprintf(buffer+length, "\"%s\": \"%d\",", aqdata->aqbuttons[i].name, get_timer_left(&aqdata->aqbuttons[i]) );
-      length += sprintf(buffer+length, "\"%s\": \"%u\",", aqdata->aqbuttons[i].name, get_timer_left_sec(&aqdata->aqbuttons[i]) );
+    jw_object_begin(&jw, "timer_durations");
+    for (i=0; i < aqdata->total_buttons; i++) 
+    {
+      if ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
+        jw_string_int(&jw, aqdata->aqbuttons[i].name, get_timer_left_sec(&aqdata->aqbuttons[i]) );
+      }
     }
+    jw_object_end(&jw);
   }
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "}");
 
-  length += sprintf(buffer+length, ",\"light_program_names\":{" );
-  for (i=0; i < aqdata->num_lights; i++) 
-  {
-    if (aqdata->lights[i].lightType == LC_DIMMER2) {
-      length += sprintf(buffer+length, "\"%s\": \"%d%%\",", aqdata->lights[i].button->name, aqdata->lights[i].currentValue );
-    } else {
-      //length += sprintf(buffer+length, "\"%s\": \"%s\",", aqdata->lights[i].button->name, light_mode_name(aqdata->lights[i].lightType, aqdata->lights[i].currentValue, RSSADAPTER) );
-      length += sprintf(buffer+length, "\"%s\": \"%s\",", aqdata->lights[i].button->name, get_currentlight_mode_name(aqdata->lights[i], RSSADAPTER) );
+  if (fields & STATUS_F_LIGHTS) {
+    jw_object_begin(&jw, "light_program_names");
+    for (i=0; i < aqdata->num_lights; i++) 
+    {
+      if (aqdata->lights[i].lightType == LC_DIMMER2) {
+        snprintf(value, sizeof(value), "%d%%", aqdata->lights[i].currentValue);
+        jw_string(&jw, aqdata->lights[i].button->name, value);
+      } else {
+        //jw_string(&jw, aqdata->lights[i].button->name, light_mode_name(aqdata->lights[i].lightType, aqdata->lights[i].currentValue, RSSADAPTER) );
+        jw_string(&jw, aqdata->lights[i].button->name, get_currentlight_mode_name(aqdata->lights[i], RSSADAPTER) );
+      }
     }
+    jw_object_end(&jw);
   }
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "}");
 
 
-  length += sprintf(buffer+length, ",\"alternate_modes\":{" );
-  if (aqdata->virtual_button_start > 0) {
-    for (i=aqdata->virtual_button_start; i < aqdata->total_buttons; i++) 
-    {
-      if (isVBUTTON_ALTLABEL(aqdata->aqbuttons[i].special_mask)) {
-        length += sprintf(buffer+length, "\"%s\": \"%s\",",aqdata->aqbuttons[i].name, ((altlabel_detail *)aqdata->aqbuttons[i].special_mask_ptr)->in_alt_mode?JSON_ON:JSON_OFF );
+  if (fields & STATUS_F_ALTMODES) {
+    jw_object_begin(&jw, "alternate_modes");
+    if (aqdata->virtual_button_start > 0) {
+      for (i=aqdata->virtual_button_start; i < aqdata->total_buttons; i++) 
+      {
+        if (isVBUTTON_ALTLABEL(aqdata->aqbuttons[i].special_mask)) {
+          jw_string(&jw, aqdata->aqbuttons[i].name, ((altlabel_detail *)aqdata->aqbuttons[i].special_mask_ptr)->in_alt_mode?JSON_ON:JSON_OFF );
+        }
       }
     }
-    if (buffer[length-1] == ',')
-      length--;
+    jw_object_end(&jw);
   }
-  length += sprintf(buffer+length, "}");
 
 
-  length += sprintf(buffer+length, ",\"sensors\":{" );
-  for (i=0; i < aqdata->num_sensors; i++) 
-  {
-    //printf("Sensor value %f %.2f\n",aqdata->sensors[i].value,aqdata->sensors[i].value);
-    
-    if (aqdata->sensors[i].value != TEMP_UNKNOWN) {
-      //length += sprintf(buffer+length, "\"%s\": \"%.2f\",", aqdata->sensors[i].label, aqdata->sensors[i].value );
-      if ( aqdata->temp_units == FAHRENHEIT && getTemperatureUOM(aqdata->sensors[i].uom) == CELSIUS ) {
-        length += sprintf(buffer+length, "\"%s\": \"%.1f\",", aqdata->sensors[i].ID, degCtoF(aqdata->sensors[i].value) );
-      } else {
-        length += sprintf(buffer+length, "\"%s\": \"%.1f\",", aqdata->sensors[i].ID, aqdata->sensors[i].value );
+  if (fields & STATUS_F_SENSORS) {
+    jw_object_begin(&jw, "sensors");
+    for (i=0; i < aqdata->num_sensors; i++) 
+    {
+      if (aqdata->sensors[i].value != TEMP_UNKNOWN) {
+        if ( aqdata->temp_units == FAHRENHEIT && getTemperatureUOM(aqdata->sensors[i].uom) == CELSIUS ) {
+          jw_string_float(&jw, aqdata->sensors[i].ID, degCtoF(aqdata->sensors[i].value), 1 );
+        } else {
+          jw_string_float(&jw, aqdata->sensors[i].ID, aqdata->sensors[i].value, 1 );
+        }
       }
     }
+    jw_object_end(&jw);
   }
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "}");
 
+  jw_object_end(&jw);
 
-  length += sprintf(buffer+length, "}" );
-  
-  buffer[length] = '\0';
-  
-  return strlen(buffer);
+  return jw_finish(&jw, type);
+}
+
+int build_aqualink_status_JSON(struct aqualinkdata *aqdata, char* buffer, int size)
+{
+  return _build_aqualink_status_JSON(aqdata, buffer, size, STATUS_F_ALL, "status");
 }
 
+// Only the keys for fields (STATUS_F_*), for websockets that asked for deltas.
+int build_aqualink_status_delta_JSON(struct aqualinkdata *aqdata, char* buffer, int size, uint32_t fields)
+{
+  return _build_aqualink_status_JSON(aqdata, buffer, size, fields, "status_delta");
+}
+
+
 int build_aux_labels_JSON(struct aqualinkdata *aqdata, char* buffer, int size)
 {
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  json_writer jw;
   int i;
   
-  length += sprintf(buffer+length, "{\"type\": \"aux_labels\"");
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_string(&jw, "type", "aux_labels");
   
   for (i=0; i < aqdata->total_buttons; i++) 
   {
-    length += sprintf(buffer+length, ",\"%s\": \"%s\"", aqdata->aqbuttons[i].name, aqdata->aqbuttons[i].label);
+    jw_string(&jw, aqdata->aqbuttons[i].name, aqdata->aqbuttons[i].label);
   }
   
-  length += sprintf(buffer+length, "}");
-  
-  return length;
-  
-//printf("%s\n",buffer);
+  jw_object_end(&jw);
   
-  //return strlen(buffer);
+  return jw_finish(&jw, "aux_labels");
 }
 /*
 const char* emulationtype2name(emulation_type type) {
@@ -978,50 +1050,42 @@ const char* emulationtype2name(emulation_type type) {
 */
 int build_aqualink_simulator_packet_JSON(struct aqualinkdata *aqdata, char* buffer, int size)
 {
-  memset(&buffer[0], 0, size);
-  int length = 0;
+  json_writer jw;
   int i;
 
-  length += sprintf(buffer+length, "{\"type\": \"simpacket\"");
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_string(&jw, "type", "simpacket");
 
   if (aqdata->simulator_packet[PKT_DEST] >= 0x40 && aqdata->simulator_packet[PKT_DEST] <= 0x43) {
-    length += sprintf(buffer+length, ",\"simtype\": \"onetouch\"");
+    jw_string(&jw, "simtype", "onetouch");
   } else if (aqdata->simulator_packet[PKT_DEST] >= 0x08 && aqdata->simulator_packet[PKT_DEST] <= 0x0a) {
-    length += sprintf(buffer+length, ",\"simtype\": \"allbutton\"");
+    jw_string(&jw, "simtype", "allbutton");
   } else if (aqdata->simulator_packet[PKT_DEST] >= 0x30 && aqdata->simulator_packet[PKT_DEST] <= 0x33) {
-    length += sprintf(buffer+length, ",\"simtype\": \"iaqtouch\"");
+    jw_string(&jw, "simtype", "iaqtouch");
   } else if (aqdata->simulator_packet[PKT_DEST] >= 0x60 && aqdata->simulator_packet[PKT_DEST] <= 0x63) {
-    length += sprintf(buffer+length, ",\"simtype\": \"aquapda\"");
+    jw_string(&jw, "simtype", "aquapda");
   } else {
-    length += sprintf(buffer+length, ",\"simtype\": \"unknown\"");
+    jw_string(&jw, "simtype", "unknown");
   }
-  //if (aqdata->simulator_packet[i][])
-  //length += sprintf(buffer+length, ",\"simtype\": \"onetouch\"");
 
-  length += sprintf(buffer+length, ",\"raw\": [");
+  jw_array_begin(&jw, "raw");
   for (i=0; i < aqdata->simulator_packet_length; i++) 
   {
-    length += sprintf(buffer+length, "\"0x%02hhx\",", aqdata->simulator_packet[i]);
+    jw_string_hex(&jw, NULL, aqdata->simulator_packet[i]);
   }
-  if (buffer[length-1] == ',')
-    length--;
-  length += sprintf(buffer+length, "]");
+  jw_array_end(&jw);
   
-  length += sprintf(buffer+length, ",\"dec\": [");
+  jw_array_begin(&jw, "dec");
   for (i=0; i < aqdata->simulator_packet_length; i++) 
   {
-    length += sprintf(buffer+length, "%d,", aqdata->simulator_packet[i]);
+    jw_int(&jw, NULL, aqdata->simulator_packet[i]);
   }
-  if (buffer[length-1] == ',')
-    length--;
+  jw_array_end(&jw);
 
-  length += sprintf(buffer+length, "]");
+  jw_object_end(&jw);
 
-  length += sprintf(buffer+length, "}");
-
-//printf("Buffer=%d, used=%d, OUT='%s'\n",size,length,buffer);
-
-  return length;
+  return jw_finish(&jw, "simpacket");
 }
 
 // WS Received '{"parameter":"SPA_HTR","value":99}'
@@ -1194,94 +1258,96 @@ int json_cfg_element_OLD(char* buffer, int size, const char *name, const void *v
 
 //#ifdef CONFIG_EDITOR
 
-int json_cfg_element(char* buffer, int size, const char *name, const void *value, cfg_value_type type, uint16_t mask, char *valid_val, uint8_t config_mask) {
-  int result = 0;
-
-  char valid_values[256];
-  char adv[256];
-  int adv_size=0;
-
-  // We shouldn't get CFG_HIDE here. Since we can't exit with 0, simply add a space
+void json_cfg_element(json_writer *jw, const char *name, const void *value, cfg_value_type type, uint16_t mask, char *valid_val, uint8_t config_mask) {
+  // We shouldn't get CFG_HIDE here, simply leave it out
   if (isMASKSET(config_mask, CFG_HIDE)) {
-    return snprintf(buffer, size, " ");
-  }
-
-  if (valid_val != NULL) {
-    sprintf(valid_values,",\"valid values\":%s",valid_val);
-  }
-
-  adv_size = sprintf(adv,",\"advanced\": \"%s\"", isMASKSET(config_mask, CFG_GRP_ADVANCED)?"yes":"no");
-  
-  if (isMASKSET(config_mask, CFG_READONLY))
-    adv_size += sprintf(adv+adv_size,",\"readonly\": \"yes\"");
-
-  if (isMASKSET(config_mask, CFG_FORCE_RESTART)) {
-    adv_size += sprintf(adv+adv_size,",\"force_restart\": \"yes\"");
-    if ( strcmp(name, CFG_N_panel_type) == 0 ) {
-      adv_size += sprintf(adv+adv_size,",\"force_restart_msg\": \"If you change panel_type, you must save and reload config for correct config options to show!\\nYou must also restart AqualinkD once finished!\"");
-    }
-
+    return;
   }
 
-  if (isMASKSET(config_mask, CFG_ALLOW_BLANK))
-    adv_size += sprintf(adv+adv_size,",\"allow_blank\": \"yes\"");
-
-   if (isMASKSET(config_mask, CFG_GREYED_OUT))
-    adv_size += sprintf(adv+adv_size,",\"greyed_out\": \"yes\"");
-  
+  jw_object_begin(jw, name);
 
   switch(type){
     case CFG_INT:
       if (*(int *)value == AQ_UNKNOWN) { 
-        result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"\", \"type\":\"int\" %s %s}", name, (valid_val==NULL?"":valid_values),adv );
+        jw_string(jw, "value", "");
       } else {
-        result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%d\", \"type\":\"int\" %s %s}", name, *(int *)value, (valid_val==NULL?"":valid_values),adv );
+        jw_string_int(jw, "value", *(int *)value);
       }
+      jw_string(jw, "type", "int");
     break;
     case CFG_STRING:
       if (*(char **)value == NULL) {
-        result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"\", \"type\":\"string\" %s %s}", name, (valid_val==NULL?"":valid_values),adv );
+        jw_string(jw, "value", "");
+        jw_string(jw, "type", "string");
+      } else if (isMASK_SET(config_mask, CFG_PASSWD_MASK)) {
+        jw_string(jw, "value", PASSWD_MASK_TEXT);
+        jw_string(jw, "type", "string");
+        jw_string(jw, "passwd_mask", "yes");
+        valid_val = NULL;
       } else {
-        if (isMASK_SET(config_mask, CFG_PASSWD_MASK)) {
-          result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"string\", \"passwd_mask\":\"yes\" %s}", name, PASSWD_MASK_TEXT,adv);
-        } else {
-          result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"string\" %s %s}", name, *(char **)value, (valid_val==NULL?"":valid_values),adv );
-        }
+        jw_string(jw, "value", *(char **)value);
+        jw_string(jw, "type", "string");
       }
     break;
     case CFG_BOOL:
-      //result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"bool\" %s}", name, bool2text(*(bool *)value), (valid_val==NULL?"":valid_values));
-      result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"bool\", \"valid values\": %s %s}", name, bool2text(*(bool *)value), CFG_V_BOOL, adv);
+      jw_string(jw, "value", bool2text(*(bool *)value));
+      jw_string(jw, "type", "bool");
+      valid_val = CFG_V_BOOL;
     break;
     case CFG_HEX:
-      result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"0x%02hhx\", \"type\":\"hex\" %s %s}", name, *(unsigned char *)value, (valid_val==NULL?"":valid_values), adv );
+      jw_string_hex(jw, "value", *(unsigned char *)value);
+      jw_string(jw, "type", "hex");
     break;
     case CFG_FLOAT:
-      result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%f\", \"type\":\"float\" %s %s}", name, *(float *)value, (valid_val==NULL?"":valid_values), adv );
+      jw_string_float(jw, "value", *(float *)value, 6);
+      jw_string(jw, "type", "float");
     break;
     case CFG_BITMASK:
-      result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"bool\", \"valid values\": %s %s}", name, (*(uint16_t *)value & mask) == mask? bool2text(true):bool2text(false) ,CFG_V_BOOL, adv );
+      jw_string(jw, "value", (*(uint16_t *)value & mask) == mask? bool2text(true):bool2text(false));
+      jw_string(jw, "type", "bool");
+      valid_val = CFG_V_BOOL;
     break;
     case CFG_SPECIAL:
       if (strncasecmp(name, CFG_N_log_level, strlen(CFG_N_log_level)) == 0) {
-        //fprintf(fp, "%s=%s\n", _cfgParams[i].name, loglevel2cgn_name(_aqconfig_.log_level));
-        //result = json_cfg_element(buffer+length, size-length, CFG_N_log_level, &stringptr, CFG_STRING, "[\"DEBUG\", \"INFO\", \"NOTICE\", \"WARNING\", \"ERROR\"]"));
-        //stringptr = loglevel2cgn_name(_aqconfig_.log_level);
-        result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"string\" %s %s}",name,loglevel2cgn_name(*(int *)value), ",\"valid values\":[\"DEBUG\", \"INFO\", \"NOTICE\", \"WARNING\", \"ERROR\"]", adv);
+        jw_string(jw, "value", loglevel2cgn_name(*(int *)value));
+        jw_string(jw, "type", "string");
+        valid_val = "[\"DEBUG\", \"INFO\", \"NOTICE\", \"WARNING\", \"ERROR\"]";
       } else if (strncasecmp(name, CFG_N_panel_type, strlen(CFG_N_panel_type)) == 0) {
-        result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"%s\", \"type\":\"string\" %s}",name,getShortPanelString(), adv);
+        jw_string(jw, "value", getShortPanelString());
+        jw_string(jw, "type", "string");
+        valid_val = NULL;
       } else {
-        result = snprintf(buffer, size, ",\"%s\" : {\"value\":\"Something went wrong\", \"type\":\"string\"}",name);
+        jw_string(jw, "value", "Something went wrong");
+        jw_string(jw, "type", "string");
+        jw_object_end(jw);
+        return;
       }
     break;
   }
 
-  if (result <= 0 || result >= size) {
-    LOG(NET_LOG,LOG_ERR, "Buffer full, result truncated! size left=%d needed=%d @ element %s\n",size,result,name);     
-    return 0;
+  if (valid_val != NULL)
+    jw_raw(jw, "valid values", valid_val);
+
+  jw_string(jw, "advanced", isMASKSET(config_mask, CFG_GRP_ADVANCED)?"yes":"no");
+
+  if (isMASKSET(config_mask, CFG_READONLY))
+    jw_string(jw, "readonly", "yes");
+
+  if (isMASKSET(config_mask, CFG_FORCE_RESTART)) {
+    jw_string(jw, "force_restart", "yes");
+    if ( strcmp(name, CFG_N_panel_type) == 0 ) {
+      // Raw as it has a \n in it, json_chars() would take that out.
+      jw_raw(jw, "force_restart_msg", "\"If you change panel_type, you must save and reload config for correct config options to show!\\nYou must also restart AqualinkD once finished!\"");
+    }
   }
 
-  return result;
+  if (isMASKSET(config_mask, CFG_ALLOW_BLANK))
+    jw_string(jw, "allow_blank", "yes");
+
+  if (isMASKSET(config_mask, CFG_GREYED_OUT))
+    jw_string(jw, "greyed_out", "yes");
+
+  jw_object_end(jw);
 }
 
 
@@ -1308,37 +1374,21 @@ const char *pumpType2String(pump_type ptype) {
 
 int build_aqualink_config_JSON(char* buffer, int size, struct aqualinkdata *aqdata)
 {
-  memset(&buffer[0], 0, size);
-  int length = 0;
-  int result;
+  json_writer jw;
   int i;
   char buf[256];
   char buf1[256];
   const char *stringptr;
-  int delectCharAt = 0;
 
-  if ((result = snprintf(buffer+length, size-length, "{\"type\": \"config\"")) < 0 || result >= size-length) {
-    length += snprintf(buffer+length, size-length, "}");
-    return length;
-  } else {
-    length += result;
-  }
-/*
-  if ((result = snprintf(buffer+length, size-length, ",\"status\": \"!!!! NOT FULLY IMPLIMENTED YET !!!!\"")) < 0 || result >= size-length) {
-    length += snprintf(buffer+length, size-length, "}");
-    return length;
-  } else {
-    length += result;
-  }
-*/
-  if ((result = snprintf(buffer+length, size-length, ",\"max_pumps\": \"%d\",\"max_lights\": \"%d\",\"max_sensors\": \"%d\",\"max_light_programs\": \"%d\",\"max_vbuttons\": \"%d\"",
-                         MAX_PUMPS,MAX_LIGHTS,MAX_SENSORS,LIGHT_COLOR_OPTIONS-1, (TOTAL_BUTTONS - aqdata->virtual_button_start) )) < 0 || result >= size-length) {
-    length += snprintf(buffer+length, size-length, "}");
-    return length;
-  } else {
-    length += result;
-  }
+  jw_init(&jw, buffer, size);
+  jw_object_begin(&jw, NULL);
+  jw_string(&jw, "type", "config");
 
+  jw_string_int(&jw, "max_pumps", MAX_PUMPS);
+  jw_string_int(&jw, "max_lights", MAX_LIGHTS);
+  jw_string_int(&jw, "max_sensors", MAX_SENSORS);
+  jw_string_int(&jw, "max_light_programs", LIGHT_COLOR_OPTIONS-1);
+  jw_string_int(&jw, "max_vbuttons", (TOTAL_BUTTONS - aqdata->virtual_button_start));
 
   //#ifdef CONFIG_DEV_TEST
   for (int i=0; i <= _numCfgParams; i++) {
@@ -1352,65 +1402,41 @@ int build_aqualink_config_JSON(char* buffer, int size, struct aqualinkdata *aqda
       continue;
     }
 
-    if ((result = json_cfg_element(buffer+length, size-length, _cfgParams[i].name, _cfgParams[i].value_ptr, _cfgParams[i].value_type, _cfgParams[i].mask, _cfgParams[i].valid_values, _cfgParams[i].config_mask)) <= 0) {
-      LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-      return length;
-    } else {
-      length += result;
-    }
+    json_cfg_element(&jw, _cfgParams[i].name, _cfgParams[i].value_ptr, _cfgParams[i].value_type, _cfgParams[i].mask, _cfgParams[i].valid_values, _cfgParams[i].config_mask);
+    if (jw.truncated)
+      return jw_finish(&jw, "config");
   }
 
   for (i = 1; i <= aqdata->num_sensors; i++)
   {
-    length += sprintf(buffer+length, ",\"sensor_%.2d\":{ \"advanced\":\"yes\",",i );
-    // The next json_cfg_element() call will add a , at the beginning, so save the next char index so we can delete it later.
-    delectCharAt = length;
+    sprintf(buf,"sensor_%.2d", i);
+    jw_object_begin(&jw, buf);
+    jw_string(&jw, "advanced", "yes");
 
-    //fprintf(fp,"\nsensor_%.2d_path=%s\n",i+1,aqdata->sensors->path);
-    //fprintf(fp,"sensor_%.2d_label=%s\n",i+1,aqdata->sensors->label);
-    //fprintf(fp,"sensor_%.2d_factor=%f\n",i+1,aqdata->sensors->factor);
     sprintf(buf,"sensor_%.2d_path", i);
-    if ((result = json_cfg_element(buffer+length, size-length, buf, &aqdata->sensors[i-1].path, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED)) <= 0)
-      return length;
-    else
-      length += result;
+    json_cfg_element(&jw, buf, &aqdata->sensors[i-1].path, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED);
   
     sprintf(buf,"sensor_%.2d_label", i);
-    if ((result = json_cfg_element(buffer+length, size-length, buf, &aqdata->sensors[i-1].label, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED)) <= 0)
-      return length;
-    else
-      length += result;
+    json_cfg_element(&jw, buf, &aqdata->sensors[i-1].label, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED);
 
     sprintf(buf,"sensor_%.2d_factor", i);
-    if ((result = json_cfg_element(buffer+length, size-length, buf, &aqdata->sensors[i-1].factor, CFG_FLOAT, 0, NULL, CFG_GRP_ADVANCED)) <= 0)
-      return length;
-    else
-      length += result;
+    json_cfg_element(&jw, buf, &aqdata->sensors[i-1].factor, CFG_FLOAT, 0, NULL, CFG_GRP_ADVANCED);
 
     sprintf(buf,"sensor_%.2d_uom", i);
-    if ((result = json_cfg_element(buffer+length, size-length, buf, &aqdata->sensors[i-1].uom, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED)) <= 0)
-      return length;
-    else
-      length += result;
-      //(&aqdata->sensors[i-1].uom==NULL ? "" : &aqdata->sensors[i-1].uom)
+    json_cfg_element(&jw, buf, &aqdata->sensors[i-1].uom, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED);
 
     /*
     // Need to escape / with /// for this to work, and fix the disply that will show // for ////
     // Don;t forget config.c, Line 2096, search comment // NSF When fixed the JSON & config editor, put these lines back.
     if (&aqdata->sensors[i-1].regex != NULL) {
       sprintf(buf,"sensor_%.2d_regex", i);
-      if ((result = json_cfg_element(buffer+length, size-length, buf, &aqdata->sensors[i-1].regex, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED)) <= 0)
-        return length;
-      else
-        length += result;
+      json_cfg_element(&jw, buf, &aqdata->sensors[i-1].regex, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED);
     }
     */
 
-    length += sprintf(buffer+length, "}" );
-    if (delectCharAt != 0) {
-      buffer[delectCharAt] = ' ';
-      delectCharAt = 0;
-    }
+    jw_object_end(&jw);
+    if (jw.truncated)
+      return jw_finish(&jw, "config");
   }
 
   //  add custom light modes/colors
@@ -1419,15 +1445,9 @@ int build_aqualink_config_JSON(char* buffer, int size, struct aqualinkdata *aqda
   const char *bufptr = buf1;
   for (i=1; i < LIGHT_COLOR_OPTIONS; i++) {
     if ((lname = get_aqualinkd_light_mode_name(i, &isShow)) != NULL) {
-      //fprintf(fp,"light_program_%.2d=%s%s\n",i,lname,isShow?" - show":"");
       sprintf(buf,"light_program_%.2d", i);
-      sprintf(buf1,"%s%s",lname,isShow?" - show":"");
-      //printf("%s %s\n",buf,buf1);
-      if ((result = json_cfg_element(buffer+length, size-length, buf, &bufptr, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED)) <= 0)
-        return length;
-      else
-        length += result;
-      
+      snprintf(buf1,sizeof(buf1),"%s%s",lname,isShow?" - show":"");
+      json_cfg_element(&jw, buf, &bufptr, CFG_STRING, 0, NULL, CFG_GRP_ADVANCED);
     } else {
       break;
     }
@@ -1438,23 +1458,18 @@ int build_aqualink_config_JSON(char* buffer, int size, struct aqualinkdata *aqda
   for (i = 0; i < aqdata->total_buttons; i++)
   {
     char prefix[30];
+
     if (isVBUTTON(aqdata->aqbuttons[i].special_mask)) {
       sprintf(prefix,"virtual_button_%.2d",(i+1)-aqdata->virtual_button_start);
     } else {
       sprintf(prefix,"button_%.2d",i+1);
     }
 
-    //length += sprintf(buffer+length, ",\"%s\":{",prefix );
-    length += sprintf(buffer+length, ",\"%s\":{ \"default\":\"%s\", ",prefix, aqdata->aqbuttons[i].name );
-    // The next json_cfg_element() call will add a , at the beginning, so save the next char index so we can delete it later.
-    delectCharAt = length;
+    jw_object_begin(&jw, prefix);
+    jw_string(&jw, "default", aqdata->aqbuttons[i].name);
     
     sprintf(buf,"%s_label", prefix);
-    if ((result = json_cfg_element(buffer+length, size-length, buf, &aqdata->aqbuttons[i].label, CFG_STRING, 0, NULL, 0)) <= 0) {
-      LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-      return length;
-    } else
-      length += result;
+    json_cfg_element(&jw, buf, &aqdata->aqbuttons[i].label, CFG_STRING, 0, NULL, 0);
 
     if (aqdata->aqbuttons[i].runtime_sec > 0) {
       sprintf(buf,"%s_runtime", prefix);
@@ -1462,131 +1477,72 @@ int build_aqualink_config_JSON(char* buffer, int size, struct aqualinkdata *aqda
       buf1[0] = '\0';
       seconds_to_time_string(aqdata->aqbuttons[i].runtime_sec, buf1, sizeof(buf1));
       stringptr = buf1; // Create a pointer to the buffer
-      if ((result = json_cfg_element(buffer+length, size-length, buf, &stringptr, CFG_STRING, 0, NULL, 0)) <= 0) {
-        LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-        return length;
-      } else
-        length += result;
+      json_cfg_element(&jw, buf, &stringptr, CFG_STRING, 0, NULL, 0);
     }
 
     if (isVS_PUMP(aqdata->aqbuttons[i].special_mask)) 
     {
-      if (((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpIndex > 0) {
+      pump_detail *pump = (pump_detail *)aqdata->aqbuttons[i].special_mask_ptr;
+
+      if (pump->pumpIndex > 0) {
         sprintf(buf,"%s_pumpIndex", prefix);
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpIndex, CFG_INT, 0, NULL, 0)) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        json_cfg_element(&jw, buf, &pump->pumpIndex, CFG_INT, 0, NULL, 0);
       }
       
-      if (((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpID != NUL) {
+      if (pump->pumpID != NUL) {
         sprintf(buf,"%s_pumpID", prefix);
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpID, CFG_HEX, 0, NULL, 0)) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        json_cfg_element(&jw, buf, &pump->pumpID, CFG_HEX, 0, NULL, 0);
       }
 
-      if (((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpName[0] != '\0') {
+      if (pump->pumpName[0] != '\0') {
         sprintf(buf,"%s_pumpName", prefix);
-        stringptr = ((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpName;
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &stringptr, CFG_STRING, 0, NULL, 0)) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        stringptr = pump->pumpName;
+        json_cfg_element(&jw, buf, &stringptr, CFG_STRING, 0, NULL, 0);
       }
 
-      if (((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpType != PT_UNKNOWN) {
+      if (pump->pumpType != PT_UNKNOWN) {
         sprintf(buf,"%s_pumpType", prefix);
-        stringptr = pumpType2String(((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpType);
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &stringptr, CFG_STRING, 0, "[\"\", \"JANDY ePUMP\",\"Pentair VS\",\"Pentair VF\"]", 0) ) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        stringptr = pumpType2String(pump->pumpType);
+        json_cfg_element(&jw, buf, &stringptr, CFG_STRING, 0, "[\"\", \"JANDY ePUMP\",\"Pentair VS\",\"Pentair VF\"]", 0);
       }
 
-      if (((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->minSpeed != PT_UNKNOWN &&
-          ((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->minSpeed != getPumpDefaultSpeed((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr, false) ) 
+      if (pump->minSpeed != PT_UNKNOWN && pump->minSpeed != getPumpDefaultSpeed(pump, false) ) 
       {
         sprintf(buf,"%s_pumpMinSpeed", prefix);
-        stringptr = pumpType2String(((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpType);
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->minSpeed, CFG_INT, 0, NULL, 0) ) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        json_cfg_element(&jw, buf, &pump->minSpeed, CFG_INT, 0, NULL, 0);
       }
 
-      if (((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->maxSpeed != PT_UNKNOWN &&
-          ((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->maxSpeed != getPumpDefaultSpeed((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr, true) ) 
+      if (pump->maxSpeed != PT_UNKNOWN && pump->maxSpeed != getPumpDefaultSpeed(pump, true) ) 
       {
         sprintf(buf,"%s_pumpMaxSpeed", prefix);
-        stringptr = pumpType2String(((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->pumpType);
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &((pump_detail *)aqdata->aqbuttons[i].special_mask_ptr)->maxSpeed, CFG_INT, 0, NULL, 0) ) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        json_cfg_element(&jw, buf, &pump->maxSpeed, CFG_INT, 0, NULL, 0);
       }
 
-
-
     } else if (isPLIGHT(aqdata->aqbuttons[i].special_mask)) {
       if (((clight_detail *)aqdata->aqbuttons[i].special_mask_ptr)->lightType >= 0) {
         sprintf(buf,"%s_lightMode", prefix);
-        //if ((result = json_cfg_element(buffer+length, size-length, buf, &((clight_detail *)aqdata->aqbuttons[i].special_mask_ptr)->lightType, CFG_INT, 0, "[\"\", \"1\",\"2\",\"3\",\"4\",\"5\",\"6\",\"7\",\"10\",\"11\"]", 0)) <= 0) {
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &((clight_detail *)aqdata->aqbuttons[i].special_mask_ptr)->lightType, CFG_INT, 0, NULL, 0)) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+        json_cfg_element(&jw, buf, &((clight_detail *)aqdata->aqbuttons[i].special_mask_ptr)->lightType, CFG_INT, 0, NULL, 0);
       }
     } else if ( (isVBUTTON(aqdata->aqbuttons[i].special_mask) && aqdata->aqbuttons[i].rssd_code >= IAQ_ONETOUCH_1 && aqdata->aqbuttons[i].rssd_code <= IAQ_ONETOUCH_6 ) ) {
-        sprintf(buf,"%s_onetouchID", prefix);
-        int oID = (aqdata->aqbuttons[i].rssd_code - 15);
-        if ((result = json_cfg_element(buffer+length, size-length, buf, &oID, CFG_INT, 0, "[\"\", \"1\",\"2\",\"3\",\"4\",\"5\",\"6\"]", 0)) <= 0) {
-          LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-          return length;
-        } else
-          length += result;
+      sprintf(buf,"%s_onetouchID", prefix);
+      int oID = (aqdata->aqbuttons[i].rssd_code - 15);
+      json_cfg_element(&jw, buf, &oID, CFG_INT, 0, "[\"\", \"1\",\"2\",\"3\",\"4\",\"5\",\"6\"]", 0);
     } else if ( isVBUTTON_ALTLABEL(aqdata->aqbuttons[i].special_mask)) {
       sprintf(buf,"%s_altlabel", prefix);
-      if ((result = json_cfg_element(buffer+length, size-length, buf, &((altlabel_detail *)aqdata->aqbuttons[i].special_mask_ptr)->altlabel, CFG_STRING, 0, NULL, 0)) <= 0) {
-        LOG(NET_LOG,LOG_ERR, "Config json buffer full in, result truncated! size=%d curently used=%d\n",size,length);
-        return length;
-      } else
-        length += result;
+      json_cfg_element(&jw, buf, &((altlabel_detail *)aqdata->aqbuttons[i].special_mask_ptr)->altlabel, CFG_STRING, 0, NULL, 0);
     }
 
-    length += sprintf(buffer+length, "}" );
-    if (delectCharAt != 0) {
-      buffer[delectCharAt] = ' ';
-      delectCharAt = 0;
-    }
-    
+    jw_object_end(&jw);
+    if (jw.truncated)
+      return jw_finish(&jw, "config");
   }
 
   // Need to add one last element, can be crap. Makes the HTML/JS easier in the loop
-  if ((result = snprintf(buffer+length, size-length, ",\"version\": \"1.0\"")) < 0 || result >= size-length) {
-    length += snprintf(buffer+length, size-length, "}");
-    return length;
-  } else {
-    length += result;
-  }
+  jw_string(&jw, "version", "1.0");
 
+  jw_object_end(&jw);
 
-  if ((result = snprintf(buffer+length, size-length, "}")) < 0) {
-    return 0;
-  } else {
-    length += result;
-  }
-
-
-  return length;
+  return jw_finish(&jw, "config");
 }
 
 
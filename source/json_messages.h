@@ -48,10 +48,12 @@ struct JSONkvptr {
 const char* getAqualinkDStatusMessage(struct aqualinkdata *aqdata);
 
 int build_aqualink_status_JSON(struct aqualinkdata *aqdata, char* buffer, int size);
+int build_aqualink_status_delta_JSON(struct aqualinkdata *aqdata, char* buffer, int size, uint32_t fields);
 int build_aux_labels_JSON(struct aqualinkdata *aqdata, char* buffer, int size);
 //bool parseJSONwebrequest(char *buffer, struct JSONwebrequest *request);
 bool parseJSONrequest(char *buffer, struct JSONkvptr *request);
 int build_logmsg_JSON(char *dest, int loglevel, const char *src, int dest_len, int src_len);
+int json_chars(char *dest, const char *src, int dest_len, int src_len);
 int build_mqtt_status_JSON(char* buffer, int size, int idx, int nvalue, float setpoint/*char *svalue*/);
 bool parseJSONmqttrequest(const char *str, size_t len, int *idx, int *nvalue, char *svalue);
 int build_aqualink_error_status_JSON(char* buffer, int size, const char *msg);
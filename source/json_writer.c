@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "aqualink.h"
+#include "utils.h"
+#include "json_messages.h"
+#include "json_writer.h"
+
+#define JW_NUMBER_SIZE 32
+#define JW_MAX_DECIMALS 9
+
+static const uint64_t _pow10[JW_MAX_DECIMALS + 1] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL
+};
+
+void jw_init(json_writer *jw, char *buffer, int size)
+{
+  memset(jw, 0, sizeof(json_writer));
+  jw->buffer = buffer;
+  jw->size = size;
+
+  if (size > 0)
+    buffer[0] = '\0';
+  else
+    jw->truncated = true;
+}
+
+/*
+ * Returns the length.  If the writer ran out of room the buffer is cut short, but anything
+ * still open is closed here (there is always room for that), so it's still valid JSON.
+ */
+int jw_finish(json_writer *jw, const char *name)
+{
+  if (jw->truncated) {
+    LOG(NET_LOG,LOG_ERR, "JSON: %s truncated at %d of %d bytes\n", name, jw->length, jw->size);
+
+    while (jw->depth > 0) {
+      jw->buffer[jw->length++] = (jw->is_array & (1u << jw->depth)) ? ']' : '}';
+      jw->depth--;
+    }
+    if (jw->size > 0)
+      jw->buffer[jw->length] = '\0';
+  }
+
+  return jw->length;
+}
+
+// Room left, less a byte to close each open object / array (and the null is still in there)
+static int jw_space(json_writer *jw)
+{
+  return jw->size - jw->length - jw->depth;
+}
+
+static bool jw_put(json_writer *jw, const char *str, int len)
+{
+  if (jw->truncated)
+    return false;
+
+  // Always leave room for the null
+  if (len >= jw_space(jw)) {
+    jw->truncated = true;
+    return false;
+  }
+
+  memcpy(jw->buffer + jw->length, str, len);
+  jw->length += len;
+  return true;
+}
+
+static bool jw_putc(json_writer *jw, char ch)
+{
+  return jw_put(jw, &ch, 1);
+}
+
+static bool jw_put_string(json_writer *jw, const char *str)
+{
+  int len = (str == NULL ? 0 : strlen(str));
+
+  if (! jw_putc(jw, '"'))
+    return false;
+
+  if (len > 0) {
+    if (len >= jw_space(jw)) {
+      jw->truncated = true;
+      return false;
+    }
+    jw->length += json_chars(jw->buffer + jw->length, str, jw_space(jw), len);
+  }
+
+  return jw_putc(jw, '"');
+}
+
+/*
+ * Comma if something is already at this level, then the key.  Returns where the member
+ * started, so jw_member_end() can take it all back off if the value didn't fit.
+ */
+static int jw_member(json_writer *jw, const char *key)
+{
+  int start = jw->length;
+
+  if (jw->has_member & (1u << jw->depth))
+    jw_putc(jw, ',');
+
+  if (key != NULL) {
+    jw_put_string(jw, key);
+    jw_putc(jw, ':');
+  }
+
+  return start;
+}
+
+static void jw_member_end(json_writer *jw, int start)
+{
+  if (jw->truncated)
+    jw->length = start;
+  else
+    jw->has_member |= (1u << jw->depth);
+
+  if (jw->size > 0)
+    jw->buffer[jw->length] = '\0';
+}
+
+static int format_uint(char *dest, uint64_t value, int min_digits)
+{
+  char digits[JW_NUMBER_SIZE];
+  int n = 0;
+  int i;
+
+  do {
+    digits[n++] = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0 || n < min_digits);
+
+  for (i = 0; i < n; i++)
+    dest[i] = digits[n - 1 - i];
+
+  return n;
+}
+
+static int format_int(char *dest, long value)
+{
+  if (value < 0) {
+    dest[0] = '-';
+    return 1 + format_uint(dest + 1, (uint64_t)(-(value + 1)) + 1, 1);
+  }
+  return format_uint(dest, (uint64_t)value, 1);
+}
+
+/*
+ * Same output as %.*f, including round half to even.  fma() gives what the multiply lost so
+ * values like 7.35 (really 7.3499..) round the way printf would.  Only values too big for
+ * that to be exact go to printf.
+ */
+static int format_float(char *dest, double value, int decimals)
+{
+  double scaled;
+  double error;
+  double fraction;
+  uint64_t whole;
+  int n = 0;
+
+  if (decimals < 0)
+    decimals = 0;
+  else if (decimals > JW_MAX_DECIMALS)
+    decimals = JW_MAX_DECIMALS;
+
+  scaled = fabs(value) * _pow10[decimals];
+  if (! isfinite(scaled) || scaled >= 9007199254740992.0) // 2^53
+    return snprintf(dest, JW_NUMBER_SIZE, "%.17g", value);
+
+  error = fma(fabs(value), (double)_pow10[decimals], -scaled);
+  whole = (uint64_t)scaled;
+  fraction = scaled - (double)whole;
+
+  if (fraction > 0.5 || (fraction == 0.5 && (error > 0 || (error == 0 && (whole & 1)))))
+    whole++;
+
+  if (signbit(value))
+    dest[n++] = '-';
+
+  n += format_uint(dest + n, whole / _pow10[decimals], 1);
+  if (decimals > 0) {
+    dest[n++] = '.';
+    n += format_uint(dest + n, whole % _pow10[decimals], decimals);
+  }
+
+  return n;
+}
+
+static void jw_number(json_writer *jw, const char *key, const char *number, int len, bool quoted)
+{
+  int start = jw_member(jw, key);
+
+  if (quoted)
+    jw_putc(jw, '"');
+  jw_put(jw, number, len);
+  if (quoted)
+    jw_putc(jw, '"');
+
+  jw_member_end(jw, start);
+}
+
+static void jw_container_begin(json_writer *jw, const char *key, bool array)
+{
+  int start = jw_member(jw, key);
+
+  // Opener and the closer we reserve for it
+  if (jw->depth + 1 >= JW_MAX_DEPTH || jw_space(jw) < 3)
+    jw->truncated = true;
+
+  jw_putc(jw, array ? '[' : '{');
+  jw_member_end(jw, start);
+
+  if (! jw->truncated) {
+    jw->depth++;
+    jw->has_member &= ~(1u << jw->depth);
+    if (array)
+      jw->is_array |= (1u << jw->depth);
+    else
+      jw->is_array &= ~(1u << jw->depth);
+  }
+}
+
+// Once truncated jw_finish() closes everything, ends from here on may not match what's open.
+static void jw_container_end(json_writer *jw)
+{
+  if (jw->truncated || jw->depth == 0)
+    return;
+
+  jw->buffer[jw->length++] = (jw->is_array & (1u << jw->depth)) ? ']' : '}';
+  jw->buffer[jw->length] = '\0';
+  jw->depth--;
+}
+
+void jw_object_begin(json_writer *jw, const char *key)
+{
+  jw_container_begin(jw, key, false);
+}
+
+void jw_object_end(json_writer *jw)
+{
+  jw_container_end(jw);
+}
+
+void jw_array_begin(json_writer *jw, const char *key)
+{
+  jw_container_begin(jw, key, true);
+}
+
+void jw_array_end(json_writer *jw)
+{
+  jw_container_end(jw);
+}
+
+void jw_string(json_writer *jw, const char *key, const char *value)
+{
+  int start = jw_member(jw, key);
+
+  jw_put_string(jw, value);
+  jw_member_end(jw, start);
+}
+
+// Most of our numbers go out as strings, "air_temp":"86"
+void jw_string_int(json_writer *jw, const char *key, long value)
+{
+  char number[JW_NUMBER_SIZE];
+
+  jw_number(jw, key, number, format_int(number, value), true);
+}
+
+void jw_string_float(json_writer *jw, const char *key, double value, int decimals)
+{
+  char number[JW_NUMBER_SIZE];
+
+  jw_number(jw, key, number, format_float(number, value, decimals), true);
+}
+
+void jw_string_hex(json_writer *jw, const char *key, uint8_t value)
+{
+  static const char hex[] = "0123456789abcdef";
+  char number[4] = {'0', 'x', hex[value >> 4], hex[value & 0x0f]};
+
+  jw_number(jw, key, number, 4, true);
+}
+
+void jw_int(json_writer *jw, const char *key, long value)
+{
+  char number[JW_NUMBER_SIZE];
+
+  jw_number(jw, key, number, format_int(number, value), false);
+}
+
+void jw_float(json_writer *jw, const char *key, double value, int decimals)
+{
+  char number[JW_NUMBER_SIZE];
+
+  jw_number(jw, key, number, format_float(number, value, decimals), false);
+}
+
+void jw_bool(json_writer *jw, const char *key, bool value)
+{
+  int start = jw_member(jw, key);
+
+  if (value)
+    jw_put(jw, "true", 4);
+  else
+    jw_put(jw, "false", 5);
+
+  jw_member_end(jw, start);
+}
+
+// json has to be a complete value already, like the valid values arrays in config
+void jw_raw(json_writer *jw, const char *key, const char *json)
+{
+  int start = jw_member(jw, key);
+
+  jw_put(jw, json, strlen(json));
+  jw_member_end(jw, start);
+}
+
+char *jw_tail(json_writer *jw, int *space)
+{
+  *space = jw->truncated ? 0 : jw_space(jw);
+  return jw->buffer + jw->length;
+}
+
+// length is what was written at jw_tail(), anything that didn't leave room for the null is truncated
+void jw_commit(json_writer *jw, int length)
+{
+  if (jw->truncated)
+    return;
+
+  if (length < 0 || length >= jw_space(jw)) {
+    jw->truncated = true;
+  } else if (length > 0) {
+    jw->length += length;
+    jw->has_member |= (1u << jw->depth);
+  }
+
+  jw->buffer[jw->length] = '\0';
+}
@@ -0,0 +1,50 @@
+#ifndef JSON_WRITER_H_
+#define JSON_WRITER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Append only JSON into a fixed buffer.  Commas between members are added for you, strings
+ * go through json_chars() and numbers are formatted by hand rather than printf.  Every call
+ * either appends a whole member or nothing, once one doesn't fit the writer is marked
+ * truncated and ignores the rest, so the buffer always ends on a complete member and is
+ * always null terminated.  A byte is kept back for the closer of each open object / array,
+ * jw_finish() uses them so truncated output is still valid JSON.  Pass a NULL key for array
+ * members.
+ */
+
+#define JW_MAX_DEPTH 32
+
+typedef struct json_writer {
+  char *buffer;
+  int size;
+  int length;
+  int depth;
+  uint32_t has_member;  // Bit per depth, something already written at that level
+  uint32_t is_array;    // Bit per depth, closes with ] rather than }
+  bool truncated;
+} json_writer;
+
+void jw_init(json_writer *jw, char *buffer, int size);
+int jw_finish(json_writer *jw, const char *name);
+
+void jw_object_begin(json_writer *jw, const char *key);
+void jw_object_end(json_writer *jw);
+void jw_array_begin(json_writer *jw, const char *key);
+void jw_array_end(json_writer *jw);
+
+void jw_string(json_writer *jw, const char *key, const char *value);
+void jw_string_int(json_writer *jw, const char *key, long value);
+void jw_string_float(json_writer *jw, const char *key, double value, int decimals);
+void jw_string_hex(json_writer *jw, const char *key, uint8_t value);
+void jw_int(json_writer *jw, const char *key, long value);
+void jw_float(json_writer *jw, const char *key, double value, int decimals);
+void jw_bool(json_writer *jw, const char *key, bool value);
+void jw_raw(json_writer *jw, const char *key, const char *json);
+
+// For things that fill a buffer with JSON themselves, members of an array or object just begun
+char *jw_tail(json_writer *jw, int *space);
+void jw_commit(json_writer *jw, int length);
+
+#endif // JSON_WRITER_H_
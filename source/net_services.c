@@ -21,6 +21,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <syslog.h>
+#include <stdatomic.h>
 
 #ifdef AQ_MANAGER
 #include <systemd/sd-journal.h>
@@ -48,6 +49,10 @@
 #include "color_lights.h"
 #include "net_interface.h"
 #include "aq_systemutils.h"
+#include "ack_latency.h"
+#include "flight_recorder.h"
+#include "packet_capture.h"
+#include "aq_snapshot.h"
 
 #ifdef AQ_PDA
 #include "pda.h"
@@ -88,13 +93,16 @@ static struct aqualinkdata *_aqualink_data;
 static pthread_t _net_thread_id = 0;
 static bool _keepNetServicesRunning = false;
 static struct mg_mgr _mgr;
+static struct aqualinkdata _aqualink_snapshot; // Net thread only, see read_aqualinkdata()
 static int _mqtt_exit_flag = false;
+static atomic_bool _net_wakeup_pending = false;
+static unsigned long _net_wakeup_id = 0;
 
 
 void start_mqtt(struct mg_mgr *mgr);
 static struct aqualinkdata _last_mqtt_aqualinkdata;
 static aqled _last_mqtt_chiller_led;
-void mqtt_broadcast_aqualinkstate(struct mg_connection *nc);
+void mqtt_broadcast_aqualinkstate(struct mg_connection *nc, struct aqualinkdata *aqdata);
 
 
 void reset_last_mqtt_status();
@@ -127,6 +135,12 @@ static void set_websocket_aqmanager(struct mg_connection *nc) {
 static int is_websocket_aqmanager(const struct mg_connection *nc) {
   return nc->aq_flags & AQ_MG_CON_WS_AQM;
 }
+static void set_websocket_delta(struct mg_connection *nc) {
+  nc->aq_flags |= AQ_MG_CON_WS_DELTA; 
+}
+static int is_websocket_delta(const struct mg_connection *nc) {
+  return nc->aq_flags & AQ_MG_CON_WS_DELTA;
+}
 static int is_mqtt(const struct mg_connection *nc) {
   //return nc->aq_flags & AQ_MG_CON_MQTT;
   return nc->aq_flags & (AQ_MG_CON_MQTT | AQ_MG_CON_MQTT_CONNECTING);
@@ -166,6 +180,8 @@ void _broadcast_aqualinkstate_error(struct mg_connection *nc, const char *msg)
     if (is_websocket(c))
       ws_send(c, data);
   }
+  // That replaced the whole status client side, so the next delta needs to be all of it.
+  status_fields_changed(STATUS_F_ALL);
   // Maybe enhacment in future to sent error messages to MQTT
 }
 
@@ -448,17 +464,32 @@ bool write_systemd_logmessages_2file(char *fname, int lines)
 
 #endif
 
+// A copy of the current state to build JSON / MQTT from, other threads keep writing the real one.
+static struct aqualinkdata *read_aqualinkdata()
+{
+  aqdata_snapshot(_aqualink_data, &_aqualink_snapshot);
+  return &_aqualink_snapshot;
+}
+
+/*
+ * Full status to websockets that haven't asked for deltas, only what's changed to those that
+ * have.  Each is only built if someone is going to get it.
+ */
 void _broadcast_aqualinkstate(struct mg_connection *nc) 
 {
   static int mqtt_count=0;
   struct mg_connection *c;
   char data[JSON_STATUS_SIZE];
+  char delta[JSON_STATUS_SIZE];
+  bool built_data = false;
+  bool built_delta = false;
+  // Take the changes before the copy, so anything after it gets sent next time
+  uint32_t fields = take_status_field_changes();
+  struct aqualinkdata *aqdata = read_aqualinkdata();
 #ifdef AQ_TM_DEBUG
   int tid;
 #endif
   DEBUG_TIMER_START(&tid);
-
-  build_aqualink_status_JSON(_aqualink_data, data, JSON_STATUS_SIZE);
   
   if (_mqtt_exit_flag == true) {
     mqtt_count++;
@@ -471,10 +502,22 @@ void _broadcast_aqualinkstate(struct mg_connection *nc)
 
   for (c = mg_next(nc->mgr, NULL); c != NULL; c = mg_next(nc->mgr, c)) {
     //if (is_websocket(c) && !is_websocket_simulator(c)) // No need to broadcast status messages to simulator.
-    if (is_websocket(c)) // All button simulator needs status messages
+    if (is_websocket(c) && is_websocket_delta(c)) {
+      if (fields == 0)
+        continue;
+      if (!built_delta) {
+        build_aqualink_status_delta_JSON(aqdata, delta, JSON_STATUS_SIZE, fields);
+        built_delta = true;
+      }
+      ws_send(c, delta);
+    } else if (is_websocket(c)) { // All button simulator needs status messages
+      if (!built_data) {
+        build_aqualink_status_JSON(aqdata, data, JSON_STATUS_SIZE);
+        built_data = true;
+      }
       ws_send(c, data);
-    else if (is_mqtt(c))
-      mqtt_broadcast_aqualinkstate(c);
+    } else if (is_mqtt(c))
+      mqtt_broadcast_aqualinkstate(c, aqdata);
 
   }
 
@@ -637,7 +680,7 @@ void send_mqtt_string_msg(struct mg_connection *nc, const char *dev_name, const
 
 #define MQTT_TIMED_UDATE 300 //(in seconds)
 
-void mqtt_broadcast_aqualinkstate(struct mg_connection *nc)
+void mqtt_broadcast_aqualinkstate(struct mg_connection *nc, struct aqualinkdata *aqdata)
 {
   int i;
   const char *status;
@@ -663,181 +706,181 @@ void mqtt_broadcast_aqualinkstate(struct mg_connection *nc)
 
 //LOG(NET_LOG,LOG_INFO, "mqtt_broadcast_aqualinkstate: START\n");
 
-  if (_aqualink_data->service_mode_state != _last_mqtt_aqualinkdata.service_mode_state) {
-     _last_mqtt_aqualinkdata.service_mode_state = _aqualink_data->service_mode_state;
-     send_mqtt_string_msg(nc, SERVICE_MODE_TOPIC, _aqualink_data->service_mode_state==OFF?MQTT_OFF:(_aqualink_data->service_mode_state==FLASH?MQTT_FLASH:MQTT_ON));
+  if (aqdata->service_mode_state != _last_mqtt_aqualinkdata.service_mode_state) {
+     _last_mqtt_aqualinkdata.service_mode_state = aqdata->service_mode_state;
+     send_mqtt_string_msg(nc, SERVICE_MODE_TOPIC, aqdata->service_mode_state==OFF?MQTT_OFF:(aqdata->service_mode_state==FLASH?MQTT_FLASH:MQTT_ON));
   }
 
   // Only send to display messag topic if not in simulator mode
-  //if (!_aqualink_data->simulate_panel) {
-    status = getAqualinkDStatusMessage(_aqualink_data);
+  //if (!aqdata->simulate_panel) {
+    status = getAqualinkDStatusMessage(aqdata);
     if (strcmp(status, _last_mqtt_aqualinkdata.last_display_message) != 0) {
       strcpy(_last_mqtt_aqualinkdata.last_display_message, status);
       send_mqtt_string_msg(nc, DISPLAY_MSG_TOPIC, status);
     }
   //}
 
-  if (_aqualink_data->air_temp != TEMP_UNKNOWN && _aqualink_data->air_temp != _last_mqtt_aqualinkdata.air_temp) {
-    _last_mqtt_aqualinkdata.air_temp = _aqualink_data->air_temp;
-    send_mqtt_temp_msg(nc, AIR_TEMP_TOPIC, _aqualink_data->air_temp);
-    //send_mqtt_temp_msg_new(nc, AIR_TEMPERATURE_TOPIC, _aqualink_data->air_temp);
+  if (aqdata->air_temp != TEMP_UNKNOWN && aqdata->air_temp != _last_mqtt_aqualinkdata.air_temp) {
+    _last_mqtt_aqualinkdata.air_temp = aqdata->air_temp;
+    send_mqtt_temp_msg(nc, AIR_TEMP_TOPIC, aqdata->air_temp);
+    //send_mqtt_temp_msg_new(nc, AIR_TEMPERATURE_TOPIC, aqdata->air_temp);
   }
 
-  if (_aqualink_data->pool_temp != _last_mqtt_aqualinkdata.pool_temp) {
-    if (_aqualink_data->pool_temp == TEMP_UNKNOWN && _aqconfig_.report_zero_pool_temp) {
+  if (aqdata->pool_temp != _last_mqtt_aqualinkdata.pool_temp) {
+    if (aqdata->pool_temp == TEMP_UNKNOWN && _aqconfig_.report_zero_pool_temp) {
       _last_mqtt_aqualinkdata.pool_temp = TEMP_UNKNOWN;
       send_mqtt_temp_msg(nc, POOL_TEMP_TOPIC, 0);
-    } if (_aqualink_data->pool_temp == TEMP_UNKNOWN && ! _aqconfig_.report_zero_pool_temp) {
+    } if (aqdata->pool_temp == TEMP_UNKNOWN && ! _aqconfig_.report_zero_pool_temp) {
       // Don't post anything in this case, ie leave last posted value alone
-    } else if (_aqualink_data->pool_temp != TEMP_UNKNOWN) {
-      _last_mqtt_aqualinkdata.pool_temp = _aqualink_data->pool_temp;
-      send_mqtt_temp_msg(nc, POOL_TEMP_TOPIC, _aqualink_data->pool_temp);
+    } else if (aqdata->pool_temp != TEMP_UNKNOWN) {
+      _last_mqtt_aqualinkdata.pool_temp = aqdata->pool_temp;
+      send_mqtt_temp_msg(nc, POOL_TEMP_TOPIC, aqdata->pool_temp);
     }
   } 
   
-  if (_aqualink_data->spa_temp != _last_mqtt_aqualinkdata.spa_temp) {
-    if (_aqualink_data->spa_temp == TEMP_UNKNOWN && _aqconfig_.report_zero_spa_temp) {
+  if (aqdata->spa_temp != _last_mqtt_aqualinkdata.spa_temp) {
+    if (aqdata->spa_temp == TEMP_UNKNOWN && _aqconfig_.report_zero_spa_temp) {
       _last_mqtt_aqualinkdata.spa_temp = TEMP_UNKNOWN;
       send_mqtt_temp_msg(nc, SPA_TEMP_TOPIC, 0);
-    } if (_aqualink_data->spa_temp == TEMP_UNKNOWN && ! _aqconfig_.report_zero_spa_temp && _aqualink_data->pool_temp != TEMP_UNKNOWN ) {
+    } if (aqdata->spa_temp == TEMP_UNKNOWN && ! _aqconfig_.report_zero_spa_temp && aqdata->pool_temp != TEMP_UNKNOWN ) {
       // Use Pool Temp as spa temp
-      if (_last_mqtt_aqualinkdata.spa_temp != _aqualink_data->pool_temp) {
-        _last_mqtt_aqualinkdata.spa_temp = _aqualink_data->pool_temp;
-        send_mqtt_temp_msg(nc, SPA_TEMP_TOPIC, _aqualink_data->pool_temp);
+      if (_last_mqtt_aqualinkdata.spa_temp != aqdata->pool_temp) {
+        _last_mqtt_aqualinkdata.spa_temp = aqdata->pool_temp;
+        send_mqtt_temp_msg(nc, SPA_TEMP_TOPIC, aqdata->pool_temp);
       }
-    } else if (_aqualink_data->spa_temp != TEMP_UNKNOWN) {
-      _last_mqtt_aqualinkdata.spa_temp = _aqualink_data->spa_temp;
-      send_mqtt_temp_msg(nc, SPA_TEMP_TOPIC, _aqualink_data->spa_temp);
+    } else if (aqdata->spa_temp != TEMP_UNKNOWN) {
+      _last_mqtt_aqualinkdata.spa_temp = aqdata->spa_temp;
+      send_mqtt_temp_msg(nc, SPA_TEMP_TOPIC, aqdata->spa_temp);
     }
   } 
 
-  if (_aqualink_data->pool_htr_set_point != TEMP_UNKNOWN && _aqualink_data->pool_htr_set_point != _last_mqtt_aqualinkdata.pool_htr_set_point) {
-    _last_mqtt_aqualinkdata.pool_htr_set_point = _aqualink_data->pool_htr_set_point;
-    send_mqtt_setpoint_msg(nc, BTN_POOL_HTR, _aqualink_data->pool_htr_set_point);
+  if (aqdata->pool_htr_set_point != TEMP_UNKNOWN && aqdata->pool_htr_set_point != _last_mqtt_aqualinkdata.pool_htr_set_point) {
+    _last_mqtt_aqualinkdata.pool_htr_set_point = aqdata->pool_htr_set_point;
+    send_mqtt_setpoint_msg(nc, BTN_POOL_HTR, aqdata->pool_htr_set_point);
   }
 
-  if (_aqualink_data->spa_htr_set_point != TEMP_UNKNOWN && _aqualink_data->spa_htr_set_point != _last_mqtt_aqualinkdata.spa_htr_set_point) {
-    _last_mqtt_aqualinkdata.spa_htr_set_point = _aqualink_data->spa_htr_set_point;
-    send_mqtt_setpoint_msg(nc, BTN_SPA_HTR, _aqualink_data->spa_htr_set_point);
+  if (aqdata->spa_htr_set_point != TEMP_UNKNOWN && aqdata->spa_htr_set_point != _last_mqtt_aqualinkdata.spa_htr_set_point) {
+    _last_mqtt_aqualinkdata.spa_htr_set_point = aqdata->spa_htr_set_point;
+    send_mqtt_setpoint_msg(nc, BTN_SPA_HTR, aqdata->spa_htr_set_point);
   }
 
-  if (_aqualink_data->frz_protect_set_point != TEMP_UNKNOWN && _aqualink_data->frz_protect_set_point != _last_mqtt_aqualinkdata.frz_protect_set_point) {
-    _last_mqtt_aqualinkdata.frz_protect_set_point = _aqualink_data->frz_protect_set_point;
-    send_mqtt_setpoint_msg(nc, FREEZE_PROTECT, _aqualink_data->frz_protect_set_point);
+  if (aqdata->frz_protect_set_point != TEMP_UNKNOWN && aqdata->frz_protect_set_point != _last_mqtt_aqualinkdata.frz_protect_set_point) {
+    _last_mqtt_aqualinkdata.frz_protect_set_point = aqdata->frz_protect_set_point;
+    send_mqtt_setpoint_msg(nc, FREEZE_PROTECT, aqdata->frz_protect_set_point);
     send_mqtt_string_msg(nc, FREEZE_PROTECT_ENABELED, MQTT_ON);
     // Duplicate of below if statment.  NSF come back and check if necessary for startup.
-    send_mqtt_string_msg(nc, FREEZE_PROTECT, _aqualink_data->frz_protect_state==ON?MQTT_ON:MQTT_OFF);
-    _last_mqtt_aqualinkdata.frz_protect_state = _aqualink_data->frz_protect_state;
+    send_mqtt_string_msg(nc, FREEZE_PROTECT, aqdata->frz_protect_state==ON?MQTT_ON:MQTT_OFF);
+    _last_mqtt_aqualinkdata.frz_protect_state = aqdata->frz_protect_state;
   }
 
-  if (_aqualink_data->frz_protect_state != _last_mqtt_aqualinkdata.frz_protect_state) {
-    _last_mqtt_aqualinkdata.frz_protect_state = _aqualink_data->frz_protect_state;
-    send_mqtt_string_msg(nc, FREEZE_PROTECT, _aqualink_data->frz_protect_state==ON?MQTT_ON:MQTT_OFF);
+  if (aqdata->frz_protect_state != _last_mqtt_aqualinkdata.frz_protect_state) {
+    _last_mqtt_aqualinkdata.frz_protect_state = aqdata->frz_protect_state;
+    send_mqtt_string_msg(nc, FREEZE_PROTECT, aqdata->frz_protect_state==ON?MQTT_ON:MQTT_OFF);
     //send_mqtt_string_msg(nc, FREEZE_PROTECT_ENABELED, MQTT_ON);
   }
 
   if (ENABLE_CHILLER) {
-    if (_aqualink_data->chiller_set_point != TEMP_UNKNOWN && _aqualink_data->chiller_set_point != _last_mqtt_aqualinkdata.chiller_set_point) {
-      _last_mqtt_aqualinkdata.chiller_set_point = _aqualink_data->chiller_set_point;
-      send_mqtt_setpoint_msg(nc, CHILLER, _aqualink_data->chiller_set_point);
+    if (aqdata->chiller_set_point != TEMP_UNKNOWN && aqdata->chiller_set_point != _last_mqtt_aqualinkdata.chiller_set_point) {
+      _last_mqtt_aqualinkdata.chiller_set_point = aqdata->chiller_set_point;
+      send_mqtt_setpoint_msg(nc, CHILLER, aqdata->chiller_set_point);
     }
 
     // Chiller is only on when in_alt_mode = true and led != off 
-    if ( _aqualink_data->chiller_button != NULL && ((altlabel_detail *) _aqualink_data->chiller_button->special_mask_ptr)->in_alt_mode == false ) {
+    if ( aqdata->chiller_button != NULL && ((altlabel_detail *) aqdata->chiller_button->special_mask_ptr)->in_alt_mode == false ) {
       // Chiller is off (in heat pump mode)
       if (OFF != _last_mqtt_chiller_led.state) {
         _last_mqtt_chiller_led.state = OFF;
         send_mqtt_led_state_msg(nc, CHILLER, OFF, MQTT_COOL, MQTT_OFF);
       }
-    } else if (_aqualink_data->chiller_button != NULL && ((altlabel_detail *) _aqualink_data->chiller_button->special_mask_ptr)->in_alt_mode == true ) {
+    } else if (aqdata->chiller_button != NULL && ((altlabel_detail *) aqdata->chiller_button->special_mask_ptr)->in_alt_mode == true ) {
       // post actual LED state, in chiller mode
-      if (_aqualink_data->chiller_button->led->state != _last_mqtt_chiller_led.state) {
-        _last_mqtt_chiller_led.state = _aqualink_data->chiller_button->led->state;
-        send_mqtt_led_state_msg(nc, CHILLER, _aqualink_data->chiller_button->led->state, MQTT_COOL, MQTT_OFF);
+      if (aqdata->chiller_button->led->state != _last_mqtt_chiller_led.state) {
+        _last_mqtt_chiller_led.state = aqdata->chiller_button->led->state;
+        send_mqtt_led_state_msg(nc, CHILLER, aqdata->chiller_button->led->state, MQTT_COOL, MQTT_OFF);
       }
     }
   }
 
-  if (_aqualink_data->battery != _last_mqtt_aqualinkdata.battery) {
-    _last_mqtt_aqualinkdata.battery = _aqualink_data->battery;
-    send_mqtt_string_msg(nc, BATTERY_STATE, _aqualink_data->battery==OK?MQTT_ON:MQTT_OFF); 
+  if (aqdata->battery != _last_mqtt_aqualinkdata.battery) {
+    _last_mqtt_aqualinkdata.battery = aqdata->battery;
+    send_mqtt_string_msg(nc, BATTERY_STATE, aqdata->battery==OK?MQTT_ON:MQTT_OFF); 
   }
 
-  if (_aqualink_data->ph != TEMP_UNKNOWN && _aqualink_data->ph != _last_mqtt_aqualinkdata.ph) {
-    _last_mqtt_aqualinkdata.ph = _aqualink_data->ph;
-    send_mqtt_float_msg(nc, CHEM_PH_TOPIC, _aqualink_data->ph);
-    send_mqtt_float_msg(nc, CHRM_PH_F_TOPIC, roundf(degFtoC(_aqualink_data->ph)));
+  if (aqdata->ph != TEMP_UNKNOWN && aqdata->ph != _last_mqtt_aqualinkdata.ph) {
+    _last_mqtt_aqualinkdata.ph = aqdata->ph;
+    send_mqtt_float_msg(nc, CHEM_PH_TOPIC, aqdata->ph);
+    send_mqtt_float_msg(nc, CHRM_PH_F_TOPIC, roundf(degFtoC(aqdata->ph)));
   }
-  if (_aqualink_data->orp != TEMP_UNKNOWN && _aqualink_data->orp != _last_mqtt_aqualinkdata.orp) {
-    _last_mqtt_aqualinkdata.orp = _aqualink_data->orp;
-    send_mqtt_numeric_msg(nc, CHEM_ORP_TOPIC, _aqualink_data->orp);
-    send_mqtt_float_msg(nc, CHRM_ORP_F_TOPIC, roundf(degFtoC(_aqualink_data->orp)));
+  if (aqdata->orp != TEMP_UNKNOWN && aqdata->orp != _last_mqtt_aqualinkdata.orp) {
+    _last_mqtt_aqualinkdata.orp = aqdata->orp;
+    send_mqtt_numeric_msg(nc, CHEM_ORP_TOPIC, aqdata->orp);
+    send_mqtt_float_msg(nc, CHRM_ORP_F_TOPIC, roundf(degFtoC(aqdata->orp)));
   }
 
   // Salt Water Generator
-  if (_aqualink_data->swg_led_state != LED_S_UNKNOWN) {
+  if (aqdata->swg_led_state != LED_S_UNKNOWN) {
 
     //LOG(NET_LOG,LOG_DEBUG, "Sending MQTT SWG MEssages\n");
 
-    if (_aqualink_data->swg_led_state != _last_mqtt_aqualinkdata.swg_led_state) {
-       send_mqtt_swg_state_msg(nc, SWG_TOPIC, _aqualink_data->swg_led_state);
-       _last_mqtt_aqualinkdata.swg_led_state = _aqualink_data->swg_led_state;
+    if (aqdata->swg_led_state != _last_mqtt_aqualinkdata.swg_led_state) {
+       send_mqtt_swg_state_msg(nc, SWG_TOPIC, aqdata->swg_led_state);
+       _last_mqtt_aqualinkdata.swg_led_state = aqdata->swg_led_state;
     }
 
-    if (_aqualink_data->swg_percent != TEMP_UNKNOWN && (_aqualink_data->swg_percent != _last_mqtt_aqualinkdata.swg_percent)) {
-      _last_mqtt_aqualinkdata.swg_percent = _aqualink_data->swg_percent;
-      send_mqtt_numeric_msg(nc, SWG_PERCENT_TOPIC, _aqualink_data->swg_percent);
-      send_mqtt_float_msg(nc, SWG_PERCENT_F_TOPIC, roundf(degFtoC(_aqualink_data->swg_percent)));
-      send_mqtt_float_msg(nc, SWG_SETPOINT_TOPIC, roundf(degFtoC(_aqualink_data->swg_percent)));
+    if (aqdata->swg_percent != TEMP_UNKNOWN && (aqdata->swg_percent != _last_mqtt_aqualinkdata.swg_percent)) {
+      _last_mqtt_aqualinkdata.swg_percent = aqdata->swg_percent;
+      send_mqtt_numeric_msg(nc, SWG_PERCENT_TOPIC, aqdata->swg_percent);
+      send_mqtt_float_msg(nc, SWG_PERCENT_F_TOPIC, roundf(degFtoC(aqdata->swg_percent)));
+      send_mqtt_float_msg(nc, SWG_SETPOINT_TOPIC, roundf(degFtoC(aqdata->swg_percent)));
     }
-    if (_aqualink_data->swg_ppm != TEMP_UNKNOWN && (_aqualink_data->swg_ppm != _last_mqtt_aqualinkdata.swg_ppm)) {
-      _last_mqtt_aqualinkdata.swg_ppm = _aqualink_data->swg_ppm;
-      send_mqtt_numeric_msg(nc, SWG_PPM_TOPIC, _aqualink_data->swg_ppm);
-      send_mqtt_float_msg(nc, SWG_PPM_F_TOPIC, roundf(degFtoC(_aqualink_data->swg_ppm)));
+    if (aqdata->swg_ppm != TEMP_UNKNOWN && (aqdata->swg_ppm != _last_mqtt_aqualinkdata.swg_ppm)) {
+      _last_mqtt_aqualinkdata.swg_ppm = aqdata->swg_ppm;
+      send_mqtt_numeric_msg(nc, SWG_PPM_TOPIC, aqdata->swg_ppm);
+      send_mqtt_float_msg(nc, SWG_PPM_F_TOPIC, roundf(degFtoC(aqdata->swg_ppm)));
     }
 
-    if (_aqualink_data->boost != _last_mqtt_aqualinkdata.boost) {
-      send_mqtt_int_msg(nc, SWG_BOOST_TOPIC, _aqualink_data->boost);
-      _last_mqtt_aqualinkdata.boost = _aqualink_data->boost;
+    if (aqdata->boost != _last_mqtt_aqualinkdata.boost) {
+      send_mqtt_int_msg(nc, SWG_BOOST_TOPIC, aqdata->boost);
+      _last_mqtt_aqualinkdata.boost = aqdata->boost;
     }
 
-    if ( _aqualink_data->boost_duration != _last_mqtt_aqualinkdata.boost_duration ) {
-      send_mqtt_int_msg(nc, SWG_BOOST_DURATION_TOPIC, _aqualink_data->boost_duration);
-      _last_mqtt_aqualinkdata.boost_duration = _aqualink_data->boost_duration;
+    if ( aqdata->boost_duration != _last_mqtt_aqualinkdata.boost_duration ) {
+      send_mqtt_int_msg(nc, SWG_BOOST_DURATION_TOPIC, aqdata->boost_duration);
+      _last_mqtt_aqualinkdata.boost_duration = aqdata->boost_duration;
     }
     
   } else {
     //LOG(NET_LOG,LOG_DEBUG, "SWG status unknown\n");
   }
 
-  if (_aqualink_data->ar_swg_device_status != SWG_STATUS_UNKNOWN) {
-    //LOG(NET_LOG,LOG_DEBUG, "Sending MQTT SWG Extended %d\n",_aqualink_data->ar_swg_device_status);
-    if (_aqualink_data->ar_swg_device_status != _last_mqtt_aqualinkdata.ar_swg_device_status) {
-      send_mqtt_int_msg(nc, SWG_EXTENDED_TOPIC, (int)_aqualink_data->ar_swg_device_status);
-      send_mqtt_string_msg(nc, SWG_STATUS_MSG_TOPIC, get_swg_status_msg(_aqualink_data) );
-      _last_mqtt_aqualinkdata.ar_swg_device_status = _aqualink_data->ar_swg_device_status;
-      //LOG(NET_LOG,LOG_DEBUG, "SWG Extended sending cur=%d sent=%d\n",_aqualink_data->ar_swg_device_status,_last_mqtt_aqualinkdata.ar_swg_device_status);
+  if (aqdata->ar_swg_device_status != SWG_STATUS_UNKNOWN) {
+    //LOG(NET_LOG,LOG_DEBUG, "Sending MQTT SWG Extended %d\n",aqdata->ar_swg_device_status);
+    if (aqdata->ar_swg_device_status != _last_mqtt_aqualinkdata.ar_swg_device_status) {
+      send_mqtt_int_msg(nc, SWG_EXTENDED_TOPIC, (int)aqdata->ar_swg_device_status);
+      send_mqtt_string_msg(nc, SWG_STATUS_MSG_TOPIC, get_swg_status_msg(aqdata) );
+      _last_mqtt_aqualinkdata.ar_swg_device_status = aqdata->ar_swg_device_status;
+      //LOG(NET_LOG,LOG_DEBUG, "SWG Extended sending cur=%d sent=%d\n",aqdata->ar_swg_device_status,_last_mqtt_aqualinkdata.ar_swg_device_status);
     } else {
-      //LOG(NET_LOG,LOG_DEBUG, "SWG Extended already sent cur=%d sent=%d\n",_aqualink_data->ar_swg_device_status,_last_mqtt_aqualinkdata.ar_swg_device_status);
+      //LOG(NET_LOG,LOG_DEBUG, "SWG Extended already sent cur=%d sent=%d\n",aqdata->ar_swg_device_status,_last_mqtt_aqualinkdata.ar_swg_device_status);
     }
   } else {
     //LOG(NET_LOG,LOG_DEBUG, "SWG Extended unknown\n");
   }
 
-  if (READ_RSDEV_JXI && _aqualink_data->heater_err_status != _last_mqtt_aqualinkdata.heater_err_status) {
+  if (READ_RSDEV_JXI && aqdata->heater_err_status != _last_mqtt_aqualinkdata.heater_err_status) {
     char message[30];
 
-    if (_aqualink_data->heater_err_status == NUL) {
-      send_mqtt_int_msg(nc, LXI_ERROR_CODE, (int)_aqualink_data->heater_err_status);
+    if (aqdata->heater_err_status == NUL) {
+      send_mqtt_int_msg(nc, LXI_ERROR_CODE, (int)aqdata->heater_err_status);
       send_mqtt_string_msg(nc, LXI_ERROR_MESSAGE, "");
     } else {
-      //send_mqtt_int_msg(nc, LXI_STATUS, (int)_aqualink_data->heater_err_status);
-      send_mqtt_int_msg(nc, LXI_ERROR_CODE, (int)_aqualink_data->heater_err_status);
-      getJandyHeaterErrorMQTT(_aqualink_data, message);
+      //send_mqtt_int_msg(nc, LXI_STATUS, (int)aqdata->heater_err_status);
+      send_mqtt_int_msg(nc, LXI_ERROR_CODE, (int)aqdata->heater_err_status);
+      getJandyHeaterErrorMQTT(aqdata, message);
       send_mqtt_string_msg(nc, LXI_ERROR_MESSAGE, status);
     }
 
-    _last_mqtt_aqualinkdata.heater_err_status = _aqualink_data->heater_err_status;
+    _last_mqtt_aqualinkdata.heater_err_status = aqdata->heater_err_status;
   }
 
   // LOG(NET_LOG,LOG_INFO, "mqtt_broadcast_aqualinkstate: START LEDs\n");
@@ -845,18 +888,18 @@ void mqtt_broadcast_aqualinkstate(struct mg_connection *nc)
   // if (time(NULL) % 2) {}   <-- use to determin odd/even second in time to make state flash on enabled.
 
   // Loop over LED's and send any changes.
-  for (i=0; i < _aqualink_data->total_buttons; i++) {
-    if (_last_mqtt_aqualinkdata.aqualinkleds[i].state != _aqualink_data->aqbuttons[i].led->state) {
-      _last_mqtt_aqualinkdata.aqualinkleds[i].state = _aqualink_data->aqbuttons[i].led->state;
-      if (_aqualink_data->aqbuttons[i].code == KEY_POOL_HTR || _aqualink_data->aqbuttons[i].code == KEY_SPA_HTR) {
-        send_mqtt_heater_state_msg(nc, _aqualink_data->aqbuttons[i].name, _aqualink_data->aqbuttons[i].led->state);
+  for (i=0; i < aqdata->total_buttons; i++) {
+    if (_last_mqtt_aqualinkdata.aqualinkleds[i].state != aqdata->aqbuttons[i].led->state) {
+      _last_mqtt_aqualinkdata.aqualinkleds[i].state = aqdata->aqbuttons[i].led->state;
+      if (aqdata->aqbuttons[i].code == KEY_POOL_HTR || aqdata->aqbuttons[i].code == KEY_SPA_HTR) {
+        send_mqtt_heater_state_msg(nc, aqdata->aqbuttons[i].name, aqdata->aqbuttons[i].led->state);
       } else {
-        send_mqtt_state_msg(nc, _aqualink_data->aqbuttons[i].name, _aqualink_data->aqbuttons[i].led->state);
+        send_mqtt_state_msg(nc, aqdata->aqbuttons[i].name, aqdata->aqbuttons[i].led->state);
       }
 
-      send_mqtt_timer_state_msg(nc, _aqualink_data->aqbuttons[i].name, &_aqualink_data->aqbuttons[i]);
-    } else if ((_aqualink_data->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
-      //send_mqtt_timer_duration_msg(nc, _aqualink_data->aqbuttons[i].name, &_aqualink_data->aqbuttons[i]);
+      send_mqtt_timer_state_msg(nc, aqdata->aqbuttons[i].name, &aqdata->aqbuttons[i]);
+    } else if ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE) {
+      //send_mqtt_timer_duration_msg(nc, aqdata->aqbuttons[i].name, &aqdata->aqbuttons[i]);
       // send_mqtt_timer_state_msg will call send_mqtt_timer_duration_msg so no need to do it here.
       // Have to use send_mqtt_timer_state_msg due to a timer being set on a device that's already on, (ir no state change so above code does't get hit)
       
@@ -868,96 +911,95 @@ void mqtt_broadcast_aqualinkstate(struct mg_connection *nc)
 
       // Check if 10 seconds (10 * 10^9 nanoseconds) have passed
       if (time_difference_ns >= 10000000000LL || last_update_timestamp.tv_sec == 0) {
-        send_mqtt_timer_state_msg(nc, _aqualink_data->aqbuttons[i].name, &_aqualink_data->aqbuttons[i]);
+        send_mqtt_timer_state_msg(nc, aqdata->aqbuttons[i].name, &aqdata->aqbuttons[i]);
         last_update_timestamp = current_time;
       }
     }
   }
 
   // Loop over Pumps
-  for (i=0; i < _aqualink_data->num_pumps; i++) {
-    //_aqualink_data->pumps[i].rpm = TEMP_UNKNOWN;
-    //_aqualink_data->pumps[i].gph = TEMP_UNKNOWN;
-    //_aqualink_data->pumps[i].watts = TEMP_UNKNOWN;
-
-    if (_aqualink_data->pumps[i].rpm != TEMP_UNKNOWN && _aqualink_data->pumps[i].rpm != _last_mqtt_aqualinkdata.pumps[i].rpm) {
-      _last_mqtt_aqualinkdata.pumps[i].rpm = _aqualink_data->pumps[i].rpm;
-      //send_mqtt_aux_msg(nc, PUMP_TOPIC, i+1, PUMP_RPM_TOPIC, _aqualink_data->pumps[i].rpm);
-      send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_RPM_TOPIC, _aqualink_data->pumps[i].rpm);
-      if (_aqualink_data->pumps[i].pumpType == EPUMP || _aqualink_data->pumps[i].pumpType == VSPUMP) {
-        send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_SPEED_TOPIC, getPumpSpeedAsPercent(&_aqualink_data->pumps[i]));
+  for (i=0; i < aqdata->num_pumps; i++) {
+    //aqdata->pumps[i].rpm = TEMP_UNKNOWN;
+    //aqdata->pumps[i].gph = TEMP_UNKNOWN;
+    //aqdata->pumps[i].watts = TEMP_UNKNOWN;
+
+    if (aqdata->pumps[i].rpm != TEMP_UNKNOWN && aqdata->pumps[i].rpm != _last_mqtt_aqualinkdata.pumps[i].rpm) {
+      _last_mqtt_aqualinkdata.pumps[i].rpm = aqdata->pumps[i].rpm;
+      //send_mqtt_aux_msg(nc, PUMP_TOPIC, i+1, PUMP_RPM_TOPIC, aqdata->pumps[i].rpm);
+      send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_RPM_TOPIC, aqdata->pumps[i].rpm);
+      if (aqdata->pumps[i].pumpType == EPUMP || aqdata->pumps[i].pumpType == VSPUMP) {
+        send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_SPEED_TOPIC, getPumpSpeedAsPercent(&aqdata->pumps[i]));
       }
     }
-    if (_aqualink_data->pumps[i].gpm != TEMP_UNKNOWN && _aqualink_data->pumps[i].gpm != _last_mqtt_aqualinkdata.pumps[i].gpm) {
-      _last_mqtt_aqualinkdata.pumps[i].gpm = _aqualink_data->pumps[i].gpm;
-      //send_mqtt_aux_msg(nc, PUMP_TOPIC, i+1, PUMP_GPH_TOPIC, _aqualink_data->pumps[i].gph);
-      send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_GPM_TOPIC, _aqualink_data->pumps[i].gpm);
-      if (_aqualink_data->pumps[i].pumpType == VFPUMP) {
-        send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_SPEED_TOPIC, getPumpSpeedAsPercent(&_aqualink_data->pumps[i]));
+    if (aqdata->pumps[i].gpm != TEMP_UNKNOWN && aqdata->pumps[i].gpm != _last_mqtt_aqualinkdata.pumps[i].gpm) {
+      _last_mqtt_aqualinkdata.pumps[i].gpm = aqdata->pumps[i].gpm;
+      //send_mqtt_aux_msg(nc, PUMP_TOPIC, i+1, PUMP_GPH_TOPIC, aqdata->pumps[i].gph);
+      send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_GPM_TOPIC, aqdata->pumps[i].gpm);
+      if (aqdata->pumps[i].pumpType == VFPUMP) {
+        send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_SPEED_TOPIC, getPumpSpeedAsPercent(&aqdata->pumps[i]));
       }
     }
-    if (_aqualink_data->pumps[i].watts != TEMP_UNKNOWN && _aqualink_data->pumps[i].watts != _last_mqtt_aqualinkdata.pumps[i].watts) {
-      _last_mqtt_aqualinkdata.pumps[i].watts = _aqualink_data->pumps[i].watts;
-      //send_mqtt_aux_msg(nc, PUMP_TOPIC, i+1, PUMP_WATTS_TOPIC, _aqualink_data->pumps[i].watts);
-      send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_WATTS_TOPIC, _aqualink_data->pumps[i].watts);
+    if (aqdata->pumps[i].watts != TEMP_UNKNOWN && aqdata->pumps[i].watts != _last_mqtt_aqualinkdata.pumps[i].watts) {
+      _last_mqtt_aqualinkdata.pumps[i].watts = aqdata->pumps[i].watts;
+      //send_mqtt_aux_msg(nc, PUMP_TOPIC, i+1, PUMP_WATTS_TOPIC, aqdata->pumps[i].watts);
+      send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_WATTS_TOPIC, aqdata->pumps[i].watts);
     }
-    if (_aqualink_data->pumps[i].mode != TEMP_UNKNOWN && _aqualink_data->pumps[i].mode != _last_mqtt_aqualinkdata.pumps[i].mode) {
-      _last_mqtt_aqualinkdata.pumps[i].mode = _aqualink_data->pumps[i].mode;
-      send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_MODE_TOPIC, _aqualink_data->pumps[i].mode);
+    if (aqdata->pumps[i].mode != TEMP_UNKNOWN && aqdata->pumps[i].mode != _last_mqtt_aqualinkdata.pumps[i].mode) {
+      _last_mqtt_aqualinkdata.pumps[i].mode = aqdata->pumps[i].mode;
+      send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_MODE_TOPIC, aqdata->pumps[i].mode);
     }
-    if (_aqualink_data->pumps[i].pressureCurve != TEMP_UNKNOWN && _aqualink_data->pumps[i].pressureCurve != _last_mqtt_aqualinkdata.pumps[i].pressureCurve) {
-      _last_mqtt_aqualinkdata.pumps[i].pressureCurve = _aqualink_data->pumps[i].pressureCurve;
-      send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_PPC_TOPIC, _aqualink_data->pumps[i].pressureCurve);
+    if (aqdata->pumps[i].pressureCurve != TEMP_UNKNOWN && aqdata->pumps[i].pressureCurve != _last_mqtt_aqualinkdata.pumps[i].pressureCurve) {
+      _last_mqtt_aqualinkdata.pumps[i].pressureCurve = aqdata->pumps[i].pressureCurve;
+      send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_PPC_TOPIC, aqdata->pumps[i].pressureCurve);
     }
-    pumpStatus = getPumpStatus(i, _aqualink_data);
+    pumpStatus = getPumpStatus(i, aqdata);
     if (pumpStatus != TEMP_UNKNOWN && 
         pumpStatus != _last_mqtt_aqualinkdata.pumps[i].status) {
       _last_mqtt_aqualinkdata.pumps[i].status = pumpStatus;
-      send_mqtt_aux_msg(nc, _aqualink_data->pumps[i].button->name, PUMP_STATUS_TOPIC, pumpStatus);
+      send_mqtt_aux_msg(nc, aqdata->pumps[i].button->name, PUMP_STATUS_TOPIC, pumpStatus);
     }
   }
 
   // Loop over programmable lights
-  for (i=0; i < _aqualink_data->num_lights; i++) {
-    //LOG(NET_LOG,LOG_NOTICE, "Light %10s | %d | lmode=%.2d cmode=%.2d | name=%s\n",_aqualink_data->lights[i].button->label,_aqualink_data->lights[i].button->led->state,_aqualink_data->lights[i].lastValue,_aqualink_data->lights[i].currentValue,get_currentlight_mode_name(_aqualink_data->lights[i], RSSADAPTER));
+  for (i=0; i < aqdata->num_lights; i++) {
+    //LOG(NET_LOG,LOG_NOTICE, "Light %10s | %d | lmode=%.2d cmode=%.2d | name=%s\n",aqdata->lights[i].button->label,aqdata->lights[i].button->led->state,aqdata->lights[i].lastValue,aqdata->lights[i].currentValue,get_currentlight_mode_name(aqdata->lights[i], RSSADAPTER));
     char topic[50];
-    if ( _aqualink_data->lights[i].currentValue != TEMP_UNKNOWN && _aqualink_data->lights[i].currentValue != _last_mqtt_aqualinkdata.lights[i].currentValue ) {
-      _last_mqtt_aqualinkdata.lights[i].currentValue = _aqualink_data->lights[i].currentValue;
-      send_mqtt_aux_msg(nc, _aqualink_data->lights[i].button->name, LIGHT_PROGRAM_TOPIC, _aqualink_data->lights[i].currentValue);
+    if ( aqdata->lights[i].currentValue != TEMP_UNKNOWN && aqdata->lights[i].currentValue != _last_mqtt_aqualinkdata.lights[i].currentValue ) {
+      _last_mqtt_aqualinkdata.lights[i].currentValue = aqdata->lights[i].currentValue;
+      send_mqtt_aux_msg(nc, aqdata->lights[i].button->name, LIGHT_PROGRAM_TOPIC, aqdata->lights[i].currentValue);
 
-      sprintf(topic, "%s%s/name", _aqualink_data->lights[i].button->name, LIGHT_PROGRAM_TOPIC);
-      if (_aqualink_data->lights[i].lightType == LC_DIMMER2) {
+      sprintf(topic, "%s%s/name", aqdata->lights[i].button->name, LIGHT_PROGRAM_TOPIC);
+      if (aqdata->lights[i].lightType == LC_DIMMER2) {
         char message[30];
-        sprintf(message, "%d%%", _aqualink_data->lights[i].currentValue);
+        sprintf(message, "%d%%", aqdata->lights[i].currentValue);
         send_mqtt_string_msg(nc, topic, message);
       } else {
-        //send_mqtt_string_msg(nc, topic, light_mode_name(_aqualink_data->lights[i].lightType, _aqualink_data->lights[i].currentValue, RSSADAPTER));
-        send_mqtt_string_msg(nc, topic, get_currentlight_mode_name(_aqualink_data->lights[i], RSSADAPTER));
+        //send_mqtt_string_msg(nc, topic, light_mode_name(aqdata->lights[i].lightType, aqdata->lights[i].currentValue, RSSADAPTER));
+        send_mqtt_string_msg(nc, topic, get_currentlight_mode_name(aqdata->lights[i], RSSADAPTER));
       }
       /* 
-      if (_aqualink_data->lights[i].lightType == LC_DIMMER) {
-        sprintf(topic, "%s%s", _aqualink_data->lights[i].button->name, LIGHT_DIMMER_VALUE_TOPIC);
-        send_mqtt_int_msg(nc, topic, _aqualink_data->lights[i].currentValue * 25);
-      } else*/ if (_aqualink_data->lights[i].lightType == LC_DIMMER2) {
-        sprintf(topic, "%s%s", _aqualink_data->lights[i].button->name, LIGHT_DIMMER_VALUE_TOPIC);
-        send_mqtt_int_msg(nc, topic, _aqualink_data->lights[i].currentValue);
+      if (aqdata->lights[i].lightType == LC_DIMMER) {
+        sprintf(topic, "%s%s", aqdata->lights[i].button->name, LIGHT_DIMMER_VALUE_TOPIC);
+        send_mqtt_int_msg(nc, topic, aqdata->lights[i].currentValue * 25);
+      } else*/ if (aqdata->lights[i].lightType == LC_DIMMER2) {
+        sprintf(topic, "%s%s", aqdata->lights[i].button->name, LIGHT_DIMMER_VALUE_TOPIC);
+        send_mqtt_int_msg(nc, topic, aqdata->lights[i].currentValue);
       }
     }
   }
 
   // Loop over sensors
-  for (i=0; i < _aqualink_data->num_sensors; i++) {
-    if ( _aqualink_data->sensors[i].value != TEMP_UNKNOWN && _last_mqtt_aqualinkdata.sensors[i].value != _aqualink_data->sensors[i].value) {
+  for (i=0; i < aqdata->num_sensors; i++) {
+    if ( aqdata->sensors[i].value != TEMP_UNKNOWN && _last_mqtt_aqualinkdata.sensors[i].value != aqdata->sensors[i].value) {
       char topic[50];
-      sprintf(topic, "%s%s", FULL_SENSOR_TOPIC, _aqualink_data->sensors[i].ID);
-      send_mqtt_float_msg(nc, topic, _aqualink_data->sensors[i].value);
-      _last_mqtt_aqualinkdata.sensors[i].value = _aqualink_data->sensors[i].value;
+      sprintf(topic, "%s%s", FULL_SENSOR_TOPIC, aqdata->sensors[i].ID);
+      send_mqtt_float_msg(nc, topic, aqdata->sensors[i].value);
+      _last_mqtt_aqualinkdata.sensors[i].value = aqdata->sensors[i].value;
     }
   }
 }
 
 
-typedef enum {uActioned, uBad, uDevices, uStatus, uHomebridge, uDynamicconf, uDebugStatus, uDebugDownload, uSimulator, uSchedules, uSetSchedules, uAQmanager, uLogDownload, uNotAvailable, uConfig, uSaveConfig, uConfigDownload, uSaveWebConfig} uriAtype;
 //typedef enum {NET_MQTT=0, NET_API, NET_WS, DZ_MQTT} netRequest;
 const char actionName[][5] = {"MQTT", "API", "WS", "DZ"};
 
@@ -1040,6 +1082,8 @@ uriAtype action_URI(request_source from, const char *URI, int uri_length, float
   
   if (strncmp(ri1, "devices", 7) == 0) {
     return uDevices;
+  } else if (strncmp(ri1, "status/delta", 12) == 0 && from == NET_WS) { // Only valid from websocket.
+    return uStatusDelta;
   } else if (strncmp(ri1, "status", 6) == 0) {
     return uStatus;
   } else if (strncmp(ri1, "homebridge", 10) == 0) {
@@ -1058,6 +1102,20 @@ uriAtype action_URI(request_source from, const char *URI, int uri_length, float
     return uSaveWebConfig;
   } else if (strncmp(ri1, "config", 6) == 0) {
     return uConfig;
+  } else if (strncmp(ri1, "acklatency/reset", 16) == 0) {
+    reset_ack_latency();
+    reset_tx_schedule_stats();
+    reset_serial_recovery_stats();
+    return uActioned;
+  } else if (strncmp(ri1, "acklatency", 10) == 0) {
+    return uAckLatency;
+  } else if (strncmp(ri1, "flightrecorder", 14) == 0) {
+    return uFlightRecorder;
+  } else if (strncmp(ri1, "capture", 7) == 0) {
+    // capture lists the segments, capture/<name> downloads one (not over websocket)
+    if (ri2 != NULL && from == NET_API)
+      return uCaptureDownload;
+    return uCaptureList;
   } else if (strncmp(ri1, "simulator", 9) == 0 && from == NET_WS) { // Only valid from websocket.
     if (ri2 != NULL && strncmp(ri2, "onetouch", 8) == 0) {
       start_simulator(_aqualink_data, ONETOUCH);
@@ -1162,6 +1220,7 @@ uriAtype action_URI(request_source from, const char *URI, int uri_length, float
     //                        _aqualink_data->slogger_ids[0]!='\0'?_aqualink_data->slogger_ids:" ", 
     //                        _aqualink_data->slogger_debug?"debug":"" ); 
     _aqualink_data->run_slogger = true;
+    wakeup_main_loop();
     return uActioned;
 #else // AQ_MANAGER
   } else if (strncmp(ri1, "aqmanager", 9) == 0 && from == NET_WS) { // Only valid from websocket.
@@ -1620,6 +1679,118 @@ void serve_file(struct mg_connection *nc, struct mg_http_message *http_msg)
   }
 }
 
+/*
+ * /api/devices, homebridge, status and config responses, kept until the state they were built
+ * from changes (status_version()).  Clients get a strong ETag and a 304 if they already have
+ * it.  Anything with a timer running has a countdown in it, so is only good for that second.
+ */
+typedef enum {RCACHE_DEVICES=0, RCACHE_HOMEBRIDGE, RCACHE_STATUS, RCACHE_CONFIG, RCACHE_COUNT} rcache_type;
+
+typedef struct response_cache {
+  bool valid;
+  uint32_t version;
+  uint32_t builds;  // Config saves don't change status_version(), so the ETag needs this too
+  time_t valid_sec; // 0 if not time dependent
+  char etag[64];
+  char body[JSON_BUFFER_SIZE];
+} response_cache;
+
+static response_cache _response_cache[RCACHE_COUNT];
+static time_t _response_cache_boot = 0; // So a restart doesn't match old ETags
+
+#define CONTENT_JSON_ETAG "Cache-Control: no-cache\r\nContent-Type: application/json\r\nETag: %s\r\n"
+
+static void invalidate_response_cache(rcache_type type)
+{
+  _response_cache[type].valid = false;
+}
+
+// Saving config can change labels, so devices & homebridge go along with config
+static void invalidate_config_response_cache()
+{
+  invalidate_response_cache(RCACHE_CONFIG);
+  invalidate_response_cache(RCACHE_DEVICES);
+  invalidate_response_cache(RCACHE_HOMEBRIDGE);
+}
+
+static bool timers_active(struct aqualinkdata *aqdata)
+{
+  for (int i=0; i < aqdata->total_buttons; i++) {
+    if ((aqdata->aqbuttons[i].special_mask & TIMER_ACTIVE) == TIMER_ACTIVE)
+      return true;
+  }
+  return false;
+}
+
+// If-None-Match can be a list, or *
+static bool etag_matches(struct mg_str *hdr, const char *etag)
+{
+  size_t len = strlen(etag);
+
+  if (hdr->len == 1 && hdr->buf[0] == '*')
+    return true;
+  for (size_t i=0; i + len <= hdr->len; i++) {
+    if (strncmp(&hdr->buf[i], etag, len) == 0)
+      return true;
+  }
+  return false;
+}
+
+static response_cache *get_response_cache(rcache_type type)
+{
+  response_cache *cache = &_response_cache[type];
+  uint32_t version = status_version(); // Before the copy, anything after it is a new version
+  struct aqualinkdata *aqdata;
+#ifdef AQ_TM_DEBUG
+  int tid;
+#endif
+
+  if (cache->valid && cache->version == version && (cache->valid_sec == 0 || cache->valid_sec == time(NULL)))
+    return cache;
+
+  DEBUG_TIMER_START(&tid);
+  aqdata = read_aqualinkdata();
+  switch (type) {
+    case RCACHE_DEVICES:
+      build_device_JSON(aqdata, cache->body, JSON_BUFFER_SIZE, false);
+    break;
+    case RCACHE_HOMEBRIDGE:
+      build_device_JSON(aqdata, cache->body, JSON_BUFFER_SIZE, true);
+    break;
+    case RCACHE_STATUS:
+      build_aqualink_status_JSON(aqdata, cache->body, JSON_BUFFER_SIZE);
+    break;
+    case RCACHE_CONFIG:
+      build_aqualink_config_JSON(cache->body, JSON_BUFFER_SIZE, _aqualink_data);
+    break;
+    default:
+    break;
+  }
+  DEBUG_TIMER_STOP(tid, NET_LOG, "action_web_request() rebuilding cached response took");
+
+  cache->version = version;
+  cache->builds++;
+  cache->valid_sec = timers_active(aqdata) ? time(NULL) : 0;
+  snprintf(cache->etag, sizeof(cache->etag), "\"%lx-%d-%x-%x-%lx\"", (long)_response_cache_boot, type, version, cache->builds, (long)cache->valid_sec);
+  cache->valid = true;
+
+  return cache;
+}
+
+static void reply_response_cache(struct mg_connection *nc, struct mg_http_message *http_msg, rcache_type type)
+{
+  response_cache *cache = get_response_cache(type);
+  struct mg_str *inm = mg_http_get_header(http_msg, "If-None-Match");
+  char headers[128];
+
+  snprintf(headers, sizeof(headers), CONTENT_JSON_ETAG, cache->etag);
+  if (inm != NULL && etag_matches(inm, cache->etag)) {
+    mg_http_reply(nc, 304, headers, "");
+    return;
+  }
+  mg_http_reply(nc, 200, headers, "%s", cache->body);
+}
+
 void action_web_request(struct mg_connection *nc, struct mg_http_message *http_msg)
 {
   char *msg = NULL;
@@ -1673,29 +1844,13 @@ void action_web_request(struct mg_connection *nc, struct mg_http_message *http_m
       mg_http_reply(nc, 200, CONTENT_TEXT, GET_RTN_OK);
       break;
     case uDevices:
-    {
-      char message[JSON_BUFFER_SIZE];
-      DEBUG_TIMER_START(&tid2);
-      build_device_JSON(_aqualink_data, message, JSON_BUFFER_SIZE, false);
-      DEBUG_TIMER_STOP(tid2, NET_LOG, "action_web_request() build_device_JSON took");
-      mg_http_reply(nc, 200, CONTENT_JSON, message);
-    }
+      reply_response_cache(nc, http_msg, RCACHE_DEVICES);
     break;
     case uHomebridge:
-    {
-      char message[JSON_BUFFER_SIZE];
-      build_device_JSON(_aqualink_data, message, JSON_BUFFER_SIZE, true);
-      mg_http_reply(nc, 200, CONTENT_JSON, message);
-    }
+      reply_response_cache(nc, http_msg, RCACHE_HOMEBRIDGE);
     break;
     case uStatus:
-    {
-      char message[JSON_BUFFER_SIZE];
-      DEBUG_TIMER_START(&tid2);
-      build_aqualink_status_JSON(_aqualink_data, message, JSON_BUFFER_SIZE);
-      DEBUG_TIMER_STOP(tid2, NET_LOG, "action_web_request() build_aqualink_status_JSON took");
-      mg_http_reply(nc, 200, CONTENT_JSON, message);
-    }
+      reply_response_cache(nc, http_msg, RCACHE_STATUS);
     break;
     case uDynamicconf:
     {
@@ -1730,14 +1885,41 @@ void action_web_request(struct mg_connection *nc, struct mg_http_message *http_m
     }
     break;
     case uConfig:
+      reply_response_cache(nc, http_msg, RCACHE_CONFIG);
+    break;
+    case uAckLatency:
     {
       char message[JSON_BUFFER_SIZE];
-      DEBUG_TIMER_START(&tid2);
-      build_aqualink_config_JSON(message, JSON_BUFFER_SIZE, _aqualink_data);
-      DEBUG_TIMER_STOP(tid2, NET_LOG, "action_web_request() build_aqualink_config_JSON took");
+      build_ack_latency_JSON(message, JSON_BUFFER_SIZE);
       mg_http_reply(nc, 200, CONTENT_JSON, message);
     }
     break;
+    case uFlightRecorder:
+    {
+      char message[JSON_BUFFER_SIZE];
+      build_flight_recorder_dump_JSON(message, JSON_BUFFER_SIZE);
+      mg_http_reply(nc, 200, CONTENT_JSON, message);
+    }
+    break;
+    case uCaptureList:
+    {
+      char message[JSON_BUFFER_SIZE];
+      build_capture_segments_JSON(message, JSON_BUFFER_SIZE);
+      mg_http_reply(nc, 200, CONTENT_JSON, message);
+    }
+    break;
+    case uCaptureDownload:
+    {
+      char path[CAPTURE_PATH_LEN];
+      // /api/capture/<name>
+      if (capture_segment_path(&buf[13], path, sizeof(path))) {
+        LOG(NET_LOG, LOG_DEBUG, "Downloading capture %s\n", path);
+        mg_http_serve_file(nc, http_msg, path, &_http_server_opts_nocache);
+      } else {
+        mg_http_reply(nc, 404, CONTENT_TEXT, "No such capture\n");
+      }
+    }
+    break;
 #ifndef AQ_MANAGER
     case uDebugStatus:
     {
@@ -1839,7 +2021,7 @@ void action_websocket_request(struct mg_connection *nc, struct mg_ws_message *wm
     {
       DEBUG_TIMER_START(&tid);
       char message[JSON_BUFFER_SIZE];
-      build_device_JSON(_aqualink_data, message, JSON_BUFFER_SIZE, false);
+      build_device_JSON(read_aqualinkdata(), message, JSON_BUFFER_SIZE, false);
       DEBUG_TIMER_STOP(tid, NET_LOG, "action_websocket_request() build_device_JSON took");
       ws_send(nc, message);
     }
@@ -1848,11 +2030,20 @@ void action_websocket_request(struct mg_connection *nc, struct mg_ws_message *wm
     {
       DEBUG_TIMER_START(&tid);
       char message[JSON_BUFFER_SIZE];
-      build_aqualink_status_JSON(_aqualink_data, message, JSON_BUFFER_SIZE);
+      build_aqualink_status_JSON(read_aqualinkdata(), message, JSON_BUFFER_SIZE);
       DEBUG_TIMER_STOP(tid, NET_LOG, "action_websocket_request() build_aqualink_status_JSON took");
       ws_send(nc, message);
     }
     break;
+    case uStatusDelta:
+    {
+      // Full status now, then only what's changed from here on
+      char message[JSON_BUFFER_SIZE];
+      set_websocket_delta(nc);
+      build_aqualink_status_JSON(read_aqualinkdata(), message, JSON_BUFFER_SIZE);
+      ws_send(nc, message);
+    }
+    break;
     case uDynamicconf:
     {
       char message[JSON_BUFFER_SIZE];
@@ -1868,7 +2059,7 @@ void action_websocket_request(struct mg_connection *nc, struct mg_ws_message *wm
       set_websocket_simulator(nc);
       DEBUG_TIMER_START(&tid);
       char message[JSON_BUFFER_SIZE];
-      build_aqualink_status_JSON(_aqualink_data, message, JSON_BUFFER_SIZE);
+      build_aqualink_status_JSON(read_aqualinkdata(), message, JSON_BUFFER_SIZE);
       DEBUG_TIMER_STOP(tid, NET_LOG, "action_websocket_request() build_aqualink_status_JSON took");
       ws_send(nc, message);
     }
@@ -1917,11 +2108,33 @@ void action_websocket_request(struct mg_connection *nc, struct mg_ws_message *wm
       ws_send(nc, message);
     }
     break;
+    case uAckLatency:
+    {
+      char message[JSON_BUFFER_SIZE];
+      build_ack_latency_JSON(message, JSON_BUFFER_SIZE);
+      ws_send(nc, message);
+    }
+    break;
+    case uFlightRecorder:
+    {
+      char message[JSON_BUFFER_SIZE];
+      build_flight_recorder_dump_JSON(message, JSON_BUFFER_SIZE);
+      ws_send(nc, message);
+    }
+    break;
+    case uCaptureList:
+    {
+      char message[JSON_BUFFER_SIZE];
+      build_capture_segments_JSON(message, JSON_BUFFER_SIZE);
+      ws_send(nc, message);
+    }
+    break;
     case uSaveConfig:
     {
       DEBUG_TIMER_START(&tid);
       char message[JSON_BUFFER_SIZE];
       save_config_js((char *)wm->data.buf, wm->data.len, message, JSON_BUFFER_SIZE, _aqualink_data);
+      invalidate_config_response_cache();
       DEBUG_TIMER_STOP(tid, NET_LOG, "action_websocket_request() save_config_js took");
       ws_send(nc, message);
     }
@@ -1931,6 +2144,7 @@ void action_websocket_request(struct mg_connection *nc, struct mg_ws_message *wm
       DEBUG_TIMER_START(&tid);
       char message[JSON_BUFFER_SIZE];
       save_web_config_json((char *)wm->data.buf, wm->data.len, message, JSON_BUFFER_SIZE, _aqualink_data);
+      invalidate_config_response_cache();
       DEBUG_TIMER_STOP(tid, NET_LOG, "action_websocket_request() save_web_config_json took");
       ws_send(nc, message);
     }
@@ -2236,8 +2450,18 @@ static void mg_logger(char ch, void *param) {
 
 
 
+#ifdef AQ_BENCH
+// Bench doesn't start the net thread, but action_URI() still needs the data.
+void bench_net_services_data(struct aqualinkdata *aqdata)
+{
+  _aqualink_data = aqdata;
+}
+#endif
+
 bool _start_net_services(struct mg_mgr *mgr, struct aqualinkdata *aqdata) {
+  set_status_field_data(aqdata);
   struct mg_connection *nc;
+  _response_cache_boot = time(NULL);
   _aqualink_data = aqdata;
   //_aqconfig_ = aqconfig;
  
@@ -2279,6 +2503,13 @@ bool _start_net_services(struct mg_mgr *mgr, struct aqualinkdata *aqdata) {
   _http_server_opts_nocache.root_dir = _aqconfig_.web_directory;
   _http_server_opts_nocache.extra_headers = NO_CACHE;
   _http_server_opts_nocache.ssi_pattern = NULL;
+  // State changes wake the net thread through mongoose's socketpair, MG_EV_WAKEUP goes to the listener.
+  if (!mg_wakeup_init(mgr)) {
+    LOG(NET_LOG,LOG_ERR, "Failed to create net services wakeup, updates will be slow\n");
+  } else {
+    _net_wakeup_id = nc->id;
+  }
+
   // Start MQTT
   start_mqtt(mgr);
 
@@ -2296,6 +2527,33 @@ bool _start_net_services(struct mg_mgr *mgr, struct aqualinkdata *aqdata) {
 //volatile bool _broadcast = false; // This is redundent when most the fully threadded rather than option.
 
 #define JOURNAL_FAIL_RETRY 5
+#define NET_POLL_MS 100
+
+/*
+ * How long the net thread can sleep for.  Anything that changes state wakes it (see
+ * wakeup_net_services()), so that's forever unless something only mongoose or the journal
+ * knows about needs looking at, or we couldn't get a wakeup socket.
+ */
+static int net_poll_timeout(struct aqualinkdata *aqdata)
+{
+  struct mg_connection *c;
+
+  if (_net_wakeup_id == 0)
+    return NET_POLL_MS;
+#ifdef AQ_MANAGER
+  if (aqdata->aqManagerActive)
+    return NET_POLL_MS;
+#endif
+  // MQTT reconnect, DNS timeouts and pipelined HTTP requests are all done on poll
+  if (_mqtt_exit_flag == true || _mgr.active_dns_requests != NULL || _mgr.timers != NULL)
+    return NET_POLL_MS;
+  for (c = _mgr.conns; c != NULL; c = c->next) {
+    if (c->is_accepted && !c->is_websocket && c->recv.len > 0)
+      return NET_POLL_MS;
+  }
+
+  return -1;
+}
 
 void *net_services_thread( void *ptr )
 {
@@ -2316,11 +2574,14 @@ void *net_services_thread( void *ptr )
 
   while (_keepNetServicesRunning == true)
   {
-    mg_mgr_poll(&_mgr, (_aqualink_data->simulator_active != SIM_NONE)?10:100);
+    mg_mgr_poll(&_mgr, net_poll_timeout(aqdata));
+    // Clear before looking, anything that changes after this wakes us again
+    atomic_store(&_net_wakeup_pending, false);
 
     if (aqdata->is_dirty == true /*|| _broadcast == true*/) {
-      _broadcast_aqualinkstate(_mgr.conns);
+      // Clear first, so anything changing while we build is sent next time round
       CLEAR_DIRTY(aqdata->is_dirty);
+      _broadcast_aqualinkstate(_mgr.conns);
 #ifdef DEBUG_SET_IF_CHANGED
       printf("NO updates for %d loops\n",noupdate), noupdate=0;
     } else {
@@ -2358,6 +2619,7 @@ void *net_services_thread( void *ptr )
 
 f_end:
   LOG(NET_LOG,LOG_NOTICE, "Stopping network services thread\n");
+  _net_wakeup_id = 0;
   mg_mgr_free(&_mgr);
 
   pthread_exit(0);
@@ -2373,11 +2635,24 @@ void broadcast_aqualinkstate_error(const char *msg) {
 }
 void broadcast_simulator_message() {
   _aqualink_data->simulator_packet_updated = true;
+  wakeup_net_services();
+}
+
+/*
+ * Any thread, after it's changed something the net thread sends out.  Only one wakeup is
+ * outstanding at a time, so producers don't fill the socketpair.
+ */
+void wakeup_net_services() {
+  unsigned long id = _net_wakeup_id;
+
+  if (id != 0 && !atomic_exchange(&_net_wakeup_pending, true))
+    mg_wakeup(&_mgr, id, NULL, 0);
 }
 
 
 void stop_net_services() {
   _keepNetServicesRunning = false;
+  wakeup_net_services();
   return;
 }
 
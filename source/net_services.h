@@ -24,12 +24,20 @@
 //bool start_web_server(struct mg_mgr *mgr, struct aqualinkdata *aqdata, char *port, char* web_root);
 //bool start_net_services(struct mg_mgr *mgr, struct aqualinkdata *aqdata, struct aqconfig *aqconfig);
 
+typedef enum {uActioned, uBad, uDevices, uStatus, uHomebridge, uDynamicconf, uDebugStatus, uDebugDownload, uSimulator, uSchedules, uSetSchedules, uAQmanager, uLogDownload, uNotAvailable, uConfig, uSaveConfig, uConfigDownload, uSaveWebConfig, uAckLatency, uFlightRecorder, uCaptureList, uCaptureDownload, uStatusDelta} uriAtype;
+
 bool start_net_services(struct aqualinkdata *aqdata);
 void stop_net_services();
 time_t poll_net_services(int timeout_ms);
 void broadcast_aqualinkstate();
 void broadcast_aqualinkstate_error(const char *msg);
 void broadcast_simulator_message();
+void wakeup_net_services();
+
+uriAtype action_URI(request_source from, const char *URI, int uri_length, float value, bool convertTemp, char **rtnmsg);
+#ifdef AQ_BENCH
+void bench_net_services_data(struct aqualinkdata *aqdata);
+#endif
 
 
 
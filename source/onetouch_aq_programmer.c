@@ -25,6 +25,7 @@
 #include "rs_msg_utils.h"
 #include "config.h"
 #include "devices_jandy.h"
+#include "flight_recorder.h"
 
 unsigned char _ot_pgm_command = NUL;
 
@@ -69,6 +70,7 @@ void waitfor_ot_queue2empty()
 
   if (_ot_pgm_command != NUL) {
     LOG(ONET_LOG,LOG_WARNING, "OneTouch Send command Queue did not empty, timeout\n");
+    auto_flight_recorder_dump("programming command timeout");
   }
 }
 
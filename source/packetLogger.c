@@ -2,8 +2,17 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 
 #include "packetLogger.h"
+#include "packet_capture.h"
+#include "flight_recorder.h"
 #include "aq_serial.h"
 #include "utils.h"
 #include "config.h"
@@ -12,17 +21,65 @@ static FILE *_packetLogFile  = NULL;
 static FILE *_byteLogFile    = NULL;
 static bool _logfile_raw     = false;
 static bool _logfile_packets = false;
+static bool _capture         = false;
+static bool _capture_raw     = false;
 //static bool _includePentair = false;
 //static unsigned char _lastReadFrom = NUL;
 
+#define PACKETLOG_RING_MASK (PACKETLOG_RING_SLOTS - 1)
+
+typedef struct log_frame {
+  bool raw; // Bytes from read() for RS485BYTELOGFILE
+  bool error;
+  bool is_read;
+  int length;
+  unsigned char packet[AQ_MAXPKTLEN];
+} log_frame;
+
+/*
+ * Serial thread packets are copied here and formatted by the logger thread, so having
+ * debug logging on doesn't change the read/ACK timing we're probably trying to debug.
+ * Same SPSC ring as the decoder thread, head is only written by the serial thread.
+ */
+struct loggerthread {
+  pthread_t thread_id;
+  log_frame slot[PACKETLOG_RING_SLOTS];
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_bool waiting;
+  atomic_bool running;
+  int wake_fd;
+  atomic_uint dropped;
+};
+
+static struct loggerthread _logger = {.wake_fd = -1};
+
+// Text logs are written by the logger thread and logPacket() callers, never the serial thread.
+static pthread_mutex_t _logfile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static long _packetLogSize = 0;
+static long _byteLogSize   = 0;
+
 void _logPacket(logmask_t from, const unsigned char *packet_buffer, int packet_length, bool error, bool force, bool is_read);
 int _beautifyPacket(char *buff, int buff_size, const unsigned char *packet_buffer, int packet_length, bool error, bool is_read);
+static void start_logger_thread();
+static void stop_logger_thread();
 
 //void startPacketLogger(bool debug_RSProtocol_packets) {
 void startPacketLogger() {
   // Make local copy of variables so we can turn on/off as needed.
   _logfile_raw = _aqconfig_.log_raw_bytes;
   _logfile_packets = _aqconfig_.log_protocol_packets;
+
+  // Binary capture replaces both text logs, use rs485mon -ctext / -crawb to read it.
+  capture_rotation(_aqconfig_.log_packet_max_kb * 1024L, _aqconfig_.log_packet_max_min * 60, _aqconfig_.log_packet_keep);
+  if (_aqconfig_.log_packet_capture && start_packet_capture(RS485CAPFILE)) {
+    _capture = true;
+    _capture_raw = _logfile_raw;
+    _logfile_raw = false;
+    _logfile_packets = false;
+  }
+
+  start_logger_thread();
 }
 
 void startPacketLogging(bool log_protocol_packets, bool log_raw_bytes)
@@ -32,14 +89,66 @@ void startPacketLogging(bool log_protocol_packets, bool log_raw_bytes)
 }
 
 void stopPacketLogger() {
+  // Let it finish what's queued before the log file goes away.
+  stop_logger_thread();
+
+  pthread_mutex_lock(&_logfile_mutex);
   if (_packetLogFile != NULL)
     fclose(_packetLogFile);
 
   if (_byteLogFile != NULL)
     fclose(_byteLogFile);
 
+  _packetLogFile = NULL;
+  _byteLogFile = NULL;
+  pthread_mutex_unlock(&_logfile_mutex);
+
+  if (_capture)
+    stop_packet_capture();
+
   _logfile_raw = false;
   _logfile_packets = false;
+  _capture = false;
+  _capture_raw = false;
+}
+
+/*
+ * Text logs are capped at log_packet_max_kb, then moved to <file>.1 (and .1 to .2 etc)
+ * keeping log_packet_keep of them, 0 keeps them all (same as capture segments).
+ * Caller holds _logfile_mutex.
+ */
+static FILE *openTextLog(FILE *fp, const char *filename, long *size)
+{
+  char from[128];
+  char to[128];
+  long max = _aqconfig_.log_packet_max_kb * 1024L;
+  int keep = _aqconfig_.log_packet_keep;
+  struct stat st;
+
+  if (fp != NULL && (max <= 0 || *size < max))
+    return fp;
+
+  if (fp != NULL) {
+    fclose(fp);
+    if (keep <= 0) {
+      // Keeping everything, so shift up as far as the first unused number
+      for (keep = 1; ; keep++) {
+        snprintf(from, sizeof(from), "%s.%d", filename, keep);
+        if (stat(from, &st) != 0)
+          break;
+      }
+    }
+    for (int i = keep; i > 1; i--) {
+      snprintf(from, sizeof(from), "%s.%d", filename, i - 1);
+      snprintf(to, sizeof(to), "%s.%d", filename, i);
+      rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", filename);
+    rename(filename, to);
+  }
+
+  *size = 0;
+  return fopen(filename, "w");
 }
 
 // Log passed packets
@@ -47,29 +156,45 @@ void writePacketLog(char *buffer) {
   if (!_logfile_packets)
     return;
 
-  if (_packetLogFile == NULL)
-    _packetLogFile = fopen(RS485LOGFILE, "w");
+  pthread_mutex_lock(&_logfile_mutex);
+  _packetLogFile = openTextLog(_packetLogFile, RS485LOGFILE, &_packetLogSize);
 
   if (_packetLogFile != NULL) {
     fputs(buffer, _packetLogFile);
+    _packetLogSize += strlen(buffer);
   } 
+  pthread_mutex_unlock(&_logfile_mutex);
 }
 
-// Log Raw Bytes
-void logPacketByte(const unsigned char *byte)
+static void writeByteLog(const unsigned char *bytes, int length)
 {
-  if (!_logfile_raw)
-    return;
-
-  char buff[10];
-  if (_byteLogFile == NULL)
-    _byteLogFile = fopen(RS485BYTELOGFILE, "w");
+  pthread_mutex_lock(&_logfile_mutex);
+  _byteLogFile = openTextLog(_byteLogFile, RS485BYTELOGFILE, &_byteLogSize);
 
   if (_byteLogFile != NULL) {
-    sprintf(buff, "0x%02hhx|",*byte);
-    fputs( buff, _byteLogFile);
+    for (int i=0; i < length; i++)
+      fprintf(_byteLogFile, "0x%02hhx|", bytes[i]);
+    _byteLogSize += length * 5;
   } 
-  //}
+  pthread_mutex_unlock(&_logfile_mutex);
+}
+
+static void queuePacketLog(const unsigned char *packet_buffer, int packet_length, bool raw, bool error, bool is_read);
+
+// Log Raw Bytes, as they came from read()
+void logPacketBytes(const unsigned char *bytes, int length)
+{
+  if (_capture_raw) {
+    capture_packet(CAPTURE_READ, CAPTURE_RAW, bytes, length);
+    return;
+  }
+
+  if (!_logfile_raw)
+    return;
+
+  // One read() can be more than a ring slot
+  for (int i = 0; i < length; i += AQ_MAXPKTLEN)
+    queuePacketLog(&bytes[i], AQ_MIN(length - i, AQ_MAXPKTLEN), true, false, true);
 }
 
 /*
@@ -77,15 +202,198 @@ void logPacket(unsigned char *packet_buffer, int packet_length) {
   _logPacket(RSSD_LOG, packet_buffer, packet_length, false, false);
 }
 */
+static void wake_logger()
+{
+  uint64_t one = 1;
+
+  if (write(_logger.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    // Counter is saturated, so logger is already due to wake up.
+  }
+}
+
+static void *logger_worker(void *ptr)
+{
+  struct loggerthread *lthread = (struct loggerthread *) ptr;
+  unsigned int tail;
+  unsigned int dropped;
+  unsigned int reported = 0;
+  uint64_t count;
+
+  LOG(AQUA_LOG, LOG_DEBUG, "Started packet logger thread\n");
+
+  // Keep going after being stopped until the ring is empty, so nothing queued is lost.
+  for (;;) {
+    // Report drops from here, the serial thread has better things to do.
+    dropped = atomic_load_explicit(&lthread->dropped, memory_order_relaxed);
+    if (dropped != reported) {
+      LOG(RSSD_LOG, LOG_WARNING, "Packet logger is behind, dropped %u packets\n", dropped - reported);
+      reported = dropped;
+    }
+
+    tail = atomic_load_explicit(&lthread->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&lthread->head, memory_order_acquire)) {
+      if (!atomic_load(&lthread->running))
+        break;
+      // Empty, tell the producer we're going to sleep then re-check so we can't miss a packet.
+      atomic_store(&lthread->waiting, true);
+      if (tail == atomic_load(&lthread->head) && atomic_load(&lthread->running)) {
+        if (read(lthread->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+          // Interrupted, simply go round again.
+        }
+      }
+      atomic_store(&lthread->waiting, false);
+      continue;
+    }
+
+    log_frame *frame = &lthread->slot[tail & PACKETLOG_RING_MASK];
+    if (frame->raw)
+      writeByteLog(frame->packet, frame->length);
+    else
+      _logPacket(RSSD_LOG, frame->packet, frame->length, frame->error, false, frame->is_read);
+
+    atomic_store_explicit(&lthread->tail, tail + 1, memory_order_release);
+  }
+
+  LOG(AQUA_LOG, LOG_DEBUG, "End packet logger thread\n");
+  pthread_exit(0);
+}
+
+static void start_logger_thread()
+{
+  if (atomic_load(&_logger.running))
+    return;
+
+  atomic_store(&_logger.dropped, 0);
+  atomic_store(&_logger.head, 0);
+  atomic_store(&_logger.tail, 0);
+  atomic_store(&_logger.waiting, false);
+
+  _logger.wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (_logger.wake_fd < 0) {
+    LOGSystemError(errno, AQUA_LOG, "packet logger eventfd");
+    return;
+  }
+
+  atomic_store(&_logger.running, true);
+  if (pthread_create(&_logger.thread_id, NULL, logger_worker, (void*)&_logger) != 0) {
+    LOG(AQUA_LOG, LOG_ERR, "could not create packet logger thread, logging on serial thread\n");
+    atomic_store(&_logger.running, false);
+    close(_logger.wake_fd);
+    _logger.wake_fd = -1;
+  }
+}
+
+static void stop_logger_thread()
+{
+  if (!atomic_load(&_logger.running))
+    return;
+
+  atomic_store(&_logger.running, false);
+  wake_logger();
+  pthread_join(_logger.thread_id, NULL);
+
+  close(_logger.wake_fd);
+  _logger.wake_fd = -1;
+}
+
+/*
+ * Serial thread only.  Same early out as _logPacket() so nothing is copied when nobody is
+ * listening, otherwise hand the raw packet to the logger thread.  The RSSD_LOG filter,
+ * all formatting and any file writes happen over there.
+ */
+static void queuePacketLog(const unsigned char *packet_buffer, int packet_length, bool raw, bool error, bool is_read)
+{
+  unsigned int head;
+  log_frame *frame;
+
+  if ( raw == false &&
+       error == false &&
+       getLogLevel(RSSD_LOG) < LOG_DEBUG_SERIAL &&
+       _logfile_packets == false ) {
+    return;
+  }
+
+  if (!atomic_load_explicit(&_logger.running, memory_order_relaxed)) {
+    if (raw)
+      writeByteLog(packet_buffer, packet_length);
+    else
+      _logPacket(RSSD_LOG, packet_buffer, packet_length, error, false, is_read);
+    return;
+  }
+
+  head = atomic_load_explicit(&_logger.head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&_logger.tail, memory_order_acquire) >= PACKETLOG_RING_SLOTS) {
+    // Logging mustn't hold up the bus, so drop and count rather than wait.
+    atomic_fetch_add_explicit(&_logger.dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  frame = &_logger.slot[head & PACKETLOG_RING_MASK];
+  frame->raw = raw;
+  frame->error = error;
+  frame->is_read = is_read;
+  frame->length = AQ_MIN(packet_length, AQ_MAXPKTLEN);
+  memcpy(frame->packet, packet_buffer, frame->length);
+
+  atomic_store_explicit(&_logger.head, head + 1, memory_order_release);
+
+  if (atomic_load(&_logger.waiting))
+    wake_logger();
+}
+
 void logPacketRead(const unsigned char *packet_buffer, int packet_length) {
-  _logPacket(RSSD_LOG, packet_buffer, packet_length, false, false, true);
+  flight_record(FLIGHT_READ, false, packet_buffer, packet_length);
+  if (_capture)
+    capture_packet(CAPTURE_READ, 0, packet_buffer, packet_length);
+  queuePacketLog(packet_buffer, packet_length, false, false, true);
 }
 void logPacketWrite(const unsigned char *packet_buffer, int packet_length) {
-  _logPacket(RSSD_LOG, packet_buffer, packet_length, false, false, false);
+  flight_record(FLIGHT_WRITE, false, packet_buffer, packet_length);
+  if (_capture)
+    capture_packet(CAPTURE_WRITE, 0, packet_buffer, packet_length);
+  queuePacketLog(packet_buffer, packet_length, false, false, false);
 }
 
 void logPacketError(const unsigned char *packet_buffer, int packet_length) {
-  _logPacket(RSSD_LOG, packet_buffer, packet_length, true, false, true);
+  flight_record(FLIGHT_READ, true, packet_buffer, packet_length);
+  if (_capture)
+    capture_packet(CAPTURE_READ, CAPTURE_ERROR, packet_buffer, packet_length);
+  queuePacketLog(packet_buffer, packet_length, false, true, true);
+}
+
+/*
+ * Print a binary capture (see packet_capture.h) the same as the text logs would have been,
+ * packets as RS485LOGFILE or raw bytes as RS485BYTELOGFILE.
+ */
+bool printCaptureFile(const char *filename, FILE *out, bool raw_bytes)
+{
+  capture_file_header header;
+  capture_record record;
+  unsigned char data[CAPTURE_MAX_RECORD];
+  char buff[LARGELOGBUFFER];
+  FILE *fp;
+  int length;
+
+  if ((fp = open_capture_file(filename, &header)) == NULL)
+    return false;
+
+  while ((length = read_capture_record(fp, &header, &record, data, sizeof(data))) >= 0) {
+    if (raw_bytes != ((record.flags & CAPTURE_RAW) == CAPTURE_RAW))
+      continue;
+
+    if (raw_bytes) {
+      for (int i=0; i < length; i++)
+        fprintf(out, "0x%02hhx|", data[i]);
+    } else if (length > 0) {
+      _beautifyPacket(buff, LARGELOGBUFFER, data, length, (record.flags & CAPTURE_ERROR), record.direction == CAPTURE_READ);
+      fputs(buff, out);
+    }
+  }
+
+  fclose(fp);
+  return true;
 }
 
 /* This should never be used in production */
@@ -168,6 +476,10 @@ int beautifyPacket(char *buff, int buff_size, const unsigned char *packet_buffer
 {
   return _beautifyPacket(buff, buff_size, packet_buffer, packet_length, false, is_read);
 }
+int beautifyBadPacket(char *buff, int buff_size, const unsigned char *packet_buffer, int packet_length, bool is_read)
+{
+  return _beautifyPacket(buff, buff_size, packet_buffer, packet_length, true, is_read);
+}
 int _beautifyPacket(char *buff, int buff_size, const unsigned char *packet_buffer, int packet_length, bool error, bool is_read)
 {
   //int i = 0;
@@ -1,6 +1,7 @@
 #ifndef PACKETLOGGER_H_
 #define PACKETLOGGER_H_
 
+#include <stdio.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -9,6 +10,8 @@
 #define RS485LOGFILE "/tmp/RS485.log"
 #define RS485BYTELOGFILE "/tmp/RS485raw.log"
 
+#define PACKETLOG_RING_SLOTS 128 // Must be power of 2, packets queued for the logger thread
+
 
 void startPacketLogger(); // use what ever config has
 void startPacketLogging(bool debug_protocol_packets, bool debug_raw_bytes); // Set custom options
@@ -19,9 +22,12 @@ void stopPacketLogger();
 void logPacketRead(const unsigned char *packet_buffer, int packet_length);
 void logPacketWrite(const unsigned char *packet_buffer, int packet_length);
 void logPacketError(const unsigned char *packet_buffer, int packet_length);
-void logPacketByte(const unsigned char *byte);
+void logPacketBytes(const unsigned char *bytes, int length);
 void logPacket(logmask_t from, int level, const unsigned char *packet_buffer, int packet_length, bool is_read) ;
 int beautifyPacket(char *buff, int buff_size, const unsigned char *packet_buffer, int packet_length, bool is_read);
+int beautifyBadPacket(char *buff, int buff_size, const unsigned char *packet_buffer, int packet_length, bool is_read);
+
+bool printCaptureFile(const char *filename, FILE *out, bool raw_bytes);
 
 int sprintFrame(char *buff, int buff_size, const unsigned char *packet_buffer, int packet_length);
 
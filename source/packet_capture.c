@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the 
+ * Free Software Foundation. For the terms of this license, 
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "utils.h"
+#include "packet_capture.h"
+
+#define CAPTURE_RING_MASK (CAPTURE_RING_SIZE - 1)
+#define CAPTURE_DRAIN_MS  50  // How often the writer empties the ring
+#define CAPTURE_COMPRESS_QUEUE 8
+
+/*
+ * Records are laid out in the ring exactly as they go in the file, so the writer just
+ * fwrite()s whatever is between tail and head.
+ * head is only written by the serial thread, tail only by the writer thread.
+ */
+struct capturethread {
+  pthread_t thread_id;
+  FILE *fp;
+  char filename[CAPTURE_PATH_LEN];
+  unsigned char ring[CAPTURE_RING_SIZE];
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_bool running;
+  uint32_t dropped;
+  bool gap; // Dropped records since the last one that made it in
+  // Rotation, only touched by the writer thread once it's running
+  long max_bytes;
+  int max_age_sec;
+  int keep;
+  long written;
+  time_t opened;
+};
+
+static struct capturethread _capture = {0};
+
+/*
+ * Closed segments are gzip'ed and old ones removed by another thread, so the writer
+ * never waits on anything but its own fwrite().
+ */
+static struct {
+  pthread_t thread_id;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  char queue[CAPTURE_COMPRESS_QUEUE][CAPTURE_PATH_LEN];
+  int count;
+  bool running;
+  bool gzip_missing;
+} _compress = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static inline int64_t timespec_ns(const struct timespec *ts)
+{
+  return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void ring_copy_in(unsigned int pos, const void *data, unsigned int length)
+{
+  unsigned int start = pos & CAPTURE_RING_MASK;
+  unsigned int first = CAPTURE_RING_SIZE - start;
+
+  if (first > length)
+    first = length;
+
+  memcpy(&_capture.ring[start], data, first);
+  memcpy(&_capture.ring[0], (const unsigned char *)data + first, length - first);
+}
+
+// Write out everything the serial thread has queued, returns false if there was nothing.
+static bool capture_drain()
+{
+  unsigned int tail = atomic_load_explicit(&_capture.tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&_capture.head, memory_order_acquire);
+  unsigned int start = tail & CAPTURE_RING_MASK;
+  unsigned int length = head - tail;
+  unsigned int first = CAPTURE_RING_SIZE - start;
+
+  if (length == 0)
+    return false;
+
+  if (first > length)
+    first = length;
+
+  // No file if rotation couldn't open the next one, keep emptying the ring regardless.
+  if (_capture.fp != NULL) {
+    fwrite(&_capture.ring[start], 1, first, _capture.fp);
+    fwrite(&_capture.ring[0], 1, length - first, _capture.fp);
+    fflush(_capture.fp);
+    _capture.written += length;
+  }
+
+  atomic_store_explicit(&_capture.tail, head, memory_order_release);
+  return true;
+}
+
+// Every segment gets its own header so it can be read on it's own.
+static FILE *open_capture_segment(const char *filename)
+{
+  capture_file_header header = {0};
+  struct timespec mono;
+  struct timespec real;
+  FILE *fp;
+
+  if ((fp = fopen(filename, "w")) == NULL)
+    return NULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+
+  header.magic = CAPTURE_MAGIC;
+  header.version = CAPTURE_VERSION;
+  header.record_size = sizeof(capture_record);
+  header.start_realtime_ns = timespec_ns(&real);
+  header.start_monotonic_ns = timespec_ns(&mono);
+  fwrite(&header, sizeof(header), 1, fp);
+
+  _capture.written = sizeof(header);
+  _capture.opened = real.tv_sec;
+
+  return fp;
+}
+
+// /tmp/RS485.cap -> /tmp/RS485 and .cap, the closed segments are /tmp/RS485.<time>.cap
+static void segment_stem(const char *filename, char *stem, int size, const char **ext)
+{
+  const char *dot = strrchr(filename, '.');
+  const char *slash = strrchr(filename, '/');
+
+  if (dot == NULL || (slash != NULL && dot < slash))
+    dot = filename + strlen(filename);
+
+  snprintf(stem, size, "%.*s", (int)(dot - filename), filename);
+  *ext = dot;
+}
+
+static void queue_compress(const char *segment)
+{
+  pthread_mutex_lock(&_compress.mutex);
+  if (_compress.count < CAPTURE_COMPRESS_QUEUE) {
+    snprintf(_compress.queue[_compress.count++], CAPTURE_PATH_LEN, "%s", segment);
+    pthread_cond_signal(&_compress.cond);
+  } else {
+    LOG(RSSD_LOG,LOG_WARNING, "Capture compression is behind, leaving %s uncompressed\n", segment);
+  }
+  pthread_mutex_unlock(&_compress.mutex);
+}
+
+static void capture_rotate()
+{
+  char stem[CAPTURE_PATH_LEN];
+  char segment[CAPTURE_PATH_LEN];
+  const char *ext;
+  struct timespec now;
+  struct tm tm;
+
+  fclose(_capture.fp);
+  _capture.fp = NULL;
+
+  // Time to the ms keeps names unique and sorting oldest first
+  clock_gettime(CLOCK_REALTIME, &now);
+  localtime_r(&now.tv_sec, &tm);
+  segment_stem(_capture.filename, stem, sizeof(stem), &ext);
+  if (snprintf(segment, sizeof(segment), "%s.%04d%02d%02d-%02d%02d%02d.%03ld%s", stem,
+               tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, now.tv_nsec / 1000000L, ext) >= sizeof(segment)) {
+    LOG(RSSD_LOG,LOG_ERR, "Capture file name %s too long to rotate\n", _capture.filename);
+  } else if (rename(_capture.filename, segment) != 0) {
+    LOGSystemError(errno, RSSD_LOG, segment);
+  } else {
+    LOG(RSSD_LOG,LOG_INFO, "Capture segment %s closed\n", segment);
+    queue_compress(segment);
+  }
+
+  if ((_capture.fp = open_capture_segment(_capture.filename)) == NULL)
+    LOG(RSSD_LOG,LOG_ERR, "Unable to open capture file %s, capture stopped\n", _capture.filename);
+}
+
+static bool capture_rotate_due()
+{
+  if (_capture.fp == NULL || _capture.written <= sizeof(capture_file_header))
+    return false;
+
+  if (_capture.max_bytes > 0 && _capture.written >= _capture.max_bytes)
+    return true;
+
+  if (_capture.max_age_sec > 0 && time(NULL) - _capture.opened >= _capture.max_age_sec)
+    return true;
+
+  return false;
+}
+
+static void *capture_writer(void *ptr)
+{
+  struct timespec wait = {0, CAPTURE_DRAIN_MS * 1000000L};
+
+  while (atomic_load_explicit(&_capture.running, memory_order_acquire)) {
+    if (!capture_drain())
+      nanosleep(&wait, NULL);
+    // Ring is record aligned, so everything drained so far is whole records
+    if (capture_rotate_due())
+      capture_rotate();
+  }
+
+  // Anything queued before we were stopped
+  capture_drain();
+
+  return NULL;
+}
+
+static bool gzip_segment(const char *segment)
+{
+  char *args[] = {"gzip", "-f", (char *)segment, NULL};
+  pid_t pid;
+  int status;
+
+  if ((pid = fork()) == -1) {
+    LOGSystemError(errno, RSSD_LOG, "fork (gzip)");
+    return false;
+  }
+
+  if (pid == 0) {
+    execvp("gzip", args);
+    _exit(127);
+  }
+
+  if (waitpid(pid, &status, 0) == -1)
+    return false;
+
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 127 && !_compress.gzip_missing) {
+    LOG(RSSD_LOG,LOG_WARNING, "gzip not found, capture segments will be left uncompressed\n");
+    _compress.gzip_missing = true;
+  }
+
+  return (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static int compare_segments(const void *a, const void *b)
+{
+  return strcmp(((const capture_segment *)a)->name, ((const capture_segment *)b)->name);
+}
+
+// Remove the oldest closed segments so no more than keep are left.
+static void capture_retention(int keep)
+{
+  capture_segment segments[CAPTURE_SEGMENT_MAX];
+  char dir[CAPTURE_PATH_LEN];
+  char path[CAPTURE_PATH_LEN];
+  int count = list_capture_segments(segments, CAPTURE_SEGMENT_MAX);
+  int closed = count;
+  const char *slash = strrchr(_capture.filename, '/');
+
+  if (count > 0 && segments[count - 1].live)
+    closed--;
+
+  snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int)(slash - _capture.filename) : 1, slash != NULL ? _capture.filename : ".");
+
+  for (int i = 0; i < closed - keep; i++) {
+    if (snprintf(path, sizeof(path), "%s/%s", dir, segments[i].name) < sizeof(path) && unlink(path) == 0)
+      LOG(RSSD_LOG,LOG_INFO, "Removed old capture segment %s\n", path);
+  }
+}
+
+static void *capture_compressor(void *ptr)
+{
+  char segment[CAPTURE_PATH_LEN];
+
+  pthread_mutex_lock(&_compress.mutex);
+  for (;;) {
+    while (_compress.count == 0 && _compress.running)
+      pthread_cond_wait(&_compress.cond, &_compress.mutex);
+
+    if (_compress.count == 0)
+      break;
+
+    snprintf(segment, sizeof(segment), "%s", _compress.queue[0]);
+    memmove(_compress.queue[0], _compress.queue[1], --_compress.count * sizeof(_compress.queue[0]));
+    pthread_mutex_unlock(&_compress.mutex);
+
+    if (!_compress.gzip_missing)
+      gzip_segment(segment);
+    if (_capture.keep > 0)
+      capture_retention(_capture.keep);
+
+    pthread_mutex_lock(&_compress.mutex);
+  }
+  pthread_mutex_unlock(&_compress.mutex);
+
+  return NULL;
+}
+
+/*
+ * Set before start_packet_capture().  The capture is closed off as a segment once it
+ * reaches max_bytes or is max_age_sec old, 0 for either means never.  Only the newest
+ * keep closed segments are kept, 0 keeps them all.
+ */
+void capture_rotation(long max_bytes, int max_age_sec, int keep)
+{
+  _capture.max_bytes = max_bytes;
+  _capture.max_age_sec = max_age_sec;
+  _capture.keep = keep;
+}
+
+// Finishes anything already queued first.
+static void stop_capture_compressor()
+{
+  if (!_compress.running)
+    return;
+
+  pthread_mutex_lock(&_compress.mutex);
+  _compress.running = false;
+  pthread_cond_signal(&_compress.cond);
+  pthread_mutex_unlock(&_compress.mutex);
+  pthread_join(_compress.thread_id, NULL);
+}
+
+bool start_packet_capture(const char *filename)
+{
+  if (atomic_load(&_capture.running))
+    return true;
+
+  snprintf(_capture.filename, sizeof(_capture.filename), "%s", filename);
+
+  if ((_capture.fp = open_capture_segment(filename)) == NULL) {
+    LOG(RSSD_LOG,LOG_ERR, "Unable to open capture file %s\n", filename);
+    return false;
+  }
+
+  if (_capture.max_bytes > 0 || _capture.max_age_sec > 0) {
+    _compress.running = true;
+    _compress.count = 0;
+    if (pthread_create(&_compress.thread_id, NULL, capture_compressor, NULL) != 0) {
+      LOG(RSSD_LOG,LOG_ERR, "Unable to start capture compression thread, not rotating capture\n");
+      _compress.running = false;
+      _capture.max_bytes = 0;
+      _capture.max_age_sec = 0;
+    }
+  }
+
+  atomic_store(&_capture.head, 0);
+  atomic_store(&_capture.tail, 0);
+  _capture.dropped = 0;
+  _capture.gap = false;
+  atomic_store(&_capture.running, true);
+
+  if (pthread_create(&_capture.thread_id, NULL, capture_writer, NULL) != 0) {
+    LOG(RSSD_LOG,LOG_ERR, "Unable to start capture writer thread\n");
+    atomic_store(&_capture.running, false);
+    fclose(_capture.fp);
+    _capture.fp = NULL;
+    stop_capture_compressor();
+    return false;
+  }
+
+  LOG(RSSD_LOG,LOG_NOTICE, "Capturing packets to %s\n", filename);
+  return true;
+}
+
+void stop_packet_capture()
+{
+  if (!atomic_load(&_capture.running))
+    return;
+
+  atomic_store_explicit(&_capture.running, false, memory_order_release);
+  pthread_join(_capture.thread_id, NULL);
+
+  if (_capture.fp != NULL)
+    fclose(_capture.fp);
+  _capture.fp = NULL;
+
+  stop_capture_compressor();
+
+  if (_capture.dropped > 0)
+    LOG(RSSD_LOG,LOG_WARNING, "Packet capture dropped %u records, writer couldn't keep up\n", _capture.dropped);
+}
+
+/*
+ * Called from the serial thread, never blocks.  If the writer has fallen behind the record is dropped
+ * and the next one that fits is flagged CAPTURE_GAP.
+ */
+void capture_packet(capture_direction direction, uint8_t flags, const unsigned char *data, int length)
+{
+  capture_record record;
+  struct timespec now;
+  unsigned int head;
+  unsigned int tail;
+
+  if (!atomic_load_explicit(&_capture.running, memory_order_relaxed) || length < 0)
+    return;
+
+  if (length > CAPTURE_MAX_RECORD)
+    length = CAPTURE_MAX_RECORD;
+
+  head = atomic_load_explicit(&_capture.head, memory_order_relaxed);
+  tail = atomic_load_explicit(&_capture.tail, memory_order_acquire);
+
+  if (CAPTURE_RING_SIZE - (head - tail) < sizeof(record) + length) {
+    _capture.dropped++;
+    _capture.gap = true;
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record.timestamp_ns = timespec_ns(&now);
+  record.length = length;
+  record.direction = direction;
+  record.flags = flags | (_capture.gap?CAPTURE_GAP:0);
+  _capture.gap = false;
+
+  ring_copy_in(head, &record, sizeof(record));
+  ring_copy_in(head + sizeof(record), data, length);
+
+  atomic_store_explicit(&_capture.head, head + sizeof(record) + length, memory_order_release);
+}
+
+/*
+ * The live capture plus every closed segment (compressed or not) next to it, oldest first
+ * with the live one last.  Fine to call from any thread, it only reads the directory.
+ */
+int list_capture_segments(capture_segment *segments, int max)
+{
+  const char *filename = _capture.filename[0] != '\0' ? _capture.filename : RS485CAPFILE;
+  const char *slash = strrchr(filename, '/');
+  const char *live = slash != NULL ? slash + 1 : filename;
+  char dir[CAPTURE_PATH_LEN];
+  char stem[CAPTURE_PATH_LEN];
+  char path[CAPTURE_PATH_LEN];
+  const char *ext;
+  const char *name_ext;
+  int stem_len;
+  int count = 0;
+  bool have_live = false;
+  capture_segment live_segment;
+  struct dirent *entry;
+  struct stat st;
+  DIR *dp;
+
+  snprintf(dir, sizeof(dir), "%.*s", slash != NULL ? (int)(slash - filename) : 1, slash != NULL ? filename : ".");
+  segment_stem(live, stem, sizeof(stem), &ext);
+  stem_len = strlen(stem);
+
+  if ((dp = opendir(dir)) == NULL)
+    return 0;
+
+  while ((entry = readdir(dp)) != NULL) {
+    bool is_live = (strcmp(entry->d_name, live) == 0);
+    bool compressed = false;
+
+    if (!is_live) {
+      // <stem>.<time><ext> or <stem>.<time><ext>.gz
+      if (strncmp(entry->d_name, stem, stem_len) != 0 || entry->d_name[stem_len] != '.')
+        continue;
+      name_ext = entry->d_name + strlen(entry->d_name);
+      if (strlen(entry->d_name) > 3 && strcmp(name_ext - 3, ".gz") == 0) {
+        compressed = true;
+        name_ext -= 3;
+      }
+      if (name_ext - entry->d_name <= stem_len + strlen(ext) || strncmp(name_ext - strlen(ext), ext, strlen(ext)) != 0)
+        continue;
+    }
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= sizeof(path) ||
+        stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    capture_segment *segment = is_live ? &live_segment : &segments[count];
+    snprintf(segment->name, sizeof(segment->name), "%s", entry->d_name);
+    segment->size = st.st_size;
+    segment->mtime = st.st_mtime;
+    segment->compressed = compressed;
+    segment->live = is_live;
+
+    if (is_live)
+      have_live = true;
+    else if (count < max - 1) // Always leave room for the live one
+      count++;
+  }
+  closedir(dp);
+
+  qsort(segments, count, sizeof(capture_segment), compare_segments);
+
+  if (have_live && count < max)
+    segments[count++] = live_segment;
+
+  return count;
+}
+
+// Full path of a segment by name, only if it really is one, so a request can't wander off.
+bool capture_segment_path(const char *name, char *path, int size)
+{
+  capture_segment segments[CAPTURE_SEGMENT_MAX];
+  const char *filename = _capture.filename[0] != '\0' ? _capture.filename : RS485CAPFILE;
+  const char *slash = strrchr(filename, '/');
+  int count = list_capture_segments(segments, CAPTURE_SEGMENT_MAX);
+
+  for (int i = 0; i < count; i++) {
+    if (strcmp(segments[i].name, name) == 0) {
+      snprintf(path, size, "%.*s/%s", slash != NULL ? (int)(slash - filename) : 1, slash != NULL ? filename : ".", name);
+      return true;
+    }
+  }
+  return false;
+}
+
+int build_capture_segments_JSON(char *buffer, int size)
+{
+  capture_segment segments[CAPTURE_SEGMENT_MAX];
+  int count = list_capture_segments(segments, CAPTURE_SEGMENT_MAX);
+  int length;
+
+  length = snprintf(buffer, size, "{\"type\": \"capture\",\"capturing\": %s,\"segments\": [",
+                    atomic_load(&_capture.running) ? "true" : "false");
+
+  for (int i = 0; i < count && length < size; i++) {
+    length += snprintf(buffer + length, size - length, "%s{\"name\": \"%s\",\"size\": %ld,\"modified\": %ld,\"compressed\": %s,\"live\": %s}",
+                       i > 0 ? "," : "", segments[i].name, segments[i].size, (long)segments[i].mtime,
+                       segments[i].compressed ? "true" : "false", segments[i].live ? "true" : "false");
+  }
+
+  if (length < size)
+    length += snprintf(buffer + length, size - length, "]}");
+
+  return length < size ? length : size - 1;
+}
+
+/*
+ * Reading captures back, for converters / offline tools.
+ */
+FILE *open_capture_file(const char *filename, capture_file_header *header)
+{
+  FILE *fp;
+
+  if ((fp = fopen(filename, "r")) == NULL)
+    return NULL;
+
+  if (fread(header, sizeof(*header), 1, fp) != 1 ||
+      header->magic != CAPTURE_MAGIC ||
+      header->version != CAPTURE_VERSION ||
+      header->record_size < sizeof(capture_record)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  return fp;
+}
+
+// Returns record length, or -1 at end of file (or a truncated record).
+int read_capture_record(FILE *fp, const capture_file_header *header, capture_record *record, unsigned char *data, int max_length)
+{
+  // record_size lets a newer writer add fields, we only know the ones in capture_record.
+  if (fread(record, sizeof(*record), 1, fp) != 1 ||
+      fseek(fp, header->record_size - sizeof(*record), SEEK_CUR) != 0)
+    return -1;
+
+  if (record->length > max_length) {
+    if (fread(data, 1, max_length, fp) != max_length || fseek(fp, record->length - max_length, SEEK_CUR) != 0)
+      return -1;
+    return max_length;
+  }
+
+  if (fread(data, 1, record->length, fp) != record->length)
+    return -1;
+
+  return record->length;
+}
@@ -0,0 +1,73 @@
+#ifndef PACKET_CAPTURE_H_
+#define PACKET_CAPTURE_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Binary packet capture, a file header followed by one record per packet (or raw read),
+ * each with a CLOCK_MONOTONIC timestamp.  Records go through a lock free ring and are
+ * written by a background thread, so capturing doesn't change serial thread timing.
+ * Fields are host byte order, the magic number will read backwards if that's different.
+ * With rotation on the capture is closed off by size / age into <name>.<time>.cap segments,
+ * each a capture file in its own right, which are then gzip'ed on another thread.
+ */
+
+#define RS485CAPFILE "/tmp/RS485.cap"
+
+#define CAPTURE_MAGIC       0x50414351 // "QCAP"
+#define CAPTURE_VERSION     1
+#define CAPTURE_RING_SIZE   (256 * 1024) // Must be power of 2
+#define CAPTURE_MAX_RECORD  2048
+#define CAPTURE_PATH_LEN    256
+#define CAPTURE_SEGMENT_MAX 64 // Most segments listed, so keep needs to be less than this
+
+typedef enum capture_direction {
+  CAPTURE_READ = 0,
+  CAPTURE_WRITE = 1
+} capture_direction;
+
+// capture_record flags
+#define CAPTURE_ERROR  0x01 // Bad packet (checksum, too large etc)
+#define CAPTURE_RAW    0x02 // Raw bytes from read(), not a framed packet
+#define CAPTURE_GAP    0x04 // Records were dropped before this one
+
+typedef struct __attribute__((packed)) capture_file_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t record_size;        // sizeof(capture_record) when written
+  int64_t  start_realtime_ns;  // CLOCK_REALTIME at start, to turn record timestamps into wall time
+  int64_t  start_monotonic_ns; // CLOCK_MONOTONIC at the same moment
+} capture_file_header;
+
+typedef struct __attribute__((packed)) capture_record {
+  int64_t  timestamp_ns; // CLOCK_MONOTONIC
+  uint16_t length;       // Bytes that follow
+  uint8_t  direction;    // capture_direction
+  uint8_t  flags;
+} capture_record;
+
+// Live capture file and the closed (rotated) segments next to it
+typedef struct capture_segment {
+  char name[64];
+  long size;
+  time_t mtime;
+  bool compressed; // .gz
+  bool live;       // Still being written
+} capture_segment;
+
+void capture_rotation(long max_bytes, int max_age_sec, int keep);
+bool start_packet_capture(const char *filename);
+void stop_packet_capture();
+void capture_packet(capture_direction direction, uint8_t flags, const unsigned char *data, int length);
+
+int list_capture_segments(capture_segment *segments, int max);
+bool capture_segment_path(const char *name, char *path, int size);
+int build_capture_segments_JSON(char *buffer, int size);
+
+FILE *open_capture_file(const char *filename, capture_file_header *header);
+int read_capture_record(FILE *fp, const capture_file_header *header, capture_record *record, unsigned char *data, int max_length);
+
+#endif // PACKET_CAPTURE_H_
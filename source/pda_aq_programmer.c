@@ -38,6 +38,8 @@
 #include "allbutton_aq_programmer.h"
 #include "rs_msg_utils.h"
 #include "color_lights.h"
+#include "flight_recorder.h"
+#include "aq_snapshot.h"
 
 #ifdef AQ_DEBUG
   #include "timespec_subtract.h"
@@ -286,6 +288,7 @@ bool waitfor_pda_queue2empty() {
 */
   if (i >= PROGRAMMING_POLL_COUNTER) {
     LOG(PDA_LOG, LOG_ERR, "Send command Queue did not empty, timeout\n");
+    auto_flight_recorder_dump("programming command timeout");
     return false;
   }
 
@@ -339,8 +342,10 @@ void pda_programming_thread_check(struct aqualinkdata *aqdata)
       else {
        
       }
+      aqdata_write_begin();
       aqdata->active_thread.thread_id = 0;
       aqdata->active_thread.ptype = AQP_NULL;
+      aqdata_write_end();
       ack_count = 0;
       thread_id = 0;
     } else {
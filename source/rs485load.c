@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+/*
+ * Bus load generator, plays the part of the control panel master through a pseudo terminal.
+ *
+ * Point aqualinkd's serial_port at the pty (or the -l symlink).  The bus is run like a
+ * panel does, one device per time slot round robin, each emulated ID (ie the ones aqualinkd
+ * is configured to answer) gets probes, status polls and (AllButton) display messages, and
+ * waits for its reply.  Other devices on the bus (SWG, ePump, Pentair VSP, chem feeder, JXi)
+ * are polled and answered by us, so aqualinkd sees their traffic too.  Slots are PANEL_SLOT_MS
+ * which is about what a real panel does, -s N runs N times faster, -f as fast as aqualinkd
+ * answers.  Reports reply latency per emulated ID, missed and late (past ACK deadline)
+ * replies, and with -p aqualinkd's CPU, so you can find how much load it takes before
+ * ACK deadlines slip.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include "aq_serial.h"
+#include "rs_devices.h"
+#include "utils.h"
+#include "timespec_subtract.h"
+#include "virtual_bus.h"
+
+#define VERSION "rs485load V1.0"
+
+#define PANEL_SLOT_MS        30    // Time per device poll on a real bus
+#define REPLY_TIMEOUT_MS     50    // No reply in this long is a miss
+#define ACK_DEADLINE_MS      20    // Replies later than this are late, same as ACK_LATENCY_DEADLINE_US
+#define DEVICE_TURNAROUND_MS 2     // How long the devices we play take to answer
+#define START_DELAY_MS       1000  // After aqualinkd opens the port, give it time to start up
+#define DEFAULT_RUN_SEC      30
+#define MAX_DEVICES          32
+#define PROBE_EVERY          20    // Polls between re-probing an emulated ID
+#define MESSAGE_EVERY        5     // Polls between display messages to AllButton IDs
+
+typedef enum load_device_type {
+  LD_EMULATED,
+  LD_SWG,
+  LD_EPUMP,
+  LD_PENTAIR,
+  LD_CHEM,
+  LD_JXI
+} load_device_type;
+
+typedef struct load_device {
+  load_device_type type;
+  unsigned char id;
+  int polls;
+  int replies;
+  int missed;
+  int late;
+  int64_t *latency_ns;
+  int latency_size;
+} load_device;
+
+typedef struct load_results {
+  int frames;        // Everything we put on the bus
+  int unsolicited;   // From aqualinkd when nothing was waiting on a reply
+  struct timespec start;
+  struct timespec end;
+} load_results;
+
+static const char *_device_names[] = {"Emulated", "SWG", "ePump", "PentairVSP", "ChemFeeder", "JXi"};
+
+static const char *_display_msgs[] = {"POOL TEMP 81`F", "AIR TEMP 72`F", "AQUAPURE 40%", "SALT 3200 PPM", "FILTER PUMP"};
+#define NUM_DISPLAY_MSGS (int)(sizeof(_display_msgs)/sizeof(_display_msgs[0]))
+
+static load_device _devices[MAX_DEVICES];
+static int _num_devices = 0;
+
+void intHandler(int dummy)
+{
+  vbus_stop();
+}
+
+static load_device *add_device(load_device_type type, unsigned char id)
+{
+  load_device *dev;
+
+  if (_num_devices >= MAX_DEVICES) {
+    fprintf(stderr, "ERROR, too many devices, max is %d\n", MAX_DEVICES);
+    exit(EXIT_FAILURE);
+  }
+
+  dev = &_devices[_num_devices++];
+  memset(dev, 0, sizeof(load_device));
+  dev->type = type;
+  dev->id = id;
+  return dev;
+}
+
+static void add_latency(load_device *dev, int64_t latency)
+{
+  if (dev->replies >= dev->latency_size) {
+    dev->latency_size = dev->latency_size ? dev->latency_size * 2 : 1024;
+    if ((dev->latency_ns = realloc(dev->latency_ns, dev->latency_size * sizeof(int64_t))) == NULL) {
+      fprintf(stderr, "ERROR, out of memory\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  dev->latency_ns[dev->replies++] = latency;
+}
+
+/*
+ * Frames, built unescaped, vbus_escape_frame() is applied when they're written.
+ */
+static int jandy_frame(unsigned char *packet, unsigned char dest, unsigned char cmd, const unsigned char *data, int data_len)
+{
+  int len = 0;
+  int sum = 0;
+
+  packet[len++] = DLE;
+  packet[len++] = STX;
+  packet[len++] = dest;
+  packet[len++] = cmd;
+  if (data_len > 0)
+    memcpy(&packet[len], data, data_len);
+  len += data_len;
+  for (int i = 0; i < len; i++)
+    sum += packet[i];
+  packet[len++] = sum & 0xFF;
+  packet[len++] = DLE;
+  packet[len++] = ETX;
+
+  return len;
+}
+
+static int pentair_frame(unsigned char *packet, unsigned char dest, unsigned char from, unsigned char cmd, const unsigned char *data, int data_len)
+{
+  int len = 0;
+  int sum = 0;
+
+  packet[len++] = PP1;
+  packet[len++] = PP2;
+  packet[len++] = PP3;
+  packet[len++] = PP4;
+  packet[len++] = 0x00;
+  packet[len++] = dest;
+  packet[len++] = from;
+  packet[len++] = cmd;
+  packet[len++] = data_len;
+  if (data_len > 0)
+    memcpy(&packet[len], data, data_len);
+  len += data_len;
+  for (int i = 3; i < len; i++)
+    sum += packet[i];
+  packet[len++] = (sum >> 8) & 0xFF;
+  packet[len++] = sum & 0xFF;
+
+  return len;
+}
+
+// What the panel sends to this device for this poll
+static int panel_request(load_device *dev, unsigned char *packet)
+{
+  switch (dev->type) {
+    case LD_EMULATED:
+      if (dev->polls % PROBE_EVERY == 0) {
+        return jandy_frame(packet, dev->id, CMD_PROBE, NULL, 0);
+      } else if (is_allbutton_id(dev->id) && dev->polls % MESSAGE_EVERY == 0) {
+        unsigned char msg[AQ_MSGLONGLEN];
+        int len = snprintf((char *)msg, sizeof(msg), "%c%-16s", 0x01, _display_msgs[(dev->polls / MESSAGE_EVERY) % NUM_DISPLAY_MSGS]);
+        return jandy_frame(packet, dev->id, CMD_MSG_LONG, msg, len);
+      } else {
+        const unsigned char leds[] = {0x00, 0x10, 0x00, 0x00, 0x00};
+        return jandy_frame(packet, dev->id, CMD_STATUS, leds, sizeof(leds));
+      }
+    case LD_SWG:
+    {
+      const unsigned char percent[] = {40};
+      return jandy_frame(packet, dev->id, CMD_PERCENT, percent, sizeof(percent));
+    }
+    case LD_EPUMP:
+    {
+      const unsigned char rpm[] = {0x00, 0x60, 0x27};
+      return jandy_frame(packet, dev->id, CMD_EPUMP_RPM, rpm, sizeof(rpm));
+    }
+    case LD_PENTAIR:
+      return pentair_frame(packet, dev->id, PEN_DEV_MASTER, PEN_CMD_STATUS, NULL, 0);
+    case LD_CHEM:
+      return jandy_frame(packet, dev->id, CMD_PROBE, NULL, 0);
+    case LD_JXI:
+    {
+      const unsigned char ping[] = {0x11, 0x55, 0x66, 0x4f};
+      return jandy_frame(packet, dev->id, CMD_JXI_PING, ping, sizeof(ping));
+    }
+  }
+  return 0;
+}
+
+// What the (non emulated) device sends back to the panel
+static int device_reply(load_device *dev, unsigned char *packet)
+{
+  switch (dev->type) {
+    case LD_SWG:
+    {
+      const unsigned char ppm[] = {32, 0x00}; // 3200 PPM, no errors
+      return jandy_frame(packet, 0x00, CMD_PPM, ppm, sizeof(ppm));
+    }
+    case LD_EPUMP:
+    {
+      const unsigned char status[] = {CMD_EPUMP_RPM, 0x00, 0x60, 0x27, 0x00};
+      return jandy_frame(packet, 0x00, CMD_EPUMP_STATUS, status, sizeof(status));
+    }
+    case LD_PENTAIR:
+    {
+      // Running, 750 watts, 2750 RPM
+      const unsigned char status[] = {0x0a, 0x02, 0x02, 0xee, 0x0a, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x09, 0x1e};
+      return pentair_frame(packet, PEN_DEV_MASTER, dev->id, PEN_CMD_STATUS, status, sizeof(status));
+    }
+    case LD_CHEM:
+    {
+      const unsigned char ack[] = {0x00, 0x00};
+      return jandy_frame(packet, 0x00, CMD_ACK, ack, sizeof(ack));
+    }
+    case LD_JXI:
+    {
+      const unsigned char status[] = {0x00, 0x00, 0x00};
+      return jandy_frame(packet, 0x00, CMD_JXI_STATUS, status, sizeof(status));
+    }
+    case LD_EMULATED:
+    break;
+  }
+  return 0;
+}
+
+static bool send_frame(int fd, const unsigned char *packet, int length, load_results *results)
+{
+  unsigned char wire[AQ_MAXPKTLEN * 2];
+  int len = vbus_escape_frame(packet, length, wire);
+
+  if (write(fd, wire, len) != len) {
+    fprintf(stderr, "ERROR, write to pty failed: %s\n", strerror(errno));
+    vbus_stop();
+    return false;
+  }
+  results->frames++;
+  return true;
+}
+
+/*
+ * Read what aqualinkd sends until the deadline, or until the first frame if want_reply.
+ * Returns time the frame was read, or 0.  Frames when we didn't want one are unsolicited.
+ */
+static int64_t read_aqualinkd(int fd, int64_t deadline, bool want_reply, load_results *results)
+{
+  static unsigned char rx[AQ_MAXPKTLEN * 2];
+  static int rx_len = 0;
+  unsigned char frame[AQ_MAXPKTLEN];
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int64_t now;
+  int len;
+  int rtn;
+
+  for (;;) {
+    while ((len = vbus_next_frame(rx, &rx_len, frame)) > 0) {
+      if (want_reply)
+        return vbus_now_ns();
+      results->unsolicited++;
+    }
+
+    if (!vbus_running() || (now = vbus_now_ns()) >= deadline)
+      return 0;
+
+    rtn = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+    if (rtn < 0 && errno != EINTR)
+      return 0;
+    if (rtn <= 0)
+      continue;
+    if (pfd.revents & POLLHUP) {
+      fprintf(stderr, "aqualinkd closed the port\n");
+      vbus_stop();
+      return 0;
+    }
+
+    if ((len = read(fd, &rx[rx_len], sizeof(rx) - rx_len)) > 0)
+      rx_len += len;
+    if (rx_len >= sizeof(rx))
+      rx_len = 0; // Garbage, start again
+  }
+}
+
+static void run_load(int fd, int run_sec, double speed, bool fast, load_results *results)
+{
+  unsigned char packet[AQ_MAXPKTLEN];
+  int64_t slot_ns = fast ? 0 : (int64_t)(PANEL_SLOT_MS * 1000000LL / speed);
+  int64_t turnaround_ns = fast ? 0 : (int64_t)(DEVICE_TURNAROUND_MS * 1000000LL / speed);
+  int64_t start = vbus_now_ns();
+  int64_t end = start + run_sec * 1000000000LL;
+  int64_t next = start;
+
+  clock_gettime(CLOCK_MONOTONIC, &results->start);
+
+  for (unsigned int slot = 0; vbus_running() && next < end; slot++) {
+    load_device *dev = &_devices[slot % _num_devices];
+    int len = panel_request(dev, packet);
+
+    // Anything aqualinkd sent since the last slot wasn't asked for
+    read_aqualinkd(fd, 0, false, results);
+
+    if (!send_frame(fd, packet, len, results))
+      break;
+    int64_t sent = vbus_now_ns();
+    dev->polls++;
+
+    if (dev->type == LD_EMULATED) {
+      int64_t replied = read_aqualinkd(fd, sent + REPLY_TIMEOUT_MS * 1000000LL, true, results);
+      if (replied > 0) {
+        add_latency(dev, replied - sent);
+        if (replied - sent > ACK_DEADLINE_MS * 1000000LL)
+          dev->late++;
+      } else if (vbus_running()) {
+        dev->missed++;
+      }
+    } else {
+      read_aqualinkd(fd, sent + turnaround_ns, false, results);
+      len = device_reply(dev, packet);
+      if (!send_frame(fd, packet, len, results))
+        break;
+    }
+
+    // A real panel doesn't speed up to catch up when a reply was slow, so neither do we.
+    next += slot_ns;
+    if (next < vbus_now_ns())
+      next = vbus_now_ns();
+    read_aqualinkd(fd, next, false, results);
+  }
+
+  // Last replies
+  read_aqualinkd(fd, vbus_now_ns() + REPLY_TIMEOUT_MS * 1000000LL, false, results);
+
+  clock_gettime(CLOCK_MONOTONIC, &results->end);
+}
+
+static void print_results(load_results *results, double speed, bool fast, double cpu_sec, bool json)
+{
+  struct timespec elapsed;
+  double wall_sec;
+  vbus_latency lat;
+
+  timespec_subtract(&elapsed, &results->end, &results->start);
+  wall_sec = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+
+  if (json) {
+    printf("{\"wall_sec\": %.3f,\"speed\": %.2f,\"fast\": %s,\"frames\": %d,\"frames_per_sec\": %.1f,\"unsolicited\": %d,\"devices\": [",
+           wall_sec, speed, fast?"true":"false", results->frames, wall_sec > 0 ? results->frames / wall_sec : 0, results->unsolicited);
+    for (int i = 0; i < _num_devices; i++) {
+      load_device *dev = &_devices[i];
+      printf("%s{\"id\": \"0x%02hhx\",\"type\": \"%s\",\"polls\": %d", i?",":"", dev->id, _device_names[dev->type], dev->polls);
+      if (dev->type == LD_EMULATED) {
+        vbus_latency_stats(dev->latency_ns, dev->replies, &lat);
+        printf(",\"replies\": %d,\"missed\": %d,\"late\": %d,\"avg_ms\": %.3f,\"p50_ms\": %.3f,\"p99_ms\": %.3f,\"max_ms\": %.3f",
+               dev->replies, dev->missed, dev->late, lat.avg_ms, lat.p50_ms, lat.p99_ms, lat.max_ms);
+      }
+      printf("}");
+    }
+    printf("]");
+    if (cpu_sec >= 0)
+      printf(",\"cpu_sec\": %.3f,\"cpu_pct\": %.1f", cpu_sec, wall_sec > 0 ? cpu_sec * 100 / wall_sec : 0);
+    printf("}\n");
+    return;
+  }
+
+  if (fast)
+    printf("Ran %.3f sec as fast as possible", wall_sec);
+  else
+    printf("Ran %.3f sec at %.1fx panel speed", wall_sec, speed);
+  printf(", %d frames (%.1f/sec), %d unsolicited from aqualinkd\n",
+         results->frames, wall_sec > 0 ? results->frames / wall_sec : 0, results->unsolicited);
+  printf("%-4s  %-10s %7s %7s %6s %6s %8s %8s %8s %8s\n", "ID", "Device", "Polls", "Replies", "Missed", "Late", "avg ms", "p50 ms", "p99 ms", "max ms");
+  for (int i = 0; i < _num_devices; i++) {
+    load_device *dev = &_devices[i];
+    if (dev->type == LD_EMULATED) {
+      vbus_latency_stats(dev->latency_ns, dev->replies, &lat);
+      printf("0x%02hhx  %-10s %7d %7d %6d %6d %8.3f %8.3f %8.3f %8.3f\n", dev->id, _device_names[dev->type], dev->polls,
+             dev->replies, dev->missed, dev->late, lat.avg_ms, lat.p50_ms, lat.p99_ms, lat.max_ms);
+    } else {
+      printf("0x%02hhx  %-10s %7d\n", dev->id, _device_names[dev->type], dev->polls);
+    }
+  }
+  if (cpu_sec >= 0)
+    printf("aqualinkd CPU %.3f sec (%.1f%%)\n", cpu_sec, wall_sec > 0 ? cpu_sec * 100 / wall_sec : 0);
+}
+
+// -i 0x0a,0x41
+static bool parse_ids(char *list)
+{
+  char *tok;
+
+  for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    char *end;
+    long id = strtol(tok, &end, 16);
+    if (*end != '\0' || id <= 0 || id > 0xFF) {
+      fprintf(stderr, "ERROR, bad ID '%s'\n", tok);
+      return false;
+    }
+    add_device(LD_EMULATED, (unsigned char)id);
+  }
+  return true;
+}
+
+// -d swg,epump,pentair,chem,jxi | all | none
+static bool parse_chatter(char *list)
+{
+  char *tok;
+
+  for (tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    bool all = (strcmp(tok, "all") == 0);
+    bool found = all;
+
+    if (all || strcmp(tok, "swg") == 0)
+      { add_device(LD_SWG, JANDY_DEV_SWG_MIN); found = true; }
+    if (all || strcmp(tok, "epump") == 0)
+      { add_device(LD_EPUMP, JANDY_DEV_PUMP_MIN); found = true; }
+    if (all || strcmp(tok, "pentair") == 0)
+      { add_device(LD_PENTAIR, PENTAIR_DEV_PUMP_MIN); found = true; }
+    if (all || strcmp(tok, "chem") == 0)
+      { add_device(LD_CHEM, JANDY_DEV_CHEM_MIN); found = true; }
+    if (all || strcmp(tok, "jxi") == 0)
+      { add_device(LD_JXI, JANDY_DEV_JXI_MIN); found = true; }
+    if (strcmp(tok, "none") == 0)
+      found = true;
+
+    if (!found) {
+      fprintf(stderr, "ERROR, unknown device '%s'\n", tok);
+      return false;
+    }
+  }
+  return true;
+}
+
+void printUsage(char *self)
+{
+  fprintf(stderr, "%s\n", VERSION);
+  fprintf(stderr, "Usage: %s -l /tmp/aqload [options], then run aqualinkd with serial_port=/tmp/aqload\n", self);
+  fprintf(stderr, "\t-l <path>   (symlink the pty here, use as serial_port in aqualinkd config)\n");
+  fprintf(stderr, "\t-i <ids>    (IDs aqualinkd emulates, comma separated hex, default 0x0a)\n");
+  fprintf(stderr, "\t-d <list>   (other devices on the bus, swg,epump,pentair,chem,jxi or all/none, default all)\n");
+  fprintf(stderr, "\t-t <sec>    (run time, default %d)\n", DEFAULT_RUN_SEC);
+  fprintf(stderr, "\t-s <N>      (run the bus N times faster than a panel)\n");
+  fprintf(stderr, "\t-f          (as fast as possible, only wait for replies)\n");
+  fprintf(stderr, "\t-p <pid>    (report CPU used by aqualinkd process)\n");
+  fprintf(stderr, "\t-j          (print results as JSON)\n");
+}
+
+int main(int argc, char *argv[])
+{
+  load_results results = {0};
+  const char *link = NULL;
+  char default_ids[] = "0x0a";
+  char default_chatter[] = "all";
+  char *ids = default_ids;
+  char *chatter = default_chatter;
+  int run_sec = DEFAULT_RUN_SEC;
+  double speed = 1.0;
+  double cpu_start = -1;
+  double cpu_sec = -1;
+  bool fast = false;
+  bool json = false;
+  pid_t pid = 0;
+  int fd;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 && i+1 < argc) {
+      link = argv[++i];
+    } else if (strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+      ids = argv[++i];
+    } else if (strcmp(argv[i], "-d") == 0 && i+1 < argc) {
+      chatter = argv[++i];
+    } else if (strcmp(argv[i], "-t") == 0 && i+1 < argc) {
+      run_sec = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      speed = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "-f") == 0) {
+      fast = true;
+    } else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) {
+      pid = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      json = true;
+    } else {
+      printUsage(argv[0]);
+      return (strcmp(argv[i], "-h") == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  if (speed <= 0 || run_sec <= 0) {
+    fprintf(stderr, "ERROR, speed and run time must be greater than 0\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!parse_ids(ids) || !parse_chatter(chatter))
+    return EXIT_FAILURE;
+
+  if (_num_devices == 0) {
+    fprintf(stderr, "ERROR, nothing on the bus\n");
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGINT, intHandler);
+  signal(SIGTERM, intHandler);
+
+  if ((fd = vbus_open_pty(link)) < 0)
+    return EXIT_FAILURE;
+
+  if (vbus_wait_for_open(fd)) {
+    delay(START_DELAY_MS);
+    if (pid > 0)
+      cpu_start = vbus_process_cpu(pid);
+
+    run_load(fd, run_sec, speed, fast, &results);
+
+    if (pid > 0 && cpu_start >= 0 && (cpu_sec = vbus_process_cpu(pid)) >= 0)
+      cpu_sec -= cpu_start;
+
+    print_results(&results, speed, fast, cpu_sec, json);
+  }
+
+  if (link != NULL)
+    unlink(link);
+  close(fd);
+  for (int i = 0; i < _num_devices; i++)
+    free(_devices[i].latency_ns);
+
+  return EXIT_SUCCESS;
+}
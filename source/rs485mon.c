@@ -31,6 +31,11 @@
 #include "aq_serial.h"
 #include "utils.h"
 #include "packetLogger.h"
+#include "packet_capture.h"
+#include "capture_decode.h"
+#include "bus_stats.h"
+#include "serial_bench.h"
+#include "virtual_bus.h"
 #include "rs_msg_utils.h"
 
 #ifdef RS485MON
@@ -88,6 +93,7 @@ unsigned char _pfilter[10];
 int _pfilters=0;
 bool _rawlog=false;
 bool _playback_file = false;
+int _busStatsSecs = 0;
 
 
 int sl_timespec_subtract (struct timespec *result, const struct timespec *x, const struct timespec *y);
@@ -616,6 +622,168 @@ void printPacket(unsigned char ID, unsigned char *packet_buffer, int packet_leng
   printf("\n");
 }
 
+void printDecodeStats(const char *filename, decode_stats *stats)
+{
+  int i;
+
+  printf("Decoded %s (%s) %llu bytes, %llu packets in %.3f sec using %d thread%s\n", filename, decode_source_text(stats->source),
+         (unsigned long long)stats->file_bytes, (unsigned long long)stats->frames, stats->elapsed, stats->threads, stats->threads>1?"s":"");
+  printf("Errors checksum %llu, too large %llu, too small %llu\n\n",
+         (unsigned long long)stats->chksum_errors, (unsigned long long)stats->toolarge_errors, (unsigned long long)stats->toosmall_errors);
+
+  printf("Jandy ID's found\n");
+  printf("  ID       Polls   Probes  Replies No reply      Bytes\n");
+  for (i = 0; i < 256; i++) {
+    decode_jandy_id *id = &stats->jandy[i];
+    if (id->polls == 0 && id->replies == 0)
+      continue;
+    printf("  0x%02x %9u %8u %8u %8u %10llu %s\n", i, id->polls, id->probes, id->replies, id->no_reply,
+           (unsigned long long)id->bytes, id->replies > 0?getDevice(i):canUseExtended(i));
+  }
+
+  for (i = 0; i < 256; i++) {
+    if (stats->pentair[i].from > 0 || stats->pentair[i].to > 0)
+      break;
+  }
+  if (i < 256) {
+    printf("\nPentair ID's found\n");
+    printf("  ID        From       To      Bytes\n");
+    for (; i < 256; i++) {
+      decode_pentair_id *id = &stats->pentair[i];
+      if (id->from == 0 && id->to == 0)
+        continue;
+      printf("  0x%02x %9u %8u %10llu %s\n", i, id->from, id->to, (unsigned long long)id->bytes, getPentairDevice(i));
+    }
+  }
+
+  printf("\nUnknown commands\n");
+  for (i = 0; i < 256; i++) {
+    if (stats->jandy_unknown[i].count > 0)
+      printf("  Jandy   0x%02x %9u (first seen with ID 0x%02hhx)\n", i, stats->jandy_unknown[i].count, stats->jandy_unknown[i].first_id);
+  }
+  for (i = 0; i < 256; i++) {
+    if (stats->pentair_unknown[i].count > 0)
+      printf("  Pentair 0x%02x %9u (first seen with ID 0x%02hhx)\n", i, stats->pentair_unknown[i].count, stats->pentair_unknown[i].first_id);
+  }
+}
+
+void printDecodeStatsJSON(const char *filename, decode_stats *stats)
+{
+  bool first;
+  int i;
+
+  printf("{\"file\":\"%s\",\"source\":\"%s\",\"file_bytes\":%llu,\"packets\":%llu,\"packet_bytes\":%llu,\"threads\":%d,\"decode_sec\":%.3f,",
+         filename, decode_source_text(stats->source), (unsigned long long)stats->file_bytes, (unsigned long long)stats->frames,
+         (unsigned long long)stats->frame_bytes, stats->threads, stats->elapsed);
+  printf("\"errors\":{\"checksum\":%llu,\"too_large\":%llu,\"too_small\":%llu},",
+         (unsigned long long)stats->chksum_errors, (unsigned long long)stats->toolarge_errors, (unsigned long long)stats->toosmall_errors);
+
+  printf("\"jandy\":[");
+  for (i = 0, first = true; i < 256; i++) {
+    decode_jandy_id *id = &stats->jandy[i];
+    if (id->polls == 0 && id->replies == 0)
+      continue;
+    printf("%s{\"id\":\"0x%02x\",\"polls\":%u,\"probes\":%u,\"replies\":%u,\"no_reply\":%u,\"bytes\":%llu}",
+           first?"":",", i, id->polls, id->probes, id->replies, id->no_reply, (unsigned long long)id->bytes);
+    first = false;
+  }
+  printf("],\"pentair\":[");
+  for (i = 0, first = true; i < 256; i++) {
+    decode_pentair_id *id = &stats->pentair[i];
+    if (id->from == 0 && id->to == 0)
+      continue;
+    printf("%s{\"id\":\"0x%02x\",\"from\":%u,\"to\":%u,\"bytes\":%llu}", first?"":",", i, id->from, id->to, (unsigned long long)id->bytes);
+    first = false;
+  }
+  printf("],\"unknown\":[");
+  for (i = 0, first = true; i < 512; i++) {
+    decode_unknown_cmd *cmd = (i < 256)?&stats->jandy_unknown[i]:&stats->pentair_unknown[i-256];
+    if (cmd->count == 0)
+      continue;
+    printf("%s{\"protocol\":\"%s\",\"cmd\":\"0x%02x\",\"count\":%u,\"first_id\":\"0x%02hhx\"}",
+           first?"":",", (i < 256)?"jandy":"pentair", i & 0xFF, cmd->count, cmd->first_id);
+    first = false;
+  }
+  printf("]}\n");
+}
+
+int decodeCaptureFile(int argc, char *argv[])
+{
+  decode_stats *stats;
+  int threads = 0;
+  bool json = false;
+  int rtn = EXIT_SUCCESS;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-threads") == 0 && i+1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      json = true;
+    }
+  }
+
+  // Stats are too big for the stack
+  if ((stats = malloc(sizeof(decode_stats))) == NULL)
+    return EXIT_FAILURE;
+
+  // Checksum checks log at info, that's just noise here
+#ifdef AQ_MANAGER
+  setLoggingPrms(LOG_WARNING, false, NULL);
+#else
+  setLoggingPrms(LOG_WARNING, false, false, NULL);
+#endif
+
+  if (!decode_capture_file(argv[1], threads, stats)) {
+    fprintf(stderr, "ERROR, unable to decode '%s'\n", argv[1]);
+    rtn = EXIT_FAILURE;
+  } else if (json) {
+    printDecodeStatsJSON(argv[1], stats);
+  } else {
+    printDecodeStats(argv[1], stats);
+  }
+
+  free(stats);
+  return rtn;
+}
+
+void rttIntHandler(int dummy) {
+  vbus_stop();
+}
+
+int serialBenchmark(int argc, char *argv[])
+{
+  const char *write_port = NULL;
+  int count = RTT_DEFAULT_COUNT;
+  bool json = false;
+
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+      count = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      json = true;
+    } else if (argv[i][0] != '-') {
+      write_port = argv[i];
+    }
+  }
+
+  if (strcmp(argv[1], "pty") != 0 && write_port == NULL) {
+    fprintf(stderr, "ERROR, need a port to write to, ie:-\n\t%s /dev/ttyUSB0 -rtt /dev/ttyUSB1\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  // Log goes to stdout, keep it to errors if that's JSON
+#ifdef AQ_MANAGER
+  setLoggingPrms(json?LOG_ERR:LOG_WARNING, false, NULL);
+#else
+  setLoggingPrms(json?LOG_ERR:LOG_WARNING, false, false, NULL);
+#endif
+
+  signal(SIGINT, rttIntHandler);
+  signal(SIGTERM, rttIntHandler);
+
+  return serial_rtt_benchmark(argv[1], write_port, count, json);
+}
+
 int main(int argc, char *argv[]) {
   int rs_fd;
   int i = 0;
@@ -630,9 +798,25 @@ int main(int argc, char *argv[]) {
   // aq_serial.c uses the following
   _aqconfig_.log_protocol_packets = false;
   _aqconfig_.log_raw_bytes = false;
+  _aqconfig_.log_packet_capture = false;
   _aqconfig_.ftdi_low_latency  = true;
   _aqconfig_.frame_delay = 10;
 
+  // Converting a capture file doesn't need the serial port (or root)
+  if (argc > 2 && (strcmp(argv[2], "-ctext") == 0 || strcmp(argv[2], "-crawb") == 0)) {
+    if (!printCaptureFile(argv[1], stdout, strcmp(argv[2], "-crawb") == 0)) {
+      fprintf(stderr, "ERROR, '%s' is not a valid capture file\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+  }
+  if (argc > 2 && strcmp(argv[2], "-decode") == 0) {
+    return decodeCaptureFile(argc, argv);
+  }
+  if (argc > 2 && strcmp(argv[2], "-rtt") == 0) {
+    return serialBenchmark(argc, argv);
+  }
+
   printf("AqualinkD %s\n",VERSION);
 
   if (getuid() != 0) {
@@ -653,10 +837,15 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "\t-s (Serial Speed Test / OS caching issues)\n");
     fprintf(stderr, "\t-lpack (log RS packets to %s)\n",RS485LOGFILE);
     fprintf(stderr, "\t-lrawb (log raw RS bytes to %s)\n",RS485BYTELOGFILE);
+    fprintf(stderr, "\t-lcap (binary capture of packets, and raw bytes with -lrawb, to %s)\n",RS485CAPFILE);
     fprintf(stderr, "\t-e (monitor errors)\n");
     fprintf(stderr, "\t-a (Print all ID's the panel queried)\n");
     fprintf(stderr, "\t-t (time each packet, will also force -s switch)\n");
+    fprintf(stderr, "\t-bus <seconds> (print bus utilisation per ID as JSON every <seconds>, until stopped)\n");
     fprintf(stderr, "\nie:\t%s /dev/ttyUSB0 -d -p 1000 -i 0x08 -i 0x0a\n\n", argv[0]);
+    fprintf(stderr, "To print a capture file as text (-crawb for raw bytes):-\n\t%s %s -ctext\n\n", argv[0], RS485CAPFILE);
+    fprintf(stderr, "To decode a capture, raw byte log or serial dump offline (-threads <n> default %d, -j for JSON):-\n\t%s %s -decode\n\n", decode_default_threads(), argv[0], RS485CAPFILE);
+    fprintf(stderr, "To benchmark serial latency, writing on one adapter and reading on another wired to it, or over a pty (-n <frames> default %d, -j for JSON):-\n\t%s /dev/ttyUSB0 -rtt /dev/ttyUSB1\n\t%s pty -rtt\n\n", RTT_DEFAULT_COUNT, argv[0], argv[0]);
     return 1;
   }
 
@@ -691,6 +880,8 @@ int main(int argc, char *argv[]) {
       _aqconfig_.log_protocol_packets = true;
     } else if (strcmp(argv[i], "-lrawb") == 0) {
       _aqconfig_.log_raw_bytes = true;
+    } else if (strcmp(argv[i], "-lcap") == 0) {
+      _aqconfig_.log_packet_capture = true;
     } else if (strcmp(argv[i], "-n") == 0) {
       panleProbe = false;
     } else if (strcmp(argv[i], "-s") == 0) {
@@ -702,9 +893,17 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[i], "-t") == 0) {
       timePackets = true;
       logLevel = LOG_DEBUG;
+    } else if (strcmp(argv[i], "-bus") == 0 && i+1 < argc) {
+      _busStatsSecs = atoi(argv[++i]);
     }
   }
 
+  // Bus stats are passive, so don't talk to the panel, and runs until stopped
+  if (_busStatsSecs > 0) {
+    panleProbe = false;
+    logLevel = LOG_NOTICE;
+  }
+
 #ifdef AQ_MANAGER
   setLoggingPrms(logLevel, false, NULL);
 #else
@@ -735,18 +934,27 @@ int main(int argc, char *argv[]) {
   } else {
     LOG(SLOG_LOG, LOG_NOTICE, "Logging serial errors!\n");
   }
-  if (_aqconfig_.log_protocol_packets)
+  if (_aqconfig_.log_protocol_packets && !_aqconfig_.log_packet_capture)
      LOG(SLOG_LOG, LOG_NOTICE, "Logging packets to %s!\n",RS485LOGFILE);
-  if (_aqconfig_.log_raw_bytes)
+  if (_aqconfig_.log_packet_capture)
+     LOG(SLOG_LOG, LOG_NOTICE, "Capturing %s to %s!\n",_aqconfig_.log_raw_bytes?"packets & raw bytes":"packets",RS485CAPFILE);
+  else if (_aqconfig_.log_raw_bytes)
      LOG(SLOG_LOG, LOG_NOTICE, "Logging raw bytes to %s!\n",RS485BYTELOGFILE);
 
-  if (logLevel < LOG_DEBUG && errorMonitor==false )
+  if (logLevel < LOG_DEBUG && errorMonitor==false && _busStatsSecs == 0)
     printf("Please wait.");
 
   startPacketLogger();
 
+  if (_busStatsSecs > 0)
+    bus_stats_init(_busStatsSecs);
+
   _rs485mon(rs_fd, argv[1], logPackets, logLevel, panleProbe, rsSerialSpeedTest, errorMonitor, printAllIDs, timePackets);
 
+  // Whatever we have of the last window
+  if (_busStatsSecs > 0)
+    bus_stats_report(stdout);
+
   stopPacketLogger();
 
   close_serial_port(rs_fd);
@@ -811,6 +1019,22 @@ int _rs485mon(int rs_fd, char *port_name, int logPackets, int logLevel, bool pan
 
     packet_length = get_packet(rs_fd, packet_buffer);
 
+#ifdef RS485MON
+    if (_busStatsSecs > 0) {
+      struct timespec now;
+      if (packet_length > 0 || packet_length == AQSERR_CHKSUM || packet_length == AQSERR_2SMALL || packet_length == AQSERR_2LARGE) {
+        get_last_read_time(&now);
+        if (packet_length > 0)
+          bus_stats_packet(packet_buffer, packet_length, &now);
+        else
+          bus_stats_error(packet_length, &now);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (bus_stats_due(&now))
+        bus_stats_report(stdout);
+    }
+#endif
+
     if (timePackets) {
       clock_gettime(CLOCK_REALTIME, &packet_end_time);
       sl_timespec_subtract(&packet_elapsed, &packet_end_time, &packet_start_time);
@@ -950,7 +1174,7 @@ int _rs485mon(int rs_fd, char *port_name, int logPackets, int logLevel, bool pan
     }
 #endif
  
-    if (logPackets != 0 && received_packets >= logPackets) {
+    if (logPackets != 0 && received_packets >= logPackets && _busStatsSecs == 0) {
       _keepRunning = false;
     }
   
@@ -960,7 +1184,7 @@ int _rs485mon(int rs_fd, char *port_name, int logPackets, int logLevel, bool pan
         last_packet_length = packet_length;
         received_packets = 0;
       }
-    } else if (logLevel < LOG_DEBUG) {
+    } else if (logLevel < LOG_DEBUG && _busStatsSecs == 0) {
 #ifdef RS485MON
       advance_cursor();
 #endif
@@ -0,0 +1,443 @@
+
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the 
+ * Free Software Foundation. For the terms of this license, 
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+/*
+ * Replay captured RS485 traffic into aqualinkd through a pseudo terminal.
+ *
+ * Point aqualinkd's serial_port at the pty (or the -l symlink) and every packet read
+ * in the capture is played back, either with its original timing, N times faster, or
+ * as fast as aqualinkd can answer.  Packets that aqualinkd answered in the capture
+ * (ie a Read followed by a Write) are timed until a reply comes back, so the same
+ * capture gives comparable ACK latency (and CPU with -p) between builds.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include "aq_serial.h"
+#include "utils.h"
+#include "packet_capture.h"
+#include "timespec_subtract.h"
+#include "virtual_bus.h"
+
+#define VERSION "rs485replay V1.0"
+
+#define REPLY_TIMEOUT_MS     50   // No reply in this long is a miss
+#define TEXT_GAP_MS          5    // Text captures have no timestamps, gap between packets
+#define START_DELAY_MS       1000 // After aqualinkd opens the port, give it time to start up
+
+typedef struct replay_frame {
+  int64_t offset_ns;   // From the first packet in the capture
+  bool error;          // Captured as a bad packet, replayed as is
+  bool expect_reply;   // aqualinkd answered this in the capture
+  int length;
+  unsigned char data[AQ_MAXPKTLEN];
+  int reply_length;    // What aqualinkd sent back in the capture, if expect_reply
+  unsigned char reply[AQ_MAXPKTLEN];
+} replay_frame;
+
+typedef struct replay_results {
+  int sent;
+  int expected;
+  int replied;
+  int missed;
+  int mismatched;   // Reply didn't match the one in the capture
+  int unsolicited;  // Reply when we weren't expecting one
+  int64_t *latency_ns;
+  struct timespec start;
+  struct timespec end;
+} replay_results;
+
+void intHandler(int dummy)
+{
+  vbus_stop();
+}
+
+static replay_frame *add_frame(replay_frame **frames, int *count, int *size)
+{
+  if (*count >= *size) {
+    *size = *size ? *size * 2 : 1024;
+    if ((*frames = realloc(*frames, *size * sizeof(replay_frame))) == NULL) {
+      fprintf(stderr, "ERROR, out of memory loading capture\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  memset(&(*frames)[*count], 0, sizeof(replay_frame));
+  return &(*frames)[(*count)++];
+}
+
+// A write straight after a read is aqualinkd's reply to it.
+static void add_reply(replay_frame *frames, int count, const unsigned char *data, int length)
+{
+  replay_frame *last;
+
+  if (count == 0 || length > AQ_MAXPKTLEN)
+    return;
+
+  last = &frames[count - 1];
+  if (last->expect_reply)
+    return;
+
+  last->expect_reply = true;
+  last->reply_length = length;
+  memcpy(last->reply, data, length);
+}
+
+static int load_binary_capture(FILE *fp, const capture_file_header *header, replay_frame **frames)
+{
+  capture_record record;
+  unsigned char data[CAPTURE_MAX_RECORD];
+  replay_frame *frame;
+  int64_t first = -1;
+  int count = 0;
+  int size = 0;
+  int length;
+
+  while ((length = read_capture_record(fp, header, &record, data, sizeof(data))) >= 0) {
+    if ((record.flags & CAPTURE_RAW) || length <= 0 || length > AQ_MAXPKTLEN)
+      continue;
+
+    if (record.direction == CAPTURE_WRITE) {
+      add_reply(*frames, count, data, length);
+      continue;
+    }
+
+    if (first < 0)
+      first = record.timestamp_ns;
+
+    frame = add_frame(frames, &count, &size);
+    frame->offset_ns = record.timestamp_ns - first;
+    frame->error = (record.flags & CAPTURE_ERROR);
+    frame->length = length;
+    memcpy(frame->data, data, length);
+  }
+
+  return count;
+}
+
+/*
+ * Text captures, RS485LOGFILE / log file lines with "HEX: 0x10|0x02|..." or lines of just hex (dummy_reader format).
+ * No timestamps so packets are spaced by their wire time plus TEXT_GAP_MS.
+ */
+static int load_text_capture(FILE *fp, replay_frame **frames)
+{
+  char line[4000];
+  unsigned char data[AQ_MAXPKTLEN];
+  replay_frame *frame;
+  int64_t offset = 0;
+  int count = 0;
+  int size = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char *hex = strstr(line, "HEX:");
+    bool is_write = false;
+    unsigned int byte;
+    int length = 0;
+    int n;
+
+    if (hex != NULL) {
+      *hex = '\0';
+      is_write = (strstr(line, "Write") != NULL);
+      hex += 4;
+    } else if (strncmp(line, "0x", 2) == 0) {
+      hex = line;
+    } else {
+      continue;
+    }
+
+    while (length < AQ_MAXPKTLEN && sscanf(hex, " 0x%2x|%n", &byte, &n) == 1) {
+      data[length++] = byte;
+      hex += n;
+    }
+
+    if (length == 0)
+      continue;
+
+    if (is_write) {
+      add_reply(*frames, count, data, length);
+      continue;
+    }
+
+    frame = add_frame(frames, &count, &size);
+    frame->offset_ns = offset;
+    frame->error = (strstr(line, "BAD PACKET") != NULL);
+    frame->length = length;
+    memcpy(frame->data, data, length);
+    offset += (int64_t)length * VBUS_BYTE_TIME_NS + TEXT_GAP_MS * 1000000LL;
+  }
+
+  return count;
+}
+
+/*
+ * Replies we're waiting on, oldest first.  With original timing the next packet is often
+ * due before aqualinkd has answered the last one (it waits frame_delay, a real panel waits
+ * for it), so replies are matched in order rather than only to the last packet sent.
+ */
+#define OUTSTANDING_MAX 64
+
+typedef struct outstanding_reply {
+  int64_t sent_ns;
+  const replay_frame *frame;
+} outstanding_reply;
+
+static outstanding_reply _outstanding[OUTSTANDING_MAX];
+static unsigned int _out_head = 0;
+static unsigned int _out_tail = 0;
+
+static void expire_replies(int64_t now, replay_results *results)
+{
+  while (_out_tail != _out_head && now - _outstanding[_out_tail % OUTSTANDING_MAX].sent_ns > REPLY_TIMEOUT_MS * 1000000LL) {
+    results->missed++;
+    _out_tail++;
+  }
+}
+
+/*
+ * Read whatever aqualinkd has sent until the deadline, or (if until_answered) until
+ * there are no replies outstanding.
+ */
+static void read_replies(int fd, int64_t deadline, bool until_answered, replay_results *results)
+{
+  static unsigned char rx[AQ_MAXPKTLEN * 2];
+  static int rx_len = 0;
+  unsigned char reply[AQ_MAXPKTLEN];
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int64_t now;
+  int len;
+  int rtn;
+
+  while (vbus_running() && (now = vbus_now_ns()) < deadline) {
+    expire_replies(now, results);
+    if (until_answered && _out_tail == _out_head)
+      return;
+
+    rtn = poll(&pfd, 1, (deadline - now + 999999) / 1000000);
+    if (rtn < 0 && errno != EINTR)
+      return;
+    if (rtn <= 0)
+      continue;
+    if (pfd.revents & POLLHUP) {
+      fprintf(stderr, "aqualinkd closed the port\n");
+      vbus_stop();
+      return;
+    }
+
+    if ((len = read(fd, &rx[rx_len], sizeof(rx) - rx_len)) <= 0)
+      continue;
+    rx_len += len;
+    now = vbus_now_ns();
+
+    while ((len = vbus_next_frame(rx, &rx_len, reply)) > 0) {
+      const outstanding_reply *out;
+
+      if (_out_tail == _out_head) {
+        results->unsolicited++;
+        continue;
+      }
+      out = &_outstanding[_out_tail++ % OUTSTANDING_MAX];
+      results->latency_ns[results->replied++] = now - out->sent_ns;
+      if (len != out->frame->reply_length || memcmp(reply, out->frame->reply, len) != 0)
+        results->mismatched++;
+    }
+
+    if (rx_len >= sizeof(rx))
+      rx_len = 0; // Garbage, start again
+  }
+
+  expire_replies(vbus_now_ns(), results);
+}
+
+static int replay(int fd, replay_frame *frames, int count, double speed, bool fast, replay_results *results)
+{
+  unsigned char wire[AQ_MAXPKTLEN * 2];
+  int64_t start = vbus_now_ns();
+  int64_t timeout = REPLY_TIMEOUT_MS * 1000000LL;
+
+  clock_gettime(CLOCK_MONOTONIC, &results->start);
+
+  for (int i = 0; i < count && vbus_running(); i++) {
+    replay_frame *frame = &frames[i];
+    int64_t due;
+    int len;
+
+    if (fast) {
+      // Only thing holding us back is aqualinkd answering
+      read_replies(fd, vbus_now_ns() + timeout, true, results);
+      due = vbus_now_ns();
+    } else {
+      due = start + (int64_t)(frame->offset_ns / speed);
+      read_replies(fd, due, false, results);
+      vbus_sleep_until_ns(due);
+    }
+
+    len = vbus_escape_frame(frame->data, frame->length, wire);
+    if (write(fd, wire, len) != len) {
+      fprintf(stderr, "ERROR, write to pty failed: %s\n", strerror(errno));
+      break;
+    }
+    results->sent++;
+
+    if (frame->expect_reply) {
+      results->expected++;
+      if (_out_head - _out_tail >= OUTSTANDING_MAX) {
+        results->missed++;
+        _out_tail++;
+      }
+      _outstanding[_out_head++ % OUTSTANDING_MAX] = (outstanding_reply){vbus_now_ns(), frame};
+    }
+  }
+
+  // Last replies
+  read_replies(fd, vbus_now_ns() + timeout, true, results);
+
+  clock_gettime(CLOCK_MONOTONIC, &results->end);
+  return results->sent;
+}
+
+static void print_results(replay_results *results, double cpu_sec, bool json)
+{
+  struct timespec elapsed;
+  double wall_sec;
+  vbus_latency lat;
+
+  timespec_subtract(&elapsed, &results->end, &results->start);
+  wall_sec = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+  vbus_latency_stats(results->latency_ns, results->replied, &lat);
+
+  if (json) {
+    printf("{\"sent\": %d,\"expected_replies\": %d,\"replies\": %d,\"missed\": %d,\"mismatched\": %d,\"unsolicited\": %d,"
+           "\"avg_ms\": %.3f,\"p50_ms\": %.3f,\"p99_ms\": %.3f,\"max_ms\": %.3f,\"wall_sec\": %.3f",
+           results->sent, results->expected, results->replied, results->missed, results->mismatched, results->unsolicited,
+           lat.avg_ms, lat.p50_ms, lat.p99_ms, lat.max_ms, wall_sec);
+    if (cpu_sec >= 0)
+      printf(",\"cpu_sec\": %.3f,\"cpu_pct\": %.1f", cpu_sec, wall_sec > 0 ? cpu_sec * 100 / wall_sec : 0);
+    printf("}\n");
+    return;
+  }
+
+  printf("Sent %d packets in %.3f sec\n", results->sent, wall_sec);
+  printf("Replies %d of %d expected, %d missed, %d didn't match capture, %d unsolicited\n",
+         results->replied, results->expected, results->missed, results->mismatched, results->unsolicited);
+  printf("Reply latency avg %.3fms p50 %.3fms p99 %.3fms max %.3fms\n", lat.avg_ms, lat.p50_ms, lat.p99_ms, lat.max_ms);
+  if (cpu_sec >= 0)
+    printf("aqualinkd CPU %.3f sec (%.1f%%)\n", cpu_sec, wall_sec > 0 ? cpu_sec * 100 / wall_sec : 0);
+}
+
+int main(int argc, char *argv[])
+{
+  capture_file_header header;
+  replay_frame *frames = NULL;
+  replay_results results = {0};
+  const char *link = NULL;
+  double speed = 1.0;
+  double cpu_start = -1;
+  double cpu_sec = -1;
+  bool fast = false;
+  bool json = false;
+  pid_t pid = 0;
+  int count;
+  int fd;
+  FILE *fp;
+
+  if (argc < 2 || access(argv[1], R_OK) == -1) {
+    fprintf(stderr, "%s\n", VERSION);
+    fprintf(stderr, "ERROR, first param must be a capture file (%s from -rscap, or a text packet log), ie:-\n\t%s %s -l /tmp/aqreplay\n\n", RS485CAPFILE, argv[0], RS485CAPFILE);
+    fprintf(stderr, "Optional parameters are :-\n");
+    fprintf(stderr, "\t-l <path> (symlink the pty here, use as serial_port in aqualinkd config)\n");
+    fprintf(stderr, "\t-s <N>    (play N times faster than captured)\n");
+    fprintf(stderr, "\t-f        (as fast as possible, only wait for replies)\n");
+    fprintf(stderr, "\t-p <pid>  (report CPU used by aqualinkd process)\n");
+    fprintf(stderr, "\t-j        (print results as JSON)\n");
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 && i+1 < argc) {
+      link = argv[++i];
+    } else if (strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+      speed = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "-f") == 0) {
+      fast = true;
+    } else if (strcmp(argv[i], "-p") == 0 && i+1 < argc) {
+      pid = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      json = true;
+    }
+  }
+
+  if (speed <= 0) {
+    fprintf(stderr, "ERROR, speed must be greater than 0\n");
+    return EXIT_FAILURE;
+  }
+
+  if ((fp = open_capture_file(argv[1], &header)) != NULL) {
+    count = load_binary_capture(fp, &header, &frames);
+  } else if ((fp = fopen(argv[1], "r")) != NULL) {
+    count = load_text_capture(fp, &frames);
+  } else {
+    fprintf(stderr, "ERROR, can't open %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  fclose(fp);
+
+  if (count == 0) {
+    fprintf(stderr, "ERROR, no packets in %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  results.latency_ns = calloc(count, sizeof(int64_t));
+  if (!json)
+    printf("Loaded %d packets, %.3f sec of traffic\n", count, frames[count - 1].offset_ns / 1e9);
+
+  signal(SIGINT, intHandler);
+  signal(SIGTERM, intHandler);
+
+  if ((fd = vbus_open_pty(link)) < 0)
+    return EXIT_FAILURE;
+
+  if (vbus_wait_for_open(fd)) {
+    delay(START_DELAY_MS);
+    if (pid > 0)
+      cpu_start = vbus_process_cpu(pid);
+
+    replay(fd, frames, count, speed, fast, &results);
+
+    if (pid > 0 && cpu_start >= 0 && (cpu_sec = vbus_process_cpu(pid)) >= 0)
+      cpu_sec -= cpu_start;
+
+    print_results(&results, cpu_sec, json);
+  }
+
+  if (link != NULL)
+    unlink(link);
+  close(fd);
+  free(results.latency_ns);
+  free(frames);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the 
+ * Free Software Foundation. For the terms of this license, 
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "aqualink.h"
+#include "utils.h"
+#include "config.h"
+#include "aq_serial.h"
+#include "rs_decoder.h"
+#include "aq_snapshot.h"
+#include "devices_jandy.h"
+#include "devices_pentair.h"
+#include "debug_timer.h"
+
+#define DECODE_RING_MASK (DECODE_RING_SLOTS - 1)
+
+typedef struct decode_frame {
+  decode_type type;
+  int length;
+  unsigned char packet[AQ_MAXPKTLEN];
+} decode_frame;
+
+/*
+ * head is only written by the serial thread, tail only by the decoder thread.
+ * waiting is set by the decoder before it blocks on wake_fd, so the serial thread
+ * only pays for a write() when the decoder is actually asleep.
+ */
+struct decoderthread {
+  pthread_t thread_id;
+  struct aqualinkdata *aqdata;
+  decode_frame slot[DECODE_RING_SLOTS];
+  atomic_uint head;
+  atomic_uint tail;
+  atomic_bool waiting;
+  atomic_bool running;
+  int wake_fd;
+  uint32_t dropped;
+};
+
+static struct decoderthread _decoder = {.wake_fd = -1};
+
+static void decode_frame_now(struct aqualinkdata *aqdata, decode_type type, unsigned char *packet, int length)
+{
+#ifdef AQ_TM_DEBUG
+  int tid;
+#endif
+  DEBUG_TIMER_START(&tid);
+
+  aqdata_decode_begin();
+  switch (type) {
+    case DECODE_READONLY:
+      if (getProtocolType(packet) == JANDY) {
+        processJandyPacket(packet, length, aqdata);
+      }
+      // Process Pentair Device Packed (pentair have to & from in message, so no need to)
+      else if (getProtocolType(packet) == PENTAIR && READ_RSDEV_vsfPUMP) {
+        processPentairPacket(packet, length, aqdata);
+        // In the future probably add code to catch device offline (ie missing reply message)
+      }
+      DEBUG_TIMER_STOP(tid, AQUA_LOG, "Processed (readonly) packet in");
+    break;
+  }
+  aqdata_decode_end();
+}
+
+static void wake_decoder()
+{
+  uint64_t one = 1;
+
+  if (write(_decoder.wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    // Counter is saturated, so decoder is already due to wake up.
+  }
+}
+
+void *decoder_worker(void *ptr)
+{
+  struct decoderthread *dthread = (struct decoderthread *) ptr;
+  unsigned int tail;
+  uint64_t count;
+
+  LOG(AQUA_LOG, LOG_NOTICE, "Started decoder thread\n");
+
+  while (atomic_load(&dthread->running)) {
+    tail = atomic_load_explicit(&dthread->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&dthread->head, memory_order_acquire)) {
+      // Empty, tell the producer we're going to sleep then re-check so we can't miss a frame.
+      atomic_store(&dthread->waiting, true);
+      if (tail == atomic_load(&dthread->head) && atomic_load(&dthread->running)) {
+        if (read(dthread->wake_fd, &count, sizeof(count)) != sizeof(count)) {
+          // Interrupted, simply go round again.
+        }
+      }
+      atomic_store(&dthread->waiting, false);
+      continue;
+    }
+
+    decode_frame *frame = &dthread->slot[tail & DECODE_RING_MASK];
+    decode_frame_now(dthread->aqdata, frame->type, frame->packet, frame->length);
+
+    atomic_store_explicit(&dthread->tail, tail + 1, memory_order_release);
+  }
+
+  LOG(AQUA_LOG, LOG_DEBUG, "End decoder thread\n");
+  pthread_exit(0);
+}
+
+bool start_decoder_thread(struct aqualinkdata *aqdata)
+{
+  _decoder.aqdata = aqdata;
+  _decoder.dropped = 0;
+  atomic_store(&_decoder.head, 0);
+  atomic_store(&_decoder.tail, 0);
+  atomic_store(&_decoder.waiting, false);
+
+  _decoder.wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (_decoder.wake_fd < 0) {
+    LOGSystemError(errno, AQUA_LOG, "decoder eventfd");
+    return false;
+  }
+
+  atomic_store(&_decoder.running, true);
+  if (pthread_create(&_decoder.thread_id, NULL, decoder_worker, (void*)&_decoder) != 0) {
+    LOG(AQUA_LOG, LOG_ERR, "could not create decoder thread, decoding on serial thread\n");
+    atomic_store(&_decoder.running, false);
+    close(_decoder.wake_fd);
+    _decoder.wake_fd = -1;
+    return false;
+  }
+
+  return true;
+}
+
+void stop_decoder_thread()
+{
+  if (!atomic_load(&_decoder.running))
+    return;
+
+  LOG(AQUA_LOG, LOG_INFO, "Stopping decoder thread\n");
+
+  atomic_store(&_decoder.running, false);
+  wake_decoder();
+  pthread_join(_decoder.thread_id, NULL);
+
+  close(_decoder.wake_fd);
+  _decoder.wake_fd = -1;
+
+  if (_decoder.dropped > 0)
+    LOG(AQUA_LOG, LOG_WARNING, "Decoder thread dropped %u packets, it couldn't keep up\n", _decoder.dropped);
+}
+
+/*
+ * Called from the serial thread only.  Return false if the frame was dropped because the
+ * decoder has fallen a whole ring behind, better to lose a status update than delay an ACK.
+ */
+bool queue_packet_decode(decode_type type, const unsigned char *packet, int length)
+{
+  unsigned int head;
+  decode_frame *frame;
+
+  if (!atomic_load_explicit(&_decoder.running, memory_order_relaxed)) {
+    // No thread, so decode inline like we always used to.
+    decode_frame_now(_decoder.aqdata, type, (unsigned char *)packet, length);
+    return true;
+  }
+
+  head = atomic_load_explicit(&_decoder.head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&_decoder.tail, memory_order_acquire) >= DECODE_RING_SLOTS) {
+    if (_decoder.dropped++ % 100 == 0)
+      LOG(AQUA_LOG, LOG_WARNING, "Decoder thread is behind, dropped packet (%u dropped so far)\n", _decoder.dropped);
+    return false;
+  }
+
+  frame = &_decoder.slot[head & DECODE_RING_MASK];
+  frame->type = type;
+  frame->length = AQ_MIN(length, AQ_MAXPKTLEN);
+  memcpy(frame->packet, packet, frame->length);
+
+  atomic_store(&_decoder.head, head + 1);
+
+  if (atomic_load(&_decoder.waiting))
+    wake_decoder();
+
+  return true;
+}
@@ -0,0 +1,24 @@
+#ifndef RS_DECODER_H_
+#define RS_DECODER_H_
+
+#include <stdbool.h>
+
+#include "aqualink.h"
+
+/*
+ * Decoder thread, takes state decoding that doesn't affect our reply off the serial thread.
+ * Frames are handed over through a single producer (serial thread) / single consumer
+ * (decoder thread) ring, so queuing a frame never blocks or takes a lock.
+ */
+
+#define DECODE_RING_SLOTS 64 // Must be power of 2
+
+typedef enum decode_type {
+  DECODE_READONLY  // Packet to or from a device we only listen to, see read_RS485_devmask
+} decode_type;
+
+bool start_decoder_thread(struct aqualinkdata *aqdata);
+void stop_decoder_thread();
+bool queue_packet_decode(decode_type type, const unsigned char *packet, int length);
+
+#endif // RS_DECODER_H_
@@ -12,6 +12,7 @@
 #include "aqualink.h"
 //#include "utils.h"
 #include "sensors.h"
+#include "aq_snapshot.h"
 
 
 /*
@@ -171,7 +172,9 @@ bool read_sensor(external_sensor *sensor) {
   LOG(AQUA_LOG,LOG_DEBUG, "Read sensor %s value=%.2f\n",sensor->label, value);
 
   if (sensor->value != value) {
+    aqdata_write_begin();
     sensor->value = value;
+    aqdata_write_end();
     return TRUE;
   }
 
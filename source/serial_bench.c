@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#include "aq_serial.h"
+#include "utils.h"
+#include "virtual_bus.h"
+#include "serial_bench.h"
+
+#define RTT_SPACING_MS 10   // Quiet time between frames, so each one starts with an idle port
+#define RTT_TIMEOUT_MS 1000 // Give up on a frame after this
+
+/*
+ * How the reader waits.  get_packet() select()s then read()s an O_NONBLOCK port, so VMIN/VTIME
+ * don't matter to it, the others are what a blocking read() would see with those settings.
+ */
+typedef struct rtt_mode {
+  const char *name;
+  bool nonblock;
+  unsigned char vmin;
+  unsigned char vtime;
+} rtt_mode;
+
+// What we send most, an ACK, with the leading NUL
+static const unsigned char _rtt_frame[] = {NUL, DLE, STX, DEV_MASTER, CMD_ACK, 0x00, 0x00, 0x13, DLE, ETX};
+#define RTT_FRAME_LEN (int)sizeof(_rtt_frame)
+
+static const rtt_mode _rtt_modes[] = {
+  {"select+read", true, 0, 10}, // init_serial_port()
+  {"VMIN 0 VTIME 10", false, 0, 10},
+  {"VMIN 1 VTIME 0", false, 1, 0},
+  {"VMIN 10 VTIME 0", false, RTT_FRAME_LEN, 0},
+  {"VMIN 255 VTIME 1", false, 255, 1}, // Only returns after 100ms of quiet
+};
+#define RTT_MODES (int)(sizeof(_rtt_modes) / sizeof(rtt_mode))
+
+typedef struct rtt_reader {
+  pthread_t thread_id;
+  int fd;
+  const rtt_mode *mode;
+  int count;
+  atomic_int done;
+  int64_t *rx_ns; // When the last byte of each frame was read
+} rtt_reader;
+
+typedef struct rtt_result {
+  const rtt_mode *mode;
+  int low_latency; // 1 on, 0 off, -1 port doesn't support it
+  int count;
+  int lost;
+  vbus_latency drain;
+  vbus_latency wakeup;
+  vbus_latency round_trip;
+} rtt_result;
+
+static void *rtt_read_thread(void *ptr)
+{
+  rtt_reader *rd = (rtt_reader *)ptr;
+  unsigned char buf[256];
+  int bytes = 0;
+  int done = 0;
+  int n;
+
+  while (done < rd->count) {
+    if (rd->mode->nonblock) {
+      fd_set readfds;
+      FD_ZERO(&readfds);
+      FD_SET(rd->fd, &readfds);
+      if (select(rd->fd + 1, &readfds, NULL, NULL, NULL) <= 0)
+        continue;
+    }
+
+    if ((n = read(rd->fd, buf, sizeof(buf))) <= 0)
+      continue;
+
+    int64_t now = vbus_now_ns();
+    for (bytes += n; bytes >= RTT_FRAME_LEN && done < rd->count; bytes -= RTT_FRAME_LEN) {
+      rd->rx_ns[done++] = now;
+      atomic_store(&rd->done, done);
+    }
+  }
+
+  return NULL;
+}
+
+static bool set_read_mode(int fd, const char *port, const rtt_mode *mode)
+{
+  int flags = fcntl(fd, F_GETFL);
+
+  if (set_serial_port_attr(fd, port, mode->vmin, mode->vtime) != 0)
+    return false;
+
+  if (mode->nonblock)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+
+  return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+static bool rtt_run(int rfd, const char *read_port, int wfd, const rtt_mode *mode, int count, rtt_result *result)
+{
+  rtt_reader rd = {.fd = rfd, .mode = mode, .count = count};
+  int64_t *tx_ns = malloc(count * sizeof(int64_t));
+  int64_t *drain_ns = malloc(count * sizeof(int64_t));
+  int64_t *wakeup_ns = malloc(count * sizeof(int64_t));
+  int64_t *rtt_ns = malloc(count * sizeof(int64_t));
+  int sent;
+
+  result->mode = mode;
+  result->count = 0;
+  result->lost = 0;
+
+  rd.rx_ns = malloc(count * sizeof(int64_t));
+  if (tx_ns == NULL || drain_ns == NULL || wakeup_ns == NULL || rtt_ns == NULL || rd.rx_ns == NULL ||
+      !set_read_mode(rfd, read_port, mode)) {
+    free(tx_ns); free(drain_ns); free(wakeup_ns); free(rtt_ns); free(rd.rx_ns);
+    return false;
+  }
+  tcflush(rfd, TCIOFLUSH);
+
+  if (pthread_create(&rd.thread_id, NULL, rtt_read_thread, (void *)&rd) != 0) {
+    free(tx_ns); free(drain_ns); free(wakeup_ns); free(rtt_ns); free(rd.rx_ns);
+    return false;
+  }
+
+  for (sent = 0; sent < count && vbus_running(); sent++) {
+    int64_t deadline;
+
+    delay(RTT_SPACING_MS);
+    tx_ns[sent] = vbus_now_ns();
+    if (write(wfd, _rtt_frame, RTT_FRAME_LEN) != RTT_FRAME_LEN)
+      break;
+    tcdrain(wfd);
+    drain_ns[sent] = vbus_now_ns() - tx_ns[sent];
+
+    // Reader is on its own thread, it's already waiting on the port like get_packet() would be
+    deadline = vbus_now_ns() + RTT_TIMEOUT_MS * 1000000LL;
+    while (atomic_load(&rd.done) <= sent && vbus_now_ns() < deadline)
+      vbus_sleep_until_ns(vbus_now_ns() + 100000);
+    if (atomic_load(&rd.done) <= sent) {
+      // Lost bytes, frames won't line up any more
+      result->lost = count - sent;
+      break;
+    }
+  }
+
+  pthread_cancel(rd.thread_id);
+  pthread_join(rd.thread_id, NULL);
+
+  result->count = atomic_load(&rd.done);
+  for (int i = 0; i < result->count; i++) {
+    int64_t drained = tx_ns[i] + drain_ns[i];
+    // On a pty the reader can have the bytes before tcdrain() returns
+    wakeup_ns[i] = rd.rx_ns[i] > drained ? rd.rx_ns[i] - drained : 0;
+    rtt_ns[i] = rd.rx_ns[i] - tx_ns[i];
+  }
+  vbus_latency_stats(drain_ns, result->count, &result->drain);
+  vbus_latency_stats(wakeup_ns, result->count, &result->wakeup);
+  vbus_latency_stats(rtt_ns, result->count, &result->round_trip);
+
+  free(tx_ns);
+  free(drain_ns);
+  free(wakeup_ns);
+  free(rtt_ns);
+  free(rd.rx_ns);
+
+  return true;
+}
+
+static int open_pty_pair(int *master, char *slave_name, int size)
+{
+  char *name;
+
+  if ((*master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 || grantpt(*master) != 0 ||
+      unlockpt(*master) != 0 || (name = ptsname(*master)) == NULL) {
+    fprintf(stderr, "ERROR, can't create pty: %s\n", strerror(errno));
+    return -1;
+  }
+  snprintf(slave_name, size, "%s", name);
+
+  return open(slave_name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static const char *low_latency_text(int low_latency)
+{
+  return low_latency < 0 ? "n/a" : (low_latency ? "on" : "off");
+}
+
+static void print_latency(const vbus_latency *lat)
+{
+  printf(" %6.2f %6.2f %6.2f %6.2f %6.2f |", lat->min_ms, lat->p50_ms, lat->p90_ms, lat->p99_ms, lat->max_ms);
+}
+
+static void print_latency_json(const char *name, const vbus_latency *lat)
+{
+  printf("\"%s\":{\"min\":%.3f,\"avg\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+         name, lat->min_ms, lat->avg_ms, lat->p50_ms, lat->p90_ms, lat->p99_ms, lat->max_ms);
+}
+
+static bool meets_window(const rtt_result *r)
+{
+  return r->lost == 0 && r->count > 0 && r->round_trip.p99_ms < RTT_REPLY_WINDOW_MS;
+}
+
+static void print_results(const char *read_port, const char *write_port, int count, rtt_result *results, int nresults)
+{
+  printf("Serial round trip, %d x %d byte frames, written to %s, read from %s\n", count, RTT_FRAME_LEN, write_port, read_port);
+  printf("Latency in ms (min p50 p90 p99 max), p99 round trip has to be under %dms to keep up with the panel\n\n", RTT_REPLY_WINDOW_MS);
+  printf("%-4s %-17s | %-34s | %-34s | %-34s |\n", "LL", "Read", "write -> tcdrain", "read wakeup after tcdrain", "round trip");
+  for (int i = 0; i < nresults; i++) {
+    rtt_result *r = &results[i];
+    printf("%-4s %-17s |", low_latency_text(r->low_latency), r->mode->name);
+    print_latency(&r->drain);
+    print_latency(&r->wakeup);
+    print_latency(&r->round_trip);
+    if (r->lost > 0)
+      printf(" lost %d\n", r->lost);
+    else
+      printf(" %s\n", meets_window(r) ? "ok" : "TOO SLOW");
+  }
+}
+
+static void print_results_json(const char *read_port, const char *write_port, int count, rtt_result *results, int nresults)
+{
+  printf("{\"read_port\":\"%s\",\"write_port\":\"%s\",\"frames\":%d,\"frame_bytes\":%d,\"reply_window_ms\":%d,\"runs\":[",
+         read_port, write_port, count, RTT_FRAME_LEN, RTT_REPLY_WINDOW_MS);
+  for (int i = 0; i < nresults; i++) {
+    rtt_result *r = &results[i];
+    printf("%s{\"low_latency\":\"%s\",\"read\":\"%s\",\"vmin\":%d,\"vtime\":%d,\"frames\":%d,\"lost\":%d,",
+           i > 0 ? "," : "", low_latency_text(r->low_latency), r->mode->name, r->mode->vmin, r->mode->vtime, r->count, r->lost);
+    print_latency_json("tcdrain_ms", &r->drain);
+    printf(",");
+    print_latency_json("wakeup_ms", &r->wakeup);
+    printf(",");
+    print_latency_json("round_trip_ms", &r->round_trip);
+    printf(",\"ok\":%s}", meets_window(r) ? "true" : "false");
+  }
+  printf("]}\n");
+}
+
+/*
+ * Low latency is left on at the end, as that's what aqualinkd will set anyway.
+ */
+int serial_rtt_benchmark(const char *read_port, const char *write_port, int count, bool json)
+{
+  rtt_result results[RTT_MODES * 2];
+  char pty_name[64];
+  int nresults = 0;
+  int rfd, wfd;
+  int ll_runs;
+  bool ll_supported;
+
+  if (count <= 0)
+    count = RTT_DEFAULT_COUNT;
+
+  if (write_port == NULL) {
+    if ((rfd = open_pty_pair(&wfd, pty_name, sizeof(pty_name))) < 0)
+      return 1;
+    write_port = "pty";
+    read_port = pty_name;
+  } else {
+    if ((rfd = open(read_port, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0) {
+      fprintf(stderr, "ERROR, unable to open %s: %s\n", read_port, strerror(errno));
+      return 1;
+    }
+    if ((wfd = open(write_port, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 || set_serial_port_attr(wfd, write_port, 0, 0) != 0) {
+      fprintf(stderr, "ERROR, unable to open %s: %s\n", write_port, strerror(errno));
+      close(rfd);
+      return 1;
+    }
+  }
+
+  ll_supported = (_set_port_low_latency(rfd, read_port, false) == 0);
+  ll_runs = ll_supported ? 2 : 1;
+
+  for (int ll = 0; ll < ll_runs && vbus_running(); ll++) {
+    if (ll_supported) {
+      _set_port_low_latency(rfd, read_port, ll == 1);
+      _set_port_low_latency(wfd, write_port, ll == 1);
+    }
+    for (int m = 0; m < RTT_MODES && vbus_running(); m++) {
+      if (!json)
+        fprintf(stderr, "Running %s, low latency %s\n", _rtt_modes[m].name, ll_supported ? (ll ? "on" : "off") : "n/a");
+      if (!rtt_run(rfd, read_port, wfd, &_rtt_modes[m], count, &results[nresults])) {
+        fprintf(stderr, "ERROR, unable to set up %s on %s\n", _rtt_modes[m].name, read_port);
+        continue;
+      }
+      results[nresults++].low_latency = ll_supported ? ll : -1;
+    }
+  }
+
+  if (json)
+    print_results_json(read_port, write_port, count, results, nresults);
+  else
+    print_results(read_port, write_port, count, results, nresults);
+
+  close(rfd);
+  close(wfd);
+
+  return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef SERIAL_BENCH_H_
+#define SERIAL_BENCH_H_
+
+#include <stdbool.h>
+
+/*
+ * Serial adapter + kernel latency, frames are written on one port and read back on another,
+ * either two adapters wired together or (write_port NULL) a pty pair.  Each read setting and
+ * low latency on/off gets its own run, see serial_bench.c.
+ */
+
+#define RTT_DEFAULT_COUNT 200
+#define RTT_REPLY_WINDOW_MS 20 // Round trip p99 has to be under this to keep up with the panel
+
+int serial_rtt_benchmark(const char *read_port, const char *write_port, int count, bool json);
+
+#endif // SERIAL_BENCH_H_
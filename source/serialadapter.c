@@ -315,7 +315,8 @@ bool process_rssadapter_packet(unsigned char *packet, int length, struct aqualin
     // This is identical to allbutton status packet.
     //LOG(RSSA_LOG,LOG_DEBUG, "RS Received STATUS length %d.\n", length);
     //debuglogPacket(RSSA_LOG, packet, length, true, true);
-    processRSSALEDstate(aqdata, packet);
+    if (!is_repeated_frame(packet, length))
+      processRSSALEDstate(aqdata, packet);
   } else if (packet[PKT_CMD] == 0x13) {
     //beautifyPacket(buff, packet, length);
     //LOG(RSSA_LOG,LOG_DEBUG, "%s", buff);
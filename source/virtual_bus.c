@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2017 Shaun Feakes - All rights reserved
+ *
+ * You may use redistribute and/or modify this code under the terms of
+ * the GNU General Public License version 2 as published by the
+ * Free Software Foundation. For the terms of this license,
+ * see <http://www.gnu.org/licenses/>.
+ *
+ * You are free to use this software under the terms of the GNU General
+ * Public License, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ *  https://github.com/sfeakes/aqualinkd
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+#include "aq_serial.h"
+#include "utils.h"
+#include "virtual_bus.h"
+
+static volatile bool _keepRunning = true;
+
+void vbus_stop()
+{
+  _keepRunning = false;
+}
+
+bool vbus_running()
+{
+  return _keepRunning;
+}
+
+int64_t vbus_now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void vbus_sleep_until_ns(int64_t deadline)
+{
+  struct timespec ts = {deadline / 1000000000LL, deadline % 1000000000LL};
+
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && _keepRunning) {}
+}
+
+int vbus_open_pty(const char *link)
+{
+  int fd;
+  char *name;
+
+  if ((fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0 || (name = ptsname(fd)) == NULL) {
+    fprintf(stderr, "ERROR, can't create pty: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (link != NULL) {
+    unlink(link);
+    if (symlink(name, link) != 0) {
+      fprintf(stderr, "ERROR, can't link %s to %s: %s\n", link, name, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    fprintf(stderr, "Panel side of bus on %s -> %s\n", link, name);
+  } else {
+    fprintf(stderr, "Panel side of bus on %s\n", name);
+  }
+
+  return fd;
+}
+
+// Until something opens the slave side the master reports POLLHUP
+bool vbus_wait_for_open(int fd)
+{
+  struct pollfd pfd = {fd, 0, 0};
+
+  while (_keepRunning) {
+    if (poll(&pfd, 1, 0) >= 0 && (pfd.revents & POLLHUP) == 0)
+      return true;
+    delay(10);
+  }
+  return false;
+}
+
+// Jandy packets are handled with DLE NUL removed, put it back for the wire.
+int vbus_escape_frame(const unsigned char *data, int length, unsigned char *out)
+{
+  int len = 0;
+
+  if (length < 4 || data[0] != DLE || data[1] != STX) {
+    memcpy(out, data, length);
+    return length;
+  }
+
+  out[len++] = DLE;
+  out[len++] = STX;
+  for (int i = 2; i < length - 2; i++) {
+    out[len++] = data[i];
+    if (data[i] == DLE)
+      out[len++] = NUL;
+  }
+  out[len++] = data[length - 2];
+  out[len++] = data[length - 1];
+
+  return len;
+}
+
+/*
+ * Pull complete Jandy frames (unescaped) out of what aqualinkd has sent, returns frame length
+ * or 0 if there isn't one yet.  Anything before DLE STX (ie leading NUL) is skipped.
+ */
+int vbus_next_frame(unsigned char *rx, int *rx_len, unsigned char *frame)
+{
+  int start;
+  int len = 0;
+
+  for (start = 0; start < *rx_len - 1; start++) {
+    if (rx[start] == DLE && rx[start + 1] == STX)
+      break;
+  }
+  if (start >= *rx_len - 1) {
+    // Keep a trailing DLE, the STX may be in the next read
+    if (*rx_len > 0 && rx[*rx_len - 1] == DLE) {
+      rx[0] = DLE;
+      *rx_len = 1;
+    } else {
+      *rx_len = 0;
+    }
+    return 0;
+  }
+
+  for (int i = start; i < *rx_len; i++) {
+    if (i > start + 1 && rx[i - 1] == DLE && rx[i] == NUL)
+      continue;
+    if (len < AQ_MAXPKTLEN)
+      frame[len++] = rx[i];
+    if (i > start + 1 && rx[i - 1] == DLE && rx[i] == ETX) {
+      memmove(rx, &rx[i + 1], *rx_len - i - 1);
+      *rx_len -= i + 1;
+      return len;
+    }
+  }
+
+  return 0;
+}
+
+// utime + stime of a process in seconds, or -1
+double vbus_process_cpu(pid_t pid)
+{
+  char path[64];
+  char buf[1024];
+  unsigned long utime, stime;
+  char *p;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  if ((fp = fopen(path, "r")) == NULL)
+    return -1;
+
+  p = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+
+  // Skip past "pid (comm)", comm can have spaces
+  if (p == NULL || (p = strrchr(buf, ')')) == NULL ||
+      sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    return -1;
+
+  return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Sorts latency_ns in place
+void vbus_latency_stats(int64_t *latency_ns, int n, vbus_latency *stats)
+{
+  int64_t total = 0;
+
+  memset(stats, 0, sizeof(vbus_latency));
+  if (n <= 0)
+    return;
+
+  qsort(latency_ns, n, sizeof(int64_t), cmp_int64);
+  for (int i = 0; i < n; i++)
+    total += latency_ns[i];
+  stats->min_ms = latency_ns[0] / 1e6;
+  stats->avg_ms = total / n / 1e6;
+  stats->p50_ms = latency_ns[(n - 1) * 50 / 100] / 1e6;
+  stats->p90_ms = latency_ns[(n - 1) * 90 / 100] / 1e6;
+  stats->p99_ms = latency_ns[(n - 1) * 99 / 100] / 1e6;
+  stats->max_ms = latency_ns[n - 1] / 1e6;
+}
@@ -0,0 +1,39 @@
+#ifndef VIRTUAL_BUS_H_
+#define VIRTUAL_BUS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Helpers for test tools that sit on the panel side of a pty, with aqualinkd's
+ * serial_port pointed at the other end (rs485replay, rs485load), and rs485mon -rtt.
+ */
+
+#define VBUS_BYTE_TIME_NS 1041667 // 10 bits at 9600 baud
+
+typedef struct vbus_latency {
+  double min_ms;
+  double avg_ms;
+  double p50_ms;
+  double p90_ms;
+  double p99_ms;
+  double max_ms;
+} vbus_latency;
+
+void vbus_stop();
+bool vbus_running();
+
+int64_t vbus_now_ns();
+void vbus_sleep_until_ns(int64_t deadline);
+
+int vbus_open_pty(const char *link);
+bool vbus_wait_for_open(int fd);
+
+int vbus_escape_frame(const unsigned char *data, int length, unsigned char *out);
+int vbus_next_frame(unsigned char *rx, int *rx_len, unsigned char *frame);
+
+double vbus_process_cpu(pid_t pid);
+void vbus_latency_stats(int64_t *latency_ns, int n, vbus_latency *stats);
+
+#endif // VIRTUAL_BUS_H_
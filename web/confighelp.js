@@ -12,5 +12,6 @@ _confighelp["event_check_use_scheduler_times"]="Turn on filter pump from events
 _confighelp["sync_panel_time"]="Keep panel time synced with computer"
 _confighelp["ftdi_low_latency"]="Give RS485 adapter higher priority in kernel (FTDI chips only)"
 _confighelp["rs485_frame_delay"]="Time for AqualinkD to reply to RS485 messages"
+_confighelp["rs485_frame_delay_auto"]="Automatically find the lowest rs485_frame_delay that doesn't cause RS485 errors"
 _confighelp["light_programming_mode"]="Valid only for AqualinkD programming light color (button_??_light_mode = 0)"
 //_confighelp["light_program_01"]="Light colors for AqualinkD programmed lights ie (button_??_light_mode = 0)"
\ No newline at end of file